@@ -1,6 +1,9 @@
 #!/bin/sh
 
 # Create the SQLite DB
+#
+# A database created before readings had a sensor needs it adding with
+# ALTER TABLE readings ADD COLUMN sensor int(11) DEFAULT 0;
 
 if [ -f sqlite.db ]; then
 	echo "Error: sqlite.db already exists"
@@ -16,7 +19,8 @@ CREATE TABLE readings (
 	temp double,
 	device_offset int(11),
 	ts_delta double(8,2),
-	joules int(11)
+	joules int(11),
+	sensor int(11) DEFAULT 0
 );
 
 create index ts_index on readings(ts);
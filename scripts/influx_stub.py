@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+#
+# Check the InfluxDB exporter against a stub server on the loopback.
+#
+# The daemon is started reading a pty with influx:gzip on and the stub
+# as its server. The stub answers the first few POSTs with a 503, so
+# the batches pile up in the backlog and have to be retried, then takes
+# the rest. Every reading fed in must arrive exactly once and in order,
+# gzip'd, as well formed line protocol, in fewer POSTs than points.
+#
+# $1 = currentcostd to run (default ./currentcostd)
+# $2 = readings to feed (default 50)
+# $3 = POSTs to refuse first (default 2)
+#
+# Exits non-zero if anything didn't arrive as it should.
+
+import gzip, http.server, os, pty, re, shutil, subprocess, sys, tempfile, threading, time, tty
+
+DAEMON = sys.argv[1] if len(sys.argv) > 1 else './currentcostd'
+READINGS = int(sys.argv[2]) if len(sys.argv) > 2 else 50
+REFUSE = int(sys.argv[3]) if len(sys.argv) > 3 else 2
+POINTS = 8
+
+LINE = re.compile(r'^power,sensor=(\d+),site=stub watts=(-?\d+)i,temp=-?[\d.]+,kwh=[\d.]+,joules=[\d.]+ (\d+)$')
+
+posts = []
+problems = []
+refused = 0
+lock = threading.Lock()
+
+
+class Stub(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_POST(self):
+        global refused
+        body = self.rfile.read(int(self.headers['Content-Length']))
+        with lock:
+            if refused < REFUSE:
+                refused += 1
+                self.send_response(503)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            if self.headers.get('Content-Encoding') != 'gzip':
+                problems.append('POST without Content-Encoding: gzip')
+            try:
+                text = gzip.decompress(body).decode()
+            except Exception as e:
+                problems.append('body is not gzip: %s' % e)
+                text = ''
+            watts = []
+            for line in text.splitlines():
+                m = LINE.match(line)
+                if m is None:
+                    problems.append('bad line protocol: %r' % line)
+                else:
+                    watts.append(int(m.group(2)))
+            if len(watts) > POINTS:
+                problems.append('%d points in one POST, influx:points is %d' % (len(watts), POINTS))
+            posts.append(watts)
+        self.send_response(204)
+        self.end_headers()
+
+    def log_message(self, *args):
+        pass
+
+
+def main():
+    server = http.server.HTTPServer(('127.0.0.1', 0), Stub)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    tmp = tempfile.mkdtemp(prefix='influx_stub.')
+    master, slave = pty.openpty()
+    tty.setraw(slave)
+    daemon = subprocess.Popen([DAEMON, '--serial:port', os.ttyname(slave),
+                               '--main:pid-filename', tmp + '/pid', '--query:socket', tmp + '/sock',
+                               '--influx:host', '127.0.0.1', '--influx:port', str(server.server_port),
+                               '--influx:gzip', '1', '--influx:points', str(POINTS),
+                               '--influx:interval', '200', '--influx:tags', 'site=stub'])
+    time.sleep(0.5)
+    for i in range(READINGS):
+        t = time.localtime()
+        os.write(master, ("<msg><src>CC128-v0.11</src><dsb>00089</dsb><time>%02d:%02d:%02d</time>"
+                          "<tmpr>18.7</tmpr><sensor>0</sensor><id>01234</id><type>1</type>"
+                          "<ch1><watts>%05d</watts></ch1></msg>\r\n" % (t.tm_hour, t.tm_min, t.tm_sec, 1000 + i)).encode())
+        time.sleep(0.02)
+
+    # Each refusal doubles the backoff from a second
+    deadline = time.time() + 10 + 2 ** REFUSE
+    while time.time() < deadline:
+        with lock:
+            if sum(len(p) for p in posts) >= READINGS:
+                break
+        time.sleep(0.2)
+    daemon.terminate()
+    daemon.wait()
+    server.shutdown()
+    shutil.rmtree(tmp, ignore_errors=True)
+
+    got = [w for p in posts for w in p]
+    if got != list(range(1000, 1000 + READINGS)):
+        problems.append('sent watts 1000..%d, got %d points: %s' % (1000 + READINGS - 1, len(got), got))
+    if refused < REFUSE:
+        problems.append('only %d POSTs were refused, nothing was retried' % refused)
+    if len(posts) >= READINGS:
+        problems.append('%d POSTs for %d points, nothing was coalesced' % (len(posts), READINGS))
+
+    for p in problems:
+        print('FAIL: ' + p)
+    print('%d points in %d POSTs after %d refused' % (len(got), len(posts), refused))
+    return 1 if problems else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
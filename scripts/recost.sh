@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# Rebuild the cost ledgers from the readings table after changing a
+# tariff. Stop the daemon first, change the [tariff] sections, run this
+# and then restart the daemon.
+#
+# $1 = sqlite database (default /var/currentcost/sqlite.db)
+# $2 = configuration file (default /etc/currentcost.conf)
+
+DB=${1:-/var/currentcost/sqlite.db}
+CONF=${2:-/etc/currentcost.conf}
+
+# Each sensor is costed on its own tariff, so readings have to say which
+if ! sqlite3 $DB "PRAGMA table_info(readings)" | grep -q '|sensor|'; then
+	echo "$DB has no sensor column, see create_db.sh" >&2
+	exit 1
+fi
+
+sqlite3 -separator ' ' $DB "SELECT strftime('%s',ts,'utc'), joules, sensor FROM readings ORDER BY ts" | \
+	currentcostd -f $CONF --tariff:recompute
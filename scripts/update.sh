@@ -6,13 +6,15 @@
 # $2 = watts
 # $3 = temp
 # $4 = device timestamp
-# $5 = change in time
-# $6 = joules used
+# $5 = change in time (from the drift corrected meter clock)
+# $6 = joules used over that time
 # $7 = offset between clocks
+# $8 = cumulative kWh for the sensor
+# $9 = sensor number
 
 
 RRDFILE=/var/currentcost/powertemp.rrd
 
 /usr/local/bin/rrdtool update $RRDFILE N:$2:$3
-/usr/local/bin/sqlite3 /var/currentcost/sqlite.db "INSERT into readings (ts, watts, temp, device_time, device_offset, ts_delta, joules) VALUES(DATETIME('now','localtime'), ${2}, ${3}, '${4}', ${7}, ${5}, ${6})"
+/usr/local/bin/sqlite3 /var/currentcost/sqlite.db "INSERT into readings (ts, watts, temp, device_time, device_offset, ts_delta, joules, sensor) VALUES(DATETIME('now','localtime'), ${2}, ${3}, '${4}', ${7}, ${5}, ${6}, ${9})"
 
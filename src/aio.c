@@ -0,0 +1,663 @@
+/*
+ *   Current Cost Daemon - asynchronous appends to files
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   A write() or fsync() on an SD card can take hundreds of milliseconds,
+ *   which is hundreds of milliseconds the serial port isn't being read.
+ *   Here data is gathered in a ring of preallocated buffers and a buffer
+ *   goes to the disc once it's full or every interval milliseconds,
+ *   without waiting. Completions come back through the event loop, and
+ *   once a buffer has been written it's free to be filled again.
+ *
+ *   Syncing is a group commit: at most one fsync is outstanding and it
+ *   covers every write that had completed when it was issued, so there's
+ *   one fsync per sync interval however many readings arrived in it.
+ *
+ *   Writes go through io_uring where the kernel has it, watching the
+ *   ring's descriptor for completions. Otherwise a thread does the
+ *   pwrite()s and fdatasync()s and wakes the loop through an eventfd.
+ *   The blocking method writes each commit straight away and syncs in
+ *   line, as a plain write() based sink would; it's there to compare
+ *   against and for filesystems which don't like the others.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "aio.h"
+#include "evloop.h"
+
+
+/* user_data for the fsync, writes are their buffer's index + 1 */
+#define AIO_SYNC            0
+
+typedef struct {
+    char           *data;
+    int             len;
+    int             done;          /* Bytes written so far */
+    int             busy;          /* Submitted and not yet completed */
+    off_t           off;
+    struct iovec    iov;
+} aio_buf_t;
+
+typedef struct {
+    unsigned long   user;
+    int             res;           /* As returned by the syscall, -errno on failure */
+} aio_op_t;
+
+struct aio_file {
+    char           *path;
+    int             fd;
+    int             method;
+    int             sync;
+    aio_buf_t      *bufs;
+    int             num_bufs;
+    int             size;
+    unsigned int    head;          /* Oldest buffer still being written */
+    unsigned int    tail;          /* Buffer being filled */
+    off_t           off;           /* Where the next write goes */
+    off_t           written;       /* Everything before this has been written */
+    off_t           synced;        /* ...and this has been synced */
+    off_t           sync_target;
+    int             syncing;
+    long long       last_sync;
+    int             failed;
+    aio_stats_t     stats;
+
+    /* io_uring */
+    int             ring_fd;
+    void           *sq_ring;
+    void           *cq_ring;
+    size_t          sq_len;
+    size_t          cq_len;
+    struct io_uring_sqe *sqes;
+    size_t          sqes_len;
+    unsigned       *sq_head;
+    unsigned       *sq_tail;
+    unsigned       *sq_mask;
+    unsigned       *sq_array;
+    unsigned       *cq_head;
+    unsigned       *cq_tail;
+    unsigned       *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Writer thread */
+    int             event_fd;
+    pthread_t       tid;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    aio_op_t       *jobs;
+    aio_op_t       *results;
+    int             num_ops;
+    unsigned int    job_head;
+    unsigned int    job_tail;
+    unsigned int    result_head;
+    unsigned int    result_tail;
+    int             quit;
+};
+
+
+static void         aio_queue(aio_file_t *file, unsigned long user);
+static void         aio_done(aio_file_t *file, unsigned long user, int res);
+static void         aio_retire(aio_file_t *file);
+static void         aio_sync(aio_file_t *file);
+static void         aio_timer(void *data);
+static void         aio_wait(aio_file_t *file);
+static int          aio_run(aio_file_t *file, unsigned long user);
+static int          uring_setup(aio_file_t *file, unsigned int entries);
+static void         uring_teardown(aio_file_t *file);
+static void         uring_queue(aio_file_t *file, unsigned long user);
+static void         uring_enter(aio_file_t *file, int wait);
+static void         uring_reap(int fd, int revents, void *data);
+static int          thread_setup(aio_file_t *file);
+static void         thread_teardown(aio_file_t *file);
+static void        *thread_main(void *arg);
+static void         thread_reap(int fd, int revents, void *data);
+
+static char        *method_names[] = { "auto", "uring", "thread", "blocking" };
+
+
+int aio_method(char *name)
+{
+    int     i;
+
+    for ( i = 0; i < sizeof(method_names) / sizeof(method_names[0]); i++ ) {
+        if ( strcmp(name, method_names[i]) == 0 ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+char *aio_method_name(int method)
+{
+    return method_names[method];
+}
+
+/** \brief Open a file for appending to in the background
+ *
+ *  \param path - File to append to, created if need be
+ *  \param method - AIO_AUTO to use io_uring if the kernel has it, else a thread
+ *  \param buffers - Number of buffers in the ring
+ *  \param size - Bytes in each buffer
+ *  \param interval - Milliseconds between writing out a partly filled buffer
+ *  \param sync - Milliseconds between fsyncs (0 = after every write, -1 = never)
+ *
+ *  \return The file
+ *  \retval NULL - Couldn't be opened
+ */
+aio_file_t *aio_open(char *path, int method, int buffers, int size, int interval, int sync)
+{
+    aio_file_t  *file;
+    int          i;
+
+    if ( buffers < 2 ) {
+        buffers = 2;
+    }
+    file = calloc(1, sizeof(*file));
+    file->path = strdup(path);
+    file->method = method;
+    file->sync = sync;
+    file->num_bufs = buffers;
+    file->size = size;
+    file->ring_fd = -1;
+    file->event_fd = -1;
+
+    if ( ( file->fd = open(path, O_WRONLY|O_CREAT, 0644) ) == -1 ) {
+        syslog(LOG_ERR,"Unable to open %s: %s",path,strerror(errno));
+        free(file->path);
+        free(file);
+        return NULL;
+    }
+    file->off = file->written = file->synced = lseek(file->fd, 0, SEEK_END);
+
+    file->bufs = calloc(buffers, sizeof(aio_buf_t));
+    for ( i = 0; i < buffers; i++ ) {
+        file->bufs[i].data = malloc(size);
+    }
+
+    /* At most every buffer but the one filling plus the fsync are in flight */
+    if ( method == AIO_AUTO || method == AIO_URING ) {
+        if ( uring_setup(file, buffers + 1) == 0 ) {
+            file->method = AIO_URING;
+        } else {
+            if ( method == AIO_URING ) {
+                syslog(LOG_WARNING,"No io_uring for %s, using a thread",path);
+            }
+            file->method = AIO_THREAD;
+        }
+    }
+    if ( file->method == AIO_THREAD ) {
+        if ( thread_setup(file) == 0 ) {
+            file->method = AIO_THREAD;
+        } else {
+            syslog(LOG_WARNING,"Unable to start a writer for %s, writing in line",path);
+            file->method = AIO_BLOCKING;
+        }
+    }
+    if ( file->method != AIO_BLOCKING ) {
+        ev_every(interval > 10 ? interval : 10, aio_timer, file);
+    }
+    return file;
+}
+
+char *aio_reserve(aio_file_t *file, int len)
+{
+    aio_buf_t   *buf = &file->bufs[file->tail % file->num_bufs];
+
+    if ( buf->len + len > file->size ) {
+        aio_submit(file);
+        buf = &file->bufs[file->tail % file->num_bufs];
+    }
+    if ( file->failed || buf->len + len > file->size ) {
+        file->stats.dropped++;
+        return NULL;
+    }
+    return buf->data + buf->len;
+}
+
+void aio_commit(aio_file_t *file, int len)
+{
+    file->bufs[file->tail % file->num_bufs].len += len;
+    if ( file->method == AIO_BLOCKING ) {
+        aio_submit(file);
+    }
+}
+
+void aio_submit(aio_file_t *file)
+{
+    aio_buf_t   *buf = &file->bufs[file->tail % file->num_bufs];
+
+    if ( buf->len == 0 || file->failed ) {
+        return;
+    }
+    /* The next buffer along is still being written */
+    if ( file->tail + 1 - file->head >= file->num_bufs ) {
+        return;
+    }
+    buf->off = file->off;
+    buf->done = 0;
+    buf->busy = 1;
+    file->off += buf->len;
+    file->tail++;
+    file->bufs[file->tail % file->num_bufs].len = 0;
+    aio_queue(file, ( buf - file->bufs ) + 1);
+}
+
+void aio_close(aio_file_t *file)
+{
+    if ( file->fd == -1 ) {
+        return;
+    }
+    aio_submit(file);
+    while ( file->head != file->tail || file->syncing ) {
+        aio_wait(file);
+        aio_submit(file);
+    }
+    if ( file->sync >= 0 && file->written > file->synced && fdatasync(file->fd) == 0 ) {
+        file->synced = file->written;
+        file->stats.syncs++;
+    }
+    if ( file->method == AIO_URING ) {
+        uring_teardown(file);
+    } else if ( file->method == AIO_THREAD ) {
+        thread_teardown(file);
+    }
+    close(file->fd);
+    file->fd = -1;
+}
+
+int aio_file_method(aio_file_t *file)
+{
+    return file->method;
+}
+
+void aio_stats(aio_file_t *file, aio_stats_t *stats)
+{
+    *stats = file->stats;
+}
+
+
+static void aio_queue(aio_file_t *file, unsigned long user)
+{
+    if ( user == AIO_SYNC ) {
+        file->stats.syncs++;
+    } else {
+        file->stats.writes++;
+    }
+    switch ( file->method ) {
+    case AIO_URING:
+        uring_queue(file, user);
+        break;
+    case AIO_THREAD:
+        pthread_mutex_lock(&file->lock);
+        file->jobs[file->job_tail++ % file->num_ops].user = user;
+        pthread_cond_signal(&file->cond);
+        pthread_mutex_unlock(&file->lock);
+        break;
+    default:
+        aio_done(file, user, aio_run(file, user));
+        break;
+    }
+}
+
+/* A write or the fsync has finished, called from the event loop */
+static void aio_done(aio_file_t *file, unsigned long user, int res)
+{
+    aio_buf_t   *buf;
+
+    if ( user == AIO_SYNC ) {
+        file->syncing = 0;
+        if ( res < 0 ) {
+            syslog(LOG_ERR,"Failed syncing %s: %s",file->path,strerror(-res));
+            file->stats.errors++;
+        } else {
+            file->synced = file->sync_target;
+        }
+        return;
+    }
+
+    buf = &file->bufs[user - 1];
+    if ( res == -EINTR || res == -EAGAIN ) {
+        aio_queue(file, user);
+        return;
+    }
+    if ( res <= 0 ) {
+        /* Carrying on would leave a hole in the file */
+        syslog(LOG_ERR,"Failed writing %s: %s, giving up on it",file->path,res ? strerror(-res) : "nothing written");
+        file->stats.errors++;
+        file->failed = 1;
+        buf->busy = 0;
+        aio_retire(file);
+        return;
+    }
+    buf->done += res;
+    file->stats.bytes += res;
+    if ( buf->done < buf->len ) {
+        aio_queue(file, user);
+        return;
+    }
+    buf->busy = 0;
+    aio_retire(file);
+    aio_sync(file);
+}
+
+/* Free up the buffers at the head which have been written */
+static void aio_retire(aio_file_t *file)
+{
+    aio_buf_t   *buf;
+
+    while ( file->head != file->tail ) {
+        buf = &file->bufs[file->head % file->num_bufs];
+        if ( buf->busy ) {
+            break;
+        }
+        file->written = buf->off + buf->done;
+        buf->len = 0;
+        file->head++;
+    }
+}
+
+/* Start an fsync of what's been written if one is due */
+static void aio_sync(aio_file_t *file)
+{
+    if ( file->sync < 0 || file->syncing || file->failed || file->written <= file->synced ) {
+        return;
+    }
+    if ( file->sync > 0 && ev_now() - file->last_sync < file->sync ) {
+        return;
+    }
+    file->syncing = 1;
+    file->sync_target = file->written;
+    file->last_sync = ev_now();
+    aio_queue(file, AIO_SYNC);
+}
+
+static void aio_timer(void *data)
+{
+    aio_file_t  *file = data;
+
+    if ( file->fd == -1 ) {
+        return;
+    }
+    aio_submit(file);
+    aio_sync(file);
+}
+
+/* Block until something completes */
+static void aio_wait(aio_file_t *file)
+{
+    struct pollfd   pfd;
+
+    if ( file->method == AIO_URING ) {
+        uring_enter(file, 1);
+        uring_reap(file->ring_fd, POLLIN, file);
+    } else if ( file->method == AIO_THREAD ) {
+        pfd.fd = file->event_fd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, -1);
+        thread_reap(file->event_fd, POLLIN, file);
+    }
+}
+
+/* Do a write or the fsync in this thread, returns the result as io_uring would */
+static int aio_run(aio_file_t *file, unsigned long user)
+{
+    aio_buf_t   *buf;
+    int          ret;
+
+    if ( user == AIO_SYNC ) {
+        ret = fdatasync(file->fd);
+    } else {
+        buf = &file->bufs[user - 1];
+        ret = pwrite(file->fd, buf->data + buf->done, buf->len - buf->done, buf->off + buf->done);
+    }
+    return ret < 0 ? -errno : ret;
+}
+
+
+static int uring_setup(aio_file_t *file, unsigned int entries)
+{
+    struct io_uring_params  p;
+
+    memset(&p, 0, sizeof(p));
+    if ( ( file->ring_fd = syscall(__NR_io_uring_setup, entries, &p) ) < 0 ) {
+        file->ring_fd = -1;
+        return -1;
+    }
+    file->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    file->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        if ( file->cq_len > file->sq_len ) {
+            file->sq_len = file->cq_len;
+        }
+        file->cq_len = 0;
+    }
+    file->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    file->sq_ring = mmap(NULL, file->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, file->ring_fd, IORING_OFF_SQ_RING);
+    if ( file->sq_ring == MAP_FAILED ) {
+        close(file->ring_fd);
+        file->ring_fd = -1;
+        return -1;
+    }
+    file->cq_ring = file->sq_ring;
+    if ( file->cq_len ) {
+        file->cq_ring = mmap(NULL, file->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, file->ring_fd, IORING_OFF_CQ_RING);
+    }
+    file->sqes = mmap(NULL, file->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, file->ring_fd, IORING_OFF_SQES);
+    if ( file->cq_ring == MAP_FAILED || file->sqes == MAP_FAILED || ev_add(file->ring_fd, POLLIN, uring_reap, file) != 0 ) {
+        if ( file->cq_ring == MAP_FAILED ) {
+            file->cq_len = 0;
+        }
+        if ( file->sqes == MAP_FAILED ) {
+            file->sqes_len = 0;
+        }
+        uring_teardown(file);
+        return -1;
+    }
+
+    file->sq_head = (unsigned *)( (char *)file->sq_ring + p.sq_off.head );
+    file->sq_tail = (unsigned *)( (char *)file->sq_ring + p.sq_off.tail );
+    file->sq_mask = (unsigned *)( (char *)file->sq_ring + p.sq_off.ring_mask );
+    file->sq_array = (unsigned *)( (char *)file->sq_ring + p.sq_off.array );
+    file->cq_head = (unsigned *)( (char *)file->cq_ring + p.cq_off.head );
+    file->cq_tail = (unsigned *)( (char *)file->cq_ring + p.cq_off.tail );
+    file->cq_mask = (unsigned *)( (char *)file->cq_ring + p.cq_off.ring_mask );
+    file->cqes = (struct io_uring_cqe *)( (char *)file->cq_ring + p.cq_off.cqes );
+    return 0;
+}
+
+static void uring_teardown(aio_file_t *file)
+{
+    ev_del(file->ring_fd);
+    if ( file->sqes_len ) {
+        munmap(file->sqes, file->sqes_len);
+    }
+    if ( file->cq_len ) {
+        munmap(file->cq_ring, file->cq_len);
+    }
+    munmap(file->sq_ring, file->sq_len);
+    close(file->ring_fd);
+    file->ring_fd = -1;
+}
+
+static void uring_queue(aio_file_t *file, unsigned long user)
+{
+    struct io_uring_sqe  *sqe;
+    aio_buf_t            *buf;
+    unsigned              tail = *file->sq_tail, index = tail & *file->sq_mask;
+
+    sqe = &file->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = file->fd;
+    sqe->user_data = user;
+    if ( user == AIO_SYNC ) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    } else {
+        /* writev rather than write for kernels before 5.6 */
+        buf = &file->bufs[user - 1];
+        buf->iov.iov_base = buf->data + buf->done;
+        buf->iov.iov_len = buf->len - buf->done;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (unsigned long)&buf->iov;
+        sqe->len = 1;
+        sqe->off = buf->off + buf->done;
+    }
+    file->sq_array[index] = index;
+    __atomic_store_n(file->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring_enter(file, 0);
+}
+
+/* Submit whatever is queued, and with wait block for a completion */
+static void uring_enter(aio_file_t *file, int wait)
+{
+    unsigned    pending = *file->sq_tail - __atomic_load_n(file->sq_head, __ATOMIC_ACQUIRE);
+
+    if ( syscall(__NR_io_uring_enter, file->ring_fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 &&
+         errno != EINTR && errno != EAGAIN && errno != EBUSY ) {
+        /* Whatever is queued will go with the next enter */
+        syslog(LOG_ERR,"io_uring_enter failed for %s: %s",file->path,strerror(errno));
+        file->stats.errors++;
+    }
+}
+
+static void uring_reap(int fd, int revents, void *data)
+{
+    aio_file_t           *file = data;
+    struct io_uring_cqe   cqe;
+    unsigned              head = *file->cq_head;
+
+    while ( head != __atomic_load_n(file->cq_tail, __ATOMIC_ACQUIRE) ) {
+        cqe = file->cqes[head & *file->cq_mask];
+        head++;
+        __atomic_store_n(file->cq_head, head, __ATOMIC_RELEASE);
+        aio_done(file, cqe.user_data, cqe.res);
+    }
+}
+
+
+static int thread_setup(aio_file_t *file)
+{
+    sigset_t   all, old;
+    int        ret;
+
+    if ( ( file->event_fd = eventfd(0, EFD_NONBLOCK) ) == -1 ) {
+        return -1;
+    }
+    if ( ev_add(file->event_fd, POLLIN, thread_reap, file) != 0 ) {
+        close(file->event_fd);
+        file->event_fd = -1;
+        return -1;
+    }
+    file->num_ops = file->num_bufs + 1;
+    file->jobs = calloc(file->num_ops, sizeof(aio_op_t));
+    file->results = calloc(file->num_ops, sizeof(aio_op_t));
+    pthread_mutex_init(&file->lock, NULL);
+    pthread_cond_init(&file->cond, NULL);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&file->tid, NULL, thread_main, file);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if ( ret != 0 ) {
+        ev_del(file->event_fd);
+        close(file->event_fd);
+        file->event_fd = -1;
+        free(file->jobs);
+        free(file->results);
+        return -1;
+    }
+    return 0;
+}
+
+static void thread_teardown(aio_file_t *file)
+{
+    pthread_mutex_lock(&file->lock);
+    file->quit = 1;
+    pthread_cond_signal(&file->cond);
+    pthread_mutex_unlock(&file->lock);
+    pthread_join(file->tid, NULL);
+    ev_del(file->event_fd);
+    close(file->event_fd);
+    file->event_fd = -1;
+}
+
+static void *thread_main(void *arg)
+{
+    aio_file_t     *file = arg;
+    uint64_t        one = 1;
+    unsigned long   user;
+    int             res;
+
+    pthread_mutex_lock(&file->lock);
+    while ( 1 ) {
+        while ( file->job_head == file->job_tail && file->quit == 0 ) {
+            pthread_cond_wait(&file->cond, &file->lock);
+        }
+        if ( file->job_head == file->job_tail ) {
+            break;
+        }
+        user = file->jobs[file->job_head++ % file->num_ops].user;
+        pthread_mutex_unlock(&file->lock);
+
+        res = aio_run(file, user);
+
+        pthread_mutex_lock(&file->lock);
+        file->results[file->result_tail % file->num_ops].user = user;
+        file->results[file->result_tail % file->num_ops].res = res;
+        file->result_tail++;
+        if ( write(file->event_fd, &one, sizeof(one)) < 0 ) {
+            /* Already readable, which is all that matters */
+        }
+    }
+    pthread_mutex_unlock(&file->lock);
+    return NULL;
+}
+
+static void thread_reap(int fd, int revents, void *data)
+{
+    aio_file_t     *file = data;
+    uint64_t        count;
+    aio_op_t        op;
+
+    if ( read(fd, &count, sizeof(count)) < 0 ) {
+        /* Nothing to clear, look anyway */
+    }
+    pthread_mutex_lock(&file->lock);
+    while ( file->result_head != file->result_tail ) {
+        op = file->results[file->result_head++ % file->num_ops];
+        pthread_mutex_unlock(&file->lock);
+        aio_done(file, op.user, op.res);
+        pthread_mutex_lock(&file->lock);
+    }
+    pthread_mutex_unlock(&file->lock);
+}
@@ -0,0 +1,60 @@
+/*
+ *   Current Cost Daemon - asynchronous appends to files
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef AIO_H
+#define AIO_H
+
+/* How the writes get to the disc */
+enum { AIO_AUTO, AIO_URING, AIO_THREAD, AIO_BLOCKING };
+
+typedef struct aio_file aio_file_t;
+
+typedef struct {
+    unsigned long   bytes;         /* Written out */
+    unsigned long   writes;
+    unsigned long   syncs;
+    unsigned long   dropped;       /* Reservations which didn't fit in the buffers */
+    unsigned long   errors;
+} aio_stats_t;
+
+/* Parse "auto", "uring", "thread" or "blocking", -1 if it's none of them */
+extern int          aio_method(char *name);
+extern char        *aio_method_name(int method);
+
+/* Open a file to append to through buffers of size bytes, written out
+   when full or every interval milliseconds. sync is the milliseconds
+   between fsyncs, 0 to sync after every write and -1 never. Completions
+   are handled by the event loop. */
+extern aio_file_t  *aio_open(char *path, int method, int buffers, int size, int interval, int sync);
+
+/* Room for len bytes, NULL if the buffers are full (and they're dropped) */
+extern char        *aio_reserve(aio_file_t *file, int len);
+extern void         aio_commit(aio_file_t *file, int len);
+
+/* Write out whatever is buffered without waiting for it */
+extern void         aio_submit(aio_file_t *file);
+
+/* Wait for everything to be written and synced, then close */
+extern void         aio_close(aio_file_t *file);
+
+extern int          aio_file_method(aio_file_t *file);
+extern void         aio_stats(aio_file_t *file, aio_stats_t *stats);
+
+#endif /* AIO_H */
@@ -0,0 +1,312 @@
+/*
+ *   Current Cost Daemon - alert rules
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Rules are configured as:
+ *
+ *   [alert]
+ *   rule = kettle watts > 2500 for=300 debounce=900
+ *   rule = baseload ewma > 400 alpha=0.001 sink=exec
+ *   rule = spike zscore > 4 sensor=2
+ *   rule = surge rate > 500
+ *
+ *   The metric is one of watts, temp, rate (watts per second), ewma (the
+ *   exponentially weighted mean of watts) or zscore (watts against the
+ *   EWMA mean and variance). A rule is raised when its condition has
+ *   held for "for" seconds, and not raised again within "debounce"
+ *   seconds. Rules are compiled into a fixed table when the config is
+ *   loaded, evaluating them doesn't allocate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <syslog.h>
+
+#include "libini.h"
+#include "alert.h"
+#include "sink.h"
+
+
+#define MAX_RULES           256
+
+/* Readings needed before a z-score means anything */
+#define ZSCORE_WARMUP       30
+
+enum { METRIC_WATTS, METRIC_TEMP, METRIC_RATE, METRIC_EWMA, METRIC_ZSCORE };
+enum { OP_GT, OP_GE, OP_LT, OP_LE };
+
+typedef struct {
+    char            name[32];
+    int             sensor;
+    int             metric;
+    int             op;
+    double          threshold;
+    int             hold;          /* Seconds the condition must hold */
+    int             debounce;      /* Minimum seconds between raises */
+    double          alpha;         /* EWMA smoothing factor */
+    sink_t         *sink;          /* NULL = every sink taking events */
+
+    /* Evaluation state */
+    int             active;
+    int             pending;
+    double          since;
+    double          last_raised;
+    double          mean;
+    double          var;
+    long            samples;
+    int             last_watts;
+} rule_t;
+
+
+static int          rule_evaluate(rule_t *rule, reading_t *reading, double *value);
+static void         rule_fire(rule_t *rule, reading_t *reading, double value, int raised);
+
+static rule_t       rules[MAX_RULES];
+static int          num_rules = 0;
+static short        sensor_rules[MAX_SENSORS][MAX_RULES];
+static int          sensor_num_rules[MAX_SENSORS];
+
+
+int alert_init(char *config_file)
+{
+    configctx_t  *cache;
+    char        **list = NULL;
+    int           num = 0;
+    int           i;
+
+    num_rules = 0;
+    memset(sensor_num_rules, 0, sizeof(sensor_num_rules));
+
+    if ( config_file == NULL ) {
+        return 0;
+    }
+    cache = iniparse_cache_init();
+    if ( iniparse_file(cache, config_file) >= 0 ) {
+        iniparse_cache_extract_array(cache, "alert:rule", OPT_STR, &list, &num);
+    }
+    iniparse_cleanup(cache);
+
+    for ( i = 0; i < num; i++ ) {
+        if ( alert_add(list[i]) < 0 ) {
+            syslog(LOG_ERR,"Invalid alert rule: %s",list[i]);
+        }
+        free(list[i]);
+    }
+    free(list);
+
+    if ( num_rules ) {
+        syslog(LOG_INFO,"Compiled %d alert rules",num_rules);
+    }
+    return num_rules;
+}
+
+/** \brief Compile a rule into the rule table
+ *
+ *  \param text - "name metric op threshold [key=value...]"
+ *
+ *  \return 0 - Rule added
+ *  \retval -1 - Rule invalid
+ */
+int alert_add(char *text)
+{
+    static const char *metrics[] = { "watts", "temp", "rate", "ewma", "zscore" };
+    static const char *ops[] = { ">", ">=", "<", "<=" };
+    rule_t    rule;
+    char      copy[512];
+    char     *tok, *save, *value;
+    int       i;
+
+    if ( num_rules >= MAX_RULES ) {
+        return -1;
+    }
+    memset(&rule, 0, sizeof(rule));
+    rule.alpha = 0.01;
+    rule.metric = -1;
+    rule.op = -1;
+
+    snprintf(copy,sizeof(copy),"%s",text);
+    if ( ( tok = strtok_r(copy," \t",&save) ) == NULL ) {
+        return -1;
+    }
+    snprintf(rule.name,sizeof(rule.name),"%s",tok);
+
+    if ( ( tok = strtok_r(NULL," \t",&save) ) == NULL ) {
+        return -1;
+    }
+    for ( i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++ ) {
+        if ( strcmp(tok, metrics[i]) == 0 )
+            rule.metric = i;
+    }
+
+    if ( ( tok = strtok_r(NULL," \t",&save) ) == NULL ) {
+        return -1;
+    }
+    for ( i = 0; i < sizeof(ops) / sizeof(ops[0]); i++ ) {
+        if ( strcmp(tok, ops[i]) == 0 )
+            rule.op = i;
+    }
+
+    if ( ( tok = strtok_r(NULL," \t",&save) ) == NULL || rule.metric == -1 || rule.op == -1 ) {
+        return -1;
+    }
+    rule.threshold = atof(tok);
+
+    while ( ( tok = strtok_r(NULL," \t",&save) ) != NULL ) {
+        if ( ( value = strchr(tok,'=') ) == NULL ) {
+            return -1;
+        }
+        *value++ = 0;
+        if ( strcmp(tok,"sensor") == 0 ) {
+            rule.sensor = atoi(value);
+        } else if ( strcmp(tok,"for") == 0 ) {
+            rule.hold = atoi(value);
+        } else if ( strcmp(tok,"debounce") == 0 ) {
+            rule.debounce = atoi(value);
+        } else if ( strcmp(tok,"alpha") == 0 ) {
+            rule.alpha = atof(value);
+        } else if ( strcmp(tok,"sink") == 0 ) {
+            if ( ( rule.sink = sink_find(value) ) == NULL ) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    if ( rule.sensor < 0 || rule.sensor >= MAX_SENSORS || rule.alpha <= 0 || rule.alpha > 1 ) {
+        return -1;
+    }
+
+    sensor_rules[rule.sensor][sensor_num_rules[rule.sensor]++] = num_rules;
+    rules[num_rules++] = rule;
+    return 0;
+}
+
+void alert_sample(reading_t *reading)
+{
+    rule_t   *rule;
+    double    value;
+    int       cond;
+    int       i;
+
+    if ( reading->sensor < 0 || reading->sensor >= MAX_SENSORS ) {
+        return;
+    }
+    for ( i = 0; i < sensor_num_rules[reading->sensor]; i++ ) {
+        rule = &rules[sensor_rules[reading->sensor][i]];
+
+        if ( ( cond = rule_evaluate(rule, reading, &value) ) < 0 ) {
+            continue;
+        }
+        if ( cond ) {
+            if ( rule->pending == 0 ) {
+                rule->pending = 1;
+                rule->since = reading->ts;
+            }
+            if ( rule->active == 0 && reading->ts - rule->since >= rule->hold &&
+                 ( rule->last_raised == 0 || reading->ts - rule->last_raised >= rule->debounce ) ) {
+                rule->active = 1;
+                rule->last_raised = reading->ts;
+                rule_fire(rule, reading, value, 1);
+            }
+        } else {
+            rule->pending = 0;
+            if ( rule->active ) {
+                rule->active = 0;
+                rule_fire(rule, reading, value, 0);
+            }
+        }
+    }
+}
+
+
+/** \brief Work out the rule's metric and test it against the threshold
+ *
+ *  \return 1 - Condition met
+ *  \retval 0 - Condition not met
+ *  \retval -1 - Not enough history to say
+ */
+static int rule_evaluate(rule_t *rule, reading_t *reading, double *value)
+{
+    double    diff, incr;
+    int       ready = 1;
+
+    switch ( rule->metric ) {
+    case METRIC_WATTS:
+        *value = reading->watts;
+        break;
+    case METRIC_TEMP:
+        *value = reading->temp;
+        break;
+    case METRIC_RATE:
+        ready = rule->samples > 0 && reading->delta > 0;
+        *value = ready ? ( reading->watts - rule->last_watts ) / reading->delta : 0;
+        break;
+    case METRIC_EWMA:
+        rule->mean = rule->samples ? rule->mean + rule->alpha * ( reading->watts - rule->mean ) : reading->watts;
+        *value = rule->mean;
+        break;
+    case METRIC_ZSCORE:
+        ready = rule->samples >= ZSCORE_WARMUP && rule->var > 0;
+        *value = ready ? ( reading->watts - rule->mean ) / sqrt(rule->var) : 0;
+        if ( rule->samples == 0 ) {
+            rule->mean = reading->watts;
+        } else {
+            diff = reading->watts - rule->mean;
+            incr = rule->alpha * diff;
+            rule->mean += incr;
+            rule->var = ( 1 - rule->alpha ) * ( rule->var + diff * incr );
+        }
+        break;
+    default:
+        return -1;
+    }
+    rule->samples++;
+    rule->last_watts = reading->watts;
+
+    if ( ready == 0 ) {
+        return -1;
+    }
+    switch ( rule->op ) {
+    case OP_GT:
+        return *value > rule->threshold;
+    case OP_GE:
+        return *value >= rule->threshold;
+    case OP_LT:
+        return *value < rule->threshold;
+    case OP_LE:
+        return *value <= rule->threshold;
+    }
+    return 0;
+}
+
+static void rule_fire(rule_t *rule, reading_t *reading, double value, int raised)
+{
+    event_t   event;
+
+    event.name = rule->name;
+    event.raised = raised;
+    event.sensor = rule->sensor;
+    event.value = value;
+    event.threshold = rule->threshold;
+    event.now = reading->now;
+
+    syslog(LOG_NOTICE,"Alert %s %s on sensor %d (%.2f against %.2f)",rule->name,
+           raised ? "raised" : "cleared", rule->sensor, value, rule->threshold);
+    sink_event(rule->sink, &event);
+}
@@ -0,0 +1,35 @@
+/*
+ *   Current Cost Daemon - alert rules
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef ALERT_H
+#define ALERT_H
+
+#include "currentcost.h"
+
+/* Compile the rules from the [alert] section, call after the sinks exist */
+extern int          alert_init(char *config_file);
+
+/* Compile a single rule */
+extern int          alert_add(char *rule);
+
+/* Evaluate every rule for the reading's sensor */
+extern void         alert_sample(reading_t *reading);
+
+#endif /* ALERT_H */
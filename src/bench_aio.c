@@ -0,0 +1,128 @@
+/*
+ *   Current Cost Daemon - file sink benchmark
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Appends readings to a scratch file in the given directory with each
+ *   aio method in turn, the way the logfile sink does, turning the event
+ *   loop over after each one. Reports the sustained rate including the
+ *   final write and sync, and the time each reading held up the loop.
+ *   The blocking method is the baseline of a write() and fdatasync() for
+ *   every reading (-b sets a sync interval for it as -s does for the
+ *   others). Point -d at the SD card to see what it does to it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "aio.h"
+#include "evloop.h"
+
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+    long long   x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void run(char *dir, int method, int num, int rate, int sync, long long *samples)
+{
+    aio_file_t  *file;
+    aio_stats_t  stats;
+    char         path[FILENAME_MAX], *line;
+    long long    start, t, next;
+    int          i, len;
+
+    snprintf(path, sizeof(path), "%s/ccbench-aio-%d", dir, (int)getpid());
+    unlink(path);
+    if ( ( file = aio_open(path, method, 8, 65536, 1000, sync) ) == NULL ) {
+        perror(path);
+        exit(1);
+    }
+
+    start = next = now_ns();
+    for ( i = 0; i < num; i++ ) {
+        if ( rate ) {
+            next += 1000000000LL / rate;
+            while ( now_ns() < next ) {
+                ev_run_once(( next - now_ns() ) / 1000000);
+            }
+        }
+        t = now_ns();
+        if ( ( line = aio_reserve(file, 256) ) != NULL ) {
+            len = snprintf(line, 256, "%.3f %d %d %.1f %.6f\n", 1286668800.0 + i * 6.0, i % 10,
+                           300 + i % 3000, 18.7, i * 0.0005);
+            aio_commit(file, len);
+        }
+        ev_run_once(0);
+        samples[i] = now_ns() - t;
+    }
+    aio_close(file);
+    t = now_ns() - start;
+    aio_stats(file, &stats);
+    unlink(path);
+
+    qsort(samples, num, sizeof(long long), compare);
+    printf("aio %-8s %9.0f readings/s  p50 %7.1f us  p99 %8.1f us  max %9.1f us  %6lu writes %5lu syncs %lu dropped\n",
+           aio_method_name(aio_file_method(file)), num / ( t / 1e9 ),
+           samples[num / 2] / 1000.0, samples[num * 99 / 100] / 1000.0, samples[num - 1] / 1000.0,
+           stats.writes, stats.syncs, stats.dropped);
+}
+
+int main(int argc, char *argv[])
+{
+    long long  *samples;
+    char       *dir = "/tmp";
+    int         num = 200000, rate = 0, sync = 1000, blocking_sync = 0, ch;
+
+    while ( ( ch = getopt(argc, argv, "b:d:n:r:s:") ) != -1 ) {
+        switch ( ch ) {
+        case 'b': blocking_sync = atoi(optarg); break;
+        case 'd': dir = optarg; break;
+        case 'n': num = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 's': sync = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: bench_aio [-d dir] [-n readings] [-r readings-per-sec] [-s sync-ms] [-b blocking-sync-ms]\n");
+            return 1;
+        }
+    }
+    if ( num < 1 ) {
+        num = 1;
+    }
+    openlog("bench_aio", LOG_PERROR, LOG_USER);
+    samples = malloc(num * sizeof(long long));
+
+    run(dir, AIO_BLOCKING, num, rate, blocking_sync, samples);
+    run(dir, AIO_THREAD, num, rate, sync, samples);
+    run(dir, AIO_URING, num, rate, sync, samples);
+    return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ *   Current Cost Daemon - appliance disaggregation benchmark
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Builds a whole house trace from a handful of appliances switching on
+ *   and off at random over a wandering base load with noise, keeping the
+ *   true switches and energy of each. The trace goes through
+ *   disagg_sample() into a scratch store, then the events are read back
+ *   and scored against the truth:
+ *
+ *     { "trace": { ... }, "ns_per_reading": N, "readings_per_sec": N,
+ *       "allocs_per_reading": N, "edges": { "true": N, "found": N,
+ *       "precision": N, "recall": N },
+ *       "appliances": [ { "name": "kettle", "watts": N, "learnt": N,
+ *                         "kwh": N, "found_kwh": N, "error": N }, ... ] }
+ *
+ *   A found switch counts if it's within two readings of a true one in
+ *   the same direction and of about the same size. Learnt appliances are
+ *   credited to the true one closest in size.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <ftw.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "libini.h"
+#include "store.h"
+#include "disagg.h"
+
+
+#define MATCH_TOLERANCE     0.2
+
+typedef struct {
+    char           *name;
+    int             watts;
+    int             min_on;        /* Seconds */
+    int             max_on;
+    int             min_off;
+    int             max_off;
+} model_t;
+
+typedef struct {
+    double          ts;
+    int             appliance;
+    int             on;
+    int             watts;
+    int             matched;
+} edge_t;
+
+/* Kettle, oven, washing machine heater, fridge and television */
+static model_t      models[] = {
+    { "kettle",  2500,  120,   240,  3600, 14400 },
+    { "oven",    1500, 1200,  3600, 14400, 43200 },
+    { "heater",   800,  600,  1800,  7200, 28800 },
+    { "fridge",   120,  600,  1200,  1800,  3600 },
+    { "tv",        60, 3600, 10800,  7200, 21600 },
+};
+#define NUM_MODELS  ( sizeof(models) / sizeof(models[0]) )
+
+/* Trace */
+static int          d_interval         = 6;
+static int          d_days             = 7;
+static double       d_noise            = 8;
+static int          d_base             = 250;
+static unsigned int d_seed             = 1;
+static time_t       d_start            = 1275350400;   /* 2010-06-01 */
+
+static reading_t   *readings           = NULL;
+static long         num_readings       = 0;
+static edge_t      *truth              = NULL;
+static long         num_truth          = 0;
+static edge_t      *found              = NULL;
+static long         num_found          = 0;
+static long         size_found         = 0;
+static double       truth_joules[NUM_MODELS];
+static double       found_joules[NUM_MODELS];
+static int          learnt_watts[NUM_MODELS];
+
+static unsigned long allocs            = 0;
+static unsigned int rng_state;
+
+extern void        *__libc_malloc(size_t size);
+extern void        *__libc_calloc(size_t num, size_t size);
+extern void        *__libc_realloc(void *ptr, size_t size);
+
+
+void *malloc(size_t size)
+{
+    __sync_fetch_and_add(&allocs, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size)
+{
+    __sync_fetch_and_add(&allocs, 1);
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&allocs, 1);
+    return __libc_realloc(ptr, size);
+}
+
+/** \brief Required to satisfy the linking of libini.c
+ */
+char *filename_expand(char *format, char *buf, size_t buflen, char *i_option, char *k_option)
+{
+    snprintf(buf, buflen, "%s",format);
+
+    return buf;
+}
+
+
+static unsigned int rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double uniform()
+{
+    return rng() / 4294967296.0;
+}
+
+static int between(int lo, int hi)
+{
+    return lo + (int)( uniform() * ( hi - lo + 1 ) );
+}
+
+static double gaussian()
+{
+    return sqrt(-2 * log(uniform() + 1e-12)) * cos(2 * M_PI * uniform());
+}
+
+static void trace_generate()
+{
+    double      next[NUM_MODELS];
+    int         on[NUM_MODELS];
+    double      ts, base = d_base, load;
+    long        i, size;
+    unsigned    a;
+
+    rng_state = d_seed ? d_seed : 1;
+    num_readings = (long)d_days * 86400 / d_interval;
+    readings = __libc_calloc(num_readings, sizeof(reading_t));
+    size = 1024;
+    truth = __libc_malloc(size * sizeof(edge_t));
+    for ( a = 0; a < NUM_MODELS; a++ ) {
+        on[a] = 0;
+        next[a] = d_start + between(0, models[a].max_off);
+    }
+
+    for ( i = 0; i < num_readings; i++ ) {
+        ts = d_start + (double)i * d_interval;
+
+        /* The base load wanders too slowly to look like a switch */
+        base += ( uniform() - 0.5 ) * 0.5;
+        if ( base < d_base / 2 ) {
+            base = d_base / 2;
+        }
+        load = base;
+        for ( a = 0; a < NUM_MODELS; a++ ) {
+            if ( ts >= next[a] ) {
+                on[a] = !on[a];
+                next[a] = ts + ( on[a] ? between(models[a].min_on, models[a].max_on) :
+                                         between(models[a].min_off, models[a].max_off) );
+                if ( num_truth == size ) {
+                    size *= 2;
+                    truth = __libc_realloc(truth, size * sizeof(edge_t));
+                }
+                truth[num_truth].ts = ts;
+                truth[num_truth].appliance = a;
+                truth[num_truth].on = on[a];
+                truth[num_truth].watts = models[a].watts;
+                truth[num_truth].matched = 0;
+                num_truth++;
+            }
+            if ( on[a] ) {
+                load += models[a].watts;
+                truth_joules[a] += models[a].watts * d_interval;
+            }
+        }
+        readings[i].sensor = 0;
+        readings[i].now = (time_t)ts;
+        readings[i].ts = ts;
+        readings[i].delta = d_interval;
+        readings[i].watts = lrint(load + gaussian() * d_noise);
+        readings[i].joules = readings[i].watts * d_interval;
+    }
+}
+
+static int event_collect(void *record, void *arg)
+{
+    store_event_t  *event = record;
+
+    if ( num_found == size_found ) {
+        size_found = size_found ? size_found * 2 : 1024;
+        found = __libc_realloc(found, size_found * sizeof(edge_t));
+    }
+    found[num_found].ts = event->ts;
+    found[num_found].appliance = event->appliance;
+    found[num_found].on = event->on;
+    found[num_found].watts = event->watts;
+    found[num_found].matched = 0;
+    num_found++;
+    return 0;
+}
+
+/* Which true appliance a learnt one is, -1 if it's nothing like any */
+static int model_of(double watts)
+{
+    unsigned    a;
+    int         best = -1;
+
+    for ( a = 0; a < NUM_MODELS; a++ ) {
+        if ( fabs(watts - models[a].watts) <= models[a].watts * MATCH_TOLERANCE &&
+             ( best == -1 || fabs(watts - models[a].watts) < fabs(watts - models[best].watts) ) ) {
+            best = a;
+        }
+    }
+    return best;
+}
+
+/* Pair up found switches with true ones, both are in time order */
+static long edges_match()
+{
+    long        i, j, first = 0, matched = 0;
+
+    for ( i = 0; i < num_found; i++ ) {
+        while ( first < num_truth && truth[first].ts < found[i].ts - 2 * d_interval ) {
+            first++;
+        }
+        for ( j = first; j < num_truth && truth[j].ts <= found[i].ts + 2 * d_interval; j++ ) {
+            if ( truth[j].matched == 0 && truth[j].on == found[i].on &&
+                 fabs(found[i].watts - truth[j].watts) <= truth[j].watts * MATCH_TOLERANCE ) {
+                truth[j].matched = found[i].matched = 1;
+                matched++;
+                break;
+            }
+        }
+    }
+    return matched;
+}
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: bench_disagg [-i interval] [-D days] [-n noise-watts] [-B base-watts]\n"
+                    "                    [-S seed] [-t threshold] [-T tolerance] [-e settle]\n"
+                    "                    [-d workdir] [-k]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    configctx_t     *ctx;
+    const appliance_t *learnt;
+    char             dir[FILENAME_MAX], storedir[FILENAME_MAX];
+    char            *args[16];
+    char            *threshold = "50", *tolerance = "15", *settle = "2";
+    unsigned long    before;
+    long long        start, elapsed;
+    long             i, matched;
+    double           precision, recall;
+    int              c, m, num, nargs = 0, keep = 0;
+
+    snprintf(dir, sizeof(dir), "/tmp/ccdisagg-%d", (int)getpid());
+    while ( ( c = getopt(argc, argv, "i:D:n:B:S:t:T:e:d:kh") ) != -1 ) {
+        switch ( c ) {
+        case 'i': d_interval = atoi(optarg); break;
+        case 'D': d_days = atoi(optarg); break;
+        case 'n': d_noise = atof(optarg); break;
+        case 'B': d_base = atoi(optarg); break;
+        case 'S': d_seed = strtoul(optarg, NULL, 0); break;
+        case 't': threshold = optarg; break;
+        case 'T': tolerance = optarg; break;
+        case 'e': settle = optarg; break;
+        case 'd': snprintf(dir, sizeof(dir), "%s", optarg); break;
+        case 'k': keep = 1; break;
+        default: usage();
+        }
+    }
+    if ( d_interval < 1 || d_days < 1 ) {
+        usage();
+    }
+    trace_generate();
+
+    snprintf(storedir, sizeof(storedir), "%s/store", dir);
+    if ( mkdir(dir, 0755) != 0 ) {
+        perror(dir);
+        return 1;
+    }
+    args[nargs++] = argv[0];
+    args[nargs++] = "--store:dir";        args[nargs++] = storedir;
+    args[nargs++] = "--disagg:sensors";   args[nargs++] = "0";
+    args[nargs++] = "--disagg:threshold"; args[nargs++] = threshold;
+    args[nargs++] = "--disagg:tolerance"; args[nargs++] = tolerance;
+    args[nargs++] = "--disagg:settle";    args[nargs++] = settle;
+    args[nargs] = NULL;
+
+    openlog("ccdisagg", LOG_PID, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_ERR));
+    ctx = iniparse_init("main");
+    store_options(ctx);
+    disagg_options(ctx);
+    iniparse_args(ctx, nargs, args);
+    iniparse_cleanup(ctx);
+    store_init();
+    disagg_init();
+
+    before = allocs;
+    start = now_ns();
+    for ( i = 0; i < num_readings; i++ ) {
+        disagg_sample(&readings[i]);
+    }
+    elapsed = now_ns() - start;
+    before = allocs - before;
+    store_flush(0);
+
+    store_scan(0, STORE_EVENT, d_start, d_start + (time_t)d_days * 86400 + 1, event_collect, NULL);
+    matched = edges_match();
+    precision = num_found ? (double)matched / num_found : 0;
+    recall = num_truth ? (double)matched / num_truth : 0;
+
+    /* Energy of each learnt appliance goes to the one it looks like */
+    num = disagg_appliances(0, &learnt);
+    for ( i = 0; i < num; i++ ) {
+        if ( ( m = model_of(learnt[i].watts) ) != -1 ) {
+            found_joules[m] += learnt[i].joules;
+            if ( learnt_watts[m] == 0 ) {
+                learnt_watts[m] = lrint(learnt[i].watts);
+            }
+        }
+    }
+
+    printf("{\n  \"trace\": { \"interval\": %d, \"days\": %d, \"noise\": %g, \"base\": %d, \"seed\": %u, "
+           "\"readings\": %ld },\n", d_interval, d_days, d_noise, d_base, d_seed, num_readings);
+    printf("  \"ns_per_reading\": %.1f,\n  \"readings_per_sec\": %.0f,\n  \"allocs_per_reading\": %.4f,\n",
+           (double)elapsed / num_readings, num_readings * 1e9 / elapsed, (double)before / num_readings);
+    printf("  \"edges\": { \"true\": %ld, \"found\": %ld, \"precision\": %.3f, \"recall\": %.3f },\n",
+           num_truth, num_found, precision, recall);
+    printf("  \"learnt\": %d,\n  \"appliances\": [\n", num);
+    for ( m = 0; m < NUM_MODELS; m++ ) {
+        printf("    { \"name\": \"%s\", \"watts\": %d, \"learnt\": %d, \"kwh\": %.3f, \"found_kwh\": %.3f, "
+               "\"error\": %.3f }%s\n", models[m].name, models[m].watts, learnt_watts[m],
+               truth_joules[m] / 3600000.0, found_joules[m] / 3600000.0,
+               truth_joules[m] ? fabs(found_joules[m] - truth_joules[m]) / truth_joules[m] : 0,
+               m < NUM_MODELS - 1 ? "," : "");
+    }
+    printf("  ]\n}\n");
+
+    fprintf(stderr, "%ld readings at %.0f ns each, %ld of %ld switches found (precision %.3f recall %.3f)\n",
+            num_readings, (double)elapsed / num_readings, matched, num_truth, precision, recall);
+
+    store_flush(1);
+    if ( keep == 0 ) {
+        nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return 0;
+}
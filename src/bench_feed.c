@@ -0,0 +1,130 @@
+/*
+ *   Current Cost Daemon - live feed latency benchmark
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Runs ./currentcostd on a pseudo terminal, writes CC128 lines into
+ *   it and follows the feed with ccfeed_next(). Reports the time from
+ *   writing the line to the reader waking up, and from the daemon
+ *   reading the first byte of the line to the reader waking up.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "ccfeed.h"
+
+
+#define READINGS    2000
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+    long long   x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(char *what, long long *samples, int num)
+{
+    qsort(samples, num, sizeof(long long), compare);
+    printf("feed %-18s p50 %7.1f us  p99 %7.1f us  max %7.1f us\n", what,
+           samples[num / 2] / 1000.0, samples[num * 99 / 100] / 1000.0, samples[num - 1] / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    static long long   written[READINGS], arrived[READINGS];
+    feed_entry_t       entry;
+    ccfeed_t          *feed = NULL;
+    char               name[64], line[256], *tty;
+    struct tm          tm;
+    time_t             t;
+    pid_t              pid;
+    long long          start;
+    int                master, i, num = 0, len;
+
+    if ( ( master = posix_openpt(O_RDWR|O_NOCTTY) ) == -1 || grantpt(master) != 0 ||
+         unlockpt(master) != 0 || ( tty = ptsname(master) ) == NULL ) {
+        perror("pty");
+        return 1;
+    }
+    snprintf(name, sizeof(name), "/ccbench-feed-%d", (int)getpid());
+
+    if ( ( pid = fork() ) == 0 ) {
+        freopen("/dev/null", "w", stdout);
+        execl("./currentcostd", "currentcostd", "--serial:port", tty, "--feed:shm", name, NULL);
+        _exit(1);
+    }
+
+    /* Wait for the daemon to create the feed */
+    for ( i = 0; i < 500 && ( feed = ccfeed_open(name) ) == NULL; i++ ) {
+        usleep(10000);
+    }
+    if ( feed == NULL ) {
+        fprintf(stderr, "No feed from ./currentcostd\n");
+        kill(pid, SIGTERM);
+        return 1;
+    }
+    usleep(100000);
+
+    for ( i = 0; i < READINGS; i++ ) {
+        t = time(NULL);
+        localtime_r(&t, &tm);
+        len = snprintf(line, sizeof(line), "<msg><src>CC128-v0.11</src><dsb>00089</dsb><time>%02d:%02d:%02d</time>"
+                       "<tmpr>18.7</tmpr><sensor>0</sensor><id>01234</id><type>1</type><ch1><watts>%05d</watts></ch1></msg>\r\n",
+                       tm.tm_hour, tm.tm_min, tm.tm_sec, 300 + ( i % 1000 ));
+        start = now_ns();
+        if ( write(master, line, len) != len ) {
+            break;
+        }
+        if ( ccfeed_next(feed, &entry, 1000) <= 0 ) {
+            fprintf(stderr, "Reading %d never arrived\n", i);
+            break;
+        }
+        written[num] = now_ns() - start;
+        arrived[num] = now_ns() - entry.rx;
+        num++;
+        usleep(1000);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    printf("feed %d readings, %lu lost\n", num, ccfeed_lost(feed));
+    ccfeed_close(feed);
+
+    if ( num == 0 ) {
+        return 1;
+    }
+    report("write to wakeup", written, num);
+    report("arrival to wakeup", arrived, num);
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ *   Current Cost Daemon - static vs dynamic pipeline benchmark
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Runs the same five stages as a build time composition and as a
+ *   chain of function pointers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pipeline.h"
+
+
+#define READINGS    20000000
+
+static double        total_kwh;
+static double        total_cost;
+static int           last_watts;
+static volatile long emitted;
+
+
+static int stage_clamp(reading_t *reading)
+{
+    if ( reading->watts < 0 ) {
+        reading->watts = 0;
+    }
+    return 1;
+}
+
+static int stage_integrate(reading_t *reading)
+{
+    reading->joules = reading->watts * reading->delta;
+    total_kwh += reading->joules / 3600000.0;
+    reading->kwh = total_kwh;
+    return 1;
+}
+
+static int stage_deadband(reading_t *reading)
+{
+    int change = reading->watts - last_watts;
+
+    last_watts = reading->watts;
+    return change > 2 || change < -2;
+}
+
+static int stage_cost(reading_t *reading)
+{
+    total_cost += ( reading->joules / 3600000.0 ) * ( reading->sensor ? 0.15 : 0.28 );
+    return 1;
+}
+
+static int stage_sink(reading_t *reading)
+{
+    emitted++;
+    return 1;
+}
+
+#define BENCH_STAGES(X) \
+    X(stage_clamp) \
+    X(stage_integrate) \
+    X(stage_deadband) \
+    X(stage_cost) \
+    X(stage_sink)
+
+PIPELINE_STATIC(bench_static, BENCH_STAGES)
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double run(pipeline_t *chain)
+{
+    reading_t   reading;
+    double      start;
+    long        i;
+
+    memset(&reading, 0, sizeof(reading));
+    reading.delta = 6;
+    total_kwh = total_cost = 0;
+    last_watts = 0;
+    emitted = 0;
+
+    start = now_ns();
+    for ( i = 0; i < READINGS; i++ ) {
+        reading.watts = 300 + ( i & 63 ) * 5;
+        reading.sensor = i & 1;
+        if ( chain ) {
+            pipeline_chain_run(chain, &reading);
+        } else {
+            bench_static(&reading);
+        }
+    }
+    return ( now_ns() - start ) / READINGS;
+}
+
+int main(int argc, char *argv[])
+{
+    pipeline_t   chain;
+    double       s, d;
+
+    memset(&chain, 0, sizeof(chain));
+    pipeline_chain_add(&chain, stage_clamp);
+    pipeline_chain_add(&chain, stage_integrate);
+    pipeline_chain_add(&chain, stage_deadband);
+    pipeline_chain_add(&chain, stage_cost);
+    pipeline_chain_add(&chain, stage_sink);
+
+    /* Warm up then measure */
+    run(NULL);
+    run(&chain);
+    s = run(NULL);
+    d = run(&chain);
+
+    printf("pipeline static  5 stages %6.2f ns/reading\n", s);
+    printf("pipeline dynamic 5 stages %6.2f ns/reading\n", d);
+    return 0;
+}
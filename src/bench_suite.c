@@ -0,0 +1,627 @@
+/*
+ *   Current Cost Daemon - end to end benchmark suite
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Generates a synthetic CC128 dataset from a seed and runs it through
+ *   each part of the daemon in turn: parsing, energy, the filters, the
+ *   in memory and shared memory stages, each sink, rollup scans, socket
+ *   queries and finally the whole pipeline. Results go to stdout as
+ *   JSON:
+ *
+ *     { "dataset": { ... }, "clock_ns": N,
+ *       "benchmarks": [ { "name": "parse", "ops": N, "per_sec": N,
+ *                         "p50_ns": N, "p99_ns": N, "max_ns": N,
+ *                         "allocs_per_op": N }, ... ] }
+ *
+ *   Each operation is timed on its own, clock_ns is the cost of the
+ *   clock read which has already been taken off the latencies. Heap
+ *   allocations are counted by wrapping malloc() for the whole process.
+ *
+ *   -o FILE writes the dataset out as the meter would send it instead,
+ *   so the same readings can be pushed down a pseudo terminal, and
+ *   -c FILE writes it as a capture for the daemon to replay.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <ftw.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libini.h"
+#include "parse.h"
+#include "energy.h"
+#include "filter.h"
+#include "sink.h"
+#include "pipeline.h"
+#include "tariff.h"
+#include "alert.h"
+#include "capture.h"
+#include "ring.h"
+#include "latest.h"
+#include "feed.h"
+#include "store.h"
+#include "mqtt.h"
+#include "influx.h"
+#include "query.h"
+#include "trace.h"
+
+
+#define MAX_RESULTS     32
+#define EXEC_OPS        200
+#define QUERY_OPS       500
+#define SCAN_OPS        300
+
+typedef struct {
+    time_t          now;
+    long long       rx;
+    char           *line;
+} sample_t;
+
+typedef struct {
+    char            name[32];
+    long            ops;
+    double          per_sec;
+    long long       p50, p99, max;
+    double          allocs;
+} result_t;
+
+typedef int (*op_fn)(long i, void *arg);
+
+/* Dataset */
+static int          d_sensors          = 3;
+static int          d_interval         = 6;
+static int          d_hours            = 24;
+static int          d_history          = 120;
+static double       d_noise            = 15;
+static unsigned int d_seed             = 1;
+static time_t       d_start            = 1275350400;   /* 2010-06-01 */
+
+static sample_t    *samples            = NULL;
+static long         num_samples        = 0;
+static reading_t   *readings           = NULL;
+static long         num_readings       = 0;
+
+static result_t     results[MAX_RESULTS];
+static int          num_results        = 0;
+static long long    clock_ns           = 0;
+static unsigned long allocs            = 0;
+static unsigned int rng_state;
+static char         query_sock[FILENAME_MAX];
+
+extern void        *__libc_malloc(size_t size);
+extern void        *__libc_calloc(size_t num, size_t size);
+extern void        *__libc_realloc(void *ptr, size_t size);
+
+
+void *malloc(size_t size)
+{
+    __sync_fetch_and_add(&allocs, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size)
+{
+    __sync_fetch_and_add(&allocs, 1);
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&allocs, 1);
+    return __libc_realloc(ptr, size);
+}
+
+/** \brief Required to satisfy the linking of libini.c
+ */
+char *filename_expand(char *format, char *buf, size_t buflen, char *i_option, char *k_option)
+{
+    snprintf(buf, buflen, "%s",format);
+
+    return buf;
+}
+
+
+static unsigned int rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double uniform()
+{
+    return rng() / 4294967296.0;
+}
+
+static void sample_add(char **buf, size_t *len, size_t *size, time_t now, long long rx, char *line)
+{
+    int     n = strlen(line) + 1;
+
+    if ( *len + n > *size ) {
+        *size = *size * 2 + n;
+        *buf = realloc(*buf, *size);
+    }
+    memcpy(*buf + *len, line, n);
+    if ( ( num_samples & ( num_samples - 1 ) ) == 0 ) {
+        samples = realloc(samples, ( num_samples ? num_samples * 2 : 1 ) * sizeof(sample_t));
+    }
+    samples[num_samples].now = now;
+    samples[num_samples].rx = rx;
+    samples[num_samples].line = (char *)*len;    /* Fixed up once the buffer stops moving */
+    num_samples++;
+    *len += n;
+}
+
+/** \brief Make up a dataset, the same seed always gives the same lines
+ *
+ *  Each sensor has a base load with a few appliances switching in and
+ *  out on top, plus noise. The meter clock runs fast by a second an
+ *  hour, and every d_history minutes each sensor sends a history block.
+ */
+static void dataset_generate()
+{
+    static const struct {
+        int     watts;
+        double  on, off;       /* Chance of switching per reading */
+    } appliances[] = {
+        { 2500, 0.0008, 0.08 },    /* Kettle */
+        {  120, 0.02,   0.03 },    /* Fridge */
+        {  800, 0.001,  0.004 },   /* Washing machine */
+        {   60, 0.003,  0.002 },   /* Lights */
+    };
+    int         on[MAX_SENSORS][4];
+    double      hist[MAX_SENSORS];
+    char        line[512], *buf = NULL;
+    size_t      len = 0, size = 0;
+    struct tm   tm;
+    time_t      t, end = d_start + d_hours * 3600, meter;
+    int         sensor, i, watts, n;
+    long        k;
+
+    rng_state = d_seed ? d_seed : 1;
+    memset(on, 0, sizeof(on));
+    memset(hist, 0, sizeof(hist));
+
+    for ( t = d_start; t < end; t += d_interval ) {
+        for ( sensor = 0; sensor < d_sensors; sensor++ ) {
+            double w = 80 + 40 * sensor;
+
+            for ( i = 0; i < 4; i++ ) {
+                if ( uniform() < ( on[sensor][i] ? appliances[i].off : appliances[i].on ) ) {
+                    on[sensor][i] = !on[sensor][i];
+                }
+                w += on[sensor][i] * appliances[i].watts;
+            }
+            w += ( uniform() + uniform() + uniform() - 1.5 ) * 2 * d_noise;
+            watts = w < 0 ? 0 : (int)w;
+            hist[sensor] += watts * d_interval / 3600000.0;
+
+            meter = t + sensor + 17 + ( t - d_start ) / 3600;
+            localtime_r(&meter, &tm);
+            snprintf(line, sizeof(line), "<msg><src>CC128-v0.11</src><dsb>00089</dsb><time>%02d:%02d:%02d</time>"
+                     "<tmpr>%.1f</tmpr><sensor>%d</sensor><id>0%04d</id><type>1</type><ch1><watts>%05d</watts></ch1></msg>",
+                     tm.tm_hour, tm.tm_min, tm.tm_sec, 18 + 3 * sin(( t - d_start ) * M_PI / 43200),
+                     sensor, 1234 + sensor, watts);
+            sample_add(&buf, &len, &size, t + sensor, ( t + sensor - d_start ) * 1000000000LL, line);
+        }
+        if ( d_history && ( t - d_start ) % ( d_history * 60 ) < d_interval && t > d_start ) {
+            for ( sensor = 0; sensor < d_sensors; sensor++ ) {
+                meter = t + 17 + ( t - d_start ) / 3600;
+                localtime_r(&meter, &tm);
+                n = snprintf(line, sizeof(line), "<msg><src>CC128-v0.11</src><dsb>00089</dsb><time>%02d:%02d:%02d</time>"
+                             "<hist><dsw>00090</dsw><type>1</type><units>kwhr</units><data><sensor>%d</sensor>",
+                             tm.tm_hour, tm.tm_min, tm.tm_sec, sensor);
+                for ( i = 0; i < 4; i++ ) {
+                    n += snprintf(line + n, sizeof(line) - n, "<h%03d>%.3f</h%03d>", 2 + i * 2, hist[sensor] / ( i + 1 ), 2 + i * 2);
+                }
+                snprintf(line + n, sizeof(line) - n, "</data></hist></msg>");
+                sample_add(&buf, &len, &size, t + 1, ( t + 1 - d_start ) * 1000000000LL, line);
+                hist[sensor] = 0;
+            }
+        }
+    }
+    for ( k = 0; k < num_samples; k++ ) {
+        samples[k].line = buf + (size_t)samples[k].line;
+    }
+}
+
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+    long long   x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* What a back to back pair of clock reads costs */
+static void clock_calibrate()
+{
+    long long   lat[1001];
+    int         i;
+
+    for ( i = 0; i < 1001; i++ ) {
+        lat[i] = now_ns();
+    }
+    for ( i = 0; i < 1000; i++ ) {
+        lat[i] = lat[i + 1] - lat[i];
+    }
+    qsort(lat, 1000, sizeof(long long), compare);
+    clock_ns = lat[500];
+}
+
+/** \brief Time ops calls of fn and add the result
+ *
+ *  One clock read per call, so each latency is the call plus a clock
+ *  read which is taken off again.
+ */
+static void bench(char *name, long ops, op_fn fn, void *arg)
+{
+    result_t       *res;
+    long long      *stamp;
+    unsigned long   before;
+    long            i;
+
+    if ( ops <= 0 || num_results == MAX_RESULTS ) {
+        return;
+    }
+    stamp = __libc_malloc(( ops + 1 ) * sizeof(long long));
+    before = allocs;
+    stamp[0] = now_ns();
+    for ( i = 0; i < ops; i++ ) {
+        fn(i, arg);
+        stamp[i + 1] = now_ns();
+    }
+    res = &results[num_results++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->ops = ops;
+    res->allocs = (double)( allocs - before ) / ops;
+    res->per_sec = ops / ( ( stamp[ops] - stamp[0] ) / 1e9 );
+    for ( i = 0; i < ops; i++ ) {
+        stamp[i] = stamp[i + 1] - stamp[i] - clock_ns;
+        if ( stamp[i] < 0 ) {
+            stamp[i] = 0;
+        }
+    }
+    qsort(stamp, ops, sizeof(long long), compare);
+    res->p50 = stamp[ops / 2];
+    res->p99 = stamp[ops * 99 / 100];
+    res->max = stamp[ops - 1];
+    free(stamp);
+    fprintf(stderr, "%-22s %9.0f/s  p50 %8lld ns  p99 %8lld ns  %.2f allocs\n", name, res->per_sec, res->p50, res->p99, res->allocs);
+}
+
+
+static int op_parse(long i, void *arg)
+{
+    sample_t   *s = &samples[i];
+
+    if ( parse_reading(s->line, s->now, s->rx, &readings[num_readings]) == 0 ) {
+        num_readings++;
+    }
+    return 0;
+}
+
+static int op_energy(long i, void *arg)
+{
+    energy_stamp(&readings[i]);
+    energy_sample(&readings[i]);
+    return 0;
+}
+
+static int op_filter(long i, void *arg)
+{
+    reading_t   scratch;
+
+    filter_apply(arg, &readings[i], &scratch);
+    return 0;
+}
+
+static int op_ring(long i, void *arg)
+{
+    ring_push(&readings[i]);
+    return 0;
+}
+
+static int op_latest(long i, void *arg)
+{
+    latest_publish(&readings[i]);
+    return 0;
+}
+
+static int op_feed(long i, void *arg)
+{
+    feed_publish(&readings[i]);
+    return 0;
+}
+
+static int op_sink(long i, void *arg)
+{
+    return sink_write(arg, &readings[i]);
+}
+
+static int scan_count(void *record, void *arg)
+{
+    ( *(long *)arg )++;
+    return 0;
+}
+
+/* arg is the level, each call scans one window for one sensor */
+static int op_scan(long i, void *arg)
+{
+    int      level = (long)arg;
+    time_t   window = level == STORE_RAW ? 3600 : level == STORE_MINUTE ? 86400 : d_hours * 3600;
+    long     windows = ( d_hours * 3600 + window - 1 ) / window;
+    long     count = 0;
+    time_t   from = d_start + ( i / d_sensors % windows ) * window;
+
+    return store_scan(i % d_sensors, level, from, from + window, scan_count, &count);
+}
+
+/* arg is the request, the daemon closes once it has answered */
+static int op_query(long i, void *arg)
+{
+    struct sockaddr_un  addr;
+    char                buf[32768];
+    int                 fd, ret;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", query_sock);
+    if ( ( fd = socket(AF_UNIX, SOCK_STREAM, 0) ) == -1 ) {
+        return -1;
+    }
+    if ( connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+         write(fd, arg, strlen(arg)) != strlen(arg) ) {
+        close(fd);
+        return -1;
+    }
+    while ( ( ret = read(fd, buf, sizeof(buf)) ) > 0 )
+        ;
+    close(fd);
+    return 0;
+}
+
+/* The whole path, shifted on a few days so the store sees new times */
+static int op_pipeline(long i, void *arg)
+{
+    sample_t   *s = &samples[i];
+    time_t      shift = (long)arg;
+    reading_t   reading;
+
+    if ( parse_reading(s->line, s->now + shift, s->rx + shift * 1000000000LL, &reading) == 0 ) {
+        pipeline_run(&reading);
+    }
+    return 0;
+}
+
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: bench_suite [-s sensors] [-i interval] [-H hours] [-b history-minutes]\n"
+                    "                   [-n noise-watts] [-S seed] [-d workdir] [-k] [-o dataset]\n"
+                    "                   [-c capture]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    configctx_t     *ctx;
+    filter_policy_t  policy;
+    filter_t         filter;
+    sink_t          *store, *mqtt, *influx, *exec;
+    char             dir[FILENAME_MAX], storedir[FILENAME_MAX];
+    char             latest[64], feedshm[64], request[128];
+    char            *output = NULL, *capture = NULL;
+    char            *args[32];
+    time_t           shift;
+    long             i;
+    int              c, nargs = 0, keep = 0;
+
+    snprintf(dir, sizeof(dir), "/tmp/ccbench-%d", (int)getpid());
+    while ( ( c = getopt(argc, argv, "s:i:H:b:n:S:d:ko:c:h") ) != -1 ) {
+        switch ( c ) {
+        case 's': d_sensors = atoi(optarg); break;
+        case 'i': d_interval = atoi(optarg); break;
+        case 'H': d_hours = atoi(optarg); break;
+        case 'b': d_history = atoi(optarg); break;
+        case 'n': d_noise = atof(optarg); break;
+        case 'S': d_seed = strtoul(optarg, NULL, 0); break;
+        case 'd': snprintf(dir, sizeof(dir), "%s", optarg); break;
+        case 'k': keep = 1; break;
+        case 'o': output = optarg; break;
+        case 'c': capture = optarg; break;
+        default: usage();
+        }
+    }
+    if ( d_sensors < 1 || d_sensors > MAX_SENSORS || d_interval < 1 || d_hours < 1 ) {
+        usage();
+    }
+
+    dataset_generate();
+    if ( output ) {
+        FILE *fp = strcmp(output, "-") ? fopen(output, "w") : stdout;
+
+        if ( fp == NULL ) {
+            perror(output);
+            return 1;
+        }
+        for ( i = 0; i < num_samples; i++ ) {
+            fprintf(fp, "%s\r\n", samples[i].line);
+        }
+        return fp == stdout ? 0 : fclose(fp);
+    }
+    if ( capture ) {
+        FILE          *fp = fopen(capture, "w");
+        unsigned char  rec[CAPTURE_RECORD];
+        int            len;
+
+        if ( fp == NULL ) {
+            perror(capture);
+            return 1;
+        }
+        fputs(CAPTURE_MAGIC, fp);
+        for ( i = 0; i < num_samples; i++ ) {
+            len = strlen(samples[i].line) + 2;
+            capture_header(rec, len, samples[i].now * 1000000000LL, 0);
+            fwrite(rec, 1, CAPTURE_RECORD, fp);
+            fprintf(fp, "%s\r\n", samples[i].line);
+        }
+        return fclose(fp);
+    }
+
+    /* Configure the modules the same way as the daemon does */
+    snprintf(storedir, sizeof(storedir), "%s/store", dir);
+    snprintf(query_sock, sizeof(query_sock), "%s/query.sock", dir);
+    snprintf(latest, sizeof(latest), "/ccbench-latest-%d", (int)getpid());
+    snprintf(feedshm, sizeof(feedshm), "/ccbench-feed-%d", (int)getpid());
+    if ( mkdir(dir, 0755) != 0 ) {
+        perror(dir);
+        return 1;
+    }
+    args[nargs++] = argv[0];
+    args[nargs++] = "--store:dir";      args[nargs++] = storedir;
+    args[nargs++] = "--query:socket";   args[nargs++] = query_sock;
+    args[nargs++] = "--latest:shm";     args[nargs++] = latest;
+    args[nargs++] = "--feed:shm";       args[nargs++] = feedshm;
+    args[nargs++] = "--mqtt:host";      args[nargs++] = "127.0.0.1";
+    args[nargs++] = "--mqtt:port";      args[nargs++] = "9";
+    args[nargs++] = "--influx:host";    args[nargs++] = "127.0.0.1";
+    args[nargs++] = "--influx:port";    args[nargs++] = "9";
+    args[nargs++] = "--trace:enabled";
+    args[nargs] = NULL;
+
+    openlog("ccbench", LOG_PID, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_ERR));
+    ctx = iniparse_init("main");
+    store_options(ctx);
+    ring_options(ctx);
+    latest_options(ctx);
+    feed_options(ctx);
+    query_options(ctx);
+    mqtt_options(ctx);
+    influx_options(ctx);
+    trace_options(ctx);
+    iniparse_args(ctx, nargs, args);
+    iniparse_cleanup(ctx);
+
+    energy_init(NULL, 300);
+    tariff_init(NULL, NULL);
+    alert_init(NULL);
+    ring_init();
+    latest_init();
+    feed_init();
+    store = store_init();
+    mqtt = mqtt_init();
+    influx = influx_init();
+    memset(&policy, 0, sizeof(policy));
+    exec = sink_exec_create("true", NULL, &policy);
+    if ( query_init() != 0 ) {
+        fprintf(stderr, "Unable to serve queries on %s\n", query_sock);
+        return 1;
+    }
+    clock_calibrate();
+
+    readings = __libc_calloc(num_samples, sizeof(reading_t));
+    bench("parse", num_samples, op_parse, NULL);
+    bench("energy", num_readings, op_energy, NULL);
+
+    memset(&policy, 0, sizeof(policy));
+    policy.deadband_watts = 20;
+    policy.heartbeat = 300;
+    filter_init(&filter, &policy);
+    bench("filter-deadband", num_readings, op_filter, &filter);
+    memset(&policy, 0, sizeof(policy));
+    policy.average = 60;
+    filter_init(&filter, &policy);
+    bench("filter-average", num_readings, op_filter, &filter);
+
+    bench("ring", num_readings, op_ring, NULL);
+    bench("latest", num_readings, op_latest, NULL);
+    bench("feed", num_readings, op_feed, NULL);
+    bench("sink-store", num_readings, op_sink, store);
+    store_flush(0);
+    bench("sink-mqtt", num_readings, op_sink, mqtt);
+    bench("sink-influx", num_readings, op_sink, influx);
+    bench("sink-exec", num_readings < EXEC_OPS ? num_readings : EXEC_OPS, op_sink, exec);
+
+    bench("scan-raw-1h", SCAN_OPS, op_scan, (void *)(long)STORE_RAW);
+    bench("rollup-minute-1d", SCAN_OPS, op_scan, (void *)(long)STORE_MINUTE);
+    bench("rollup-hour-all", SCAN_OPS, op_scan, (void *)(long)STORE_HOUR);
+
+    bench("query-latest", QUERY_OPS, op_query, "latest\n");
+    snprintf(request, sizeof(request), "range 0 %ld %ld\n", (long)d_start, (long)d_start + 3600);
+    bench("query-range-1h", QUERY_OPS, op_query, request);
+    snprintf(request, sizeof(request), "agg 0 %ld %ld 3600\n", (long)d_start, (long)d_start + d_hours * 3600);
+    bench("query-agg-hourly", QUERY_OPS, op_query, request);
+
+    sink_register(store);
+    sink_register(mqtt);
+    sink_register(influx);
+    pipeline_init();
+    shift = ( d_hours / 24 + 1 ) * 86400;
+    bench("pipeline", num_samples, op_pipeline, (void *)(long)shift);
+    trace_init();
+    bench("pipeline-traced", num_samples, op_pipeline, (void *)(long)( shift * 2 ));
+    trace_enabled = 0;
+
+    printf("{\n  \"dataset\": { \"sensors\": %d, \"interval\": %d, \"hours\": %d, \"history\": %d, "
+           "\"noise\": %g, \"seed\": %u, \"lines\": %ld, \"readings\": %ld },\n",
+           d_sensors, d_interval, d_hours, d_history, d_noise, d_seed, num_samples, num_readings);
+    printf("  \"clock_ns\": %lld,\n  \"benchmarks\": [\n", clock_ns);
+    for ( i = 0; i < num_results; i++ ) {
+        result_t *res = &results[i];
+
+        printf("    { \"name\": \"%s\", \"ops\": %ld, \"per_sec\": %.0f, \"p50_ns\": %lld, \"p99_ns\": %lld, "
+               "\"max_ns\": %lld, \"allocs_per_op\": %.3f }%s\n", res->name, res->ops, res->per_sec,
+               res->p50, res->p99, res->max, res->allocs, i < num_results - 1 ? "," : "");
+    }
+    printf("  ]\n}\n");
+
+    query_close();
+    store_flush(1);
+    latest_close();
+    feed_close();
+    shm_unlink(latest);
+    if ( keep == 0 ) {
+        nftw(dir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+    }
+    return 0;
+}
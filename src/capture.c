@@ -0,0 +1,351 @@
+/*
+ *   Current Cost Daemon - raw serial capture and replay
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   A capture file is the 8 byte magic "CCCAPT01" followed by a record
+ *   per read() of the serial port:
+ *
+ *     int64   CLOCK_REALTIME ns of the read, little endian
+ *     uint16  length, little endian, the top two bits are the port
+ *     bytes   exactly as read
+ *
+ *   Records are gathered in one buffer whilst a thread writes out the
+ *   other, so the serial port never waits on the disc. When the file
+ *   passes capture:max-size it's rotated to .1, .2 and so on up to
+ *   capture:files. If the writer can't keep up the bytes are dropped
+ *   and counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "evloop.h"
+
+
+#define CAPTURE_BUFFER      65536
+
+
+/* Replays read through their own buffer, stdio would allocate one */
+typedef struct {
+    int             fd;
+    int             len;
+    int             pos;
+    char            buf[CAPTURE_BUFFER];
+} replay_t;
+
+
+static void         capture_timer(void *data);
+static void         capture_swap();
+static void        *capture_writer(void *arg);
+static void         capture_rotate();
+static int          replay_read(replay_t *replay, void *data, int len);
+
+/* Configuration */
+static char        *c_capture_file       = NULL;
+static int          c_capture_size       = 16 * 1024 * 1024;
+static int          c_capture_files      = 4;
+static int          c_capture_flush      = 1000;
+
+static char        *active               = NULL;   /* Being filled by the main thread */
+static int          active_len           = 0;
+static char        *pending              = NULL;   /* Handed to the writer */
+static int          pending_len          = 0;
+static char        *spare                = NULL;
+static int          writer_quit          = 0;
+static int          writer_running       = 0;
+static pthread_t    writer_tid;
+static pthread_mutex_t writer_lock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  writer_cond      = PTHREAD_COND_INITIALIZER;
+
+/* Owned by the writer thread */
+static int          capture_fd           = -1;
+static off_t        capture_size         = 0;
+
+static unsigned long stat_bytes          = 0;
+static unsigned long stat_dropped        = 0;
+
+
+void capture_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "capture:file","File to record raw serial data in",OPT_STR,&c_capture_file);
+    iniparse_add(ctx, 0, "capture:max-size","Bytes to write before rotating the capture",OPT_INT,&c_capture_size);
+    iniparse_add(ctx, 0, "capture:files","Rotated captures to keep",OPT_INT,&c_capture_files);
+    iniparse_add(ctx, 0, "capture:flush","Milliseconds between writes of the capture",OPT_INT,&c_capture_flush);
+}
+
+void capture_init()
+{
+    sigset_t   all, old;
+
+    if ( c_capture_file == NULL ) {
+        return;
+    }
+    active = malloc(CAPTURE_BUFFER);
+    spare = malloc(CAPTURE_BUFFER);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if ( pthread_create(&writer_tid, NULL, capture_writer, NULL) != 0 ) {
+        syslog(LOG_ERR,"Unable to start the capture writer");
+        free(active);
+        free(spare);
+        active = spare = NULL;
+    } else {
+        writer_running = 1;
+        ev_every(c_capture_flush > 10 ? c_capture_flush : 10, capture_timer, NULL);
+        syslog(LOG_INFO,"Capturing serial data to %s",c_capture_file);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void capture_write(char *data, int len, long long ns, int device)
+{
+    unsigned char  *rec;
+
+    if ( active == NULL ) {
+        return;
+    }
+    while ( len > 0 ) {
+        int chunk = len > CAPTURE_CHUNK ? CAPTURE_CHUNK : len;
+
+        if ( active_len + CAPTURE_RECORD + chunk > CAPTURE_BUFFER ) {
+            capture_swap();
+            if ( active_len + CAPTURE_RECORD + chunk > CAPTURE_BUFFER ) {
+                stat_dropped += len;
+                return;
+            }
+        }
+        rec = (unsigned char *)active + active_len;
+        capture_header(rec, chunk, ns, device);
+        memcpy(rec + CAPTURE_RECORD, data, chunk);
+        active_len += CAPTURE_RECORD + chunk;
+        stat_bytes += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void capture_close()
+{
+    if ( writer_running == 0 ) {
+        return;
+    }
+    /* Hand over the last buffer once the writer has finished the one it has */
+    pthread_mutex_lock(&writer_lock);
+    while ( pending != NULL ) {
+        pthread_cond_wait(&writer_cond, &writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+    capture_swap();
+
+    pthread_mutex_lock(&writer_lock);
+    writer_quit = 1;
+    pthread_cond_broadcast(&writer_cond);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer_tid, NULL);
+    writer_running = 0;
+    active = NULL;
+}
+
+void capture_stats(unsigned long *bytes, unsigned long *dropped)
+{
+    *bytes = stat_bytes;
+    *dropped = stat_dropped;
+}
+
+/** \brief Fill in a record header: the stamp in little endian ns, then
+ *  the length with the device in the top two bits
+ */
+void capture_header(unsigned char *rec, int len, long long ns, int device)
+{
+    int     i;
+
+    for ( i = 0; i < 8; i++ ) {
+        rec[i] = ( ns >> ( i * 8 ) ) & 0xff;
+    }
+    rec[8] = len & 0xff;
+    rec[9] = ( ( len >> 8 ) & 0x3f ) | ( ( device & 3 ) << 6 );
+}
+
+/** \brief Feed the chunks of a capture to fn
+ *
+ *  \return Number of chunks
+ *  \retval -1 - Not a capture file
+ */
+long capture_replay(char *filename, capture_fn fn)
+{
+    unsigned char   rec[CAPTURE_RECORD];
+    char            magic[8];
+    char            data[CAPTURE_CHUNK];
+    replay_t        replay;
+    long long       ns;
+    long            num = 0;
+    int             i, len;
+
+    if ( ( replay.fd = open(filename, O_RDONLY) ) == -1 ) {
+        return -1;
+    }
+    replay.len = replay.pos = 0;
+    if ( replay_read(&replay, magic, 8) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0 ) {
+        close(replay.fd);
+        return -1;
+    }
+    while ( replay_read(&replay, rec, CAPTURE_RECORD) == CAPTURE_RECORD ) {
+        ns = 0;
+        for ( i = 7; i >= 0; i-- ) {
+            ns = ( ns << 8 ) | rec[i];
+        }
+        len = ( rec[8] | ( rec[9] << 8 ) ) & CAPTURE_CHUNK;
+        if ( replay_read(&replay, data, len) != len ) {
+            break;
+        }
+        fn(data, len, ns, rec[9] >> 6);
+        num++;
+    }
+    close(replay.fd);
+    return num;
+}
+
+
+static void capture_timer(void *data)
+{
+    if ( active_len ) {
+        capture_swap();
+    }
+}
+
+/* Give the active buffer to the writer if it's free */
+static void capture_swap()
+{
+    pthread_mutex_lock(&writer_lock);
+    if ( pending == NULL && active_len ) {
+        pending = active;
+        pending_len = active_len;
+        active = spare;
+        active_len = 0;
+        spare = NULL;
+        pthread_cond_broadcast(&writer_cond);
+    }
+    pthread_mutex_unlock(&writer_lock);
+}
+
+static void *capture_writer(void *arg)
+{
+    char   *buf;
+    int     len, done, ret;
+
+    pthread_mutex_lock(&writer_lock);
+    while ( 1 ) {
+        while ( pending == NULL && writer_quit == 0 ) {
+            pthread_cond_wait(&writer_cond, &writer_lock);
+        }
+        if ( pending == NULL ) {
+            break;
+        }
+        buf = pending;
+        len = pending_len;
+        pthread_mutex_unlock(&writer_lock);
+
+        if ( capture_fd == -1 || capture_size >= c_capture_size ) {
+            capture_rotate();
+        }
+        for ( done = 0; capture_fd != -1 && done < len; done += ret ) {
+            if ( ( ret = write(capture_fd, buf + done, len - done) ) <= 0 ) {
+                if ( ret < 0 && errno == EINTR ) {
+                    ret = 0;
+                    continue;
+                }
+                syslog(LOG_ERR,"Failed writing capture %s",c_capture_file);
+                close(capture_fd);
+                capture_fd = -1;
+                break;
+            }
+        }
+        capture_size += done;
+
+        pthread_mutex_lock(&writer_lock);
+        spare = buf;
+        pending = NULL;
+        pthread_cond_broadcast(&writer_cond);
+    }
+    pthread_mutex_unlock(&writer_lock);
+    if ( capture_fd != -1 ) {
+        fsync(capture_fd);
+        close(capture_fd);
+    }
+    return NULL;
+}
+
+/* Up to len bytes from the replay, short only at the end of the file */
+static int replay_read(replay_t *replay, void *data, int len)
+{
+    int     done = 0, chunk, ret;
+
+    while ( done < len ) {
+        if ( replay->pos == replay->len ) {
+            if ( ( ret = read(replay->fd, replay->buf, sizeof(replay->buf)) ) < 0 && errno == EINTR ) {
+                continue;
+            }
+            if ( ret <= 0 ) {
+                break;
+            }
+            replay->len = ret;
+            replay->pos = 0;
+        }
+        chunk = replay->len - replay->pos < len - done ? replay->len - replay->pos : len - done;
+        memcpy((char *)data + done, replay->buf + replay->pos, chunk);
+        replay->pos += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+/* Called from the writer thread */
+static void capture_rotate()
+{
+    char     from[FILENAME_MAX], to[FILENAME_MAX];
+    int      i;
+
+    if ( capture_fd != -1 ) {
+        close(capture_fd);
+        capture_fd = -1;
+        for ( i = c_capture_files; i > 0; i-- ) {
+            snprintf(from, sizeof(from), i > 1 ? "%s.%d" : "%s", c_capture_file, i - 1);
+            snprintf(to, sizeof(to), "%s.%d", c_capture_file, i);
+            rename(from, to);
+        }
+        if ( c_capture_files <= 0 ) {
+            unlink(c_capture_file);
+        }
+    }
+    if ( ( capture_fd = open(c_capture_file, O_WRONLY|O_CREAT|O_APPEND, 0644) ) == -1 ) {
+        syslog(LOG_ERR,"Unable to open capture %s",c_capture_file);
+        return;
+    }
+    capture_size = lseek(capture_fd, 0, SEEK_END);
+    if ( capture_size == 0 && write(capture_fd, CAPTURE_MAGIC, 8) == 8 ) {
+        capture_size = 8;
+    }
+}
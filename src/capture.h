@@ -0,0 +1,53 @@
+/*
+ *   Current Cost Daemon - raw serial capture and replay
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "libini.h"
+
+#define CAPTURE_MAGIC       "CCCAPT01"
+#define CAPTURE_RECORD      10         /* Bytes before the data */
+#define CAPTURE_CHUNK       0x3fff     /* Most data in one record */
+
+/* Called for each chunk of a capture, ns is CLOCK_REALTIME */
+typedef void (*capture_fn)(char *data, int len, long long ns, int device);
+
+/* Register the [capture] options */
+extern void         capture_options(configctx_t *ctx);
+
+/* Start the writer if capture:file is set */
+extern void         capture_init();
+
+/* Record what a read() of a serial port returned */
+extern void         capture_write(char *data, int len, long long ns, int device);
+
+/* Write out what's buffered and stop the writer */
+extern void         capture_close();
+
+/* Fill in the CAPTURE_RECORD bytes which go before len bytes of data */
+extern void         capture_header(unsigned char *rec, int len, long long ns, int device);
+
+/* Feed a capture file to fn, returns the number of chunks or -1 */
+extern long         capture_replay(char *filename, capture_fn fn);
+
+extern void         capture_stats(unsigned long *bytes, unsigned long *dropped);
+
+#endif /* CAPTURE_H */
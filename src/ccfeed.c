@@ -0,0 +1,189 @@
+/*
+ *   Current Cost Daemon - live feed reader library
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ccfeed.h"
+
+
+struct ccfeed {
+    const feed_header_t *header;
+    const feed_entry_t  *entries;
+    size_t               size;
+    uint32_t             mask;
+    uint64_t             next;         /* Reading we want next */
+    unsigned long        lost;
+};
+
+
+static int          ccfeed_wait(ccfeed_t *feed, int timeout);
+
+
+ccfeed_t *ccfeed_open(const char *name)
+{
+    const feed_header_t  *header;
+    struct stat           st;
+    ccfeed_t             *feed;
+    void                 *map;
+    int                   fd;
+
+    if ( ( fd = shm_open(name, O_RDONLY, 0) ) == -1 ) {
+        return NULL;
+    }
+    if ( fstat(fd, &st) != 0 || st.st_size < sizeof(feed_header_t) ||
+         ( map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) ) == MAP_FAILED ) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    header = map;
+    if ( __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != FEED_MAGIC || header->version != FEED_VERSION ||
+         header->entry_size != sizeof(feed_entry_t) ||
+         st.st_size < sizeof(feed_header_t) + (size_t)header->capacity * sizeof(feed_entry_t) ) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    if ( ( feed = calloc(1, sizeof(*feed)) ) == NULL ) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    feed->header = header;
+    feed->entries = (const feed_entry_t *)( header + 1 );
+    feed->size = st.st_size;
+    feed->mask = header->capacity - 1;
+    feed->next = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) + 1;
+    return feed;
+}
+
+void ccfeed_close(ccfeed_t *feed)
+{
+    munmap((void *)feed->header, feed->size);
+    free(feed);
+}
+
+unsigned long ccfeed_lost(ccfeed_t *feed)
+{
+    return feed->lost;
+}
+
+const feed_entry_t *ccfeed_peek(ccfeed_t *feed, int timeout)
+{
+    const feed_entry_t  *entry;
+    uint64_t             head;
+
+    while ( ccfeed_wait(feed, timeout) > 0 ) {
+        entry = &feed->entries[feed->next & feed->mask];
+        if ( __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) == feed->next ) {
+            return entry;
+        }
+        /* Lapped, skip to the oldest entry that can't be mid write */
+        head = __atomic_load_n(&feed->header->head, __ATOMIC_ACQUIRE);
+        if ( head - feed->next + 2 > feed->mask + 1 ) {
+            feed->lost += head - feed->mask + 1 - feed->next;
+            feed->next = head - feed->mask + 1;
+        }
+    }
+    return NULL;
+}
+
+int ccfeed_advance(ccfeed_t *feed)
+{
+    const feed_entry_t  *entry = &feed->entries[feed->next & feed->mask];
+    uint64_t             seq;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    feed->next++;
+    if ( seq != feed->next - 1 ) {
+        feed->lost++;
+        return -1;
+    }
+    return 0;
+}
+
+int ccfeed_next(ccfeed_t *feed, feed_entry_t *entry, int timeout)
+{
+    const feed_entry_t  *peek;
+
+    do {
+        if ( ( peek = ccfeed_peek(feed, timeout) ) == NULL ) {
+            return feed->header->pid == 0 ? -1 : 0;
+        }
+        memcpy(entry, peek, sizeof(*entry));
+    } while ( ccfeed_advance(feed) < 0 );
+    return 1;
+}
+
+
+/** \brief Wait for the reading we want next to be published
+ *
+ *  \return 1 - It's there
+ *  \retval 0 - Timed out
+ *  \retval -1 - The daemon has stopped
+ */
+static int ccfeed_wait(ccfeed_t *feed, int timeout)
+{
+    struct timespec   deadline, now, left;
+    uint32_t          wake;
+
+    if ( timeout >= 0 ) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += ( timeout % 1000 ) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L ) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    while ( 1 ) {
+        wake = __atomic_load_n(&feed->header->wake, __ATOMIC_SEQ_CST);
+        if ( __atomic_load_n(&feed->header->head, __ATOMIC_SEQ_CST) >= feed->next ) {
+            return 1;
+        }
+        if ( feed->header->pid == 0 ) {
+            return -1;
+        }
+        if ( timeout >= 0 ) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if ( left.tv_nsec < 0 ) {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if ( left.tv_sec < 0 ) {
+                return 0;
+            }
+        }
+        syscall(SYS_futex, &feed->header->wake, FUTEX_WAIT, wake, timeout >= 0 ? &left : NULL, NULL, 0);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ *   Current Cost Daemon - live feed reader library
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Follow the daemon's feed:shm from another process:
+ *
+ *     ccfeed_t      *feed = ccfeed_open("/currentcost-feed");
+ *     feed_entry_t   entry;
+ *
+ *     while ( ccfeed_next(feed, &entry, -1) > 0 )
+ *         printf("%d %d\n", entry.sensor, entry.watts);
+ *
+ *   or without copying:
+ *
+ *     const feed_entry_t *entry;
+ *
+ *     while ( ( entry = ccfeed_peek(feed, -1) ) != NULL ) {
+ *         use(entry);
+ *         if ( ccfeed_advance(feed) < 0 )
+ *             ...entry was overwritten whilst we used it...
+ *     }
+ *
+ *   Link with libccfeed.a.
+ */
+
+#ifndef CCFEED_H
+#define CCFEED_H
+
+#define FEED_READER_ONLY
+#include "feed.h"
+
+typedef struct ccfeed ccfeed_t;
+
+/* Map a feed, reading starts with the next reading published */
+extern ccfeed_t    *ccfeed_open(const char *name);
+extern void         ccfeed_close(ccfeed_t *feed);
+
+/* Wait up to timeout ms (-1 = forever) and copy out the next reading.
+   Returns 1 with a reading, 0 on timeout and -1 if the feed has gone */
+extern int          ccfeed_next(ccfeed_t *feed, feed_entry_t *entry, int timeout);
+
+/* Wait for the next reading and return it in place, NULL on timeout */
+extern const feed_entry_t *ccfeed_peek(ccfeed_t *feed, int timeout);
+
+/* Move past the peeked reading, -1 if it changed under us */
+extern int          ccfeed_advance(ccfeed_t *feed);
+
+/* Readings missed through falling too far behind */
+extern unsigned long ccfeed_lost(ccfeed_t *feed);
+
+#endif /* CCFEED_H */
@@ -0,0 +1,297 @@
+/*
+ *   Current Cost Daemon - query client
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Usage:
+ *
+ *     ccquery [-s socket] [-t] latest [sensor]
+ *     ccquery [-s socket] [-t] range sensor from to
+ *     ccquery [-s socket] [-t] agg sensor from to step
+ *     ccquery [-s socket] appliances sensor from to
+ *     ccquery [-s socket] [-t] lttb sensor from to points
+ *     ccquery [-s socket] [-t] gaps sensor from to
+ *     ccquery [-s socket] metrics
+ *     ccquery [-m shm] [-t] now [sensor]
+ *
+ *   Times can be epoch seconds, now, today, yesterday, YYYY-MM-DD,
+ *   YYYY-MM-DDTHH:MM[:SS] (local time) or -N[smhd] before now. Steps
+ *   are seconds or N[smhd]. So yesterday's usage is:
+ *
+ *     ccquery agg 0 yesterday today 1d
+ *
+ *   and last year thinned out to a thousand points for a chart:
+ *
+ *     ccquery lttb 0 -365d now 1000
+ *
+ *   now reads the table the daemon exports with latest:shm rather than
+ *   going through the socket.
+ */
+
+#define _GNU_SOURCE             /* strptime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LATEST_READER_ONLY
+#include "latest.h"
+
+
+static int          now(char *shm, int sensor, int human);
+static long         parse_time(char *str);
+static long         parse_step(char *str);
+static void         usage();
+
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un  addr;
+    char               *path = "/var/run/currentcost.sock";
+    char               *shm = "/currentcost";
+    char                request[256];
+    char                line[1024];
+    char                stamp[32];
+    char               *rest;
+    FILE               *fp;
+    struct tm           tm;
+    time_t              ts;
+    int                 human = 0;
+    int                 fd, opt, len;
+    long                from, to, step;
+
+    while ( ( opt = getopt(argc, argv, "+s:m:th") ) != -1 ) {
+        switch ( opt ) {
+        case 's':
+            path = optarg;
+            break;
+        case 'm':
+            shm = optarg;
+            break;
+        case 't':
+            human = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if ( argc >= 1 && argc <= 2 && strcmp(argv[0], "now") == 0 ) {
+        exit(now(shm, argc == 2 ? atoi(argv[1]) : -1, human));
+    } else if ( argc >= 1 && argc <= 2 && strcmp(argv[0], "latest") == 0 ) {
+        snprintf(request, sizeof(request), "latest%s%s\n", argc == 2 ? " " : "", argc == 2 ? argv[1] : "");
+    } else if ( argc == 1 && strcmp(argv[0], "metrics") == 0 ) {
+        snprintf(request, sizeof(request), "metrics\n");
+        human = 0;
+    } else if ( argc == 4 && strcmp(argv[0], "range") == 0 ) {
+        if ( ( from = parse_time(argv[2]) ) < 0 || ( to = parse_time(argv[3]) ) < 0 ) {
+            usage();
+        }
+        snprintf(request, sizeof(request), "range %d %ld %ld\n", atoi(argv[1]), from, to);
+    } else if ( argc == 5 && strcmp(argv[0], "agg") == 0 ) {
+        if ( ( from = parse_time(argv[2]) ) < 0 || ( to = parse_time(argv[3]) ) < 0 ||
+             ( step = parse_step(argv[4]) ) <= 0 ) {
+            usage();
+        }
+        snprintf(request, sizeof(request), "agg %d %ld %ld %ld\n", atoi(argv[1]), from, to, step);
+    } else if ( argc == 4 && strcmp(argv[0], "appliances") == 0 ) {
+        if ( ( from = parse_time(argv[2]) ) < 0 || ( to = parse_time(argv[3]) ) < 0 ) {
+            usage();
+        }
+        snprintf(request, sizeof(request), "appliances %d %ld %ld\n", atoi(argv[1]), from, to);
+        human = 0;
+    } else if ( argc == 5 && strcmp(argv[0], "lttb") == 0 ) {
+        if ( ( from = parse_time(argv[2]) ) < 0 || ( to = parse_time(argv[3]) ) < 0 || atoi(argv[4]) < 3 ) {
+            usage();
+        }
+        snprintf(request, sizeof(request), "lttb %d %ld %ld %d\n", atoi(argv[1]), from, to, atoi(argv[4]));
+    } else if ( argc == 4 && strcmp(argv[0], "gaps") == 0 ) {
+        if ( ( from = parse_time(argv[2]) ) < 0 || ( to = parse_time(argv[3]) ) < 0 ) {
+            usage();
+        }
+        snprintf(request, sizeof(request), "gaps %d %ld %ld\n", atoi(argv[1]), from, to);
+    } else {
+        usage();
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if ( ( fd = socket(AF_UNIX, SOCK_STREAM, 0) ) == -1 ||
+         connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ) {
+        perror(path);
+        exit(1);
+    }
+    len = strlen(request);
+    if ( write(fd, request, len) != len || ( fp = fdopen(fd, "r") ) == NULL ) {
+        perror(path);
+        exit(1);
+    }
+
+    while ( fgets(line, sizeof(line), fp) != NULL ) {
+        if ( strncmp(line, "ERR ", 4) == 0 ) {
+            fprintf(stderr, "%s", line + 4);
+            exit(1);
+        } else if ( strncmp(line, "END ", 4) == 0 ) {
+            exit(0);
+        } else if ( strcmp(line, "OK\n") == 0 ) {
+            continue;
+        }
+        /* The time is the first column, except for latest */
+        if ( human ) {
+            rest = line;
+            if ( strcmp(argv[0], "latest") == 0 && ( rest = strchr(line, ' ') ) != NULL ) {
+                *rest++ = 0;
+                printf("%s ", line);
+            }
+            if ( rest != NULL ) {
+                ts = strtol(rest, &rest, 10);
+                rest += strspn(rest, "0123456789.");
+                localtime_r(&ts, &tm);
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+                printf("%s%s", stamp, rest);
+                continue;
+            }
+        }
+        fputs(line, stdout);
+    }
+    fprintf(stderr, "Connection closed early\n");
+    exit(1);
+}
+
+/** \brief Print the latest readings straight from the shared table
+ *
+ *  \param sensor - Sensor to print, -1 for all of them
+ */
+static int now(char *shm, int sensor, int human)
+{
+    latest_table_t   *table;
+    latest_slot_t     slot;
+    struct tm         tm;
+    time_t            ts;
+    char              stamp[32];
+    int               fd, i, found = 0;
+
+    if ( ( fd = shm_open(shm, O_RDONLY, 0) ) == -1 ||
+         ( table = mmap(NULL, sizeof(*table), PROT_READ, MAP_SHARED, fd, 0) ) == MAP_FAILED ) {
+        perror(shm);
+        return 1;
+    }
+    close(fd);
+    if ( table->magic != LATEST_MAGIC || table->version != LATEST_VERSION ) {
+        fprintf(stderr, "%s isn't a table of latest readings\n", shm);
+        return 1;
+    }
+    if ( table->pid == 0 ) {
+        fprintf(stderr, "Warning: the daemon has stopped\n");
+    }
+    for ( i = 0; i < table->sensors; i++ ) {
+        if ( ( sensor == -1 || sensor == i ) && latest_read(table, i, &slot) == 0 ) {
+            ts = (time_t)slot.ts;
+            localtime_r(&ts, &tm);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+            if ( human ) {
+                printf("%d %s %d %.1f %.6f\n", i, stamp, slot.watts, slot.temp, slot.kwh);
+            } else {
+                printf("%d %.3f %d %.1f %.6f\n", i, slot.ts, slot.watts, slot.temp, slot.kwh);
+            }
+            found++;
+        }
+    }
+    return found ? 0 : 1;
+}
+
+static long parse_time(char *str)
+{
+    struct tm   tm;
+    time_t      now = time(NULL);
+    char       *end;
+    long        val;
+
+    localtime_r(&now, &tm);
+    tm.tm_isdst = -1;
+    if ( strcmp(str, "now") == 0 ) {
+        return now;
+    } else if ( strcmp(str, "today") == 0 || strcmp(str, "yesterday") == 0 ) {
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        if ( str[0] == 'y' ) {
+            tm.tm_mday--;
+        }
+        return mktime(&tm);
+    } else if ( str[0] == '-' ) {
+        return ( val = parse_step(str + 1) ) > 0 ? now - val : -1;
+    }
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_isdst = -1;
+    if ( ( end = strptime(str, "%Y-%m-%d", &tm) ) != NULL ) {
+        if ( *end == 'T' || *end == ' ' ) {
+            if ( ( end = strptime(end + 1, "%H:%M", &tm) ) == NULL ) {
+                return -1;
+            }
+            if ( *end == ':' && ( end = strptime(end + 1, "%S", &tm) ) == NULL ) {
+                return -1;
+            }
+        }
+        return *end ? -1 : mktime(&tm);
+    }
+    val = strtol(str, &end, 10);
+    return *end || end == str ? -1 : val;
+}
+
+static long parse_step(char *str)
+{
+    char   *end;
+    long    val = strtol(str, &end, 10);
+
+    switch ( *end ) {
+    case 0:
+    case 's':
+        break;
+    case 'm':
+        val *= 60;
+        break;
+    case 'h':
+        val *= 3600;
+        break;
+    case 'd':
+        val *= 86400;
+        break;
+    default:
+        return -1;
+    }
+    return end == str ? -1 : val;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: ccquery [-s socket] [-t] latest [sensor]\n"
+                    "       ccquery [-s socket] [-t] range sensor from to\n"
+                    "       ccquery [-s socket] [-t] agg sensor from to step\n"
+                    "       ccquery [-s socket] appliances sensor from to\n"
+                    "       ccquery [-s socket] [-t] lttb sensor from to points\n"
+                    "       ccquery [-s socket] [-t] gaps sensor from to\n"
+                    "       ccquery [-s socket] metrics\n"
+                    "       ccquery [-m shm] [-t] now [sensor]\n");
+    exit(1);
+}
@@ -0,0 +1,602 @@
+/*
+ *   Current Cost Daemon - collecting readings from other daemons
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   With collector:port set we take readings forwarded by other daemons
+ *   (see federate.c) and keep them in a store for each site:
+ *
+ *     <collector:dir>/<site>/...        the usual store layout
+ *     <collector:dir>/<site>/stream     stream id and next seq wanted
+ *
+ *   Each site sends a numbered stream of readings. Anything numbered
+ *   below what we've already stored is a duplicate from a resend and is
+ *   skipped. Every collector:ack-interval milliseconds the stores are
+ *   written out and the stream positions saved, then a thread syncs the
+ *   filesystem they're on with a single syncfs() and only once that's
+ *   done are they acknowledged. A node only lets go of readings once
+ *   they're on disc, so a restart (or power cut) at either end carries
+ *   on where it left off, and the event loop never waits on the disc
+ *   however many sites there are.
+ *
+ *   Every node is a descriptor in the event loop, which has room for a
+ *   thousand or so.
+ */
+
+#define _GNU_SOURCE             /* syncfs() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "collector.h"
+#include "federate.h"
+#include "evloop.h"
+#include "heap.h"
+
+
+typedef struct site {
+    char            name[FEDERATE_SITE_MAX + 1];
+    store_t        *store;
+    uint64_t        stream;
+    uint64_t        next;          /* Seq of the next reading wanted */
+    uint64_t        synced;        /* What next was when the disc last caught up */
+    uint64_t        syncing;       /* And when the sync under way started */
+    int             dirty;         /* Stored readings not yet being synced */
+    int             pending;       /* Waiting on the sync under way */
+    struct conn    *conn;
+    struct site    *next_site;
+} site_t;
+
+typedef struct conn {
+    int             fd;
+    site_t         *site;          /* Once it's said hello */
+    unsigned char  *in;
+    int             in_len;
+    unsigned char   out[64];
+    int             out_len;
+    struct conn    *next;
+} conn_t;
+
+
+static void         collector_accept(int fd, int revents, void *data);
+static void         collector_io(int fd, int revents, void *data);
+static int          collector_input(conn_t *conn);
+static int          collector_hello(conn_t *conn, unsigned char *payload, int len);
+static int          collector_batch(conn_t *conn, unsigned char *payload, int len);
+static int          collector_send(conn_t *conn, int type, uint64_t seq);
+static void         collector_drop(conn_t *conn, char *why);
+static void         collector_timer(void *data);
+static site_t      *collector_site(char *name);
+static void         collector_save(site_t *site);
+static void        *collector_syncer(void *arg);
+static void         collector_synced(int fd, int revents, void *data);
+
+/* Configuration */
+static int          c_collector_port     = 0;
+static char        *c_collector_listen   = NULL;
+static char        *c_collector_dir      = NULL;
+static int          c_collector_ack      = 1000;
+
+static int          listen_fd            = -1;
+static conn_t      *conns                = NULL;
+static site_t      *sites                = NULL;
+
+/* The sync thread, it's only ever doing one */
+static int          sync_dir             = -1;
+static int          sync_event           = -1;
+static int          sync_busy            = 0;      /* Main thread's view */
+static int          sync_wanted          = 0;
+static int          sync_result          = 0;
+static pthread_t    sync_tid;
+static pthread_mutex_t sync_lock         = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sync_cond         = PTHREAD_COND_INITIALIZER;
+
+static unsigned long stat_nodes          = 0;
+static unsigned long stat_sites          = 0;
+static unsigned long stat_readings       = 0;
+static unsigned long stat_duplicates     = 0;
+static unsigned long stat_lost           = 0;
+
+
+void collector_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "collector:port","Port to take forwarded readings on (0 = off)",OPT_INT,&c_collector_port);
+    iniparse_add(ctx, 0, "collector:listen","Address to listen on (default all)",OPT_STR,&c_collector_listen);
+    iniparse_add(ctx, 0, "collector:dir","Directory to keep a store for each site in",OPT_STR,&c_collector_dir);
+    iniparse_add(ctx, 0, "collector:ack-interval","Milliseconds between storing and acknowledging readings",OPT_INT,&c_collector_ack);
+}
+
+/** \brief Start listening for nodes
+ *
+ *  \return 0 - Listening, or not configured to
+ *  \retval -1 - Unable to listen
+ */
+int collector_init()
+{
+    struct addrinfo   hints, *res, *ai;
+    struct rlimit     rl;
+    sigset_t          all, old;
+    char              port[16];
+    int               one = 1, ret;
+
+    if ( c_collector_port == 0 ) {
+        return 0;
+    }
+    if ( c_collector_dir == NULL ) {
+        syslog(LOG_ERR,"Collecting readings needs a collector:dir");
+        return -1;
+    }
+    /* Sites and connections come and go, each with its own memory */
+    if ( heap_static() ) {
+        syslog(LOG_ERR,"The collector can't run with heap:static");
+        return -1;
+    }
+    if ( mkdir(c_collector_dir, 0755) != 0 && errno != EEXIST ) {
+        syslog(LOG_ERR,"Unable to create collector directory %s",c_collector_dir);
+        return -1;
+    }
+    if ( c_collector_ack < 10 ) {
+        c_collector_ack = 10;
+    }
+    if ( ( sync_dir = open(c_collector_dir, O_RDONLY|O_DIRECTORY) ) == -1 ||
+         ( sync_event = eventfd(0, EFD_NONBLOCK) ) == -1 ||
+         ev_add(sync_event, POLLIN, collector_synced, NULL) != 0 ) {
+        syslog(LOG_ERR,"Unable to set up syncing %s",c_collector_dir);
+        return -1;
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&sync_tid, NULL, collector_syncer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if ( ret != 0 ) {
+        syslog(LOG_ERR,"Unable to start the collector's sync thread");
+        return -1;
+    }
+
+    /* A descriptor for every node */
+    if ( getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max ) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(port, sizeof(port), "%d", c_collector_port);
+    if ( getaddrinfo(c_collector_listen, port, &hints, &res) != 0 ) {
+        syslog(LOG_ERR,"Unable to resolve collector:listen %s",c_collector_listen);
+        return -1;
+    }
+    for ( ai = res; ai != NULL; ai = ai->ai_next ) {
+        if ( ( listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol) ) == -1 ) {
+            continue;
+        }
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if ( bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(listen_fd, 128) == 0 ) {
+            break;
+        }
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    freeaddrinfo(res);
+    if ( listen_fd == -1 ) {
+        syslog(LOG_ERR,"Unable to listen on port %d for nodes",c_collector_port);
+        return -1;
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    ev_add(listen_fd, POLLIN, collector_accept, NULL);
+    ev_every(c_collector_ack, collector_timer, NULL);
+    syslog(LOG_INFO,"Collecting readings on port %d into %s",c_collector_port,c_collector_dir);
+    return 0;
+}
+
+void collector_stats(unsigned long *nodes, unsigned long *sites, unsigned long *readings, unsigned long *duplicates, unsigned long *lost)
+{
+    *nodes = stat_nodes;
+    *sites = stat_sites;
+    *readings = stat_readings;
+    *duplicates = stat_duplicates;
+    *lost = stat_lost;
+}
+
+
+static void collector_accept(int fd, int revents, void *data)
+{
+    conn_t   *conn;
+    int       cfd;
+    int       one = 1;
+
+    while ( ( cfd = accept(fd, NULL, NULL) ) != -1 ) {
+        fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(cfd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+        if ( ( conn = calloc(1, sizeof(conn_t)) ) == NULL ||
+             ( conn->in = malloc(FEDERATE_FRAME_MAX) ) == NULL ) {
+            free(conn);
+            close(cfd);
+            continue;
+        }
+        conn->fd = cfd;
+        if ( ev_add(cfd, POLLIN, collector_io, conn) != 0 ) {
+            syslog(LOG_WARNING,"Too many connections, turning a node away");
+            free(conn->in);
+            free(conn);
+            close(cfd);
+            continue;
+        }
+        conn->next = conns;
+        conns = conn;
+    }
+}
+
+static void collector_io(int fd, int revents, void *data)
+{
+    conn_t   *conn = data;
+    int       ret;
+
+    if ( revents & ( POLLIN | POLLHUP | POLLERR ) ) {
+        ret = read(fd, conn->in + conn->in_len, FEDERATE_FRAME_MAX - conn->in_len);
+        if ( ret == 0 || ( ret < 0 && errno != EAGAIN && errno != EINTR ) ) {
+            collector_drop(conn, ret == 0 ? NULL : strerror(errno));
+            return;
+        }
+        if ( ret > 0 ) {
+            conn->in_len += ret;
+            if ( collector_input(conn) != 0 ) {
+                return;
+            }
+        }
+    }
+    if ( ( revents & POLLOUT ) && collector_send(conn, 0, 0) != 0 ) {
+        collector_drop(conn, strerror(errno));
+    }
+}
+
+/* Act on the complete frames received, returns -1 if the connection
+   was dropped */
+static int collector_input(conn_t *conn)
+{
+    unsigned char  *frame = conn->in;
+    unsigned char  *end = conn->in + conn->in_len;
+    uint32_t        len;
+    int             ret;
+
+    while ( end - frame >= FEDERATE_HEADER ) {
+        len = federate_get32(frame);
+        if ( len < 1 || len > FEDERATE_FRAME_MAX - 4 ) {
+            collector_drop(conn, "bad frame");
+            return -1;
+        }
+        if ( end - frame < 4 + len ) {
+            break;
+        }
+        switch ( frame[4] ) {
+        case FEDERATE_HELLO:
+            ret = collector_hello(conn, frame + FEDERATE_HEADER, len - 1);
+            break;
+        case FEDERATE_BATCH:
+            ret = collector_batch(conn, frame + FEDERATE_HEADER, len - 1);
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+        if ( ret != 0 ) {
+            collector_drop(conn, "bad frame");
+            return -1;
+        }
+        frame += 4 + len;
+    }
+    conn->in_len = end - frame;
+    memmove(conn->in, frame, conn->in_len);
+    return 0;
+}
+
+static int collector_hello(conn_t *conn, unsigned char *payload, int len)
+{
+    char       name[FEDERATE_SITE_MAX + 1];
+    site_t    *site;
+    uint64_t   stream, first;
+    int        i;
+
+    if ( conn->site != NULL || len < 18 || len > 17 + FEDERATE_SITE_MAX || payload[0] != FEDERATE_VERSION ) {
+        return -1;
+    }
+    stream = federate_get64(payload + 1);
+    first = federate_get64(payload + 9);
+    memcpy(name, payload + 17, len - 17);
+    name[len - 17] = 0;
+    for ( i = 0; name[i]; i++ ) {
+        if ( !isalnum((unsigned char)name[i]) && strchr("-_.", name[i]) == NULL ) {
+            return -1;
+        }
+    }
+    if ( name[0] == '.' || ( site = collector_site(name) ) == NULL ) {
+        return -1;
+    }
+
+    /* Reconnected before we noticed the old connection going */
+    if ( site->conn != NULL ) {
+        collector_drop(site->conn, "replaced");
+    }
+    /* Nothing before first is coming, so there's nothing to wait on the
+       disc for. A sync under way would be for the old position */
+    if ( stream != site->stream ) {
+        syslog(LOG_INFO,"Site %s started a new stream at %llu",name,(unsigned long long)first);
+        site->stream = stream;
+        site->next = site->synced = first;
+        site->pending = 0;
+        collector_save(site);
+    } else if ( first > site->next ) {
+        syslog(LOG_WARNING,"Site %s dropped %llu readings whilst away",name,(unsigned long long)( first - site->next ));
+        stat_lost += first - site->next;
+        site->next = site->synced = first;
+        site->pending = 0;
+        collector_save(site);
+    }
+    conn->site = site;
+    site->conn = conn;
+    stat_nodes++;
+    syslog(LOG_INFO,"Site %s connected, carrying on from %llu",name,(unsigned long long)site->synced);
+    /* Only what's on disc, anything after is resent and skipped */
+    return collector_send(conn, FEDERATE_WELCOME, site->synced);
+}
+
+static int collector_batch(conn_t *conn, unsigned char *payload, int len)
+{
+    site_t        *site = conn->site;
+    store_raw_t    raw;
+    uint64_t       seq;
+    int            count, sensor, i;
+
+    if ( site == NULL || len < 10 ) {
+        return -1;
+    }
+    seq = federate_get64(payload);
+    count = federate_get16(payload + 8);
+    if ( count > FEDERATE_BATCH_MAX || len != 10 + count * FEDERATE_RECORD ) {
+        return -1;
+    }
+    payload += 10;
+    for ( i = 0; i < count; i++, seq++, payload += FEDERATE_RECORD ) {
+        if ( seq < site->next ) {
+            stat_duplicates++;
+            continue;
+        }
+        if ( seq > site->next ) {
+            stat_lost += seq - site->next;
+        }
+        sensor = federate_decode(payload, &raw);
+        store_append(site->store, sensor, &raw);
+        site->next = seq + 1;
+        site->dirty = 1;
+        stat_readings++;
+    }
+    return 0;
+}
+
+/* Queue a frame carrying a seq, or with no type just write what's
+   queued. If the node isn't reading there's no room and the next ack
+   will do instead. Returns -1 if the connection has failed */
+static int collector_send(conn_t *conn, int type, uint64_t seq)
+{
+    int       ret;
+
+    if ( type != 0 && conn->out_len + FEDERATE_HEADER + 8 <= sizeof(conn->out) ) {
+        federate_put64(federate_frame(conn->out + conn->out_len, type, 8), seq);
+        conn->out_len += FEDERATE_HEADER + 8;
+    }
+    if ( conn->out_len ) {
+        ret = write(conn->fd, conn->out, conn->out_len);
+        if ( ret < 0 && errno != EAGAIN && errno != EINTR ) {
+            return -1;
+        }
+        if ( ret > 0 ) {
+            conn->out_len -= ret;
+            memmove(conn->out, conn->out + ret, conn->out_len);
+        }
+    }
+    ev_mod(conn->fd, conn->out_len ? POLLIN|POLLOUT : POLLIN);
+    return 0;
+}
+
+static void collector_drop(conn_t *conn, char *why)
+{
+    conn_t  **pp;
+
+    if ( conn->site ) {
+        if ( why ) {
+            syslog(LOG_WARNING,"Dropped site %s (%s)",conn->site->name,why);
+        } else {
+            syslog(LOG_INFO,"Site %s disconnected",conn->site->name);
+        }
+        conn->site->conn = NULL;
+        stat_nodes--;
+    }
+    for ( pp = &conns; *pp != NULL; pp = &(*pp)->next ) {
+        if ( *pp == conn ) {
+            *pp = conn->next;
+            break;
+        }
+    }
+    ev_del(conn->fd);
+    close(conn->fd);
+    free(conn->in);
+    free(conn);
+}
+
+/* Write out what's been stored and have it synced, the nodes are told
+   once it has been. If the last sync is still going this one waits */
+static void collector_timer(void *data)
+{
+    site_t   *site;
+    int       dirty = 0;
+
+    if ( sync_busy ) {
+        return;
+    }
+    for ( site = sites; site != NULL; site = site->next_site ) {
+        dirty |= site->dirty;
+    }
+    if ( dirty == 0 ) {
+        return;
+    }
+    store_flush(0);
+    for ( site = sites; site != NULL; site = site->next_site ) {
+        if ( site->dirty ) {
+            collector_save(site);
+            site->syncing = site->next;
+            site->pending = 1;
+            site->dirty = 0;
+        }
+    }
+    sync_busy = 1;
+    pthread_mutex_lock(&sync_lock);
+    sync_wanted = 1;
+    pthread_cond_signal(&sync_cond);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+static void *collector_syncer(void *arg)
+{
+    uint64_t   one = 1;
+    int        ret;
+
+    pthread_mutex_lock(&sync_lock);
+    while ( 1 ) {
+        while ( sync_wanted == 0 ) {
+            pthread_cond_wait(&sync_cond, &sync_lock);
+        }
+        sync_wanted = 0;
+        pthread_mutex_unlock(&sync_lock);
+
+        /* The segments, stream files and the directories they're in */
+        ret = syncfs(sync_dir);
+
+        pthread_mutex_lock(&sync_lock);
+        sync_result = ret;
+        if ( write(sync_event, &one, sizeof(one)) < 0 ) {
+            /* Already readable, which is all that matters */
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return NULL;
+}
+
+/* Back on the event loop, acknowledge what the sync covered */
+static void collector_synced(int fd, int revents, void *data)
+{
+    site_t   *site;
+    uint64_t  count;
+    int       ret;
+
+    if ( read(fd, &count, sizeof(count)) < 0 ) {
+        /* Nothing to clear, look anyway */
+    }
+    pthread_mutex_lock(&sync_lock);
+    ret = sync_result;
+    pthread_mutex_unlock(&sync_lock);
+    sync_busy = 0;
+
+    for ( site = sites; site != NULL; site = site->next_site ) {
+        if ( site->pending == 0 ) {
+            continue;
+        }
+        site->pending = 0;
+        if ( ret != 0 ) {
+            /* Try again next time */
+            site->dirty = 1;
+            continue;
+        }
+        site->synced = site->syncing;
+        if ( site->conn && collector_send(site->conn, FEDERATE_ACK, site->synced) != 0 ) {
+            collector_drop(site->conn, strerror(errno));
+        }
+    }
+    if ( ret != 0 ) {
+        syslog(LOG_ERR,"Unable to sync %s, readings aren't being acknowledged",c_collector_dir);
+    }
+}
+
+/* Find a site, opening its store and stream position the first time */
+static site_t *collector_site(char *name)
+{
+    site_t             *site;
+    char                path[FILENAME_MAX];
+    FILE               *fp;
+    unsigned long long  stream, next;
+
+    for ( site = sites; site != NULL; site = site->next_site ) {
+        if ( strcmp(site->name, name) == 0 ) {
+            return site;
+        }
+    }
+    if ( ( site = calloc(1, sizeof(site_t)) ) == NULL ) {
+        return NULL;
+    }
+    strcpy(site->name, name);
+    snprintf(path, sizeof(path), "%s/%s", c_collector_dir, name);
+    if ( ( site->store = store_open(path) ) == NULL ) {
+        free(site);
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/%s/stream", c_collector_dir, name);
+    if ( ( fp = fopen(path, "r") ) != NULL ) {
+        if ( fscanf(fp, "%llx %llu", &stream, &next) == 2 ) {
+            site->stream = stream;
+            site->next = site->synced = next;
+        }
+        fclose(fp);
+    }
+    site->next_site = sites;
+    sites = site;
+    stat_sites++;
+    return site;
+}
+
+static void collector_save(site_t *site)
+{
+    char      path[FILENAME_MAX], tmp[FILENAME_MAX + 4];
+    FILE     *fp;
+
+    snprintf(path, sizeof(path), "%s/%s/stream", c_collector_dir, site->name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ( ( fp = fopen(tmp, "w") ) == NULL ) {
+        syslog(LOG_ERR,"Unable to save the stream position of site %s",site->name);
+        return;
+    }
+    fprintf(fp, "%llx %llu\n", (unsigned long long)site->stream, (unsigned long long)site->next);
+    if ( fclose(fp) == 0 ) {
+        rename(tmp, path);
+    }
+}
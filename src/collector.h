@@ -0,0 +1,34 @@
+/*
+ *   Current Cost Daemon - collecting readings from other daemons
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef COLLECTOR_H
+#define COLLECTOR_H
+
+#include "libini.h"
+
+/* Register the [collector] options */
+extern void         collector_options(configctx_t *ctx);
+
+/* Start listening if collector:port is set, returns -1 on failure */
+extern int          collector_init();
+
+extern void         collector_stats(unsigned long *nodes, unsigned long *sites, unsigned long *readings, unsigned long *duplicates, unsigned long *lost);
+
+#endif /* COLLECTOR_H */
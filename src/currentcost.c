@@ -33,19 +33,66 @@
 #include <pwd.h>
 #include <termios.h>
 #include <fcntl.h>
-#include <regex.h>
+#include <signal.h>
+#include <sys/ioctl.h>
 
 
 
 #include "libini.h"
+#include "currentcost.h"
+#include "energy.h"
+#include "gap.h"
+#include "sink.h"
+#include "tariff.h"
+#include "alert.h"
+#include "pipeline.h"
+#include "evloop.h"
+#include "mqtt.h"
+#include "influx.h"
+#include "federate.h"
+#include "collector.h"
+#include "logfile.h"
+#include "store.h"
+#include "query.h"
+#include "ring.h"
+#include "latest.h"
+#include "feed.h"
+#include "capture.h"
+#include "parse.h"
+#include "trace.h"
+#include "notify.h"
+#include "disagg.h"
+#include "dedup.h"
+#include "heap.h"
+#include "import.h"
+#include "export.h"
 
 #define VERSION "0.0.1"
 
+#define SERIAL_RETRY_MIN    100        /* ms */
+#define SERIAL_RETRY_MAX    5000
 
-static int         serial_open(char *device);
-static void        serial_close();
-static void        parse_line(char *line);
-static char       *strduplen(char *ptr, size_t len);
+/* A receiver, readings from it carry its index as their device */
+typedef struct {
+    char           *device;
+    int             fd;
+    char            buf[1024];
+    int             len;
+    long long       rx;
+    long long       next;          /* When to try opening it again */
+    int             backoff;
+} port_t;
+
+
+static int         serial_ports();
+static int         serial_open(port_t *port);
+static void        serial_close(port_t *port);
+static void        serial_retry(void *data);
+static void        serial_read(int fd, int revents, void *data);
+static void        serial_frame(port_t *port, int len, time_t now, long long rx);
+static void        replay_chunk(char *data, int len, long long ns, int device);
+static void        parse_line(char *line, time_t now, long long rx, int device);
+static void        startup_done();
 
 /* Real configurable items */
 static char       *c_config_file         = NULL;
@@ -55,20 +102,64 @@ static char        c_help                = 0;
 static char        c_daemon              = 0;
 static char       *c_serial_port         = "/dev/ttyU1";
 static char       *c_update_command      = NULL;
+static char       *c_alert_command       = NULL;
 static int         c_baudrate            = 57600;
+static char       *c_energy_file         = NULL;
+static int         c_energy_interval     = 300;
+static filter_policy_t c_exec_filter;
+static char       *c_ledger_dir          = NULL;
+static char       *c_cost_report         = NULL;
+static char        c_cost_recompute      = 0;
+static char       *c_replay_file         = NULL;
 
-static int         serial_fd             = -1;
-static FILE       *serial_fp             = NULL;
+static port_t      ports[MAX_DEVICES];
+static int         num_ports             = 0;
+static unsigned long readings            = 0;
+static volatile sig_atomic_t quit        = 0;
+static volatile sig_atomic_t dump_trace  = 0;
 
 
 static void cleanup_files()
 {
+    heap_unseal();
+    notify_stopping();
+    dedup_flush();
+    energy_checkpoint();
+    tariff_checkpoint();
+    capture_close();
+    logfile_close();
+    store_flush(1);
+    query_close();
+    latest_close();
+    feed_close();
     unlink(c_pid_file);
 
     closelog();
 }
 
-    
+static void handle_quit(int sig)
+{
+    quit = 1;
+}
+
+static void handle_dump(int sig)
+{
+    dump_trace = 1;
+}
+
+/* Everything is allocated, from here on it's just readings */
+static void startup_done()
+{
+    /* Otherwise they'd allocate when the first reading comes along */
+    if ( heap_static() ) {
+        sink_open_all();
+    }
+    if ( heap_seal() != 0 ) {
+        fprintf(stderr, "Startup went over heap:budget, see syslog\n");
+        exit(1);
+    }
+}
+
 
 
 int main(int argc, char *argv[])
@@ -78,7 +169,6 @@ int main(int argc, char *argv[])
     int          len;
 
     /* Set up some basic stuff */
-    atexit(cleanup_files);
     openlog("currentcost", LOG_PID, LOG_USER);
 
     /* Get out any daemonising configuration */
@@ -89,9 +179,36 @@ int main(int argc, char *argv[])
     iniparse_add(ctx, 0, "main:user","User to run the program as", OPT_STR,&c_user);
     iniparse_add(ctx, 'd', "main:daemon", "Daemonise the program", OPT_BOOL, &c_daemon);
     iniparse_add(ctx,'h',"main:help","Display this help information",OPT_BOOL,&c_help);
-    iniparse_add(ctx, 0, "serial:port","Serial port", OPT_STR,&c_serial_port);
+    iniparse_add(ctx, 0, "serial:port","Serial port, or several separated by commas", OPT_STR,&c_serial_port);
     iniparse_add(ctx, 0, "serial:baudrate","Baudrate for the serial device",OPT_INT,&c_baudrate);
+    dedup_options(ctx);
+    gap_options(ctx);
+    iniparse_add(ctx, 0, "main:replay","Feed a serial capture through as fast as possible and exit",OPT_STR,&c_replay_file);
+    capture_options(ctx);
+    trace_options(ctx);
+    notify_options(ctx);
+    heap_options(ctx);
     iniparse_add(ctx, 0, "exec:command","Command to log data",OPT_STR,&c_update_command);
+    iniparse_add(ctx, 0, "exec:alert-command","Command to run when an alert is raised or cleared",OPT_STR,&c_alert_command);
+    filter_options(ctx, "exec", &c_exec_filter);
+    mqtt_options(ctx);
+    influx_options(ctx);
+    federate_options(ctx);
+    collector_options(ctx);
+    logfile_options(ctx);
+    store_options(ctx);
+    disagg_options(ctx);
+    import_options(ctx);
+    export_options(ctx);
+    ring_options(ctx);
+    latest_options(ctx);
+    feed_options(ctx);
+    query_options(ctx);
+    iniparse_add(ctx, 0, "energy:checkpoint-file","File to keep the cumulative kWh counters in",OPT_STR,&c_energy_file);
+    iniparse_add(ctx, 0, "energy:checkpoint-interval","Seconds between checkpoints of the kWh counters",OPT_INT,&c_energy_interval);
+    iniparse_add(ctx, 0, "tariff:ledger-dir","Directory to keep the daily cost ledgers in",OPT_STR,&c_ledger_dir);
+    iniparse_add(ctx, 0, "tariff:report","Report cost for YYYY-MM-DD[,YYYY-MM-DD] and exit",OPT_STR,&c_cost_report);
+    iniparse_add(ctx, 0, "tariff:recompute","Rebuild the ledgers from readings on stdin and exit",OPT_BOOL,&c_cost_recompute);
 
     /* Parse arguments to get out since location of config may change */
     iniparse_args(ctx,argc,argv);
@@ -104,9 +221,37 @@ int main(int argc, char *argv[])
     }
     iniparse_cleanup(ctx);
 
+    tariff_init(c_config_file, c_ledger_dir);
+    if ( c_cost_report ) {
+        exit(tariff_report(c_cost_report, stdout) == 0 ? 0 : 1);
+    }
+    if ( c_cost_recompute ) {
+        int count = tariff_recompute(stdin);
+
+        if ( count >= 0 ) {
+            printf("Costed %d readings\n",count);
+        }
+        exit(count >= 0 ? 0 : 1);
+    }
+    if ( import_wanted() ) {
+        if ( store_init() == NULL ) {
+            fprintf(stderr, "Importing needs a store:dir\n");
+            exit(1);
+        }
+        exit(import_run() >= 0 ? 0 : 1);
+    }
+    if ( export_wanted() ) {
+        if ( store_init() == NULL ) {
+            fprintf(stderr, "Exporting needs a store:dir\n");
+            exit(1);
+        }
+        exit(export_run() >= 0 ? 0 : 1);
+    }
+    atexit(cleanup_files);
+
 
     /* Put the application into the background if necessary */
-    if ( c_daemon ) {
+    if ( c_daemon && c_replay_file == NULL ) {
         pid_t pid;       
         if( (pid = fork()) > 0) {
             FILE *pidfile = fopen(c_pid_file, "w");
@@ -159,22 +304,105 @@ int main(int argc, char *argv[])
 
     syslog(LOG_INFO,"Current cost daemon %s starting",VERSION);
 
-    /* Loop round waiting to read from the socket */
-    while ( 1 ) {
-        if ( serial_fd == -1 ) {
-            serial_open(c_serial_port);
+    /* Get the port open first, everything else is set up before the
+       event loop runs so nothing is read until then */
+    notify_init();
+    num_ports = serial_ports();
+    if ( c_replay_file == NULL ) {
+        serial_retry(NULL);
+    }
+    trace_init();
+    energy_init(c_energy_file, c_energy_interval);
+    gap_init();
+    ring_init();
+    latest_init();
+    feed_init();
+
+    if ( c_update_command || c_alert_command ) {
+        sink_register(sink_exec_create(c_update_command, c_alert_command, &c_exec_filter));
+    }
+    {
+        sink_t *sink;
+
+        if ( ( sink = mqtt_init() ) != NULL ) {
+            sink_register(sink);
+        }
+        if ( ( sink = influx_init() ) != NULL ) {
+            sink_register(sink);
+        }
+        if ( ( sink = federate_init() ) != NULL ) {
+            sink_register(sink);
         }
-        if ( serial_fd != -1 ) {
-            char  line[1024];
+        if ( ( sink = logfile_init() ) != NULL ) {
+            sink_register(sink);
+        }
+        if ( ( sink = store_init() ) != NULL ) {
+            sink_register(sink);
+        }
+    }
+    disagg_init();
+    dedup_init(num_ports);
+    query_init();
+    if ( collector_init() != 0 ) {
+        fprintf(stderr, "Unable to start collecting, see syslog\n");
+        exit(1);
+    }
+    alert_init(c_config_file);
+    if ( pipeline_init() != 0 ) {
+        fprintf(stderr, "Unable to set up the pipeline, see syslog\n");
+        exit(1);
+    }
 
-            if ( fgets(line,sizeof(line),serial_fp) != NULL ) {
-                parse_line(line);
-            } else {
-               serial_close();
-               sleep(1);
-            }
-        } else {
-            sleep(5);
+    /* Exit through atexit() so the counters get checkpointed */
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_quit;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+        sa.sa_handler = handle_dump;
+        sigaction(SIGUSR2, &sa, NULL);
+        sa.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &sa, NULL);
+    }
+
+    if ( c_replay_file ) {
+        struct timespec  start, end;
+        double           secs;
+        long             chunks;
+
+        startup_done();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if ( ( chunks = capture_replay(c_replay_file, replay_chunk) ) < 0 ) {
+            fprintf(stderr, "Unable to replay %s\n", c_replay_file);
+            exit(1);
+        }
+        /* Give the sinks a chance to send what they've queued */
+        dedup_flush();
+        ev_run_once(0);
+        heap_unseal();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+        printf("Replayed %ld reads, %lu readings in %.3fs (%.0f readings/s)\n",
+               chunks, readings, secs, secs > 0 ? readings / secs : 0.0);
+        exit(0);
+    }
+    capture_init();
+
+    /* Keep trying to open the serial port, everything else happens
+       from the event loop */
+    ev_every(SERIAL_RETRY_MIN, serial_retry, NULL);
+    startup_done();
+    notify_ready();
+
+    while ( quit == 0 ) {
+        ev_run_once(1000);
+        sink_open_all();
+        if ( dump_trace ) {
+            dump_trace = 0;
+            trace_dump();
         }
     }
     /* And exit as normal */
@@ -185,93 +413,54 @@ int main(int argc, char *argv[])
  *
  *  \param line - Line to parse
  */
-#define regparm(x) strduplen(line + regmatch[x].rm_so, regmatch[x].rm_eo - regmatch[x].rm_so)
-static void parse_line(char *line)
+static void parse_line(char *line, time_t now, long long rx, int device)
 {
-    static regex_t   regex;
-    static time_t    last;
-    static int       compiled = 0;
-    char             buf[4096];
-    regmatch_t       regmatch[6];
-    char            *hour,*min,*sec,*temp,*watt;
-    time_t           now;
-    struct tm         tm;
-    int              delta;
-    int              offset;
-    int              joules;
-
-    if ( compiled == 0 && regcomp(&regex,"<time>(.*):(.*):(.*)</time>.*<tmpr>(.*)</tmpr>.*<ch1><watts>(.*)</watts>", REG_EXTENDED) != 0 ) {
-        return;
-    }
-    compiled=1;
-
-    if ( regexec(&regex, line, 6, &regmatch[0], 0) != 0 ) {
-       syslog(LOG_WARNING,"Failed to match regex on: %s",line);
+    static history_t hist;
+    reading_t        reading;
+    int              ret;
+    TRACE_START(t);
+
+    ret = parse_reading(line, now, rx, &reading);
+    reading.device = device;
+    TRACE_STOP(TRACE_PARSE, t);
+    if ( ret != 0 ) {
+       if ( parse_history(line, now, &hist) >= 0 ) {
+           hist.device = device;
+           gap_history(&hist);
+           return;
+       }
+       syslog(LOG_WARNING,"Unable to parse: %s",line);
        return;
     }
-    hour = regparm(1);
-    min = regparm(2);
-    sec = regparm(3);
-    temp = regparm(4);
-    watt = regparm(5);
-
-    now = time(NULL);
-    localtime_r(&now,&tm);
-    if ( last == 0 ) {
-       delta = 6;
-    } else {
-       delta = now -last;
-    }
-    last = now;
-    joules = atoi(watt) * delta;
-    offset = (atoi(hour) * 3600) + (atoi(min)*60) + atoi(sec);
-    offset -= ( ( tm.tm_hour * 3600 ) + ( tm.tm_min * 60 ) + tm.tm_sec);
-
-    if ( c_update_command ) {
-       snprintf(buf,sizeof(buf),"%s %ld %d %s %s:%s:%s %d %d %d",c_update_command, now, atoi(watt), temp, hour, min, sec, delta, joules, offset);
-       system(buf);
-    }
-    syslog(LOG_INFO,"Temperature is %s current watts %d",temp,atoi(watt));
+    TRACE_START(p);
+    pipeline_run(&reading);
+    TRACE_STOP(TRACE_PIPELINE, p);
+    notify_reading();
+    readings++;
 
-    free(hour); 
-    free(min);
-    free(sec);
-    free(temp);
-    free(watt);
-}
-
-static char *strduplen(char *ptr, size_t len)
-{
-    char *ret = calloc(len + 1, sizeof(char));
-    memcpy(ret, ptr, len);
-    return ret;
+    syslog(LOG_INFO,"Temperature is %.1f current watts %d",reading.temp,reading.watts);
 }
 
 /**
  * \brief Open the specified serial port
  *
- * \param device - Serial port to open
+ * \param port - Serial port to open
  *
- * \return 0 - Opened ok (and serial_fd/serial_fp are setup
+ * \return 0 - Opened ok (and port->fd is setup
  * \retval -1 - Failure to open
  *
  * \note Code lifted from open2300 - http://www.lavrsen.dk/twiki/bin/view/Open2300/WebHome
  */
-static int serial_open(char *device)
+static int serial_open(port_t *port)
 {
     int             fd;
     struct termios  adtio;
-    int             portstatus, fdflags;
-    int             arg;
+    int             portstatus;
 
-    if ((fd = open(device, O_RDONLY|O_NONBLOCK)) < 0) {
-        printf("\nUnable to open serial device %s\n", device);
+    if ((fd = open(port->device, O_RDONLY|O_NONBLOCK)) < 0) {
         return -1;
     }
-    syslog(LOG_INFO,"Opened serial port <%s>",device);
-    arg = fcntl(fd, F_GETFL, NULL);
-    arg&= ~O_NONBLOCK; 
-    fcntl(fd, F_SETFL, arg);
+    syslog(LOG_INFO,"Opened serial port <%s>",port->device);
     
 #if 0
     if ( flock(fd, LOCK_EX|LOCK_NB) < 0 ) { 
@@ -332,18 +521,161 @@ static int serial_open(char *device)
     portstatus |= TIOCM_RTS;
     ioctl(fd, TIOCMSET, &portstatus);    // set current port status
 
-    serial_fd = fd;
-    serial_fp = fdopen(serial_fd,"r");
+    port->fd = fd;
+    port->len = 0;
 
     return 0;
 }
 
-static void serial_close()
+static void serial_close(port_t *port)
+{
+    ev_del(port->fd);
+    close(port->fd);
+    port->fd = -1;
+}
+
+/* Split serial:port up into the receivers, returns how many there are */
+static int serial_ports()
+{
+    char    *copy, *tok, *save;
+    int      num = 0;
+
+    copy = strdup(c_serial_port);
+    for ( tok = strtok_r(copy, ", ", &save); tok != NULL; tok = strtok_r(NULL, ", ", &save) ) {
+        if ( num == MAX_DEVICES ) {
+            syslog(LOG_WARNING,"Only reading from the first %d serial ports",MAX_DEVICES);
+            break;
+        }
+        memset(&ports[num], 0, sizeof(port_t));
+        ports[num].device = tok;
+        ports[num].fd = -1;
+        num++;
+    }
+    return num;
+}
+
+/* Try again quickly at first in case the device is still appearing, backing
+   off to every SERIAL_RETRY_MAX ms */
+static void serial_retry(void *data)
+{
+    port_t  *port;
+    int      i;
+
+    for ( i = 0; i < num_ports; i++ ) {
+        port = &ports[i];
+        if ( port->fd != -1 || ev_now() < port->next ) {
+            continue;
+        }
+        if ( serial_open(port) == 0 ) {
+            ev_add(port->fd, POLLIN, serial_read, port);
+            port->backoff = 0;
+            notify_send("STATUS=Reading from %s", port->device);
+            continue;
+        }
+        if ( port->backoff == 0 ) {
+            printf("\nUnable to open serial device %s\n", port->device);
+            syslog(LOG_WARNING,"Unable to open serial port <%s>, will keep trying",port->device);
+            notify_send("STATUS=Waiting for %s", port->device);
+        }
+        port->backoff = port->backoff ? port->backoff * 2 : SERIAL_RETRY_MIN;
+        if ( port->backoff > SERIAL_RETRY_MAX ) {
+            port->backoff = SERIAL_RETRY_MAX;
+        }
+        port->next = ev_now() + port->backoff;
+    }
+}
+
+/** \brief Read what's available from the serial port and pass on any
+ *         complete lines
+ */
+static void serial_read(int fd, int revents, void *data)
+{
+    port_t          *port = data;
+    struct timespec  tp, wall;
+    int              ret;
+    TRACE_START(t);
+
+    ret = read(fd, port->buf + port->len, sizeof(port->buf) - port->len - 1);
+    if ( ret == 0 || ( ret < 0 && errno != EAGAIN && errno != EINTR ) ) {
+        syslog(LOG_WARNING,"Lost serial port <%s>",port->device);
+        notify_send("STATUS=Lost %s", port->device);
+        serial_close(port);
+        return;
+    }
+    if ( ret < 0 ) {
+        return;
+    }
+    TRACE_STOP(TRACE_READ, t);
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    capture_write(port->buf + port->len, ret, wall.tv_sec * 1000000000LL + wall.tv_nsec, port - ports);
+
+    serial_frame(port, ret, wall.tv_sec, tp.tv_sec * 1000000000LL + tp.tv_nsec);
+}
+
+/** \brief Pass on any lines completed by len bytes just added to a port's buffer
+ *
+ *  \param port - Port they were read from
+ *  \param len - Bytes added after port->len
+ *  \param now - Wall clock time they arrived
+ *  \param rx - CLOCK_MONOTONIC ns they arrived
+ */
+static void serial_frame(port_t *port, int len, time_t now, long long rx)
 {
-    close(serial_fd);
-    fclose(serial_fp);
-    serial_fd = -1;
-    serial_fp = NULL;
+    char            *start, *end;
+
+    /* A line carried over started arriving with an earlier read */
+    if ( port->len == 0 ) {
+        port->rx = rx;
+    }
+    port->len += len;
+    port->buf[port->len] = 0;
+
+    start = port->buf;
+    while ( ( end = strchr(start,'\n') ) != NULL ) {
+        TRACE_START(t);
+
+        trace_reading();
+        *end = 0;
+        parse_line(start, now, port->rx, port - ports);
+        TRACE_STOP(TRACE_FRAME, t);
+        start = end + 1;
+        port->rx = rx;
+    }
+    port->len -= start - port->buf;
+    memmove(port->buf, start, port->len);
+
+    /* A line that won't fit is garbage */
+    if ( port->len == sizeof(port->buf) - 1 ) {
+        port->len = 0;
+    }
+}
+
+/** \brief Frame a read from a capture as though it came from the port,
+ *         the readings are stamped with the time it was captured
+ */
+static void replay_chunk(char *data, int len, long long ns, int device)
+{
+    static unsigned long  chunks = 0;
+    struct timespec       tp;
+    port_t               *port = &ports[device];
+    int                   space;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    while ( len > 0 ) {
+        space = sizeof(port->buf) - port->len - 1;
+        if ( space > len ) {
+            space = len;
+        }
+        memcpy(port->buf + port->len, data, space);
+        serial_frame(port, space, ns / 1000000000LL, tp.tv_sec * 1000000000LL + tp.tv_nsec);
+        data += space;
+        len -= space;
+    }
+    /* Let the sinks drain every so often */
+    if ( ( ++chunks & 255 ) == 0 ) {
+        ev_run_once(0);
+    }
 }
 
 
@@ -0,0 +1,71 @@
+/*
+ *   Current Cost Daemon
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef CURRENTCOST_H
+#define CURRENTCOST_H
+
+#include <time.h>
+
+/* A CC128 can pair with sensors 0-9 */
+#define MAX_SENSORS     10
+
+/* Number of receivers (serial ports) we can track */
+#define MAX_DEVICES     4
+
+
+/* A single decoded reading as it leaves parse_line() */
+typedef struct {
+    int             device;        /* Receiver the reading came from */
+    int             sensor;        /* Sensor number (0 = whole house) */
+    time_t          now;           /* Host clock when the line arrived */
+    long long       rx;            /* CLOCK_MONOTONIC ns the line started arriving */
+    int             hour;          /* Meter clock */
+    int             min;
+    int             sec;
+    double          temp;          /* Temperature at the receiver */
+    int             watts;         /* ch1 watts */
+    int             offset;        /* Meter clock - host clock (seconds) */
+    double          ts;            /* Drift corrected timestamp */
+    double          delta;         /* Seconds since the previous reading */
+    double          joules;        /* Energy used over delta */
+    double          kwh;           /* Cumulative energy for this sensor */
+    int             gap;           /* Set if delta spans missing readings */
+} reading_t;
+
+/* Most two hour totals we take from one history message */
+#define MAX_HISTORY     128
+
+/* The two hour kWh totals from a history message, hNNN covers the two
+   hours up to NNN - 2 hours before the meter's last even hour */
+typedef struct {
+    int             device;
+    time_t          now;
+    int             hour;          /* Meter clock */
+    int             min;
+    int             sec;
+    int             num;
+    struct {
+        int         sensor;
+        int         ago;           /* NNN */
+        double      kwh;
+    } totals[MAX_HISTORY];
+} history_t;
+
+#endif /* CURRENTCOST_H */
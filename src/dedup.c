@@ -0,0 +1,295 @@
+/*
+ *   Current Cost Daemon - dropping readings heard by several receivers
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   With receivers overlapping, one transmission from a sensor arrives
+ *   once from each of them. After the stamping stage has put each
+ *   receiver's clock onto ours, copies have the same sensor and stamps
+ *   within dedup:window seconds of each other.
+ *
+ *   Each copy passed on is remembered in a fixed hash table keyed on
+ *   the sensor and its stamp divided into windows, so a match is in the
+ *   copy's window or one either side. Entries older than a few windows
+ *   are free to be reused and a lookup probes a bounded number of
+ *   slots, so the cost per reading and the memory are fixed.
+ *
+ *   The best copy is the one from the receiver which hears the sensor
+ *   most reliably, scored with a decaying count of what it's heard. A
+ *   copy from that receiver (or as good) goes straight on. One from a
+ *   worse receiver is held for up to dedup:hold milliseconds in case the
+ *   better copy follows, and passed on if it doesn't.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "dedup.h"
+#include "pipeline.h"
+#include "evloop.h"
+
+
+/* Size of the table (a power of two) and slots probed per lookup */
+#define DEDUP_SLOTS         1024
+#define DEDUP_PROBES        8
+
+/* Copies which can be waiting at once, the oldest goes if it fills */
+#define DEDUP_HELD          64
+
+/* Milliseconds between looking for held copies which have waited long enough */
+#define DEDUP_TICK          100
+
+typedef struct {
+    double          ts;            /* Stamp of the copy passed on, 0 = never used */
+    int             sensor;
+    int             device;
+    int             held;          /* Index in held[] whilst it waits, else -1 */
+} seen_t;
+
+typedef struct {
+    reading_t       reading;
+    long long       deadline;      /* CLOCK_MONOTONIC ns */
+    int             slot;          /* Its seen[] entry, -1 once superseded */
+} held_t;
+
+
+static seen_t      *dedup_find(reading_t *reading);
+static seen_t      *dedup_insert(reading_t *reading);
+static unsigned int dedup_hash(int sensor, long window);
+static int          dedup_preferred(int sensor, int device);
+static void         dedup_release(long long now);
+static void         dedup_timer(void *data);
+
+/* Configuration */
+static int          c_dedup_window       = 2;
+static int          c_dedup_hold         = 500;
+
+static int          active               = 0;
+static seen_t       seen[DEDUP_SLOTS];
+static held_t       held[DEDUP_HELD];
+static unsigned int held_head            = 0;
+static unsigned int held_tail            = 0;
+static unsigned int scores[MAX_SENSORS][MAX_DEVICES];
+static double       newest               = 0;
+
+static unsigned long stat_duplicates     = 0;
+static unsigned long stat_held           = 0;
+static unsigned long stat_replaced       = 0;
+
+
+void dedup_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "dedup:window","Seconds apart copies of a reading from different receivers can be",OPT_INT,&c_dedup_window);
+    iniparse_add(ctx, 0, "dedup:hold","Milliseconds to wait for the best receiver's copy (0 = take the first)",OPT_INT,&c_dedup_hold);
+}
+
+void dedup_init(int receivers)
+{
+    int     i;
+
+    memset(seen, 0, sizeof(seen));
+    for ( i = 0; i < DEDUP_SLOTS; i++ ) {
+        seen[i].held = -1;
+    }
+    memset(scores, 0, sizeof(scores));
+    if ( receivers < 2 ) {
+        return;
+    }
+    if ( c_dedup_window < 1 ) {
+        c_dedup_window = 1;
+    }
+    if ( c_dedup_hold < 0 ) {
+        c_dedup_hold = 0;
+    }
+    active = 1;
+    if ( c_dedup_hold ) {
+        ev_every(DEDUP_TICK, dedup_timer, NULL);
+    }
+    syslog(LOG_INFO,"Dropping copies from %d receivers within %ds",receivers,c_dedup_window);
+}
+
+int dedup_sample(reading_t *reading)
+{
+    seen_t   *entry;
+    held_t   *h;
+    int       sensor = reading->sensor, i;
+
+    if ( active == 0 || sensor < 0 || sensor >= MAX_SENSORS ||
+         reading->device < 0 || reading->device >= MAX_DEVICES ) {
+        return 1;
+    }
+    dedup_release(reading->rx);
+
+    for ( i = 0; i < MAX_DEVICES; i++ ) {
+        scores[sensor][i] -= scores[sensor][i] >> 4;
+    }
+    scores[sensor][reading->device] += 256;
+    if ( reading->ts > newest ) {
+        newest = reading->ts;
+    }
+
+    if ( ( entry = dedup_find(reading) ) != NULL ) {
+        stat_duplicates++;
+        if ( entry->held != -1 && dedup_preferred(sensor, reading->device) &&
+             !dedup_preferred(sensor, entry->device) ) {
+            /* The copy we were waiting for */
+            held[entry->held].slot = -1;
+            entry->held = -1;
+            entry->device = reading->device;
+            stat_replaced++;
+            return 1;
+        }
+        return 0;
+    }
+    entry = dedup_insert(reading);
+    if ( c_dedup_hold == 0 || dedup_preferred(sensor, reading->device) ) {
+        return 1;
+    }
+
+    /* Wait a while for a better receiver */
+    if ( held_tail - held_head == DEDUP_HELD ) {
+        dedup_release(-1);
+    }
+    h = &held[held_tail % DEDUP_HELD];
+    h->reading = *reading;
+    h->deadline = reading->rx + c_dedup_hold * 1000000LL;
+    h->slot = entry - seen;
+    entry->held = held_tail % DEDUP_HELD;
+    held_tail++;
+    stat_held++;
+    return 0;
+}
+
+void dedup_flush()
+{
+    while ( held_head != held_tail ) {
+        dedup_release(-1);
+    }
+}
+
+void dedup_stats(unsigned long *duplicates, unsigned long *held, unsigned long *replaced)
+{
+    *duplicates = stat_duplicates;
+    *held = stat_held;
+    *replaced = stat_replaced;
+}
+
+
+/* The copy already seen of this transmission, if any */
+static seen_t *dedup_find(reading_t *reading)
+{
+    seen_t         *entry;
+    double          stale = newest - c_dedup_window * 4;
+    long            window = (long)floor(reading->ts / c_dedup_window);
+    unsigned int    h;
+    int             w, i;
+
+    for ( w = -1; w <= 1; w++ ) {
+        h = dedup_hash(reading->sensor, window + w);
+        for ( i = 0; i < DEDUP_PROBES; i++ ) {
+            entry = &seen[( h + i ) & ( DEDUP_SLOTS - 1 )];
+            if ( entry->ts == 0 ) {
+                break;
+            }
+            /* A receiver only hears each transmission once */
+            if ( entry->sensor == reading->sensor && entry->device != reading->device &&
+                 entry->ts >= stale && fabs(entry->ts - reading->ts) <= c_dedup_window ) {
+                return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Remember a copy in the first stale slot along, or failing that the
+   oldest of those probed */
+static seen_t *dedup_insert(reading_t *reading)
+{
+    seen_t         *entry, *victim = NULL;
+    double          stale = newest - c_dedup_window * 4;
+    unsigned int    h = dedup_hash(reading->sensor, (long)floor(reading->ts / c_dedup_window));
+    int             i;
+
+    for ( i = 0; i < DEDUP_PROBES; i++ ) {
+        entry = &seen[( h + i ) & ( DEDUP_SLOTS - 1 )];
+        if ( entry->ts < stale && entry->held == -1 ) {
+            victim = entry;
+            break;
+        }
+        if ( entry->held == -1 && ( victim == NULL || entry->ts < victim->ts ) ) {
+            victim = entry;
+        }
+    }
+    if ( victim == NULL ) {
+        /* All waiting, so one stops waiting now */
+        victim = &seen[h & ( DEDUP_SLOTS - 1 )];
+        held[victim->held].slot = -1;
+        pipeline_resume(STAGE_DEDUP + 1, &held[victim->held].reading);
+    }
+    victim->ts = reading->ts;
+    victim->sensor = reading->sensor;
+    victim->device = reading->device;
+    victim->held = -1;
+    return victim;
+}
+
+static unsigned int dedup_hash(int sensor, long window)
+{
+    return ( (unsigned int)window * 2654435761U ) ^ ( sensor * 40503U );
+}
+
+/* Whether no receiver hears the sensor better than this one */
+static int dedup_preferred(int sensor, int device)
+{
+    int     i;
+
+    for ( i = 0; i < MAX_DEVICES; i++ ) {
+        if ( scores[sensor][i] > scores[sensor][device] ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Pass on the held copies whose time is up, or with now < 0 the oldest */
+static void dedup_release(long long now)
+{
+    held_t   *h;
+
+    while ( held_head != held_tail ) {
+        h = &held[held_head % DEDUP_HELD];
+        if ( now >= 0 && h->slot != -1 && h->deadline > now ) {
+            break;
+        }
+        held_head++;
+        if ( h->slot != -1 ) {
+            seen[h->slot].held = -1;
+            h->slot = -1;
+            pipeline_resume(STAGE_DEDUP + 1, &h->reading);
+        }
+        if ( now < 0 ) {
+            break;
+        }
+    }
+}
+
+static void dedup_timer(void *data)
+{
+    struct timespec  tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    dedup_release(tp.tv_sec * 1000000000LL + tp.tv_nsec);
+}
@@ -0,0 +1,42 @@
+/*
+ *   Current Cost Daemon - dropping readings heard by several receivers
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "libini.h"
+#include "currentcost.h"
+
+/* Register the [dedup] options */
+extern void         dedup_options(configctx_t *ctx);
+
+/* Nothing is dropped unless there's more than one receiver */
+extern void         dedup_init(int receivers);
+
+/* Returns 0 if the reading is a copy of one already passed on, or is
+   being held back in case a better copy turns up */
+extern int          dedup_sample(reading_t *reading);
+
+/* Pass on everything held back, eg at the end of a replay */
+extern void         dedup_flush();
+
+extern void         dedup_stats(unsigned long *duplicates, unsigned long *held, unsigned long *replaced);
+
+#endif /* DEDUP_H */
@@ -0,0 +1,255 @@
+/*
+ *   Current Cost Daemon - appliance disaggregation
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Splits the whole house reading into appliances by the steps they
+ *   make as they switch on and off:
+ *
+ *   - The signal is a series of steady states. A reading within half of
+ *     disagg:threshold of the current one is noise and refines its mean.
+ *   - Anything further out starts a transition, which becomes the next
+ *     steady state once disagg:settle readings agree with each other.
+ *     Readings which don't agree (a motor starting) restart it.
+ *   - A step of at least disagg:threshold is an edge, matched to the
+ *     learnt appliance with the closest step size within
+ *     disagg:tolerance percent. Off edges prefer appliances which are on.
+ *     Anything unmatched is a new appliance.
+ *
+ *   Each reading costs a few comparisons, the appliance table is only
+ *   searched on an edge. Edges are written to the store as events, the
+ *   off event carrying the energy used whilst the appliance was on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "disagg.h"
+#include "store.h"
+
+
+/* Weight given to the newest sample in the running means is at least 1/this */
+#define DISAGG_WEIGHT       32
+
+/* How far back the store is searched for the appliances already learnt */
+#define DISAGG_HISTORY      ( 30 * 86400 )
+
+typedef struct {
+    int             enabled;
+    double          level;         /* Mean of the current steady state */
+    int             level_n;
+    double          pending;       /* Sum of the readings since leaving it */
+    int             pending_n;
+    double          pending_ts;    /* When they started */
+    appliance_t     appliances[DISAGG_APPLIANCES];
+    int             num;
+} detector_t;
+
+
+static void         disagg_edge(int sensor, detector_t *d, double step, double ts);
+static int          disagg_seed(void *record, void *arg);
+
+/* Configuration */
+static char        *c_disagg_sensors     = NULL;
+static int          c_disagg_threshold   = 50;
+static int          c_disagg_tolerance   = 15;
+static int          c_disagg_settle      = 2;
+
+static detector_t   detectors[MAX_SENSORS];
+
+
+void disagg_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "disagg:sensors","Sensors to split into appliances (eg 0 or 0,2)",OPT_STR,&c_disagg_sensors);
+    iniparse_add(ctx, 0, "disagg:threshold","Smallest step in watts taken as an appliance switching",OPT_INT,&c_disagg_threshold);
+    iniparse_add(ctx, 0, "disagg:tolerance","Percentage a step can differ from an appliance and still match",OPT_INT,&c_disagg_tolerance);
+    iniparse_add(ctx, 0, "disagg:settle","Readings which must agree before a step is believed",OPT_INT,&c_disagg_settle);
+}
+
+void disagg_init()
+{
+    char       *copy, *tok, *save;
+    time_t      now = time(NULL);
+    int         sensor;
+
+    memset(detectors, 0, sizeof(detectors));
+    if ( c_disagg_sensors == NULL ) {
+        return;
+    }
+    if ( c_disagg_threshold < 1 ) {
+        c_disagg_threshold = 1;
+    }
+    if ( c_disagg_settle < 1 ) {
+        c_disagg_settle = 1;
+    }
+    copy = strdup(c_disagg_sensors);
+    for ( tok = strtok_r(copy, ", ", &save); tok != NULL; tok = strtok_r(NULL, ", ", &save) ) {
+        sensor = atoi(tok);
+        if ( sensor < 0 || sensor >= MAX_SENSORS ) {
+            syslog(LOG_WARNING,"Ignoring disaggregation of sensor %s",tok);
+            continue;
+        }
+        detectors[sensor].enabled = 1;
+        store_scan(sensor, STORE_EVENT, now - DISAGG_HISTORY, now + 1, disagg_seed, &detectors[sensor]);
+        syslog(LOG_INFO,"Disaggregating sensor %d, %d appliances known",sensor,detectors[sensor].num);
+    }
+    free(copy);
+}
+
+void disagg_sample(reading_t *reading)
+{
+    detector_t  *d;
+    double       w = reading->watts;
+    double       band = c_disagg_threshold / 2.0;
+    double       ts = reading->ts > 0 ? reading->ts : reading->now;
+    double       mean, step;
+
+    if ( reading->sensor < 0 || reading->sensor >= MAX_SENSORS ||
+         ( d = &detectors[reading->sensor] )->enabled == 0 ) {
+        return;
+    }
+    if ( d->level_n == 0 || fabs(w - d->level) <= band ) {
+        if ( d->level_n < DISAGG_WEIGHT ) {
+            d->level_n++;
+        }
+        d->level += ( w - d->level ) / d->level_n;
+        d->pending_n = 0;
+        return;
+    }
+
+    /* Moving away, wait until the readings agree on where to */
+    if ( d->pending_n && fabs(w - d->pending / d->pending_n) > band ) {
+        d->pending_n = 0;
+    }
+    if ( d->pending_n == 0 ) {
+        d->pending = 0;
+        d->pending_ts = ts;
+    }
+    d->pending += w;
+    if ( ++d->pending_n < c_disagg_settle ) {
+        return;
+    }
+    mean = d->pending / d->pending_n;
+    step = mean - d->level;
+    d->level = mean;
+    d->level_n = d->pending_n;
+    d->pending_n = 0;
+    if ( fabs(step) >= c_disagg_threshold ) {
+        disagg_edge(reading->sensor, d, step, d->pending_ts);
+    }
+}
+
+int disagg_appliances(int sensor, const appliance_t **list)
+{
+    if ( sensor < 0 || sensor >= MAX_SENSORS ) {
+        return 0;
+    }
+    *list = detectors[sensor].appliances;
+    return detectors[sensor].num;
+}
+
+
+static void disagg_edge(int sensor, detector_t *d, double step, double ts)
+{
+    store_event_t   event;
+    appliance_t    *a;
+    double          size = fabs(step);
+    double          diff, tol, best_diff = 0;
+    int             i, pass, best = -1;
+
+    /* An off edge should belong to something that's on, failing that
+       we missed it going on */
+    for ( pass = step < 0 ? 0 : 1; pass < 2 && best == -1; pass++ ) {
+        for ( i = 0; i < d->num; i++ ) {
+            a = &d->appliances[i];
+            if ( pass == 0 && a->on == 0 ) {
+                continue;
+            }
+            diff = fabs(a->watts - size);
+            tol = a->watts * c_disagg_tolerance / 100.0;
+            if ( tol < c_disagg_threshold / 2.0 ) {
+                tol = c_disagg_threshold / 2.0;
+            }
+            if ( diff <= tol && ( best == -1 || diff < best_diff ) ) {
+                best = i;
+                best_diff = diff;
+            }
+        }
+    }
+    if ( best == -1 ) {
+        if ( d->num < DISAGG_APPLIANCES ) {
+            best = d->num++;
+            memset(&d->appliances[best], 0, sizeof(appliance_t));
+            d->appliances[best].watts = size;
+        } else {
+            /* Full up, the nearest will have to do */
+            for ( i = 0; i < d->num; i++ ) {
+                diff = fabs(d->appliances[i].watts - size);
+                if ( best == -1 || diff < best_diff ) {
+                    best = i;
+                    best_diff = diff;
+                }
+            }
+        }
+    }
+    a = &d->appliances[best];
+    if ( a->edges < DISAGG_WEIGHT ) {
+        a->edges++;
+    }
+    a->watts += ( size - a->watts ) / a->edges;
+
+    /* Energy is accounted at each change, so the events add up to it.
+       Going on again when it's already on means we missed it going off,
+       better to lose a little than to count it twice from here on. */
+    memset(&event, 0, sizeof(event));
+    if ( a->on ) {
+        event.joules = a->watts * ( ts - a->since );
+        a->joules += event.joules;
+    }
+    a->since = ts;
+    a->on = step > 0;
+    event.ts = (uint32_t)ts;
+    event.appliance = best;
+    event.on = step > 0;
+    event.watts = lrint(size);
+    store_event(sensor, &event);
+    syslog(LOG_INFO,"Sensor %d appliance %d (%.0fW) switched %s",sensor,best,a->watts,a->on ? "on" : "off");
+}
+
+/* Rebuild the appliance table from the events in the store */
+static int disagg_seed(void *record, void *arg)
+{
+    store_event_t  *event = record;
+    detector_t     *d = arg;
+    appliance_t    *a;
+
+    if ( event->appliance >= DISAGG_APPLIANCES ) {
+        return 0;
+    }
+    a = &d->appliances[event->appliance];
+    if ( event->appliance >= d->num ) {
+        d->num = event->appliance + 1;
+    }
+    if ( a->edges < DISAGG_WEIGHT ) {
+        a->edges++;
+    }
+    a->watts += ( event->watts - a->watts ) / a->edges;
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ *   Current Cost Daemon - appliance disaggregation
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef DISAGG_H
+#define DISAGG_H
+
+#include "currentcost.h"
+#include "libini.h"
+
+#define DISAGG_APPLIANCES   32
+
+/* An appliance as learnt from the steps it makes */
+typedef struct {
+    double          watts;         /* Centroid of the step sizes */
+    unsigned long   edges;         /* Steps matched to it */
+    int             on;            /* Switched on */
+    double          since;         /* When it last switched */
+    double          joules;        /* Energy attributed to it */
+} appliance_t;
+
+
+/* Register the [disagg] options */
+extern void         disagg_options(configctx_t *ctx);
+
+/* Set up the sensors named by disagg:sensors, picking up the appliances
+   already learnt from the store's events */
+extern void         disagg_init();
+
+/* Look for a step in a reading with its energy filled in */
+extern void         disagg_sample(reading_t *reading);
+
+/* Appliances learnt for a sensor, returns how many */
+extern int          disagg_appliances(int sensor, const appliance_t **list);
+
+#endif /* DISAGG_H */
@@ -0,0 +1,346 @@
+/*
+ *   Current Cost Daemon - energy integration
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   The CC128 stamps every message with its own clock, which ticks far
+ *   more regularly than the time at which we get round to reading the
+ *   line. We fit host time against (unwrapped) meter time for each
+ *   receiver and integrate on the fitted timestamps, so a delayed
+ *   daemon doesn't skew the energy totals.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "energy.h"
+
+
+/* Forgetting factor for the fit: ~1000 samples, or 100 minutes at 6s */
+#define DRIFT_LAMBDA        0.999
+
+/* Samples needed before we trust the slope of the fit */
+#define DRIFT_MIN_SAMPLES   10
+
+/* Host time this far from the fit is a delayed read - don't learn from it */
+#define DRIFT_OUTLIER       5.0
+
+/* Further out than this and somebody has set one of the clocks */
+#define DRIFT_RESET         120.0
+
+
+typedef struct {
+    int             valid;
+    int             last_sod;      /* Last meter time of day */
+    long            days;          /* Midnights seen by the meter */
+    double          x0;            /* Meter time origin */
+    double          y0;            /* Host time origin */
+    double          sw, sx, sy, sxx, sxy;
+    int             samples;
+} drift_t;
+
+typedef struct {
+    int             valid;
+    double          last_ts;
+    int             last_watts;
+    double          joules;        /* Cumulative since the counter began */
+} meter_t;
+
+
+static void         drift_reset(drift_t *drift, int sod, time_t now);
+static void         drift_recentre(drift_t *drift, double dx, double dy);
+static double       drift_fit(drift_t *drift, double x);
+static int          energy_load();
+
+static drift_t      devices[MAX_DEVICES];
+static meter_t      meters[MAX_SENSORS];
+static char        *checkpoint_file       = NULL;
+static int          checkpoint_interval   = 300;
+static time_t       checkpoint_last       = 0;
+
+
+void energy_init(char *file, int interval)
+{
+    memset(devices, 0, sizeof(devices));
+    memset(meters, 0, sizeof(meters));
+    checkpoint_file = file;
+    checkpoint_interval = interval;
+    checkpoint_last = time(NULL);
+    energy_load();
+}
+
+/** \brief Work out the corrected timestamp and integrate the energy for
+ *         a reading
+ *
+ *  \param reading - Reading to fill in
+ */
+void energy_stamp(reading_t *reading)
+{
+    drift_t   *drift;
+    int        sod;
+    double     x, y, fit;
+
+    if ( reading->device < 0 || reading->device >= MAX_DEVICES ) {
+        return;
+    }
+    drift = &devices[reading->device];
+
+    sod = ( reading->hour * 3600 ) + ( reading->min * 60 ) + reading->sec;
+
+    if ( drift->valid == 0 ) {
+        drift_reset(drift, sod, reading->now);
+    } else if ( sod < drift->last_sod - 43200 ) {
+        drift->days++;
+    }
+    drift->last_sod = sod;
+
+    x = ( drift->days * 86400.0 ) + sod - drift->x0;
+    y = reading->now - drift->y0;
+
+    /* Keep the sums small so the fit doesn't lose precision over the years */
+    if ( x > 86400.0 ) {
+        drift_recentre(drift, x, drift_fit(drift, x));
+        x = 0;
+        y = reading->now - drift->y0;
+    }
+
+    if ( drift->samples > 0 ) {
+        fit = drift_fit(drift, x);
+        if ( fabs(y - fit) > DRIFT_RESET ) {
+            syslog(LOG_NOTICE,"Meter clock moved by %.0fs, restarting drift estimate",y - fit);
+            drift_reset(drift, sod, reading->now);
+            x = 0;
+            y = 0;
+        }
+    }
+
+    /* Learn from the reading unless it was obviously delayed */
+    if ( drift->samples < DRIFT_MIN_SAMPLES || fabs(y - drift_fit(drift, x)) < DRIFT_OUTLIER ) {
+        drift->sw  = drift->sw  * DRIFT_LAMBDA + 1;
+        drift->sx  = drift->sx  * DRIFT_LAMBDA + x;
+        drift->sy  = drift->sy  * DRIFT_LAMBDA + y;
+        drift->sxx = drift->sxx * DRIFT_LAMBDA + x * x;
+        drift->sxy = drift->sxy * DRIFT_LAMBDA + x * y;
+        drift->samples++;
+    }
+
+    reading->ts = drift->y0 + drift_fit(drift, x);
+}
+
+void energy_sample(reading_t *reading)
+{
+    meter_t   *meter;
+
+    if ( reading->sensor < 0 || reading->sensor >= MAX_SENSORS ) {
+        return;
+    }
+    meter = &meters[reading->sensor];
+
+    reading->delta = 0;
+    reading->joules = 0;
+
+    /* Trapezoidal integration against the previous reading */
+    if ( meter->valid && reading->ts > meter->last_ts ) {
+        reading->delta = reading->ts - meter->last_ts;
+        reading->joules = ( ( meter->last_watts + reading->watts ) / 2.0 ) * reading->delta;
+    }
+    meter->valid = 1;
+    meter->last_ts = reading->ts;
+    meter->last_watts = reading->watts;
+    meter->joules += reading->joules;
+    reading->kwh = meter->joules / 3600000.0;
+
+    if ( checkpoint_file && reading->now - checkpoint_last >= checkpoint_interval ) {
+        energy_checkpoint();
+    }
+}
+
+/** \brief Add energy found after the event, eg over a gap once the
+ *         meter's history says how much was used
+ */
+void energy_adjust(int sensor, double joules)
+{
+    if ( sensor < 0 || sensor >= MAX_SENSORS ) {
+        return;
+    }
+    meters[sensor].joules += joules;
+}
+
+/** \brief Host time of a meter clock reading, from its receiver's fit
+ *         without learning from it
+ *
+ *  \param device - Receiver
+ *  \param hour, min, sec - Meter clock, within half a day of its last reading
+ *  \param now - Host clock, used until the receiver has a fit
+ */
+double energy_host_time(int device, int hour, int min, int sec, time_t now)
+{
+    drift_t   *drift;
+    int        sod;
+    double     x;
+
+    if ( device < 0 || device >= MAX_DEVICES || devices[device].valid == 0 ) {
+        return now;
+    }
+    drift = &devices[device];
+    sod = ( hour * 3600 ) + ( min * 60 ) + sec;
+    x = ( drift->days * 86400.0 ) + sod - drift->x0;
+    if ( sod < drift->last_sod - 43200 ) {
+        x += 86400.0;
+    } else if ( sod > drift->last_sod + 43200 ) {
+        x -= 86400.0;
+    }
+    return drift->y0 + drift_fit(drift, x);
+}
+
+double energy_kwh(int sensor)
+{
+    if ( sensor < 0 || sensor >= MAX_SENSORS ) {
+        return 0;
+    }
+    return meters[sensor].joules / 3600000.0;
+}
+
+/** \brief Write the cumulative counters to the checkpoint file
+ *
+ *  \return 0 - Written ok
+ *  \retval -1 - Failed to write
+ *
+ *  \note The file is written alongside and renamed into place so a crash
+ *        never leaves a truncated checkpoint. It's formatted in a buffer
+ *        rather than through stdio, which would allocate each time.
+ */
+int energy_checkpoint()
+{
+    char       tmpname[FILENAME_MAX];
+    char       buf[64 + MAX_SENSORS * 64];
+    int        fd, i, len;
+
+    if ( checkpoint_file == NULL ) {
+        return 0;
+    }
+    checkpoint_last = time(NULL);
+
+    snprintf(tmpname,sizeof(tmpname),"%s.tmp",checkpoint_file);
+    if ( ( fd = open(tmpname,O_WRONLY|O_CREAT|O_TRUNC,0644) ) == -1 ) {
+        syslog(LOG_ERR,"Unable to write energy checkpoint %s",tmpname);
+        return -1;
+    }
+    len = snprintf(buf,sizeof(buf),"# sensor kWh last-ts last-watts\n");
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        if ( meters[i].valid ) {
+            len += snprintf(buf + len,sizeof(buf) - len,"%d %.6f %.3f %d\n",i,meters[i].joules / 3600000.0,
+                            meters[i].last_ts,meters[i].last_watts);
+        } else if ( meters[i].joules != 0 ) {
+            len += snprintf(buf + len,sizeof(buf) - len,"%d %.6f\n",i,meters[i].joules / 3600000.0);
+        }
+    }
+    if ( len >= sizeof(buf) || write(fd,buf,len) != len || fsync(fd) != 0 ) {
+        close(fd);
+        unlink(tmpname);
+        return -1;
+    }
+    close(fd);
+
+    if ( rename(tmpname, checkpoint_file) != 0 ) {
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+static int energy_load()
+{
+    char       line[256];
+    FILE      *fp;
+    int        sensor, watts, n;
+    double     kwh, ts;
+
+    if ( checkpoint_file == NULL || ( fp = fopen(checkpoint_file,"r") ) == NULL ) {
+        return -1;
+    }
+    /* Older checkpoints only have the counters. With the last reading
+       too, the first one after a restart spans the time we were down */
+    while ( fgets(line,sizeof(line),fp) != NULL ) {
+        if ( ( n = sscanf(line,"%d %lf %lf %d",&sensor,&kwh,&ts,&watts) ) >= 2 && sensor >= 0 && sensor < MAX_SENSORS ) {
+            meters[sensor].joules = kwh * 3600000.0;
+            if ( n == 4 ) {
+                meters[sensor].valid = 1;
+                meters[sensor].last_ts = ts;
+                meters[sensor].last_watts = watts;
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void drift_reset(drift_t *drift, int sod, time_t now)
+{
+    memset(drift, 0, sizeof(*drift));
+    drift->valid = 1;
+    drift->last_sod = sod;
+    drift->x0 = sod;
+    drift->y0 = now;
+}
+
+/** \brief Move the origin of the fit without changing the fitted line
+ *
+ *  \param drift - Receiver clock state
+ *  \param dx - Amount to move the meter time origin by
+ *  \param dy - Amount to move the host time origin by
+ */
+static void drift_recentre(drift_t *drift, double dx, double dy)
+{
+    drift->sxy = drift->sxy - dx * drift->sy - dy * drift->sx + drift->sw * dx * dy;
+    drift->sxx = drift->sxx - 2 * dx * drift->sx + drift->sw * dx * dx;
+    drift->sx -= drift->sw * dx;
+    drift->sy -= drift->sw * dy;
+    drift->x0 += dx;
+    drift->y0 += dy;
+    drift->days = 0;
+    drift->x0 -= ( (long)drift->x0 / 86400 ) * 86400;
+}
+
+/** \brief Evaluate the weighted least squares fit of host time against
+ *         meter time
+ *
+ *  \param drift - Receiver clock state
+ *  \param x - Meter time relative to the origin
+ *
+ *  \return Host time relative to the origin
+ */
+static double drift_fit(drift_t *drift, double x)
+{
+    double   det, slope, intercept;
+
+    if ( drift->sw == 0 ) {
+        return x;
+    }
+    det = drift->sw * drift->sxx - drift->sx * drift->sx;
+    if ( drift->samples < DRIFT_MIN_SAMPLES || fabs(det) < 1e-6 ) {
+        /* Not enough spread yet, assume both clocks tick at the same rate */
+        return x + ( drift->sy - drift->sx ) / drift->sw;
+    }
+    slope = ( drift->sw * drift->sxy - drift->sx * drift->sy ) / det;
+    intercept = ( drift->sy - slope * drift->sx ) / drift->sw;
+    return intercept + slope * x;
+}
@@ -0,0 +1,46 @@
+/*
+ *   Current Cost Daemon - energy integration
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include "currentcost.h"
+
+/* Set up the counters, loading them from the checkpoint file if present */
+extern void         energy_init(char *checkpoint_file, int checkpoint_interval);
+
+/* Fill in ts for a freshly parsed reading from its receiver's clock */
+extern void         energy_stamp(reading_t *reading);
+
+/* Then delta, joules and kwh, once any duplicates are out of the way */
+extern void         energy_sample(reading_t *reading);
+
+/* Write the counters out (also done periodically by energy_sample()) */
+extern int          energy_checkpoint();
+
+extern double       energy_kwh(int sensor);
+
+/* Add energy to a sensor's counter after the event */
+extern void         energy_adjust(int sensor, double joules);
+
+/* Host time of a meter clock reading on a receiver, without learning from it */
+extern double       energy_host_time(int device, int hour, int min, int sec, time_t now);
+
+#endif /* ENERGY_H */
@@ -0,0 +1,174 @@
+/*
+ *   Current Cost Daemon - event loop
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   A plain poll() loop - the serial port, network sinks and listeners
+ *   all run from here on the one thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "evloop.h"
+
+
+#define MAX_WATCHES     1024
+#define MAX_TIMERS      32
+
+typedef struct {
+    ev_fn           fn;
+    void           *data;
+} watch_t;
+
+typedef struct {
+    int             interval;
+    long long       next;
+    ev_timer_fn     fn;
+    void           *data;
+} ev_timer_t;
+
+
+static struct pollfd  pollfds[MAX_WATCHES];
+static watch_t        watches[MAX_WATCHES];
+static int            num_watches = 0;
+static ev_timer_t       timers[MAX_TIMERS];
+static int            num_timers = 0;
+
+
+long long ev_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ( (long long)ts.tv_sec * 1000 ) + ( ts.tv_nsec / 1000000 );
+}
+
+static int ev_find(int fd)
+{
+    int     i;
+
+    for ( i = 0; i < num_watches; i++ ) {
+        if ( pollfds[i].fd == fd ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int ev_add(int fd, int events, ev_fn fn, void *data)
+{
+    int     i;
+
+    if ( ( i = ev_find(fd) ) == -1 ) {
+        if ( num_watches >= MAX_WATCHES ) {
+            return -1;
+        }
+        i = num_watches++;
+    }
+    pollfds[i].fd = fd;
+    pollfds[i].events = events;
+    pollfds[i].revents = 0;
+    watches[i].fn = fn;
+    watches[i].data = data;
+    return 0;
+}
+
+void ev_mod(int fd, int events)
+{
+    int     i;
+
+    if ( ( i = ev_find(fd) ) != -1 ) {
+        pollfds[i].events = events;
+    }
+}
+
+void ev_del(int fd)
+{
+    int     i;
+
+    if ( ( i = ev_find(fd) ) == -1 ) {
+        return;
+    }
+    /* Mark it dead, the slot is reclaimed after dispatching */
+    pollfds[i].fd = -1;
+    pollfds[i].events = 0;
+    pollfds[i].revents = 0;
+}
+
+int ev_every(int interval, ev_timer_fn fn, void *data)
+{
+    if ( num_timers >= MAX_TIMERS ) {
+        return -1;
+    }
+    timers[num_timers].interval = interval;
+    timers[num_timers].next = ev_now() + interval;
+    timers[num_timers].fn = fn;
+    timers[num_timers].data = data;
+    num_timers++;
+    return 0;
+}
+
+int ev_run_once(int timeout)
+{
+    long long   now = ev_now();
+    int         count = num_watches;
+    int         ret, i, j;
+
+    for ( i = 0; i < num_timers; i++ ) {
+        if ( timers[i].next - now < timeout ) {
+            timeout = timers[i].next - now;
+        }
+    }
+    if ( timeout < 0 ) {
+        timeout = 0;
+    }
+
+    if ( ( ret = poll(pollfds, count, timeout) ) < 0 && errno != EINTR ) {
+        return -1;
+    }
+
+    for ( i = 0; ret > 0 && i < count; i++ ) {
+        if ( pollfds[i].fd != -1 && pollfds[i].revents ) {
+            int revents = pollfds[i].revents;
+
+            pollfds[i].revents = 0;
+            watches[i].fn(pollfds[i].fd, revents, watches[i].data);
+        }
+    }
+
+    now = ev_now();
+    for ( i = 0; i < num_timers; i++ ) {
+        if ( timers[i].next <= now ) {
+            timers[i].next = now + timers[i].interval;
+            timers[i].fn(timers[i].data);
+        }
+    }
+
+    /* Compact out anything removed whilst dispatching */
+    for ( i = 0, j = 0; i < num_watches; i++ ) {
+        if ( pollfds[i].fd != -1 ) {
+            pollfds[j] = pollfds[i];
+            watches[j] = watches[i];
+            j++;
+        }
+    }
+    num_watches = j;
+    return ret;
+}
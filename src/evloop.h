@@ -0,0 +1,44 @@
+/*
+ *   Current Cost Daemon - event loop
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <poll.h>
+
+/* Called with the poll() revents for the descriptor */
+typedef void (*ev_fn)(int fd, int revents, void *data);
+typedef void (*ev_timer_fn)(void *data);
+
+/* Watch a descriptor for POLLIN/POLLOUT */
+extern int          ev_add(int fd, int events, ev_fn fn, void *data);
+extern void         ev_mod(int fd, int events);
+extern void         ev_del(int fd);
+
+/* Call fn every interval milliseconds */
+extern int          ev_every(int interval, ev_timer_fn fn, void *data);
+
+/* Wait up to timeout milliseconds and dispatch whatever is ready */
+extern int          ev_run_once(int timeout);
+
+/* Milliseconds on the monotonic clock */
+extern long long    ev_now();
+
+#endif /* EVLOOP_H */
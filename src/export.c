@@ -0,0 +1,1316 @@
+/*
+ *   Current Cost Daemon - columnar export of the store
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Writes readings or rollups from the store out for analysis tools:
+ *
+ *     currentcostd -f /etc/currentcost.conf --export:file 2023.parquet \
+ *         --export:from 2023-01-01 --export:to 2024-01-01 --export:level minute
+ *
+ *   A .parquet file is written as Parquet and anything else as an Arrow
+ *   IPC file (aka Feather), or pick with export:format. Either loads
+ *   straight into pandas, polars, duckdb and the like with the types
+ *   intact: ts is a UTC timestamp in milliseconds and sensor is a
+ *   dictionary of the sensors exported. Times given are local.
+ *
+ *   Rows go out sensor by sensor in time order, export:rows at a time as
+ *   an Arrow record batch or a Parquet row group, so the memory used is
+ *   the same however long the range. Only the footer grows, by a few
+ *   dozen bytes a chunk.
+ *
+ *   In Parquet the sensor and the temperature of readings are dictionary
+ *   encoded and the timestamps and whole numbers are delta encoded, so
+ *   readings at a steady interval take a byte or two a column. Arrow IPC
+ *   has no delta encoding, only the sensor is a dictionary there. Nothing
+ *   is compressed on top.
+ */
+
+#define _GNU_SOURCE             /* strptime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "export.h"
+#include "store.h"
+
+
+#define EXPORT_ROWS         65536
+#define EXPORT_MAX_COLUMNS  8
+
+/* Parquet delta encoding, values in a block and miniblocks in a block */
+#define DELTA_BLOCK         128
+#define DELTA_MINIBLOCKS    4
+#define DELTA_MINIBLOCK     ( DELTA_BLOCK / DELTA_MINIBLOCKS )
+
+enum { FORMAT_ARROW, FORMAT_PARQUET };
+
+/* Column types, as Arrow has them */
+enum { COL_TIMESTAMP, COL_INT8, COL_INT32, COL_FLOAT, COL_DOUBLE };
+
+/* How Parquet encodes a column */
+enum { ENC_PLAIN, ENC_DICT, ENC_DELTA };
+
+/* Arrow flatbuffer constants, see Schema.fbs and Message.fbs */
+#define ARROW_V5            4
+#define ARROW_SCHEMA        1
+#define ARROW_DICTIONARY    2
+#define ARROW_RECORD_BATCH  3
+
+/* Parquet thrift constants, see parquet.thrift */
+#define PQ_INT32            1
+#define PQ_INT64            2
+#define PQ_FLOAT            4
+#define PQ_DOUBLE           5
+#define PQ_PLAIN            0
+#define PQ_RLE              3
+#define PQ_DELTA            5
+#define PQ_RLE_DICTIONARY   8
+#define PQ_DATA_PAGE        0
+#define PQ_DICTIONARY_PAGE  2
+#define PQ_TIMESTAMP_MILLIS 9
+#define PQ_INT_8            15
+
+/* Thrift compact protocol types */
+#define TC_TRUE             1
+#define TC_FALSE            2
+#define TC_I32              5
+#define TC_I64              6
+#define TC_BINARY           8
+#define TC_LIST             9
+#define TC_STRUCT           12
+
+typedef struct {
+    char           *name;
+    int             type;
+    int             encoding;
+} column_t;
+
+/* Somewhere to build metadata and pages */
+typedef struct {
+    unsigned char  *data;
+    size_t          len;
+    size_t          size;
+} buf_t;
+
+/* Where an Arrow message went, for the footer */
+typedef struct {
+    int64_t         offset;
+    int32_t         meta_len;
+    int64_t         body_len;
+} block_t;
+
+/* Where a Parquet column chunk went, for the footer */
+typedef struct {
+    int64_t         offset;        /* First page */
+    int64_t         data_offset;   /* Data page, after the dictionary */
+    int64_t         size;
+    unsigned char   min[8];
+    unsigned char   max[8];
+    int             stat_len;      /* 0 = no statistics */
+} chunk_meta_t;
+
+typedef struct {
+    int64_t         rows;
+    chunk_meta_t    columns[EXPORT_MAX_COLUMNS];
+} group_t;
+
+typedef struct {
+    buf_t          *buf;
+    int             last[8];       /* Field id last written at each depth */
+    int             depth;
+} thrift_t;
+
+
+static int          export_setup(time_t *from, time_t *to);
+static int          export_time(char *str, time_t *when);
+static int          export_row(void *record, void *arg);
+static void         export_flush();
+static void         out_write(const void *data, size_t len);
+static void         arrow_begin();
+static void         arrow_batch();
+static void         arrow_end();
+static int          arrow_message(buf_t *b, int type, int64_t body_len);
+static int          arrow_schema(buf_t *b);
+static int          arrow_type(buf_t *b, int type);
+static int          arrow_int(buf_t *b, int bits);
+static int          arrow_record_batch(buf_t *b, int64_t length, int num, int64_t *lens);
+static void         arrow_write(buf_t *b, block_t *block, int num, unsigned char **bodies, int64_t *lens);
+static void         arrow_block(buf_t *b, int at, block_t *block);
+static void         parquet_begin();
+static void         parquet_group();
+static void         parquet_column(int c, chunk_meta_t *m);
+static void         parquet_page(int type, int num, int encoding, int64_t *offset);
+static void         parquet_plain(buf_t *b, int type, const unsigned char *value);
+static void         parquet_stats(int c, chunk_meta_t *m);
+static void         parquet_end();
+static int          dict_build(int c);
+static void         delta_encode(buf_t *b, int c);
+static void         rle_encode(buf_t *b, const uint32_t *vals, int num, int width);
+static void         bitpack(buf_t *b, const uint64_t *vals, int num, int width);
+static int64_t      col_int(int c, int row);
+static int          bit_width(uint64_t max);
+static int          fb_align(buf_t *b, int align, int extra);
+static int          fb_table(buf_t *b, int num, const int *sizes, int *fields);
+static int          fb_vector(buf_t *b, int num, int size, int align);
+static int          fb_string(buf_t *b, char *str);
+static void         fb_ref(buf_t *b, int at, int target);
+static void         tc_field(thrift_t *t, int id, int type);
+static void         tc_i32(thrift_t *t, int id, int32_t val);
+static void         tc_i64(thrift_t *t, int id, int64_t val);
+static void         tc_binary(thrift_t *t, int id, const void *data, int len);
+static void         tc_list(thrift_t *t, int id, int type, int num);
+static void         tc_begin(thrift_t *t, int id);
+static void         tc_end(thrift_t *t);
+static unsigned char *buf_add(buf_t *b, size_t len);
+static void         buf_put(buf_t *b, const void *data, size_t len);
+static void         buf_varint(buf_t *b, uint64_t val);
+static uint64_t     zigzag(int64_t val);
+static void         put16(unsigned char *p, uint16_t val);
+static void         put32(unsigned char *p, uint32_t val);
+static void         put64(unsigned char *p, uint64_t val);
+
+/* Configuration */
+static char        *c_export_file        = NULL;
+static char        *c_export_format      = NULL;
+static char        *c_export_level       = "raw";
+static char        *c_export_from        = NULL;
+static char        *c_export_to          = NULL;
+static char        *c_export_sensors     = NULL;
+static int          c_export_rows        = EXPORT_ROWS;
+
+static const column_t raw_columns[] = {
+    { "ts",         COL_TIMESTAMP,  ENC_DELTA },
+    { "sensor",     COL_INT8,       ENC_DICT },
+    { "watts",      COL_INT32,      ENC_DELTA },
+    { "temp",       COL_FLOAT,      ENC_DICT },
+    { "joules",     COL_FLOAT,      ENC_PLAIN },
+};
+
+static const column_t rollup_columns[] = {
+    { "ts",         COL_TIMESTAMP,  ENC_DELTA },
+    { "sensor",     COL_INT8,       ENC_DICT },
+    { "count",      COL_INT32,      ENC_DELTA },
+    { "min",        COL_INT32,      ENC_DELTA },
+    { "max",        COL_INT32,      ENC_DELTA },
+    { "mean",       COL_FLOAT,      ENC_PLAIN },
+    { "temp",       COL_FLOAT,      ENC_PLAIN },
+    { "joules",     COL_DOUBLE,     ENC_PLAIN },
+};
+
+static const int    type_size[]          = { 8, 1, 4, 4, 8 };
+static const int    arrow_type_id[]      = { 10, 2, 2, 3, 3 };   /* Timestamp, Int, FloatingPoint */
+static const int    parquet_type[]       = { PQ_INT64, PQ_INT32, PQ_INT32, PQ_FLOAT, PQ_DOUBLE };
+static const char   zero[8];
+
+static int          format;
+static int          level;
+static const column_t *columns;
+static int          num_columns;
+static int          sensors[MAX_SENSORS];
+static int          num_sensors;
+static int8_t       sensor_index[MAX_SENSORS];
+
+/* The chunk being filled, a column at a time */
+static unsigned char *chunk[EXPORT_MAX_COLUMNS];
+static int          rows                 = 0;
+static long         total_rows           = 0;
+static long         chunks               = 0;
+
+static FILE        *out                  = NULL;
+static int64_t      out_pos              = 0;
+static int          out_error            = 0;
+
+static buf_t        meta;                /* Flatbuffers and thrift */
+static buf_t        page;                /* A page, or the sensor indices */
+static buf_t        blocks;              /* block_t for each record batch */
+static buf_t        groups;              /* group_t for each row group */
+static block_t      dict_block;
+
+/* Dictionary encoding a column, an open addressed table of values */
+static int32_t     *dict_slots           = NULL;
+static uint64_t    *dict_keys            = NULL;
+static uint32_t    *dict_index           = NULL;
+static int          dict_bits            = 0;
+
+
+void export_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "export:file","Export the store to this Arrow IPC or .parquet file and exit",OPT_STR,&c_export_file);
+    iniparse_add(ctx, 0, "export:format","arrow or parquet (default from the file name)",OPT_STR,&c_export_format);
+    iniparse_add(ctx, 0, "export:level","What to export: raw, minute or hour",OPT_STR,&c_export_level);
+    iniparse_add(ctx, 0, "export:from","Start of the range, YYYY-MM-DD[THH:MM[:SS]] or epoch seconds",OPT_STR,&c_export_from);
+    iniparse_add(ctx, 0, "export:to","End of the range (default now)",OPT_STR,&c_export_to);
+    iniparse_add(ctx, 0, "export:sensors","Sensors to export, eg 0,2 (default all)",OPT_STR,&c_export_sensors);
+    iniparse_add(ctx, 0, "export:rows","Rows in each record batch or row group",OPT_INT,&c_export_rows);
+}
+
+int export_wanted()
+{
+    return c_export_file != NULL;
+}
+
+/** \brief Export the configured range from the store
+ *
+ *  \return Number of rows written
+ *  \retval -1 - Bad options or the file couldn't be written
+ */
+long export_run()
+{
+    struct timespec  start, end;
+    time_t           from, to;
+    double           secs;
+    int              i;
+
+    if ( export_setup(&from, &to) != 0 ) {
+        return -1;
+    }
+    if ( ( out = fopen(c_export_file, "w") ) == NULL ) {
+        perror(c_export_file);
+        return -1;
+    }
+    for ( i = 0; i < num_columns; i++ ) {
+        chunk[i] = malloc((size_t)c_export_rows * type_size[columns[i].type]);
+    }
+    if ( format == FORMAT_PARQUET ) {
+        for ( dict_bits = 1; ( 1 << dict_bits ) < c_export_rows * 2; dict_bits++ ) {
+            ;
+        }
+        dict_slots = malloc(sizeof(int32_t) << dict_bits);
+        dict_keys = malloc(sizeof(uint64_t) * c_export_rows);
+        dict_index = malloc(sizeof(uint32_t) * c_export_rows);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if ( format == FORMAT_ARROW ) {
+        arrow_begin();
+    } else {
+        parquet_begin();
+    }
+    for ( i = 0; i < num_sensors && out_error == 0; i++ ) {
+        store_scan(sensors[i], level, from, to, export_row, &sensors[i]);
+    }
+    export_flush();
+    if ( format == FORMAT_ARROW ) {
+        arrow_end();
+    } else {
+        parquet_end();
+    }
+    if ( fclose(out) != 0 ) {
+        out_error = 1;
+    }
+    if ( out_error ) {
+        fprintf(stderr, "Unable to write %s\n", c_export_file);
+        unlink(c_export_file);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+    printf("Exported %ld rows in %ld %s to %s, %.1fMB in %.1fs (%.0f rows/s)\n",
+           total_rows, chunks, format == FORMAT_ARROW ? "record batches" : "row groups",
+           c_export_file, out_pos / 1048576.0, secs, secs > 0 ? total_rows / secs : 0);
+    return total_rows;
+}
+
+
+/* Check the options, working out the format, columns and sensors */
+static int export_setup(time_t *from, time_t *to)
+{
+    char      *ptr, *end;
+    size_t     len = strlen(c_export_file);
+    long       sensor;
+
+    if ( c_export_format ) {
+        if ( strcmp(c_export_format, "arrow") == 0 ) {
+            format = FORMAT_ARROW;
+        } else if ( strcmp(c_export_format, "parquet") == 0 ) {
+            format = FORMAT_PARQUET;
+        } else {
+            fprintf(stderr, "export:format is arrow or parquet\n");
+            return -1;
+        }
+    } else {
+        format = len > 8 && strcmp(c_export_file + len - 8, ".parquet") == 0 ? FORMAT_PARQUET : FORMAT_ARROW;
+    }
+
+    if ( strcmp(c_export_level, "raw") == 0 ) {
+        level = STORE_RAW;
+        columns = raw_columns;
+        num_columns = sizeof(raw_columns) / sizeof(raw_columns[0]);
+    } else if ( strcmp(c_export_level, "minute") == 0 || strcmp(c_export_level, "hour") == 0 ) {
+        level = c_export_level[0] == 'm' ? STORE_MINUTE : STORE_HOUR;
+        columns = rollup_columns;
+        num_columns = sizeof(rollup_columns) / sizeof(rollup_columns[0]);
+    } else {
+        fprintf(stderr, "export:level is raw, minute or hour\n");
+        return -1;
+    }
+
+    *from = 0;
+    *to = time(NULL) + 1;
+    if ( ( c_export_from && export_time(c_export_from, from) != 0 ) ||
+         ( c_export_to && export_time(c_export_to, to) != 0 ) || *from >= *to ) {
+        fprintf(stderr, "export:from and export:to don't make a range\n");
+        return -1;
+    }
+
+    memset(sensor_index, -1, sizeof(sensor_index));
+    num_sensors = 0;
+    if ( c_export_sensors == NULL ) {
+        for ( num_sensors = 0; num_sensors < MAX_SENSORS; num_sensors++ ) {
+            sensors[num_sensors] = num_sensors;
+            sensor_index[num_sensors] = num_sensors;
+        }
+    } else {
+        ptr = c_export_sensors;
+        do {
+            sensor = strtol(ptr, &end, 10);
+            if ( end == ptr || sensor < 0 || sensor >= MAX_SENSORS || sensor_index[sensor] != -1 ) {
+                fprintf(stderr, "export:sensors is a list of sensors 0-%d\n", MAX_SENSORS - 1);
+                return -1;
+            }
+            sensor_index[sensor] = num_sensors;
+            sensors[num_sensors++] = sensor;
+            ptr = end + 1;
+        } while ( *end == ',' );
+        if ( *end ) {
+            fprintf(stderr, "export:sensors is a list of sensors 0-%d\n", MAX_SENSORS - 1);
+            return -1;
+        }
+    }
+
+    if ( c_export_rows < 1 ) {
+        c_export_rows = 1;
+    } else if ( c_export_rows > 1 << 24 ) {
+        c_export_rows = 1 << 24;
+    }
+    return 0;
+}
+
+/* YYYY-MM-DD[THH:MM[:SS]] in local time, or epoch seconds */
+static int export_time(char *str, time_t *when)
+{
+    struct tm   tm;
+    char       *end;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_isdst = -1;
+    if ( ( end = strptime(str, "%Y-%m-%d", &tm) ) != NULL && *end != '\0' && *end != 'T' && *end != ' ' ) {
+        end = NULL;
+    }
+    if ( end != NULL ) {
+        if ( *end != '\0' ) {
+            if ( ( end = strptime(end + 1, "%H:%M", &tm) ) == NULL ) {
+                return -1;
+            }
+            if ( *end == ':' && ( end = strptime(end + 1, "%S", &tm) ) == NULL ) {
+                return -1;
+            }
+        }
+        *when = mktime(&tm);
+        return *end ? -1 : 0;
+    }
+    *when = strtol(str, &end, 10);
+    return *end || end == str ? -1 : 0;
+}
+
+/* Add a record from the store to the chunk */
+static int export_row(void *record, void *arg)
+{
+    store_raw_t     *raw = record;
+    store_rollup_t  *rollup = record;
+
+    if ( level == STORE_RAW ) {
+        ((int64_t *)chunk[0])[rows] = raw->ts * 1000LL + raw->ms;
+        ((int8_t *)chunk[1])[rows] = *(int *)arg;
+        ((int32_t *)chunk[2])[rows] = raw->watts;
+        ((float *)chunk[3])[rows] = raw->temp / 10.0f;
+        ((float *)chunk[4])[rows] = raw->joules;
+    } else {
+        ((int64_t *)chunk[0])[rows] = rollup->ts * 1000LL;
+        ((int8_t *)chunk[1])[rows] = *(int *)arg;
+        ((int32_t *)chunk[2])[rows] = rollup->count;
+        ((int32_t *)chunk[3])[rows] = rollup->min;
+        ((int32_t *)chunk[4])[rows] = rollup->max;
+        ((float *)chunk[5])[rows] = rollup->mean;
+        ((float *)chunk[6])[rows] = rollup->temp;
+        ((double *)chunk[7])[rows] = rollup->joules;
+    }
+    if ( ++rows == c_export_rows ) {
+        export_flush();
+    }
+    return out_error;
+}
+
+/* Write out the chunk as a record batch or row group */
+static void export_flush()
+{
+    if ( rows == 0 ) {
+        return;
+    }
+    if ( format == FORMAT_ARROW ) {
+        arrow_batch();
+    } else {
+        parquet_group();
+    }
+    total_rows += rows;
+    chunks++;
+    rows = 0;
+}
+
+static void out_write(const void *data, size_t len)
+{
+    if ( len && fwrite(data, 1, len, out) != len ) {
+        out_error = 1;
+    }
+    out_pos += len;
+}
+
+
+/* The Arrow IPC file format: magic, the schema and dictionary messages,
+   the record batches and a footer listing where they all are */
+static void arrow_begin()
+{
+    unsigned char  *body;
+    int64_t         len = num_sensors;
+    int             f[3];
+    block_t         block;
+    static const int dict_sizes[] = { 8, 4, 0 };
+    int8_t          values[MAX_SENSORS];
+    int             i;
+
+    out_write("ARROW1\0\0", 8);
+
+    i = arrow_message(&meta, ARROW_SCHEMA, 0);
+    fb_ref(&meta, i, arrow_schema(&meta));
+    arrow_write(&meta, &block, 0, NULL, NULL);
+
+    /* The one dictionary, of the sensors being exported */
+    for ( i = 0; i < num_sensors; i++ ) {
+        values[i] = sensors[i];
+    }
+    body = (unsigned char *)values;
+    i = arrow_message(&meta, ARROW_DICTIONARY, ( len + 7 ) & ~7);
+    fb_ref(&meta, i, fb_table(&meta, 3, dict_sizes, f));
+    fb_ref(&meta, f[1], arrow_record_batch(&meta, num_sensors, 1, &len));
+    arrow_write(&meta, &dict_block, 1, &body, &len);
+}
+
+static void arrow_batch()
+{
+    unsigned char  *bodies[EXPORT_MAX_COLUMNS];
+    int64_t         lens[EXPORT_MAX_COLUMNS], body_len = 0;
+    block_t         block;
+    int             i;
+
+    for ( i = 0; i < num_columns; i++ ) {
+        bodies[i] = chunk[i];
+        lens[i] = (int64_t)rows * type_size[columns[i].type];
+        body_len += ( lens[i] + 7 ) & ~7;
+    }
+    /* Sensors go out as indices into the dictionary */
+    page.len = 0;
+    bodies[1] = buf_add(&page, rows);
+    for ( i = 0; i < rows; i++ ) {
+        bodies[1][i] = sensor_index[((int8_t *)chunk[1])[i]];
+    }
+
+    i = arrow_message(&meta, ARROW_RECORD_BATCH, body_len);
+    fb_ref(&meta, i, arrow_record_batch(&meta, rows, num_columns, lens));
+    arrow_write(&meta, &block, num_columns, bodies, lens);
+    buf_put(&blocks, &block, sizeof(block));
+}
+
+static void arrow_end()
+{
+    static const int footer_sizes[] = { 2, 4, 4, 4 };
+    unsigned char    tail[10];
+    block_t         *block = (block_t *)blocks.data;
+    int              f[4], num = blocks.len / sizeof(block_t), at, i;
+
+    /* End of stream, then the footer */
+    put32(tail, 0xffffffff);
+    put32(tail + 4, 0);
+    out_write(tail, 8);
+
+    meta.len = 0;
+    buf_add(&meta, 4);
+    at = fb_table(&meta, 4, footer_sizes, f);
+    put32(meta.data, at);
+    put16(meta.data + f[0], ARROW_V5);
+    fb_ref(&meta, f[1], arrow_schema(&meta));
+    at = fb_vector(&meta, 1, 24, 8);
+    arrow_block(&meta, at + 4, &dict_block);
+    fb_ref(&meta, f[2], at);
+    at = fb_vector(&meta, num, 24, 8);
+    for ( i = 0; i < num; i++ ) {
+        arrow_block(&meta, at + 4 + i * 24, &block[i]);
+    }
+    fb_ref(&meta, f[3], at);
+    out_write(meta.data, meta.len);
+
+    put32(tail, meta.len);
+    memcpy(tail + 4, "ARROW1", 6);
+    out_write(tail, 10);
+}
+
+/* Start a Message in b, returns where the offset of its header goes */
+static int arrow_message(buf_t *b, int type, int64_t body_len)
+{
+    static const int sizes[] = { 2, 1, 4, 8 };
+    int              message, f[4];
+
+    b->len = 0;
+    buf_add(b, 4);
+    message = fb_table(b, 4, sizes, f);
+    put32(b->data, message);
+    put16(b->data + f[0], ARROW_V5);
+    b->data[f[1]] = type;
+    put64(b->data + f[3], body_len);
+    return f[2];
+}
+
+static int arrow_schema(buf_t *b)
+{
+    static const int schema_sizes[] = { 2, 4 };
+    static const int dict_sizes[] = { 8, 4 };
+    int              sizes[6] = { 4, 1, 1, 4, 0, 4 };
+    int              schema, fields, field, f[6], d[2], i;
+
+    schema = fb_table(b, 2, schema_sizes, f);
+    fields = fb_vector(b, num_columns, 4, 4);
+    fb_ref(b, f[1], fields);
+    for ( i = 0; i < num_columns; i++ ) {
+        sizes[4] = columns[i].type == COL_INT8 ? 4 : 0;
+        field = fb_table(b, 6, sizes, f);
+        fb_ref(b, fields + 4 + i * 4, field);
+        fb_ref(b, f[0], fb_string(b, columns[i].name));
+        b->data[f[2]] = arrow_type_id[columns[i].type];
+        fb_ref(b, f[3], arrow_type(b, columns[i].type));
+        if ( sizes[4] ) {
+            /* Dictionary id 0, int8 indices */
+            fb_ref(b, f[4], fb_table(b, 2, dict_sizes, d));
+            fb_ref(b, d[1], arrow_int(b, 8));
+        }
+        fb_ref(b, f[5], fb_vector(b, 0, 4, 4));
+    }
+    return schema;
+}
+
+static int arrow_type(buf_t *b, int type)
+{
+    static const int ts_sizes[] = { 2, 4 };
+    static const int float_sizes[] = { 2 };
+    int              table, f[2];
+
+    switch ( type ) {
+    case COL_TIMESTAMP:
+        table = fb_table(b, 2, ts_sizes, f);
+        put16(b->data + f[0], 1);          /* MILLISECOND */
+        fb_ref(b, f[1], fb_string(b, "UTC"));
+        return table;
+    case COL_INT8:
+        return arrow_int(b, 8);
+    case COL_INT32:
+        return arrow_int(b, 32);
+    default:
+        table = fb_table(b, 1, float_sizes, f);
+        put16(b->data + f[0], type == COL_FLOAT ? 1 : 2);
+        return table;
+    }
+}
+
+static int arrow_int(buf_t *b, int bits)
+{
+    static const int sizes[] = { 4, 1 };
+    int              table, f[2];
+
+    table = fb_table(b, 2, sizes, f);
+    put32(b->data + f[0], bits);
+    b->data[f[1]] = 1;
+    return table;
+}
+
+/* A RecordBatch of num columns with no nulls, each a validity buffer
+   left empty and the values */
+static int arrow_record_batch(buf_t *b, int64_t length, int num, int64_t *lens)
+{
+    static const int sizes[] = { 8, 4, 4 };
+    int64_t          offset = 0;
+    int              table, at, f[3], i;
+
+    table = fb_table(b, 3, sizes, f);
+    put64(b->data + f[0], length);
+    at = fb_vector(b, num, 16, 8);
+    for ( i = 0; i < num; i++ ) {
+        put64(b->data + at + 4 + i * 16, length);
+    }
+    fb_ref(b, f[1], at);
+    at = fb_vector(b, num * 2, 16, 8);
+    for ( i = 0; i < num; i++ ) {
+        put64(b->data + at + 4 + i * 32, offset);
+        put64(b->data + at + 4 + i * 32 + 16, offset);
+        put64(b->data + at + 4 + i * 32 + 24, lens[i]);
+        offset += ( lens[i] + 7 ) & ~7;
+    }
+    fb_ref(b, f[2], at);
+    return table;
+}
+
+/* Write a message from b followed by its body, each part padded to 8 */
+static void arrow_write(buf_t *b, block_t *block, int num, unsigned char **bodies, int64_t *lens)
+{
+    unsigned char   prefix[8];
+    size_t          len = ( b->len + 7 ) & ~7;
+    int             i;
+
+    block->offset = out_pos;
+    block->meta_len = 8 + len;
+    block->body_len = 0;
+    put32(prefix, 0xffffffff);
+    put32(prefix + 4, len);
+    out_write(prefix, 8);
+    out_write(b->data, b->len);
+    out_write(zero, len - b->len);
+    for ( i = 0; i < num; i++ ) {
+        out_write(bodies[i], lens[i]);
+        out_write(zero, -lens[i] & 7);
+        block->body_len += ( lens[i] + 7 ) & ~7;
+    }
+}
+
+/* A Block struct for the footer */
+static void arrow_block(buf_t *b, int at, block_t *block)
+{
+    put64(b->data + at, block->offset);
+    put32(b->data + at + 8, block->meta_len);
+    put64(b->data + at + 16, block->body_len);
+}
+
+
+/* Parquet: magic, a row group per chunk with each column a dictionary
+   page if it has one and a data page, then the thrift footer */
+static void parquet_begin()
+{
+    out_write("PAR1", 4);
+}
+
+static void parquet_group()
+{
+    group_t    *group = (group_t *)buf_add(&groups, sizeof(group_t));
+    int         i;
+
+    group->rows = rows;
+    for ( i = 0; i < num_columns; i++ ) {
+        parquet_column(i, &group->columns[i]);
+    }
+}
+
+static void parquet_column(int c, chunk_meta_t *m)
+{
+    const column_t *col = &columns[c];
+    int             size = type_size[col->type];
+    int             num, i;
+
+    m->offset = out_pos;
+    page.len = 0;
+    switch ( col->encoding ) {
+    case ENC_DICT:
+        num = dict_build(c);
+        for ( i = 0; i < num; i++ ) {
+            parquet_plain(&page, col->type, (unsigned char *)&dict_keys[i]);
+        }
+        parquet_page(PQ_DICTIONARY_PAGE, num, PQ_PLAIN, &m->offset);
+        page.len = 0;
+        i = bit_width(num - 1);
+        i = i ? i : 1;
+        *buf_add(&page, 1) = i;
+        rle_encode(&page, dict_index, rows, i);
+        parquet_page(PQ_DATA_PAGE, rows, PQ_RLE_DICTIONARY, &m->data_offset);
+        break;
+    case ENC_DELTA:
+        delta_encode(&page, c);
+        parquet_page(PQ_DATA_PAGE, rows, PQ_DELTA, &m->data_offset);
+        break;
+    default:
+        if ( col->type == COL_INT8 ) {
+            for ( i = 0; i < rows; i++ ) {
+                parquet_plain(&page, col->type, chunk[c] + i);
+            }
+        } else {
+            buf_put(&page, chunk[c], (size_t)rows * size);
+        }
+        parquet_page(PQ_DATA_PAGE, rows, PQ_PLAIN, &m->data_offset);
+        break;
+    }
+    m->size = out_pos - m->offset;
+    parquet_stats(c, m);
+}
+
+/* Write a page header and the page built up in page */
+static void parquet_page(int type, int num, int encoding, int64_t *offset)
+{
+    thrift_t    t = { &meta };
+
+    meta.len = 0;
+    tc_i32(&t, 1, type);
+    tc_i32(&t, 2, page.len);
+    tc_i32(&t, 3, page.len);
+    if ( type == PQ_DICTIONARY_PAGE ) {
+        tc_begin(&t, 7);
+        tc_i32(&t, 1, num);
+        tc_i32(&t, 2, encoding);
+    } else {
+        tc_begin(&t, 5);
+        tc_i32(&t, 1, num);
+        tc_i32(&t, 2, encoding);
+        tc_i32(&t, 3, PQ_RLE);
+        tc_i32(&t, 4, PQ_RLE);
+    }
+    tc_end(&t);
+    *buf_add(&meta, 1) = 0;
+
+    *offset = out_pos;
+    out_write(meta.data, meta.len);
+    out_write(page.data, page.len);
+}
+
+/* A value as Parquet stores it, int8 goes out as INT32 */
+static void parquet_plain(buf_t *b, int type, const unsigned char *value)
+{
+    if ( type == COL_INT8 ) {
+        put32(buf_add(b, 4), *(int8_t *)value);
+    } else {
+        buf_put(b, value, type_size[type]);
+    }
+}
+
+/* Smallest and largest in the column chunk, so readers can skip it */
+static void parquet_stats(int c, chunk_meta_t *m)
+{
+    int64_t     imin = 0, imax = 0, v;
+    double      dmin = 0, dmax = 0, d;
+    float       f;
+    int         type = columns[c].type, found = 0, i;
+
+    m->stat_len = 0;
+    for ( i = 0; i < rows; i++ ) {
+        if ( type == COL_FLOAT || type == COL_DOUBLE ) {
+            d = type == COL_FLOAT ? ((float *)chunk[c])[i] : ((double *)chunk[c])[i];
+            if ( isnan(d) ) {
+                continue;
+            }
+            if ( found == 0 || d < dmin ) {
+                dmin = d;
+            }
+            if ( found == 0 || d > dmax ) {
+                dmax = d;
+            }
+        } else {
+            v = col_int(c, i);
+            if ( found == 0 || v < imin ) {
+                imin = v;
+            }
+            if ( found == 0 || v > imax ) {
+                imax = v;
+            }
+        }
+        found = 1;
+    }
+    if ( found == 0 ) {
+        return;
+    }
+    switch ( type ) {
+    case COL_TIMESTAMP:
+        put64(m->min, imin);
+        put64(m->max, imax);
+        m->stat_len = 8;
+        break;
+    case COL_INT8:
+    case COL_INT32:
+        put32(m->min, imin);
+        put32(m->max, imax);
+        m->stat_len = 4;
+        break;
+    case COL_FLOAT:
+        f = dmin;
+        memcpy(m->min, &f, 4);
+        f = dmax;
+        memcpy(m->max, &f, 4);
+        m->stat_len = 4;
+        break;
+    default:
+        memcpy(m->min, &dmin, 8);
+        memcpy(m->max, &dmax, 8);
+        m->stat_len = 8;
+        break;
+    }
+}
+
+static void parquet_end()
+{
+    static const int encodings[][3] = { { PQ_PLAIN, PQ_RLE }, { PQ_PLAIN, PQ_RLE, PQ_RLE_DICTIONARY }, { PQ_DELTA, PQ_RLE } };
+    static const int num_encodings[] = { 2, 3, 2 };
+    thrift_t         t = { &meta };
+    group_t         *group = (group_t *)groups.data;
+    chunk_meta_t    *m;
+    unsigned char    tail[8];
+    int64_t          size;
+    int              num = groups.len / sizeof(group_t), enc, g, i, j;
+
+    meta.len = 0;
+    tc_i32(&t, 1, 1);
+
+    /* The schema is a root with the columns under it */
+    tc_list(&t, 2, TC_STRUCT, num_columns + 1);
+    tc_begin(&t, 0);
+    tc_binary(&t, 4, "schema", 6);
+    tc_i32(&t, 5, num_columns);
+    tc_end(&t);
+    for ( i = 0; i < num_columns; i++ ) {
+        tc_begin(&t, 0);
+        tc_i32(&t, 1, parquet_type[columns[i].type]);
+        tc_i32(&t, 3, 0);                  /* REQUIRED */
+        tc_binary(&t, 4, columns[i].name, strlen(columns[i].name));
+        if ( columns[i].type == COL_TIMESTAMP ) {
+            tc_i32(&t, 6, PQ_TIMESTAMP_MILLIS);
+            /* TimestampType, adjusted to UTC and in milliseconds */
+            tc_begin(&t, 10);
+            tc_begin(&t, 8);
+            tc_field(&t, 1, TC_TRUE);
+            tc_begin(&t, 2);
+            tc_begin(&t, 1);
+            tc_end(&t);
+            tc_end(&t);
+            tc_end(&t);
+            tc_end(&t);
+        } else if ( columns[i].type == COL_INT8 ) {
+            tc_i32(&t, 6, PQ_INT_8);
+        }
+        tc_end(&t);
+    }
+    tc_i64(&t, 3, total_rows);
+
+    tc_list(&t, 4, TC_STRUCT, num);
+    for ( g = 0; g < num; g++ ) {
+        tc_begin(&t, 0);
+        tc_list(&t, 1, TC_STRUCT, num_columns);
+        for ( i = 0, size = 0; i < num_columns; i++ ) {
+            m = &group[g].columns[i];
+            enc = columns[i].encoding;
+            size += m->size;
+            tc_begin(&t, 0);
+            tc_i64(&t, 2, m->offset);
+            tc_begin(&t, 3);
+            tc_i32(&t, 1, parquet_type[columns[i].type]);
+            tc_list(&t, 2, TC_I32, num_encodings[enc]);
+            for ( j = 0; j < num_encodings[enc]; j++ ) {
+                buf_varint(&meta, zigzag(encodings[enc][j]));
+            }
+            tc_list(&t, 3, TC_BINARY, 1);
+            buf_varint(&meta, strlen(columns[i].name));
+            buf_put(&meta, columns[i].name, strlen(columns[i].name));
+            tc_i32(&t, 4, 0);              /* UNCOMPRESSED */
+            tc_i64(&t, 5, group[g].rows);
+            tc_i64(&t, 6, m->size);
+            tc_i64(&t, 7, m->size);
+            tc_i64(&t, 9, m->data_offset);
+            if ( enc == ENC_DICT ) {
+                tc_i64(&t, 11, m->offset);
+            }
+            if ( m->stat_len ) {
+                tc_begin(&t, 12);
+                tc_i64(&t, 3, 0);
+                tc_binary(&t, 5, m->max, m->stat_len);
+                tc_binary(&t, 6, m->min, m->stat_len);
+                tc_end(&t);
+            }
+            tc_end(&t);
+            tc_end(&t);
+        }
+        tc_i64(&t, 2, size);
+        tc_i64(&t, 3, group[g].rows);
+        tc_i64(&t, 5, group[g].columns[0].offset);
+        tc_i64(&t, 6, size);
+        tc_end(&t);
+    }
+    tc_binary(&t, 6, "currentcostd", 12);
+
+    /* Columns sort as their types do, so the statistics can be used */
+    tc_list(&t, 7, TC_STRUCT, num_columns);
+    for ( i = 0; i < num_columns; i++ ) {
+        tc_begin(&t, 0);
+        tc_begin(&t, 1);
+        tc_end(&t);
+        tc_end(&t);
+    }
+    *buf_add(&meta, 1) = 0;
+
+    out_write(meta.data, meta.len);
+    put32(tail, meta.len);
+    memcpy(tail + 4, "PAR1", 4);
+    out_write(tail, 8);
+}
+
+
+/* Number the distinct values of the column into dict_index, with the
+   values themselves in dict_keys. Returns how many there are */
+static int dict_build(int c)
+{
+    uint64_t    key, mask = ( 1ULL << dict_bits ) - 1, h;
+    int         size = type_size[columns[c].type], num = 0, i;
+    int32_t     slot;
+
+    memset(dict_slots, -1, sizeof(int32_t) << dict_bits);
+    for ( i = 0; i < rows; i++ ) {
+        key = 0;
+        memcpy(&key, chunk[c] + (size_t)i * size, size);
+        h = ( key * 0x9e3779b97f4a7c15ULL ) >> ( 64 - dict_bits );
+        while ( ( slot = dict_slots[h] ) != -1 && dict_keys[slot] != key ) {
+            h = ( h + 1 ) & mask;
+        }
+        if ( slot == -1 ) {
+            slot = dict_slots[h] = num;
+            dict_keys[num++] = key;
+        }
+        dict_index[i] = slot;
+    }
+    return num;
+}
+
+/* DELTA_BINARY_PACKED: the first value, then blocks of differences from
+   the one before, each less the smallest in the block and bit packed in
+   miniblocks as narrow as their largest */
+static void delta_encode(buf_t *b, int c)
+{
+    int64_t     deltas[DELTA_BLOCK], min = 0;
+    uint64_t    vals[DELTA_MINIBLOCK], max;
+    size_t      widths;
+    int         is32 = columns[c].type != COL_TIMESTAMP;
+    int         i, num, k, m;
+
+    buf_varint(b, DELTA_BLOCK);
+    buf_varint(b, DELTA_MINIBLOCKS);
+    buf_varint(b, rows);
+    buf_varint(b, zigzag(col_int(c, 0)));
+    for ( i = 1; i < rows; i += num ) {
+        num = rows - i < DELTA_BLOCK ? rows - i : DELTA_BLOCK;
+        for ( k = 0; k < num; k++ ) {
+            deltas[k] = col_int(c, i + k) - col_int(c, i + k - 1);
+            if ( is32 ) {
+                /* Readers work in the width of the column */
+                deltas[k] = (int32_t)(uint32_t)deltas[k];
+            }
+            if ( k == 0 || deltas[k] < min ) {
+                min = deltas[k];
+            }
+        }
+        buf_varint(b, zigzag(min));
+        widths = b->len;
+        buf_add(b, DELTA_MINIBLOCKS);
+        /* Miniblocks past the last value have a width of 0 and no data */
+        for ( m = 0; m * DELTA_MINIBLOCK < num; m++ ) {
+            max = 0;
+            for ( k = 0; k < DELTA_MINIBLOCK; k++ ) {
+                vals[k] = 0;
+                if ( m * DELTA_MINIBLOCK + k < num ) {
+                    vals[k] = (uint64_t)deltas[m * DELTA_MINIBLOCK + k] - (uint64_t)min;
+                }
+                if ( vals[k] > max ) {
+                    max = vals[k];
+                }
+            }
+            b->data[widths + m] = bit_width(max);
+            bitpack(b, vals, DELTA_MINIBLOCK, bit_width(max));
+        }
+    }
+}
+
+/* The RLE / bit packed hybrid: runs of 8 or more of the same value as a
+   count and the value, anything else bit packed in groups of 8 */
+static void rle_encode(buf_t *b, const uint32_t *vals, int num, int width)
+{
+    uint64_t    group[8];
+    int         i = 0, j, run, groups, g, k;
+
+    while ( i < num ) {
+        for ( run = 1; i + run < num && vals[i + run] == vals[i]; run++ ) {
+            ;
+        }
+        if ( run >= 8 ) {
+            buf_varint(b, (uint64_t)run << 1);
+            for ( k = 0; k < width; k += 8 ) {
+                *buf_add(b, 1) = vals[i] >> k;
+            }
+            i += run;
+            continue;
+        }
+        /* Pack groups until a run starts at the end of one */
+        for ( j = i + 8; j < num; j += 8 ) {
+            for ( run = 1; j + run < num && run < 8 && vals[j + run] == vals[j]; run++ ) {
+                ;
+            }
+            if ( run == 8 ) {
+                break;
+            }
+        }
+        if ( j > num ) {
+            j = num;
+        }
+        groups = ( j - i + 7 ) / 8;
+        buf_varint(b, (uint64_t)groups << 1 | 1);
+        for ( g = 0; g < groups; g++ ) {
+            for ( k = 0; k < 8; k++ ) {
+                group[k] = i + g * 8 + k < num ? vals[i + g * 8 + k] : 0;
+            }
+            bitpack(b, group, 8, width);
+        }
+        i = j;
+    }
+}
+
+/* Values width bits each, least significant bit first */
+static void bitpack(buf_t *b, const uint64_t *vals, int num, int width)
+{
+    unsigned char  *p;
+    size_t          bit = 0;
+    int             i, k, take;
+
+    p = buf_add(b, ( (size_t)num * width + 7 ) / 8);
+    for ( i = 0; i < num; i++ ) {
+        for ( k = 0; k < width; k += take, bit += take ) {
+            take = 8 - ( bit & 7 );
+            if ( take > width - k ) {
+                take = width - k;
+            }
+            p[bit >> 3] |= ( ( vals[i] >> k ) & ( ( 1U << take ) - 1 ) ) << ( bit & 7 );
+        }
+    }
+}
+
+static int64_t col_int(int c, int row)
+{
+    switch ( columns[c].type ) {
+    case COL_TIMESTAMP:
+        return ((int64_t *)chunk[c])[row];
+    case COL_INT8:
+        return ((int8_t *)chunk[c])[row];
+    default:
+        return ((int32_t *)chunk[c])[row];
+    }
+}
+
+static int bit_width(uint64_t max)
+{
+    int     width = 0;
+
+    while ( max ) {
+        width++;
+        max >>= 1;
+    }
+    return width;
+}
+
+
+/* Flatbuffers, built front to back. Offsets to children have to point
+   forward, so each table goes in before the things it refers to and
+   fb_ref() fills in the offset once they're written. */
+static int fb_align(buf_t *b, int align, int extra)
+{
+    while ( ( b->len + extra ) % align ) {
+        buf_add(b, 1);
+    }
+    return b->len;
+}
+
+/* A table with a field of each size (0 = absent), preceded by its
+   vtable. fields gets where each one went */
+static int fb_table(buf_t *b, int num, const int *sizes, int *fields)
+{
+    int     vtable, table, off = 4, i;
+
+    vtable = fb_align(b, 2, 0);
+    buf_add(b, 4 + num * 2);
+    table = fb_align(b, 8, 0);
+    for ( i = 0; i < num; i++ ) {
+        fields[i] = 0;
+        if ( sizes[i] ) {
+            off = ( off + sizes[i] - 1 ) & ~( sizes[i] - 1 );
+            put16(b->data + vtable + 4 + i * 2, off);
+            fields[i] = table + off;
+            off += sizes[i];
+        }
+    }
+    put16(b->data + vtable, 4 + num * 2);
+    put16(b->data + vtable + 2, off);
+    buf_add(b, off);
+    put32(b->data + table, table - vtable);
+    return table;
+}
+
+/* A vector of num elements of size bytes, returns where its length is,
+   the elements follow aligned to align */
+static int fb_vector(buf_t *b, int num, int size, int align)
+{
+    int     at = fb_align(b, align > 4 ? align : 4, 4);
+
+    buf_add(b, 4 + num * size);
+    put32(b->data + at, num);
+    return at;
+}
+
+static int fb_string(buf_t *b, char *str)
+{
+    int     len = strlen(str), at = fb_align(b, 4, 0);
+
+    buf_add(b, 4 + len + 1);
+    put32(b->data + at, len);
+    memcpy(b->data + at + 4, str, len);
+    return at;
+}
+
+static void fb_ref(buf_t *b, int at, int target)
+{
+    put32(b->data + at, target - at);
+}
+
+
+/* Thrift compact protocol, enough for the Parquet metadata */
+static void tc_field(thrift_t *t, int id, int type)
+{
+    int     delta = id - t->last[t->depth];
+
+    if ( delta > 0 && delta <= 15 ) {
+        *buf_add(t->buf, 1) = delta << 4 | type;
+    } else {
+        *buf_add(t->buf, 1) = type;
+        buf_varint(t->buf, zigzag(id));
+    }
+    t->last[t->depth] = id;
+}
+
+static void tc_i32(thrift_t *t, int id, int32_t val)
+{
+    tc_field(t, id, TC_I32);
+    buf_varint(t->buf, zigzag(val));
+}
+
+static void tc_i64(thrift_t *t, int id, int64_t val)
+{
+    tc_field(t, id, TC_I64);
+    buf_varint(t->buf, zigzag(val));
+}
+
+static void tc_binary(thrift_t *t, int id, const void *data, int len)
+{
+    tc_field(t, id, TC_BINARY);
+    buf_varint(t->buf, len);
+    buf_put(t->buf, data, len);
+}
+
+/* The elements follow, written without field headers */
+static void tc_list(thrift_t *t, int id, int type, int num)
+{
+    tc_field(t, id, TC_LIST);
+    if ( num < 15 ) {
+        *buf_add(t->buf, 1) = num << 4 | type;
+    } else {
+        *buf_add(t->buf, 1) = 0xf0 | type;
+        buf_varint(t->buf, num);
+    }
+}
+
+/* Start a struct field, or with id 0 a struct in a list */
+static void tc_begin(thrift_t *t, int id)
+{
+    if ( id ) {
+        tc_field(t, id, TC_STRUCT);
+    }
+    t->last[++t->depth] = 0;
+}
+
+static void tc_end(thrift_t *t)
+{
+    *buf_add(t->buf, 1) = 0;
+    t->depth--;
+}
+
+
+/* Room for len more bytes, zeroed */
+static unsigned char *buf_add(buf_t *b, size_t len)
+{
+    unsigned char  *p;
+    size_t          size;
+
+    if ( b->len + len > b->size ) {
+        for ( size = b->size ? b->size : 4096; size < b->len + len; size *= 2 ) {
+            ;
+        }
+        if ( ( p = realloc(b->data, size) ) == NULL ) {
+            fprintf(stderr, "Out of memory exporting\n");
+            exit(1);
+        }
+        b->data = p;
+        b->size = size;
+    }
+    p = b->data + b->len;
+    memset(p, 0, len);
+    b->len += len;
+    return p;
+}
+
+static void buf_put(buf_t *b, const void *data, size_t len)
+{
+    memcpy(buf_add(b, len), data, len);
+}
+
+static void buf_varint(buf_t *b, uint64_t val)
+{
+    while ( val >= 0x80 ) {
+        *buf_add(b, 1) = ( val & 0x7f ) | 0x80;
+        val >>= 7;
+    }
+    *buf_add(b, 1) = val;
+}
+
+static uint64_t zigzag(int64_t val)
+{
+    return ( (uint64_t)val << 1 ) ^ (uint64_t)( val >> 63 );
+}
+
+static void put16(unsigned char *p, uint16_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t val)
+{
+    put16(p, val);
+    put16(p + 2, val >> 16);
+}
+
+static void put64(unsigned char *p, uint64_t val)
+{
+    put32(p, val);
+    put32(p + 4, val >> 32);
+}
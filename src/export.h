@@ -0,0 +1,36 @@
+/*
+ *   Current Cost Daemon - columnar export of the store
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "libini.h"
+
+/* Register the [export] options */
+extern void         export_options(configctx_t *ctx);
+
+/* Whether export:file asks for an export */
+extern int          export_wanted();
+
+/* Export from the store, which must be set up. Returns the number of
+   rows written or -1 */
+extern long         export_run();
+
+#endif /* EXPORT_H */
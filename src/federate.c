@@ -0,0 +1,505 @@
+/*
+ *   Current Cost Daemon - forwarding readings to a collector
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Readings are numbered as they arrive and packed into a spool of
+ *   federate:spool records, which is sent on to the collector at
+ *   federate:host in batches of up to federate:batch. A batch goes as
+ *   soon as it's full, otherwise every federate:interval milliseconds.
+ *
+ *   Records stay in the spool until the collector acknowledges them as
+ *   stored. Each start of the daemon is a new stream with a random id;
+ *   on connecting we say which stream this is and the oldest record we
+ *   still hold, and the collector answers with where to carry on from,
+ *   so nothing is stored twice after a reconnect. When the spool fills
+ *   up whilst the collector is away the oldest records are dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "federate.h"
+#include "evloop.h"
+#include "net.h"
+#include "heap.h"
+
+
+#define FEDERATE_MAX_BACKOFF 60000
+#define FEDERATE_TIMEOUT     30000
+
+enum { FED_IDLE, FED_CONNECTING, FED_GREETING, FED_READY };
+
+
+static int          federate_open(sink_t *sink);
+static int          federate_write(sink_t *sink, reading_t *reading);
+static void         federate_timer(void *data);
+static void         federate_connect();
+static void         federate_close();
+static void         federate_fail(char *why);
+static void         federate_io(int fd, int revents, void *data);
+static void         federate_input();
+static void         federate_acked(uint64_t seq);
+static void         federate_pump(int partial);
+
+/* Configuration */
+static char        *c_federate_host      = NULL;
+static int          c_federate_port      = 7430;
+static char        *c_federate_site      = NULL;
+static int          c_federate_batch     = 256;
+static int          c_federate_interval  = 1000;
+static int          c_federate_spool     = 65536;
+static filter_policy_t c_federate_filter;
+
+/* The spool, record seq lives at slot seq % c_federate_spool. Records
+   from head have yet to be acknowledged, from sent have yet to be sent */
+static unsigned char *spool              = NULL;
+static uint64_t     spool_head           = 1;
+static uint64_t     spool_sent           = 1;
+static uint64_t     spool_tail           = 1;
+static uint64_t     stream               = 0;
+
+/* The connection to the collector */
+static int          fed_fd               = -1;
+static net_addr_t   fed_addr;
+static int          fed_state            = FED_IDLE;
+static long long    fed_heard            = 0;
+static long long    fed_retry_at         = 0;
+static int          fed_backoff          = 1000;
+static unsigned char *fed_out            = NULL;
+static int          fed_out_len          = 0;
+static int          fed_out_sent         = 0;
+static unsigned char fed_in[64];
+static int          fed_in_len           = 0;
+
+static unsigned long stat_acked          = 0;
+static unsigned long stat_retries        = 0;
+static unsigned long stat_dropped        = 0;
+
+
+void federate_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "federate:host","Collector to forward readings to",OPT_STR,&c_federate_host);
+    iniparse_add(ctx, 0, "federate:port","Port of the collector",OPT_INT,&c_federate_port);
+    iniparse_add(ctx, 0, "federate:site","Name to store our readings under (default hostname)",OPT_STR,&c_federate_site);
+    iniparse_add(ctx, 0, "federate:batch","Readings to send at once",OPT_INT,&c_federate_batch);
+    iniparse_add(ctx, 0, "federate:interval","Milliseconds before sending a part filled batch",OPT_INT,&c_federate_interval);
+    iniparse_add(ctx, 0, "federate:spool","Readings to hold whilst the collector is away",OPT_INT,&c_federate_spool);
+    filter_options(ctx, "federate", &c_federate_filter);
+}
+
+/** \brief Create the forwarding sink if a collector has been configured
+ *
+ *  \return The sink
+ *  \retval NULL - Not configured
+ */
+sink_t *federate_init()
+{
+    char      name[FEDERATE_SITE_MAX + 1];
+    sink_t   *sink;
+    int       fd;
+
+    if ( c_federate_host == NULL ) {
+        return NULL;
+    }
+    if ( c_federate_site == NULL ) {
+        if ( gethostname(name, sizeof(name)) != 0 ) {
+            strcpy(name, "currentcost");
+        }
+        name[sizeof(name) - 1] = 0;
+        c_federate_site = strdup(name);
+    }
+    if ( strlen(c_federate_site) > FEDERATE_SITE_MAX ) {
+        syslog(LOG_ERR,"Site name %s is too long to forward readings",c_federate_site);
+        return NULL;
+    }
+    if ( c_federate_batch < 1 ) {
+        c_federate_batch = 1;
+    }
+    if ( c_federate_batch > FEDERATE_BATCH_MAX ) {
+        c_federate_batch = FEDERATE_BATCH_MAX;
+    }
+    if ( c_federate_spool < c_federate_batch * 2 ) {
+        c_federate_spool = c_federate_batch * 2;
+    }
+    if ( c_federate_interval < 10 ) {
+        c_federate_interval = 10;
+    }
+
+    if ( ( fd = open("/dev/urandom", O_RDONLY) ) != -1 ) {
+        if ( read(fd, &stream, sizeof(stream)) != sizeof(stream) ) {
+            stream = 0;
+        }
+        close(fd);
+    }
+    if ( stream == 0 ) {
+        stream = ( (uint64_t)time(NULL) << 32 ) ^ getpid() ^ ev_now();
+    }
+
+    sink = sink_create("federate", &c_federate_filter, federate_write, NULL);
+    sink->open = federate_open;
+    return sink;
+}
+
+void federate_stats(unsigned long *spooled, unsigned long *acked, unsigned long *retries, unsigned long *dropped)
+{
+    *spooled = spool_tail - spool_head;
+    *acked = stat_acked;
+    *retries = stat_retries;
+    *dropped = stat_dropped;
+}
+
+void federate_put16(unsigned char *buf, uint16_t val)
+{
+    buf[0] = val;
+    buf[1] = val >> 8;
+}
+
+void federate_put32(unsigned char *buf, uint32_t val)
+{
+    federate_put16(buf, val);
+    federate_put16(buf + 2, val >> 16);
+}
+
+void federate_put64(unsigned char *buf, uint64_t val)
+{
+    federate_put32(buf, val);
+    federate_put32(buf + 4, val >> 32);
+}
+
+uint16_t federate_get16(unsigned char *buf)
+{
+    return buf[0] | ( buf[1] << 8 );
+}
+
+uint32_t federate_get32(unsigned char *buf)
+{
+    return federate_get16(buf) | ( (uint32_t)federate_get16(buf + 2) << 16 );
+}
+
+uint64_t federate_get64(unsigned char *buf)
+{
+    return federate_get32(buf) | ( (uint64_t)federate_get32(buf + 4) << 32 );
+}
+
+unsigned char *federate_frame(unsigned char *buf, int type, int len)
+{
+    federate_put32(buf, len + 1);
+    buf[4] = type;
+    return buf + FEDERATE_HEADER;
+}
+
+void federate_encode(unsigned char *buf, int sensor, store_raw_t *raw)
+{
+    uint32_t  joules;
+
+    memcpy(&joules, &raw->joules, sizeof(joules));
+    federate_put32(buf, raw->ts);
+    federate_put16(buf + 4, raw->ms);
+    federate_put16(buf + 6, raw->temp);
+    federate_put32(buf + 8, raw->watts);
+    federate_put32(buf + 12, joules);
+    buf[16] = sensor;
+}
+
+int federate_decode(unsigned char *buf, store_raw_t *raw)
+{
+    uint32_t  joules = federate_get32(buf + 12);
+
+    raw->ts = federate_get32(buf);
+    raw->ms = federate_get16(buf + 4);
+    raw->temp = (int16_t)federate_get16(buf + 6);
+    raw->watts = (int32_t)federate_get32(buf + 8);
+    memcpy(&raw->joules, &joules, sizeof(joules));
+    return buf[16];
+}
+
+
+static int federate_open(sink_t *sink)
+{
+    spool = malloc((size_t)c_federate_spool * FEDERATE_RECORD);
+    fed_out = malloc(FEDERATE_HEADER + 10 + c_federate_batch * FEDERATE_RECORD);
+    if ( spool == NULL || fed_out == NULL ) {
+        syslog(LOG_ERR,"Unable to allocate %d readings of spool",c_federate_spool);
+        free(spool);
+        free(fed_out);
+        spool = NULL;
+        fed_out = NULL;
+        return -1;
+    }
+    if ( heap_static() && net_resolve(c_federate_host, c_federate_port, &fed_addr) != 0 ) {
+        syslog(LOG_ERR,"Unable to resolve collector %s, it won't be tried again",c_federate_host);
+    }
+    ev_every(c_federate_interval, federate_timer, NULL);
+    return 0;
+}
+
+static int federate_write(sink_t *sink, reading_t *reading)
+{
+    store_raw_t   raw;
+
+    /* federate_open() failed, the sink is still called */
+    if ( spool == NULL ) {
+        return -1;
+    }
+    if ( reading->ts <= 0 || reading->sensor < 0 || reading->sensor > 255 ) {
+        return -1;
+    }
+    raw.ts = (uint32_t)reading->ts;
+    raw.ms = (uint16_t)( ( reading->ts - raw.ts ) * 1000 );
+    raw.temp = (int16_t)lrint(reading->temp * 10);
+    raw.watts = reading->watts;
+    raw.joules = reading->joules;
+    federate_encode(spool + ( spool_tail % c_federate_spool ) * FEDERATE_RECORD, reading->sensor, &raw);
+    spool_tail++;
+
+    if ( spool_tail - spool_head > c_federate_spool ) {
+        /* Out of room, anything already on the wire was copied out */
+        if ( stat_dropped++ == 0 ) {
+            syslog(LOG_WARNING,"Federation spool full, dropping the oldest readings");
+        }
+        spool_head++;
+        if ( spool_sent < spool_head ) {
+            spool_sent = spool_head;
+        }
+    }
+    if ( fed_state == FED_READY && spool_tail - spool_sent >= c_federate_batch ) {
+        federate_pump(0);
+    }
+    return 0;
+}
+
+static void federate_timer(void *data)
+{
+    long long   now = ev_now();
+
+    if ( fed_state == FED_IDLE ) {
+        if ( spool_tail != spool_head && now >= fed_retry_at ) {
+            federate_connect();
+        }
+        return;
+    }
+    if ( ( fed_state != FED_READY || spool_sent != spool_head ) && now - fed_heard > FEDERATE_TIMEOUT ) {
+        federate_fail("timed out");
+        return;
+    }
+    if ( fed_state == FED_READY ) {
+        federate_pump(1);
+    }
+}
+
+static void federate_connect()
+{
+    char     *why;
+    int       fd;
+
+    if ( ( fd = net_connect(c_federate_host, c_federate_port, &fed_addr, 1, &why) ) == -1 ) {
+        federate_fail(why);
+        return;
+    }
+    fed_fd = fd;
+    fed_state = FED_CONNECTING;
+    fed_heard = ev_now();
+    fed_out_len = fed_out_sent = fed_in_len = 0;
+    ev_add(fed_fd, POLLOUT, federate_io, NULL);
+}
+
+static void federate_close()
+{
+    if ( fed_fd != -1 ) {
+        ev_del(fed_fd);
+        close(fed_fd);
+    }
+    fed_fd = -1;
+    fed_state = FED_IDLE;
+    /* Whatever wasn't acknowledged goes again */
+    spool_sent = spool_head;
+}
+
+static void federate_fail(char *why)
+{
+    syslog(LOG_WARNING,"Forwarding to %s failed (%s), retrying in %ds",c_federate_host,why,fed_backoff / 1000);
+    federate_close();
+    stat_retries++;
+    fed_retry_at = ev_now() + fed_backoff;
+    fed_backoff *= 2;
+    if ( fed_backoff > FEDERATE_MAX_BACKOFF ) {
+        fed_backoff = FEDERATE_MAX_BACKOFF;
+    }
+}
+
+static void federate_io(int fd, int revents, void *data)
+{
+    unsigned char  *payload;
+    int             err = 0;
+    socklen_t       len = sizeof(err);
+    int             site_len = strlen(c_federate_site);
+    int             ret;
+
+    if ( fed_state == FED_CONNECTING ) {
+        if ( getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0 ) {
+            federate_fail(strerror(err));
+            return;
+        }
+        payload = federate_frame(fed_out, FEDERATE_HELLO, 17 + site_len);
+        payload[0] = FEDERATE_VERSION;
+        federate_put64(payload + 1, stream);
+        federate_put64(payload + 9, spool_head);
+        memcpy(payload + 17, c_federate_site, site_len);
+        fed_out_len = FEDERATE_HEADER + 17 + site_len;
+        fed_out_sent = 0;
+        fed_state = FED_GREETING;
+        federate_pump(0);
+        return;
+    }
+    if ( revents & ( POLLIN | POLLHUP | POLLERR ) ) {
+        ret = read(fd, fed_in + fed_in_len, sizeof(fed_in) - fed_in_len);
+        if ( ret == 0 || ( ret < 0 && errno != EAGAIN && errno != EINTR ) ) {
+            federate_fail(ret == 0 ? "connection closed" : strerror(errno));
+            return;
+        }
+        if ( ret > 0 ) {
+            fed_in_len += ret;
+            federate_input();
+            if ( fed_fd == -1 ) {
+                return;
+            }
+        }
+    }
+    if ( revents & POLLOUT ) {
+        federate_pump(0);
+    }
+}
+
+/* Act on the frames from the collector, they're all a seq number */
+static void federate_input()
+{
+    unsigned char  *frame = fed_in;
+    uint32_t        len;
+    uint64_t        seq;
+
+    while ( fed_in + fed_in_len - frame >= 4 ) {
+        len = federate_get32(frame);
+        if ( len != 9 ) {
+            federate_fail("bad frame");
+            return;
+        }
+        if ( fed_in + fed_in_len - frame < 4 + len ) {
+            break;
+        }
+        seq = federate_get64(frame + FEDERATE_HEADER);
+        switch ( frame[4] ) {
+        case FEDERATE_WELCOME:
+            if ( fed_state != FED_GREETING ) {
+                federate_fail("unexpected welcome");
+                return;
+            }
+            federate_acked(seq);
+            spool_sent = spool_head;
+            fed_state = FED_READY;
+            fed_backoff = 1000;
+            syslog(LOG_INFO,"Forwarding readings from %llu to %s",(unsigned long long)spool_head,c_federate_host);
+            break;
+        case FEDERATE_ACK:
+            federate_acked(seq);
+            break;
+        default:
+            federate_fail("bad frame");
+            return;
+        }
+        fed_heard = ev_now();
+        frame += 4 + len;
+    }
+    fed_in_len -= frame - fed_in;
+    memmove(fed_in, frame, fed_in_len);
+    if ( fed_state == FED_READY ) {
+        federate_pump(0);
+    }
+}
+
+/* The collector has stored everything before seq */
+static void federate_acked(uint64_t seq)
+{
+    if ( seq > spool_tail ) {
+        seq = spool_tail;
+    }
+    if ( seq > spool_head ) {
+        stat_acked += seq - spool_head;
+        spool_head = seq;
+    }
+    if ( spool_sent < spool_head ) {
+        spool_sent = spool_head;
+    }
+}
+
+/* Write what's pending, filling the buffer with the next batch once
+   it's empty. Part filled batches wait for the timer */
+static void federate_pump(int partial)
+{
+    unsigned char  *payload;
+    unsigned int    slot;
+    int             count, first;
+    int             ret;
+
+    if ( fed_out_sent == fed_out_len && fed_state == FED_READY && spool_sent < spool_tail &&
+         ( partial || spool_tail - spool_sent >= c_federate_batch ) ) {
+        count = spool_tail - spool_sent;
+        if ( count > c_federate_batch ) {
+            count = c_federate_batch;
+        }
+        payload = federate_frame(fed_out, FEDERATE_BATCH, 10 + count * FEDERATE_RECORD);
+        federate_put64(payload, spool_sent);
+        federate_put16(payload + 8, count);
+
+        /* In one or two pieces depending on where the spool wraps */
+        slot = spool_sent % c_federate_spool;
+        first = c_federate_spool - slot < count ? c_federate_spool - slot : count;
+        memcpy(payload + 10, spool + slot * FEDERATE_RECORD, first * FEDERATE_RECORD);
+        memcpy(payload + 10 + first * FEDERATE_RECORD, spool, ( count - first ) * FEDERATE_RECORD);
+        fed_out_len = FEDERATE_HEADER + 10 + count * FEDERATE_RECORD;
+        fed_out_sent = 0;
+        if ( spool_sent == spool_head ) {
+            fed_heard = ev_now();      /* Time the ack from now */
+        }
+        spool_sent += count;
+    }
+    if ( fed_out_sent < fed_out_len ) {
+        ret = write(fed_fd, fed_out + fed_out_sent, fed_out_len - fed_out_sent);
+        if ( ret < 0 ) {
+            if ( errno != EAGAIN && errno != EINTR ) {
+                federate_fail(strerror(errno));
+                return;
+            }
+        } else {
+            fed_out_sent += ret;
+        }
+    }
+    if ( fed_out_sent < fed_out_len || ( fed_state == FED_READY && spool_tail - spool_sent >= c_federate_batch ) ) {
+        ev_mod(fed_fd, POLLIN|POLLOUT);
+    } else {
+        ev_mod(fed_fd, POLLIN);
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ *   Current Cost Daemon - forwarding readings to a collector
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef FEDERATE_H
+#define FEDERATE_H
+
+#include <stdint.h>
+#include "libini.h"
+#include "sink.h"
+#include "store.h"
+
+
+/* The wire format shared with collector.c. Every frame is a little
+   endian u32 length of what follows, a type byte and the payload */
+#define FEDERATE_VERSION    1
+#define FEDERATE_HEADER     5
+#define FEDERATE_RECORD     17         /* ts u32, ms u16, temp i16, watts i32, joules f32, sensor u8 */
+#define FEDERATE_BATCH_MAX  1024
+#define FEDERATE_SITE_MAX   63
+#define FEDERATE_FRAME_MAX  ( FEDERATE_HEADER + 10 + FEDERATE_BATCH_MAX * FEDERATE_RECORD )
+
+enum {
+    FEDERATE_HELLO = 1,                /* version u8, stream u64, oldest seq held u64, site */
+    FEDERATE_WELCOME,                  /* seq u64 to carry on from */
+    FEDERATE_BATCH,                    /* seq u64 of the first record, count u16, records */
+    FEDERATE_ACK                       /* seq u64, everything before it is stored */
+};
+
+
+/* Register the [federate] options */
+extern void         federate_options(configctx_t *ctx);
+
+/* Return the sink, NULL if no collector is configured */
+extern sink_t      *federate_init();
+
+extern void         federate_stats(unsigned long *spooled, unsigned long *acked, unsigned long *retries, unsigned long *dropped);
+
+/* Little endian packing for the frames */
+extern void         federate_put16(unsigned char *buf, uint16_t val);
+extern void         federate_put32(unsigned char *buf, uint32_t val);
+extern void         federate_put64(unsigned char *buf, uint64_t val);
+extern uint16_t     federate_get16(unsigned char *buf);
+extern uint32_t     federate_get32(unsigned char *buf);
+extern uint64_t     federate_get64(unsigned char *buf);
+
+/* Start a frame of len payload bytes, returns where the payload goes */
+extern unsigned char *federate_frame(unsigned char *buf, int type, int len);
+
+/* Pack and unpack a record of a batch, decode returns the sensor */
+extern void         federate_encode(unsigned char *buf, int sensor, store_raw_t *raw);
+extern int          federate_decode(unsigned char *buf, store_raw_t *raw);
+
+#endif /* FEDERATE_H */
@@ -0,0 +1,131 @@
+/*
+ *   Current Cost Daemon - shared memory live feed
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   See feed.h for the layout. The daemon never waits on readers, a
+ *   reader which falls a whole ring behind loses readings.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "feed.h"
+
+
+/* Configuration */
+static char        *c_feed_shm           = NULL;
+static int          c_feed_capacity      = 4096;
+
+static feed_header_t *header             = NULL;
+static feed_entry_t  *entries            = NULL;
+static uint32_t       feed_mask          = 0;
+
+typedef char feed_entry_check[sizeof(feed_entry_t) == 64 ? 1 : -1];
+typedef char feed_header_check[sizeof(feed_header_t) == 64 ? 1 : -1];
+
+
+void feed_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "feed:shm","Shared memory object to publish every reading in (eg /currentcost-feed)",OPT_STR,&c_feed_shm);
+    iniparse_add(ctx, 0, "feed:capacity","Readings held in the feed",OPT_INT,&c_feed_capacity);
+}
+
+void feed_init()
+{
+    uint32_t   capacity;
+    size_t     size;
+    void      *map;
+    int        fd;
+
+    if ( c_feed_shm == NULL ) {
+        return;
+    }
+    for ( capacity = 16; capacity < c_feed_capacity && capacity < ( 1 << 24 ); capacity <<= 1 )
+        ;
+    size = sizeof(feed_header_t) + capacity * sizeof(feed_entry_t);
+
+    /* Start afresh so readers of an old feed see the magic go */
+    shm_unlink(c_feed_shm);
+    if ( ( fd = shm_open(c_feed_shm, O_RDWR|O_CREAT|O_EXCL, 0644) ) == -1 ) {
+        syslog(LOG_ERR,"Unable to create feed %s",c_feed_shm);
+        return;
+    }
+    if ( ftruncate(fd, size) != 0 ||
+         ( map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) ) == MAP_FAILED ) {
+        syslog(LOG_ERR,"Unable to map feed %s",c_feed_shm);
+        close(fd);
+        shm_unlink(c_feed_shm);
+        return;
+    }
+    close(fd);
+
+    header = map;
+    entries = (feed_entry_t *)( header + 1 );
+    feed_mask = capacity - 1;
+    header->version = FEED_VERSION;
+    header->capacity = capacity;
+    header->entry_size = sizeof(feed_entry_t);
+    header->pid = getpid();
+    __atomic_store_n(&header->magic, FEED_MAGIC, __ATOMIC_RELEASE);
+    syslog(LOG_INFO,"Publishing readings to %s",c_feed_shm);
+}
+
+void feed_close()
+{
+    if ( header != NULL ) {
+        header->pid = 0;
+        /* Let anyone asleep notice, their mappings outlive the name */
+        __atomic_add_fetch(&header->wake, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &header->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        shm_unlink(c_feed_shm);
+    }
+}
+
+void feed_publish(reading_t *reading)
+{
+    feed_entry_t   *entry;
+    uint64_t        seq;
+
+    if ( header == NULL ) {
+        return;
+    }
+    seq = header->head + 1;
+    entry = &entries[seq & feed_mask];
+
+    __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->rx = reading->rx;
+    entry->ts = reading->ts;
+    entry->kwh = reading->kwh;
+    entry->sensor = reading->sensor;
+    entry->watts = reading->watts;
+    entry->temp = reading->temp;
+    entry->joules = reading->joules;
+    __atomic_store_n(&entry->seq, seq, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&header->head, seq, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&header->wake, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &header->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
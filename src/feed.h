@@ -0,0 +1,87 @@
+/*
+ *   Current Cost Daemon - shared memory live feed
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Layout of the POSIX shared memory object named by feed:shm:
+ *
+ *     feed_header_t                   64 bytes
+ *     feed_entry_t[capacity]          64 bytes each
+ *
+ *   Readings are numbered from 1 and reading n lives in entry
+ *   n & ( capacity - 1 ). To publish reading n the daemon sets the
+ *   entry's seq to 0, fills it in, sets seq to n, then sets head to n,
+ *   increments wake and FUTEX_WAKEs everyone waiting on it. At a reading
+ *   every few seconds the wake costs nothing, and it means readers can
+ *   map the feed read only.
+ *
+ *   A reader wanting reading n reads the entry, and the copy is good if
+ *   seq was n both before and after. Anything else means the daemon has
+ *   lapped the reader. To sleep, note wake, check head once more and
+ *   FUTEX_WAIT on wake for the noted value. ccfeed.h wraps all of this
+ *   up.
+ */
+
+#ifndef FEED_H
+#define FEED_H
+
+#include <stdint.h>
+
+#define FEED_MAGIC          0x44464343     /* "CCFD" */
+#define FEED_VERSION        1
+
+typedef struct {
+    uint64_t        seq;           /* Reading number, 0 whilst being written */
+    uint64_t        rx;            /* CLOCK_MONOTONIC ns when the line started arriving */
+    double          ts;            /* Corrected time of the reading */
+    double          kwh;
+    int32_t         sensor;
+    int32_t         watts;
+    float           temp;
+    float           joules;
+    char            pad[16];
+} feed_entry_t;
+
+typedef struct {
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        capacity;      /* Entries, a power of two */
+    uint32_t        entry_size;
+    int64_t         pid;           /* Daemon writing it, 0 once it's stopped */
+    uint64_t        head;          /* Last reading published */
+    uint32_t        wake;          /* Futex word, moves on every reading */
+    char            pad[28];
+} feed_header_t;
+
+
+#ifndef FEED_READER_ONLY
+#include "currentcost.h"
+#include "libini.h"
+
+/* Register the [feed] options */
+extern void         feed_options(configctx_t *ctx);
+
+/* Create the feed if feed:shm is set */
+extern void         feed_init();
+
+/* Mark the feed as no longer being updated */
+extern void         feed_close();
+
+/* Publish a reading, only ever called from the main thread */
+extern void         feed_publish(reading_t *reading);
+#endif
+
+#endif /* FEED_H */
@@ -0,0 +1,139 @@
+/*
+ *   Current Cost Daemon - per sink reading filters
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   A quiet house produces long runs of identical readings. Each sink
+ *   gets its own filter which holds back readings that don't tell it
+ *   anything new. The energy of held back readings is carried forward
+ *   into the next one emitted so totals downstream stay exact, along
+ *   with whether any of it spanned a gap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "filter.h"
+
+
+void filter_options(configctx_t *ctx, char *section, filter_policy_t *policy)
+{
+    char    key[128];
+
+    snprintf(key,sizeof(key),"%s:deadband-watts",section);
+    iniparse_add(ctx, 0, key, "Only pass on readings that change by more than this many watts", OPT_INT, &policy->deadband_watts);
+    snprintf(key,sizeof(key),"%s:deadband-percent",section);
+    iniparse_add(ctx, 0, key, "Only pass on readings that change by more than this (eg 5%)", OPT_FLOAT, &policy->deadband_percent);
+    snprintf(key,sizeof(key),"%s:heartbeat",section);
+    iniparse_add(ctx, 0, key, "Pass on a reading at least this often (seconds), or only this often without a deadband", OPT_INT, &policy->heartbeat);
+    snprintf(key,sizeof(key),"%s:average",section);
+    iniparse_add(ctx, 0, key, "Average readings over windows of this many seconds", OPT_INT, &policy->average);
+}
+
+void filter_init(filter_t *filter, filter_policy_t *policy)
+{
+    memset(filter, 0, sizeof(*filter));
+    if ( policy ) {
+        filter->policy = *policy;
+    }
+    filter->passthrough = filter->policy.deadband_watts == 0 && filter->policy.deadband_percent == 0 &&
+                          filter->policy.heartbeat == 0 && filter->policy.average == 0;
+}
+
+/** \brief Decide whether a reading should be passed on to a sink
+ *
+ *  \param filter - The sink's filter
+ *  \param reading - Reading from parse_line()
+ *  \param scratch - Space for a modified reading
+ *
+ *  \return The reading to pass on (delta/joules cover everything held back)
+ *  \retval NULL - Reading held back
+ *
+ *  \note Without a policy the reading is passed on as is, without a copy
+ */
+reading_t *filter_apply(filter_t *filter, reading_t *reading, reading_t *scratch)
+{
+    filter_policy_t  *policy = &filter->policy;
+    filter_state_t   *state;
+    reading_t        *out = scratch;
+    int               change;
+    int               emit = 0;
+
+    if ( filter->passthrough || reading->sensor < 0 || reading->sensor >= MAX_SENSORS ) {
+        return reading;
+    }
+    *out = *reading;
+    state = &filter->sensors[reading->sensor];
+    state->delta += reading->delta;
+    state->joules += reading->joules;
+    state->gap |= reading->gap;
+
+    if ( policy->average > 0 ) {
+        if ( state->window_count == 0 && state->window_start == 0 ) {
+            state->window_start = reading->ts;
+        }
+        state->window_time += reading->delta;
+        state->window_energy += reading->joules;
+        state->window_temp += reading->temp;
+        state->window_count++;
+        if ( reading->ts - state->window_start < policy->average ) {
+            return NULL;
+        }
+        if ( state->window_time > 0 ) {
+            out->watts = (int)floor(state->window_energy / state->window_time + 0.5);
+        }
+        out->temp = state->window_temp / state->window_count;
+        state->window_start = reading->ts;
+        state->window_time = 0;
+        state->window_energy = 0;
+        state->window_temp = 0;
+        state->window_count = 0;
+    }
+
+    if ( state->valid == 0 ) {
+        emit = 1;
+    } else if ( policy->deadband_watts == 0 && policy->deadband_percent == 0 ) {
+        /* Averaging alone passes every window on */
+        emit = policy->heartbeat == 0;
+    } else {
+        change = abs(out->watts - state->last_watts);
+        if ( policy->deadband_watts > 0 && change > policy->deadband_watts ) {
+            emit = 1;
+        }
+        if ( policy->deadband_percent > 0 && change > policy->deadband_percent * state->last_watts ) {
+            emit = 1;
+        }
+    }
+    if ( policy->heartbeat > 0 && reading->ts - state->last_emit >= policy->heartbeat ) {
+        emit = 1;
+    }
+
+    if ( emit == 0 ) {
+        return NULL;
+    }
+    out->delta = state->delta;
+    out->joules = state->joules;
+    out->gap = state->gap;
+    state->valid = 1;
+    state->last_watts = out->watts;
+    state->last_emit = reading->ts;
+    state->delta = 0;
+    state->joules = 0;
+    state->gap = 0;
+    return out;
+}
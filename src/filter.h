@@ -0,0 +1,66 @@
+/*
+ *   Current Cost Daemon - per sink reading filters
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "currentcost.h"
+#include "libini.h"
+
+
+/* What a sink wants to see - all zero passes every reading through */
+typedef struct {
+    int             deadband_watts;    /* Emit when watts move by more than this */
+    double          deadband_percent;  /* ...or by more than this fraction */
+    int             heartbeat;         /* Emit at least this often (seconds), or
+                                          only this often without a deadband */
+    int             average;           /* Average over windows of this many seconds */
+} filter_policy_t;
+
+typedef struct {
+    int             valid;
+    int             last_watts;        /* Watts we last emitted */
+    double          last_emit;         /* Timestamp we last emitted at */
+    double          delta;             /* Time held back since last emit */
+    double          joules;            /* Energy held back since last emit */
+    int             gap;               /* A reading held back spanned a gap */
+    double          window_start;
+    double          window_time;       /* Time covered by the averaging window */
+    double          window_energy;
+    double          window_temp;
+    int             window_count;
+} filter_state_t;
+
+typedef struct {
+    filter_policy_t policy;
+    int             passthrough;       /* Nothing configured */
+    filter_state_t  sensors[MAX_SENSORS];
+} filter_t;
+
+
+/* Register <section>:deadband-watts etc. against the policy */
+extern void         filter_options(configctx_t *ctx, char *section, filter_policy_t *policy);
+
+extern void         filter_init(filter_t *filter, filter_policy_t *policy);
+
+/* Returns the reading to pass on (reading itself or scratch) or NULL */
+extern reading_t   *filter_apply(filter_t *filter, reading_t *reading, reading_t *scratch);
+
+#endif /* FILTER_H */
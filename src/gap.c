@@ -0,0 +1,492 @@
+/*
+ *   Current Cost Daemon - gaps in the readings
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   A sensor that's heard nothing from for more than gap:threshold
+ *   seconds - the receiver unplugged, the serial port not opening, the
+ *   daemon stopped - has a gap in its readings. The reading which ends
+ *   the gap carries the energy across it, interpolated from the readings
+ *   either side. It's marked so the tariff costs that energy over the
+ *   gap rather than all at once, and the gap is appended to the sensor's
+ *   index under gap:dir. Gaps go in in time order and never overlap, so
+ *   those in a range are found with a binary search of the file.
+ *
+ *   The meter sends two hourly kWh totals in its history messages. For
+ *   the last GAP_HOURS we keep the energy per minute, what the readings
+ *   measured apart from what was estimated for gaps. A history total
+ *   less what was measured over the same two hours is what was used in
+ *   the gaps, and the difference from the estimate goes on the kWh
+ *   counter, the ledger and the gaps in the index. The estimates per
+ *   minute are scaled to match, so the same total coming round again
+ *   changes nothing. Gaps the history doesn't reach stay estimated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "gap.h"
+#include "energy.h"
+#include "tariff.h"
+
+
+/* How far back the meter's history goes */
+#define GAP_HOURS           26
+#define GAP_MINUTES         ( GAP_HOURS * 60 )
+
+/* Gaps remembered for filling in, more than this in GAP_HOURS and the
+   oldest have to stay estimated */
+#define GAP_RECENT          64
+
+/* Index records read at a time when scanning */
+#define GAP_CHUNK           256
+
+/* A history total this much under what was measured isn't for the two
+   hours we think it is */
+#define GAP_MISMATCH_KWH    0.1
+
+typedef struct {
+    gap_t           gap;
+    double          start;         /* Exact stamps */
+    double          end;
+    long            index;         /* Record in the index, -1 if not there */
+} recent_t;
+
+typedef struct {
+    int             fd;
+    long            count;         /* Records in the index */
+    uint32_t        last_end;
+    double          valid_from;    /* Minutes are complete from here, 0 = no readings yet */
+    long            head;          /* Newest minute */
+    int             num_recent;
+    int             next_recent;
+    recent_t        recent[GAP_RECENT];
+    float           measured[GAP_MINUTES];
+    float           estimate[GAP_MINUTES];
+    unsigned char   seconds[GAP_MINUTES];  /* Of the minute in a gap */
+    unsigned char   filled[GAP_MINUTES];   /* Set once history covers the minute */
+} track_t;
+
+typedef struct {
+    time_t          from;
+    time_t          to;
+    double          joules;
+} estimated_t;
+
+
+static void         gap_open(int sensor, double from, double to, double joules);
+static void         history_fill(int sensor, double start, double kwh);
+static void         minutes_advance(track_t *track, double ts);
+static void         minutes_add(track_t *track, double from, double to, double joules, int gap);
+static int          index_write(int sensor, long index, gap_t *gap);
+static int          estimated_add(gap_t *gap, void *arg);
+static char        *gap_filename(int sensor, char *buf, size_t buflen);
+
+/* Configuration */
+static int          c_gap_threshold      = 60;
+static char        *c_gap_dir            = NULL;
+
+static track_t      tracks[MAX_SENSORS];
+
+static unsigned long stat_gaps           = 0;
+static unsigned long stat_seconds        = 0;
+static unsigned long stat_filled         = 0;
+
+
+void gap_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "gap:threshold","Seconds without a reading from a sensor which make a gap (0 = off)",OPT_INT,&c_gap_threshold);
+    iniparse_add(ctx, 0, "gap:dir","Directory to keep the index of gaps in",OPT_STR,&c_gap_dir);
+}
+
+/** \brief Pick up the indexes where they left off, they're created when
+ *         the first gap is found
+ */
+void gap_init()
+{
+    char        filename[FILENAME_MAX];
+    gap_t       last;
+    struct stat st;
+    int         i;
+
+    memset(tracks, 0, sizeof(tracks));
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        tracks[i].fd = -1;
+        if ( c_gap_dir == NULL ||
+             ( tracks[i].fd = open(gap_filename(i, filename, sizeof(filename)), O_RDWR) ) == -1 ) {
+            continue;
+        }
+        if ( fstat(tracks[i].fd, &st) == 0 ) {
+            tracks[i].count = st.st_size / sizeof(gap_t);
+        }
+        if ( tracks[i].count &&
+             pread(tracks[i].fd, &last, sizeof(last), ( tracks[i].count - 1 ) * sizeof(last)) == sizeof(last) ) {
+            tracks[i].last_end = last.end;
+        }
+    }
+}
+
+void gap_sample(reading_t *reading)
+{
+    track_t    *track;
+    double      from;
+
+    if ( reading->sensor < 0 || reading->sensor >= MAX_SENSORS ) {
+        return;
+    }
+    track = &tracks[reading->sensor];
+    from = reading->ts - reading->delta;
+
+    if ( track->valid_from == 0 ) {
+        track->valid_from = from;
+        track->head = (long)floor(from / 60);
+    }
+    if ( reading->delta <= 0 ) {
+        return;
+    }
+    minutes_advance(track, reading->ts);
+    if ( c_gap_threshold > 0 && reading->delta > c_gap_threshold ) {
+        reading->gap = 1;
+        gap_open(reading->sensor, from, reading->ts, reading->joules);
+    }
+    minutes_add(track, from, reading->ts, reading->joules, reading->gap);
+}
+
+/** \brief Fill in gaps from the totals in a history message
+ *
+ *  \param hist - Totals, with the receiver they came from
+ */
+void gap_history(history_t *hist)
+{
+    double      even;
+    int         i;
+
+    /* The totals count back from the meter's last even hour */
+    even = energy_host_time(hist->device, hist->hour, hist->min, hist->sec, hist->now);
+    even -= ( ( hist->hour % 2 ) * 3600 ) + ( hist->min * 60 ) + hist->sec;
+
+    for ( i = 0; i < hist->num; i++ ) {
+        if ( hist->totals[i].sensor >= 0 && hist->totals[i].sensor < MAX_SENSORS &&
+             hist->totals[i].ago >= 2 && hist->totals[i].ago % 2 == 0 ) {
+            history_fill(hist->totals[i].sensor, even - ( hist->totals[i].ago * 3600.0 ), hist->totals[i].kwh);
+        }
+    }
+}
+
+/** \brief Pass the gaps in a range to fn
+ *
+ *  \return Number of gaps passed on
+ *  \retval -1 - No index
+ */
+int gap_scan(int sensor, time_t from, time_t to, gap_scan_fn fn, void *arg)
+{
+    char        filename[FILENAME_MAX];
+    gap_t       buf[GAP_CHUNK];
+    struct stat st;
+    long        lo, hi, mid, count, i;
+    ssize_t     len;
+    int         fd, n, j, found = 0, stop = 0;
+
+    if ( c_gap_dir == NULL || sensor < 0 || sensor >= MAX_SENSORS ) {
+        return -1;
+    }
+    if ( ( fd = open(gap_filename(sensor, filename, sizeof(filename)), O_RDONLY) ) == -1 ) {
+        return 0;
+    }
+    if ( fstat(fd, &st) != 0 ) {
+        close(fd);
+        return -1;
+    }
+    count = st.st_size / sizeof(gap_t);
+
+    /* First gap ending after from, as they don't overlap the ends are in order too */
+    lo = 0;
+    hi = count;
+    while ( lo < hi ) {
+        mid = lo + ( hi - lo ) / 2;
+        if ( pread(fd, buf, sizeof(gap_t), mid * sizeof(gap_t)) != sizeof(gap_t) ) {
+            close(fd);
+            return -1;
+        }
+        if ( buf[0].end <= from ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for ( i = lo; i < count && stop == 0; i += n ) {
+        n = count - i > GAP_CHUNK ? GAP_CHUNK : count - i;
+        if ( ( len = pread(fd, buf, n * sizeof(gap_t), i * sizeof(gap_t)) ) < (ssize_t)sizeof(gap_t) ) {
+            break;
+        }
+        n = len / sizeof(gap_t);
+        for ( j = 0; j < n && stop == 0; j++ ) {
+            if ( buf[j].start >= to ) {
+                stop = 1;
+            } else {
+                found++;
+                stop = fn(&buf[j], arg);
+            }
+        }
+    }
+    close(fd);
+    return found;
+}
+
+double gap_estimated(int sensor, time_t from, time_t to)
+{
+    estimated_t est;
+
+    est.from = from;
+    est.to = to;
+    est.joules = 0;
+    gap_scan(sensor, from, to, estimated_add, &est);
+    return est.joules / 3600000.0;
+}
+
+void gap_stats(unsigned long *gaps, unsigned long *seconds, unsigned long *filled)
+{
+    *gaps = stat_gaps;
+    *seconds = stat_seconds;
+    *filled = stat_filled;
+}
+
+
+/** \brief Remember a gap for filling in and put it in the index
+ */
+static void gap_open(int sensor, double from, double to, double joules)
+{
+    track_t    *track = &tracks[sensor];
+    recent_t   *recent;
+
+    recent = &track->recent[track->next_recent];
+    track->next_recent = ( track->next_recent + 1 ) % GAP_RECENT;
+    if ( track->num_recent < GAP_RECENT ) {
+        track->num_recent++;
+    }
+    memset(recent, 0, sizeof(*recent));
+    recent->start = from;
+    recent->end = to;
+    recent->gap.start = (uint32_t)from;
+    recent->gap.end = (uint32_t)to;
+    recent->gap.joules = joules;
+    recent->index = -1;
+
+    /* A replay of older readings mustn't put the index out of order */
+    if ( c_gap_dir && recent->gap.start >= track->last_end &&
+         index_write(sensor, track->count, &recent->gap) == 0 ) {
+        recent->index = track->count++;
+        track->last_end = recent->gap.end;
+    }
+    stat_gaps++;
+    stat_seconds += (unsigned long)( to - from );
+    syslog(LOG_NOTICE,"No readings from sensor %d for %.0fs, estimated %.3f kWh",sensor,to - from,joules / 3600000.0);
+}
+
+/** \brief Fill in the gaps in two hours from the meter's total for them
+ *
+ *  \param sensor - Sensor the total is for
+ *  \param start - Host time the two hours started
+ *  \param kwh - Meter's total
+ */
+static void history_fill(int sensor, double start, double kwh)
+{
+    track_t    *track = &tracks[sensor];
+    recent_t   *recent;
+    double      measured = 0, estimate = 0, used, correction, share;
+    double      block_start, block_end, lo, hi, overlap, total = 0;
+    double      newly[GAP_RECENT];
+    long        m, m0, m1;
+    int         seconds = 0, slot, i;
+
+    /* Only two hours we've seen all of, to the minute */
+    m0 = (long)floor(( start / 60 ) + 0.5);
+    m1 = m0 + 120;
+    if ( track->valid_from == 0 || m0 * 60.0 < track->valid_from ||
+         m1 > track->head || m0 <= track->head - GAP_MINUTES ) {
+        return;
+    }
+    for ( m = m0; m < m1; m++ ) {
+        slot = m % GAP_MINUTES;
+        measured += track->measured[slot];
+        estimate += track->estimate[slot];
+        seconds += track->seconds[slot];
+    }
+    if ( seconds == 0 ) {
+        return;
+    }
+    used = ( kwh * 3600000.0 ) - measured;
+    if ( used < -( GAP_MISMATCH_KWH * 3600000.0 ) - ( measured * 0.05 ) ) {
+        return;
+    }
+    if ( used < 0 ) {
+        used = 0;
+    }
+    correction = used - estimate;
+
+    /* Share it between the gaps by how much of the two hours they cover,
+       noting the time covered for the first time */
+    block_start = m0 * 60.0;
+    block_end = m1 * 60.0;
+    for ( i = 0; i < track->num_recent; i++ ) {
+        recent = &track->recent[i];
+        newly[i] = 0;
+        lo = recent->start > block_start ? recent->start : block_start;
+        hi = recent->end < block_end ? recent->end : block_end;
+        if ( hi <= lo ) {
+            continue;
+        }
+        total += hi - lo;
+        for ( m = (long)floor(lo / 60); m * 60.0 < hi; m++ ) {
+            if ( track->filled[m % GAP_MINUTES] == 0 ) {
+                newly[i] += ( hi < ( m + 1 ) * 60.0 ? hi : ( m + 1 ) * 60.0 ) - ( lo > m * 60.0 ? lo : m * 60.0 );
+            }
+        }
+    }
+
+    /* Then the minutes, so the same total again comes to nothing */
+    for ( m = m0; m < m1; m++ ) {
+        slot = m % GAP_MINUTES;
+        if ( track->seconds[slot] ) {
+            track->estimate[slot] = estimate > 0 ? track->estimate[slot] * ( used / estimate )
+                                                 : used * track->seconds[slot] / seconds;
+            track->filled[slot] = 1;
+        }
+    }
+    if ( fabs(correction) < 1 && total == 0 ) {
+        return;
+    }
+    stat_filled++;
+    energy_adjust(sensor, correction);
+    if ( total == 0 ) {
+        /* The gaps have been forgotten, the two hours will have to do */
+        tariff_spread(sensor, block_start, block_end, correction);
+        return;
+    }
+    for ( i = 0; i < track->num_recent; i++ ) {
+        recent = &track->recent[i];
+        lo = recent->start > block_start ? recent->start : block_start;
+        hi = recent->end < block_end ? recent->end : block_end;
+        if ( hi <= lo ) {
+            continue;
+        }
+        overlap = hi - lo;
+        share = correction * overlap / total;
+        if ( fabs(share) < 1 && newly[i] == 0 ) {
+            continue;
+        }
+        tariff_spread(sensor, lo, hi, share);
+        recent->gap.joules += share;
+        recent->gap.filled += (uint32_t)( newly[i] + 0.5 );
+        if ( recent->gap.filled > recent->gap.end - recent->gap.start ) {
+            recent->gap.filled = recent->gap.end - recent->gap.start;
+        }
+        if ( recent->index >= 0 ) {
+            index_write(sensor, recent->index, &recent->gap);
+        }
+    }
+}
+
+/* Move the newest minute on to the one holding ts, clearing those passed */
+static void minutes_advance(track_t *track, double ts)
+{
+    long        m = (long)floor(ts / 60), i, n;
+    int         slot;
+
+    if ( m <= track->head ) {
+        return;
+    }
+    n = m - track->head > GAP_MINUTES ? GAP_MINUTES : m - track->head;
+    for ( i = 1; i <= n; i++ ) {
+        slot = ( m - n + i ) % GAP_MINUTES;
+        track->measured[slot] = 0;
+        track->estimate[slot] = 0;
+        track->seconds[slot] = 0;
+        track->filled[slot] = 0;
+    }
+    track->head = m;
+}
+
+/* Spread energy evenly over the minutes between two times */
+static void minutes_add(track_t *track, double from, double to, double joules, int gap)
+{
+    long        m, first = track->head - GAP_MINUTES + 1;
+    double      lo, hi;
+    int         slot, secs;
+
+    m = (long)floor(from / 60);
+    if ( m < first ) {
+        m = first;
+    }
+    for ( ; m * 60.0 < to && m <= track->head; m++ ) {
+        lo = from > m * 60.0 ? from : m * 60.0;
+        hi = to < ( m + 1 ) * 60.0 ? to : ( m + 1 ) * 60.0;
+        slot = m % GAP_MINUTES;
+        if ( gap ) {
+            track->estimate[slot] += joules * ( hi - lo ) / ( to - from );
+            secs = track->seconds[slot] + (int)( hi - lo + 0.5 );
+            track->seconds[slot] = secs > 60 ? 60 : secs;
+        } else {
+            track->measured[slot] += joules * ( hi - lo ) / ( to - from );
+        }
+    }
+}
+
+static int index_write(int sensor, long index, gap_t *gap)
+{
+    track_t    *track = &tracks[sensor];
+    char        filename[FILENAME_MAX];
+
+    if ( track->fd == -1 &&
+         ( track->fd = open(gap_filename(sensor, filename, sizeof(filename)), O_RDWR|O_CREAT, 0644) ) == -1 ) {
+        syslog(LOG_ERR,"Unable to open gap index %s: %s",filename,strerror(errno));
+        return -1;
+    }
+    if ( pwrite(track->fd, gap, sizeof(*gap), (off_t)index * sizeof(*gap)) != sizeof(*gap) ) {
+        syslog(LOG_ERR,"Unable to write gap index: %s",strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Add up the part of a gap in range the history hasn't covered */
+static int estimated_add(gap_t *gap, void *arg)
+{
+    estimated_t *est = arg;
+    double       span = gap->end > gap->start ? gap->end - gap->start : 1;
+    double       lo, hi;
+
+    lo = gap->start > est->from ? gap->start : est->from;
+    hi = gap->end < est->to ? gap->end : est->to;
+    if ( hi > lo && gap->filled < span ) {
+        est->joules += gap->joules * ( ( hi - lo ) / span ) * ( 1 - ( gap->filled / span ) );
+    }
+    return 0;
+}
+
+static char *gap_filename(int sensor, char *buf, size_t buflen)
+{
+    snprintf(buf, buflen, "%s/gaps-%d.dat", c_gap_dir, sensor);
+    return buf;
+}
@@ -0,0 +1,59 @@
+/*
+ *   Current Cost Daemon - gaps in the readings
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef GAP_H
+#define GAP_H
+
+#include <stdint.h>
+#include "libini.h"
+#include "currentcost.h"
+
+/* A gap as kept in the index, one file of these per sensor in time order */
+typedef struct {
+    uint32_t        start;         /* Stamp of the reading before it */
+    uint32_t        end;           /* And of the one which ended it */
+    float           joules;        /* Estimated, or from the meter's history */
+    uint32_t        filled;        /* Seconds of it the history has covered */
+} gap_t;
+
+/* Return non-zero to stop the scan */
+typedef int (*gap_scan_fn)(gap_t *gap, void *arg);
+
+/* Register the [gap] options */
+extern void         gap_options(configctx_t *ctx);
+
+/* Open the index files */
+extern void         gap_init();
+
+/* Mark a reading which ends a gap and keep track of the energy per minute */
+extern void         gap_sample(reading_t *reading);
+
+/* Fill in gaps from the meter's hourly totals */
+extern void         gap_history(history_t *hist);
+
+/* Gaps for a sensor overlapping from <= t < to, in time order */
+extern int          gap_scan(int sensor, time_t from, time_t to, gap_scan_fn fn, void *arg);
+
+/* kWh between two times which is still an estimate */
+extern double       gap_estimated(int sensor, time_t from, time_t to);
+
+extern void         gap_stats(unsigned long *gaps, unsigned long *seconds, unsigned long *filled);
+
+#endif /* GAP_H */
@@ -0,0 +1,114 @@
+/*
+ *   Current Cost Daemon - keeping off the heap once running
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Running for months on a small router, a heap which is allocated from
+ *   and freed back to as readings go by slowly fragments. With
+ *   heap:static set each module takes whatever it will need while
+ *   starting up, sized from the configuration: the rings and store
+ *   buffers for every sensor, the sinks' queues, their servers'
+ *   addresses. Once everything is running the main thread, which reads
+ *   the serial ports and takes each reading through the pipeline and
+ *   sinks, doesn't touch the heap again.
+ *
+ *   Work done on request in other threads - answering queries, the
+ *   store compactor, trace dumps - still allocates what it needs for
+ *   that request and frees it after, from their own arenas. The
+ *   collector, which opens a store per site as they turn up, isn't
+ *   available in this mode.
+ *
+ *   heap:budget puts a ceiling on what startup may take, checked once
+ *   it's over so a configuration that doesn't fit fails straight away
+ *   rather than weeks later.
+ *
+ *   "make heapcheck" builds the daemon with malloc() wrapped to abort on
+ *   any allocation by the main thread once heap_sealed is set, then
+ *   replays a capture through it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "heap.h"
+
+
+/* Configuration */
+static char         c_heap_static        = 0;
+static int          c_heap_budget        = 0;
+
+volatile int        heap_sealed          = 0;
+pthread_t           heap_thread;
+static unsigned long heap_used           = 0;
+
+
+void heap_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "heap:static","Allocate everything at startup and never again",OPT_BOOL,&c_heap_static);
+    iniparse_add(ctx, 0, "heap:budget","KB of heap startup may use (0 = no limit)",OPT_INT,&c_heap_budget);
+}
+
+int heap_static()
+{
+    return c_heap_static;
+}
+
+/** \brief Mark the end of startup
+ *
+ *  \return 0 - Within budget
+ *  \retval -1 - Startup took more than heap:budget
+ */
+int heap_seal()
+{
+#ifdef __GLIBC__
+    struct mallinfo2   info = mallinfo2();
+
+    /* Blocks handed out from the arenas plus the ones mapped on their own */
+    heap_used = info.uordblks + info.hblkhd;
+#endif
+    if ( c_heap_budget > 0 ) {
+        if ( heap_used == 0 ) {
+            syslog(LOG_WARNING,"Can't measure the heap here, heap:budget isn't checked");
+        } else if ( heap_used > c_heap_budget * 1024UL ) {
+            syslog(LOG_ERR,"Startup used %luKB of heap, over the %dKB budget",heap_used / 1024,c_heap_budget);
+            return -1;
+        }
+    }
+    if ( c_heap_static ) {
+        syslog(LOG_INFO,"Running on %luKB of heap allocated at startup",heap_used / 1024);
+        /* Unbuffered stdout uses a buffer of its own rather than a heap one */
+        fflush(stdout);
+        setvbuf(stdout, NULL, _IONBF, 0);
+        heap_thread = pthread_self();
+        heap_sealed = 1;
+    }
+    return 0;
+}
+
+void heap_unseal()
+{
+    heap_sealed = 0;
+}
+
+void heap_stats(unsigned long *used, unsigned long *budget)
+{
+    *used = heap_used;
+    *budget = c_heap_budget * 1024UL;
+}
@@ -0,0 +1,46 @@
+/*
+ *   Current Cost Daemon - keeping off the heap once running
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <pthread.h>
+#include "libini.h"
+
+/* Set once startup is over in static mode, heapcheck.c watches it */
+extern volatile int heap_sealed;
+extern pthread_t    heap_thread;
+
+/* Register the [heap] options */
+extern void         heap_options(configctx_t *ctx);
+
+/* Whether everything has to be allocated up front */
+extern int          heap_static();
+
+/* Startup is over, returns -1 if the heap is already over budget */
+extern int          heap_seal();
+
+/* Shutting down, allocating is fine again */
+extern void         heap_unseal();
+
+/* Bytes in use on the heap and the budget (0 = none) */
+extern void         heap_stats(unsigned long *used, unsigned long *budget);
+
+#endif /* HEAP_H */
@@ -0,0 +1,102 @@
+/*
+ *   Current Cost Daemon - catching heap use after startup
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Linked into currentcostd-heapcheck ahead of the C library, so every
+ *   allocation in the process (the library's own included) comes through
+ *   here. Once heap_sealed is set by heap_seal() an allocation by the
+ *   thread which set it prints where it came from and aborts, or with HEAPCHECK_ALL in the
+ *   environment carries on so they can all be listed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <execinfo.h>
+
+#include "heap.h"
+
+
+extern void        *__libc_malloc(size_t size);
+extern void        *__libc_calloc(size_t num, size_t size);
+extern void        *__libc_realloc(void *ptr, size_t size);
+extern void        *__libc_memalign(size_t align, size_t size);
+
+static void         heapcheck_fail(char *what, size_t size);
+
+
+void *malloc(size_t size)
+{
+    heapcheck_fail("malloc", size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size)
+{
+    heapcheck_fail("calloc", num * size);
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    heapcheck_fail("realloc", size);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+    heapcheck_fail("posix_memalign", size);
+    return ( *ptr = __libc_memalign(align, size) ) ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    heapcheck_fail("aligned_alloc", size);
+    return __libc_memalign(align, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    heapcheck_fail("memalign", size);
+    return __libc_memalign(align, size);
+}
+
+
+static void heapcheck_fail(char *what, size_t size)
+{
+    void   *frames[32];
+    char    msg[128];
+    int     len;
+
+    if ( heap_sealed == 0 || !pthread_equal(pthread_self(), heap_thread) ) {
+        return;
+    }
+    heap_sealed = 0;
+    len = snprintf(msg, sizeof(msg), "heapcheck: %s(%lu) after startup from:\n", what, (unsigned long)size);
+    if ( write(2, msg, len) < 0 ) {
+        /* Nowhere to complain to */
+    }
+    backtrace_symbols_fd(frames, backtrace(frames, 32), 2);
+    if ( getenv("HEAPCHECK_ALL") == NULL ) {
+        abort();
+    }
+    heap_sealed = 1;
+}
@@ -0,0 +1,668 @@
+/*
+ *   Current Cost Daemon - bulk import of old readings
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Moves the readings logged by update.sh into the store:
+ *
+ *     currentcostd -f /etc/currentcost.conf --import:sqlite /var/currentcost/sqlite.db
+ *
+ *   The readings table (see create_db.sh) is read in time order through
+ *   the sqlite3 command, and powertemp.rrd through rrdtool for anything
+ *   from before the table starts. Readings are cut into UTC days, which
+ *   a pool of import:workers threads write out as whole store segments
+ *   along with their minute rollups. Once every day is in, the hour
+ *   rollups are rebuilt a year per thread.
+ *
+ *   Only a few days are in flight at once. As each run of days is
+ *   finished the point reached goes in import:checkpoint, so an
+ *   interrupted import carries on from there. Running it again later
+ *   picks up whatever has been added to the table since.
+ *
+ *   Stop the daemon first, it shouldn't be writing to the same sensor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "import.h"
+#include "store.h"
+
+
+#define IMPORT_LINE_MAX     256
+#define IMPORT_DAY_ROWS     16384          /* A day at 6 second readings */
+#define IMPORT_PROGRESS     5              /* Seconds between progress reports */
+#define IMPORT_DST_MARGIN   7200           /* Local time in the table can be this far off */
+#define IMPORT_MAX_RRAS     32
+
+/* A day of readings, or a year of hour rollups to rebuild */
+typedef struct batch {
+    long            seq;
+    time_t          end;           /* Everything before this is done with this batch */
+    time_t          year;
+    store_raw_t    *raw;
+    int             num;
+    int             size;
+    struct batch   *next;
+} batch_t;
+
+typedef struct {
+    int             pdp;
+    int             rows;
+} rra_t;
+
+
+static void         import_row(double ts, int watts, double temp, double joules);
+static void         import_submit(batch_t *batch);
+static void        *import_worker(void *arg);
+static int          pool_start();
+static int          pool_finish();
+static int          import_sqlite(char *db, time_t *first);
+static int          import_rrd(char *file, time_t until);
+static FILE        *import_spawn(char *argv[], pid_t *pid);
+static int          import_wait(FILE *fp, pid_t pid);
+static int          split(char *line, char sep, char **fields, int max);
+static void         checkpoint_load();
+static void         checkpoint_save();
+
+/* Configuration */
+static char        *c_import_sqlite      = NULL;
+static char        *c_import_rrd         = NULL;
+static int          c_import_sensor      = 0;
+static int          c_import_workers     = 0;
+static char        *c_import_checkpoint  = NULL;
+
+static pthread_t   *workers              = NULL;
+static int          num_workers          = 0;
+static pthread_mutex_t queue_lock        = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready        = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space        = PTHREAD_COND_INITIALIZER;
+static batch_t     *queue_head           = NULL;
+static batch_t     *queue_tail           = NULL;
+static int          queued               = 0;
+static int          closing              = 0;
+static int          failed               = 0;
+
+/* Days finish in any order, the checkpoint moves over a run of them */
+static int          window               = 0;
+static char        *finished             = NULL;
+static time_t      *finished_end         = NULL;
+static long        *finished_rows        = NULL;
+static long         next_seq             = 0;
+static long         next_done            = 0;
+
+/* Progress, the checkpoint ones under the queue lock */
+static batch_t     *current              = NULL;
+static time_t       first_ts             = 0;
+static double       last_ts              = 0;
+static time_t       resume_before        = 0;
+static time_t       done_before          = 0;
+static long         done_rows            = 0;
+static long         rows                 = 0;
+static long         skipped              = 0;
+static int          days                 = 0;
+static time_t       progress_last        = 0;
+static struct timespec started;
+
+
+void import_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "import:sqlite","Import the readings table of this sqlite.db into the store and exit",OPT_STR,&c_import_sqlite);
+    iniparse_add(ctx, 0, "import:rrd","Import this powertemp.rrd, up to where the sqlite readings start",OPT_STR,&c_import_rrd);
+    iniparse_add(ctx, 0, "import:sensor","Sensor the imported readings are for",OPT_INT,&c_import_sensor);
+    iniparse_add(ctx, 0, "import:workers","Threads writing the store (0 = one per core)",OPT_INT,&c_import_workers);
+    iniparse_add(ctx, 0, "import:checkpoint","File to record progress in (default <source>.import)",OPT_STR,&c_import_checkpoint);
+}
+
+int import_wanted()
+{
+    return c_import_sqlite != NULL || c_import_rrd != NULL;
+}
+
+long import_run()
+{
+    struct timespec  now;
+    time_t           until = 0, year;
+    struct tm        tm;
+    double           secs;
+    char             path[FILENAME_MAX];
+    int              years = 0;
+
+    if ( c_import_sensor < 0 || c_import_sensor >= MAX_SENSORS ) {
+        fprintf(stderr, "No such sensor %d\n", c_import_sensor);
+        return -1;
+    }
+    if ( c_import_checkpoint == NULL ) {
+        snprintf(path, sizeof(path), "%s.import", c_import_sqlite ? c_import_sqlite : c_import_rrd);
+        c_import_checkpoint = strdup(path);
+    }
+    if ( ( num_workers = c_import_workers ) < 1 &&
+         ( num_workers = sysconf(_SC_NPROCESSORS_ONLN) ) < 1 ) {
+        num_workers = 1;
+    }
+    window = num_workers * 4;
+    workers = calloc(num_workers, sizeof(pthread_t));
+    finished = calloc(window, sizeof(char));
+    finished_end = calloc(window, sizeof(time_t));
+    finished_rows = calloc(window, sizeof(long));
+    checkpoint_load();
+    if ( ( resume_before = done_before ) ) {
+        printf("Carrying on from %s", ctime(&resume_before));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    progress_last = time(NULL);
+
+    if ( pool_start() != 0 ) {
+        return -1;
+    }
+    if ( c_import_rrd ) {
+        if ( c_import_sqlite && import_sqlite(c_import_sqlite, &until) != 0 ) {
+            failed = 1;
+        }
+        if ( failed == 0 && import_rrd(c_import_rrd, until) != 0 ) {
+            failed = 1;
+        }
+    }
+    if ( failed == 0 && c_import_sqlite && import_sqlite(c_import_sqlite, NULL) != 0 ) {
+        failed = 1;
+    }
+    if ( current ) {
+        current->end = (time_t)last_ts + 1;
+        import_submit(current);
+        current = NULL;
+    }
+    if ( pool_finish() != 0 || failed ) {
+        checkpoint_save();
+        fprintf(stderr, "Import stopped after %ld readings, run it again to carry on\n", done_rows);
+        return -1;
+    }
+    checkpoint_save();
+
+    /* Hours are rolled up from the minutes, a year per thread */
+    if ( first_ts && done_before && pool_start() == 0 ) {
+        for ( year = first_ts; year < done_before; year = timegm(&tm) ) {
+            batch_t *batch = calloc(1, sizeof(batch_t));
+
+            batch->year = year;
+            batch->seq = -1;
+            import_submit(batch);
+            years++;
+            gmtime_r(&year, &tm);
+            tm.tm_year++;
+            tm.tm_mon = 0;
+            tm.tm_mday = 1;
+            tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        }
+        if ( pool_finish() != 0 ) {
+            fprintf(stderr, "Unable to rebuild the hour rollups\n");
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = ( now.tv_sec - started.tv_sec ) + ( now.tv_nsec - started.tv_nsec ) / 1e9;
+    printf("Imported %ld readings over %d days in %.1fs (%.0f readings/s, %d workers), %d years of hours rebuilt\n",
+           rows, days, secs, secs > 0 ? rows / secs : 0, num_workers, years);
+    if ( skipped ) {
+        printf("Skipped %ld rows which couldn't be read\n", skipped);
+    }
+    syslog(LOG_INFO,"Imported %ld readings into sensor %d",rows,c_import_sensor);
+    return rows;
+}
+
+
+/* Add a reading from either source, they come in time order */
+static void import_row(double ts, int watts, double temp, double joules)
+{
+    store_raw_t  *raw;
+    time_t        day, now;
+    char          when[32];
+
+    if ( ts < resume_before || ts <= 0 ) {
+        return;
+    }
+    /* As the store does, hold a clock that steps back */
+    if ( ts < last_ts ) {
+        ts = last_ts;
+    }
+    day = (time_t)ts - ( (time_t)ts % 86400 );
+    if ( current && day != current->raw[0].ts - ( current->raw[0].ts % 86400 ) ) {
+        current->end = day;
+        import_submit(current);
+        current = NULL;
+    }
+    if ( current == NULL ) {
+        current = calloc(1, sizeof(batch_t));
+        current->size = IMPORT_DAY_ROWS;
+        current->raw = malloc(current->size * sizeof(store_raw_t));
+    } else if ( current->num == current->size ) {
+        current->size *= 2;
+        current->raw = realloc(current->raw, current->size * sizeof(store_raw_t));
+    }
+    raw = &current->raw[current->num++];
+    raw->ts = (uint32_t)ts;
+    raw->ms = (uint16_t)( ( ts - raw->ts ) * 1000 );
+    raw->temp = (int16_t)lrint(temp * 10);
+    raw->watts = watts;
+    raw->joules = joules;
+
+    if ( first_ts == 0 ) {
+        first_ts = raw->ts;
+    }
+    last_ts = ts;
+    if ( ( ++rows & 0xffff ) == 0 && ( now = time(NULL) ) - progress_last >= IMPORT_PROGRESS ) {
+        progress_last = now;
+        strftime(when, sizeof(when), "%Y-%m-%d", gmtime(&day));
+        printf("%ld readings, up to %s\n", rows, when);
+        fflush(stdout);
+        checkpoint_save();
+    }
+}
+
+/* Queue a batch for the workers, waiting whilst they're behind */
+static void import_submit(batch_t *batch)
+{
+    pthread_mutex_lock(&queue_lock);
+    while ( ( queued >= num_workers * 2 || ( batch->raw && next_seq - next_done >= window ) ) && failed == 0 ) {
+        pthread_cond_wait(&queue_space, &queue_lock);
+    }
+    if ( batch->raw ) {
+        batch->seq = next_seq++;
+    }
+    if ( queue_tail ) {
+        queue_tail->next = batch;
+    } else {
+        queue_head = batch;
+    }
+    queue_tail = batch;
+    queued++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void *import_worker(void *arg)
+{
+    batch_t     *batch;
+    int          ret, slot;
+
+    while ( 1 ) {
+        pthread_mutex_lock(&queue_lock);
+        while ( queue_head == NULL && closing == 0 ) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        if ( ( batch = queue_head ) == NULL ) {
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        if ( ( queue_head = batch->next ) == NULL ) {
+            queue_tail = NULL;
+        }
+        queued--;
+        pthread_mutex_unlock(&queue_lock);
+
+        if ( failed ) {
+            ret = -1;
+        } else if ( batch->raw ) {
+            ret = store_import(c_import_sensor, batch->raw, batch->num);
+        } else {
+            ret = store_rebuild(c_import_sensor, batch->year);
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        if ( ret < 0 ) {
+            failed = 1;
+        } else if ( batch->raw ) {
+            slot = batch->seq % window;
+            finished[slot] = 1;
+            finished_end[slot] = batch->end;
+            finished_rows[slot] = batch->num;
+            days++;
+            while ( finished[next_done % window] ) {
+                slot = next_done++ % window;
+                finished[slot] = 0;
+                done_before = finished_end[slot];
+                done_rows += finished_rows[slot];
+            }
+        }
+        pthread_cond_broadcast(&queue_space);
+        pthread_mutex_unlock(&queue_lock);
+        free(batch->raw);
+        free(batch);
+    }
+    return NULL;
+}
+
+static int pool_start()
+{
+    int     i;
+
+    closing = 0;
+    for ( i = 0; i < num_workers; i++ ) {
+        if ( pthread_create(&workers[i], NULL, import_worker, NULL) != 0 ) {
+            fprintf(stderr, "Unable to start import worker\n");
+            num_workers = i;
+            pool_finish();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Wait for the queue to drain and the workers to finish */
+static int pool_finish()
+{
+    batch_t *batch;
+    int      i;
+
+    pthread_mutex_lock(&queue_lock);
+    closing = 1;
+    pthread_cond_broadcast(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    for ( i = 0; i < num_workers; i++ ) {
+        pthread_join(workers[i], NULL);
+    }
+    while ( ( batch = queue_head ) != NULL ) {
+        queue_head = batch->next;
+        free(batch->raw);
+        free(batch);
+    }
+    queue_tail = NULL;
+    queued = 0;
+    return failed ? -1 : 0;
+}
+
+/** \brief Read the readings table in time order
+ *
+ *  \param db - sqlite database created by create_db.sh
+ *  \param first - If not NULL just find when the table starts
+ *
+ *  \return 0 - Read it all
+ *  \retval -1 - sqlite3 failed
+ */
+static int import_sqlite(char *db, time_t *first)
+{
+    char        sql[512];
+    char        line[IMPORT_LINE_MAX];
+    char       *argv[] = { "sqlite3", "-batch", "-separator", " ", db, sql, NULL };
+    char       *fields[4], *end;
+    FILE       *fp;
+    pid_t       pid;
+    double      ts;
+
+    if ( first ) {
+        snprintf(sql, sizeof(sql), "SELECT strftime('%%s',min(ts),'utc') FROM readings");
+    } else if ( resume_before ) {
+        /* The table is in local time, which the index has to be searched in */
+        snprintf(sql, sizeof(sql), "SELECT strftime('%%s',ts,'utc'),watts,coalesce(temp,0),coalesce(joules,watts*ts_delta,0) "
+                 "FROM readings WHERE ts >= datetime(%ld,'unixepoch','localtime') ORDER BY ts,id",
+                 (long)resume_before - IMPORT_DST_MARGIN);
+    } else {
+        snprintf(sql, sizeof(sql), "SELECT strftime('%%s',ts,'utc'),watts,coalesce(temp,0),coalesce(joules,watts*ts_delta,0) "
+                 "FROM readings ORDER BY ts,id");
+    }
+    if ( ( fp = import_spawn(argv, &pid) ) == NULL ) {
+        fprintf(stderr, "Unable to run sqlite3 on %s\n", db);
+        return -1;
+    }
+    while ( fgets(line, sizeof(line), fp) != NULL ) {
+        if ( first ) {
+            *first = strtol(line, NULL, 10);
+            continue;
+        }
+        if ( split(line, ' ', fields, 4) != 4 || ( ts = strtod(fields[0], &end) ) <= 0 || end == fields[0] ) {
+            skipped++;
+            continue;
+        }
+        import_row(ts, atoi(fields[1]), strtod(fields[2], NULL), strtod(fields[3], NULL));
+    }
+    if ( import_wait(fp, pid) != 0 ) {
+        fprintf(stderr, "sqlite3 failed reading %s\n", db);
+        return -1;
+    }
+    return 0;
+}
+
+/** \brief Read the power and temperature from an rrd, each archive
+ *         filling in from where the finer one before it runs out
+ *
+ *  \param file - rrd created by create_rrd.sh
+ *  \param until - Stop here, 0 for everything
+ *
+ *  \return 0 - Read it all
+ *  \retval -1 - rrdtool failed
+ */
+static int import_rrd(char *file, time_t until)
+{
+    rra_t       rras[IMPORT_MAX_RRAS], tmp;
+    char        line[IMPORT_LINE_MAX];
+    char        res[16], from[24], to[24];
+    char       *info[] = { "rrdtool", "info", file, NULL };
+    char       *fetch[] = { "rrdtool", "fetch", file, "AVERAGE", "-r", res, "-s", from, "-e", to, NULL };
+    char       *fields[8], *p;
+    FILE       *fp;
+    pid_t       pid;
+    time_t      last = 0, start, end, ts;
+    double      watts, temp;
+    int         step = 0, num = 0, n, i, j, cf = 0;
+    int         power_ds = 0, temp_ds = 1;
+
+    if ( ( fp = import_spawn(info, &pid) ) == NULL ) {
+        fprintf(stderr, "Unable to run rrdtool on %s\n", file);
+        return -1;
+    }
+    memset(rras, 0, sizeof(rras));
+    while ( fgets(line, sizeof(line), fp) != NULL ) {
+        if ( sscanf(line, "step = %d", &step) == 1 || sscanf(line, "last_update = %ld", &last) == 1 ) {
+            continue;
+        }
+        if ( sscanf(line, "rra[%d].%n", &i, &n) != 1 || i < 0 || i >= IMPORT_MAX_RRAS ) {
+            continue;
+        }
+        p = line + n;
+        if ( strncmp(p, "cf = ", 5) == 0 && strstr(p, "\"AVERAGE\"") ) {
+            rras[i].rows = -1;             /* Marked as wanted until the rows turn up */
+            cf = 1;
+        } else if ( sscanf(p, "rows = %d", &n) == 1 && rras[i].rows ) {
+            rras[i].rows = n;
+        } else if ( sscanf(p, "pdp_per_row = %d", &n) == 1 ) {
+            rras[i].pdp = n;
+        }
+        if ( i >= num ) {
+            num = i + 1;
+        }
+    }
+    if ( import_wait(fp, pid) != 0 || step < 1 || last == 0 || cf == 0 ) {
+        fprintf(stderr, "Unable to read the archives of %s\n", file);
+        return -1;
+    }
+
+    /* Finest first */
+    for ( i = j = 0; i < num; i++ ) {
+        if ( rras[i].rows > 0 && rras[i].pdp > 0 ) {
+            rras[j++] = rras[i];
+        }
+    }
+    num = j;
+    for ( i = 1; i < num; i++ ) {
+        for ( j = i; j > 0 && rras[j].pdp < rras[j - 1].pdp; j-- ) {
+            tmp = rras[j];
+            rras[j] = rras[j - 1];
+            rras[j - 1] = tmp;
+        }
+    }
+
+    /* Oldest first, so coarsest first */
+    for ( i = num - 1; i >= 0 && failed == 0; i-- ) {
+        start = last - (time_t)rras[i].pdp * step * rras[i].rows;
+        end = i ? last - (time_t)rras[i - 1].pdp * step * rras[i - 1].rows : last + 1;
+        if ( start < resume_before ) {
+            start = resume_before;
+        }
+        if ( until && end > until ) {
+            end = until;
+        }
+        if ( start >= end ) {
+            continue;
+        }
+        snprintf(res, sizeof(res), "%d", rras[i].pdp * step);
+        snprintf(from, sizeof(from), "%ld", (long)start);
+        snprintf(to, sizeof(to), "%ld", (long)end);
+        if ( ( fp = import_spawn(fetch, &pid) ) == NULL ) {
+            fprintf(stderr, "Unable to run rrdtool on %s\n", file);
+            return -1;
+        }
+        while ( fgets(line, sizeof(line), fp) != NULL ) {
+            if ( strchr(line, ':') == NULL ) {
+                /* The header names the data sources */
+                for ( n = split(line, ' ', fields, 8), j = 0; n > 0 && j < n; j++ ) {
+                    if ( strncmp(fields[j], "Power", 5) == 0 ) {
+                        power_ds = j;
+                    } else if ( strncmp(fields[j], "Temperature", 11) == 0 ) {
+                        temp_ds = j;
+                    }
+                }
+                continue;
+            }
+            ts = strtol(line, &p, 10);
+            n = split(p + 1, ' ', fields, 8);
+            if ( ts < start || ts >= end || power_ds >= n ) {
+                continue;
+            }
+            watts = strtod(fields[power_ds], NULL);
+            temp = temp_ds < n ? strtod(fields[temp_ds], NULL) : 0;
+            if ( isnan(watts) ) {
+                continue;
+            }
+            import_row(ts, lrint(watts), isnan(temp) ? 0 : temp, watts * rras[i].pdp * step);
+        }
+        if ( import_wait(fp, pid) != 0 ) {
+            fprintf(stderr, "rrdtool failed fetching from %s\n", file);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Run a command with its output on the returned stream */
+static FILE *import_spawn(char *argv[], pid_t *pid)
+{
+    int     fds[2];
+
+    if ( pipe(fds) != 0 ) {
+        return NULL;
+    }
+    if ( ( *pid = fork() ) == 0 ) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(fds[1]);
+    if ( *pid == -1 ) {
+        close(fds[0]);
+        return NULL;
+    }
+    return fdopen(fds[0], "r");
+}
+
+static int import_wait(FILE *fp, pid_t pid)
+{
+    int     status;
+
+    fclose(fp);
+    if ( waitpid(pid, &status, 0) != pid ) {
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/* Split a line in place, runs of the separator are one */
+static int split(char *line, char sep, char **fields, int max)
+{
+    int     num = 0;
+
+    while ( num < max ) {
+        while ( *line == sep ) {
+            line++;
+        }
+        if ( *line == 0 || *line == '\n' || *line == '\r' ) {
+            break;
+        }
+        fields[num++] = line;
+        while ( *line && *line != sep && *line != '\n' && *line != '\r' ) {
+            line++;
+        }
+        if ( *line == 0 ) {
+            break;
+        }
+        *line++ = 0;
+    }
+    return num;
+}
+
+static void checkpoint_load()
+{
+    FILE    *fp;
+    long     first, before, count;
+
+    if ( ( fp = fopen(c_import_checkpoint, "r") ) == NULL ) {
+        return;
+    }
+    if ( fscanf(fp, "# first before readings\n%ld %ld %ld", &first, &before, &count) == 3 ) {
+        first_ts = first;
+        done_before = before;
+        done_rows = count;
+    }
+    fclose(fp);
+}
+
+/* Written alongside and renamed into place, as the energy checkpoint */
+static void checkpoint_save()
+{
+    char       tmpname[FILENAME_MAX];
+    FILE      *fp;
+    time_t     before;
+    long       count;
+    int        ok;
+
+    pthread_mutex_lock(&queue_lock);
+    before = done_before;
+    count = done_rows;
+    pthread_mutex_unlock(&queue_lock);
+    if ( before == 0 ) {
+        return;
+    }
+
+    snprintf(tmpname,sizeof(tmpname),"%s.tmp",c_import_checkpoint);
+    if ( ( fp = fopen(tmpname,"w") ) == NULL ) {
+        fprintf(stderr, "Unable to write import checkpoint %s\n", tmpname);
+        return;
+    }
+    fprintf(fp,"# first before readings\n%ld %ld %ld\n",(long)first_ts,(long)before,count);
+    ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    fclose(fp);
+    if ( ok == 0 || rename(tmpname, c_import_checkpoint) != 0 ) {
+        unlink(tmpname);
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ *   Current Cost Daemon - bulk import of old readings
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include "libini.h"
+
+/* Register the [import] options */
+extern void         import_options(configctx_t *ctx);
+
+/* Whether import:sqlite or import:rrd asks for an import */
+extern int          import_wanted();
+
+/* Import into the store, which must be set up. Returns the number of
+   readings imported or -1 */
+extern long         import_run();
+
+#endif /* IMPORT_H */
@@ -0,0 +1,562 @@
+/*
+ *   Current Cost Daemon - InfluxDB line protocol exporter
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Readings are appended as line protocol to the batch at the tail of
+ *   a ring of preallocated batches. A batch is closed off every
+ *   influx:interval milliseconds or once it holds influx:points
+ *   readings, and batches are POSTed oldest first over a kept alive
+ *   connection. A failed POST is retried with backoff; when the ring
+ *   fills up the oldest batch is dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <zlib.h>
+
+#include "influx.h"
+#include "evloop.h"
+#include "net.h"
+#include "heap.h"
+
+
+#define INFLUX_LINE_MAX     256
+#define INFLUX_MAX_BACKOFF  60000
+#define INFLUX_TIMEOUT      30000
+
+enum { HTTP_IDLE, HTTP_CONNECTING, HTTP_SENDING, HTTP_READING, HTTP_READY };
+
+typedef struct {
+    char           *data;
+    int             len;
+    int             points;
+} batch_t;
+
+
+static int          influx_open(sink_t *sink);
+static int          influx_write(sink_t *sink, reading_t *reading);
+static int          influx_event(sink_t *sink, event_t *event);
+static void         influx_free();
+static char        *influx_reserve();
+static void         influx_commit(int len);
+static void         influx_seal();
+static void         influx_timer(void *data);
+static void         influx_kick();
+static void         influx_connect();
+static void         influx_close();
+static void         influx_fail(char *why);
+static void         influx_io(int fd, int revents, void *data);
+static int          influx_prepare();
+static void         influx_send();
+static void         influx_response();
+
+/* Configuration */
+static char        *c_influx_host        = NULL;
+static int          c_influx_port        = 8086;
+static char        *c_influx_path        = "/write?db=currentcost&precision=ms";
+static char        *c_influx_measurement = "power";
+static char        *c_influx_tags        = NULL;
+static char        *c_influx_auth        = NULL;
+static int          c_influx_interval    = 10000;
+static int          c_influx_points      = 500;
+static int          c_influx_backlog     = 64;
+static char         c_influx_gzip        = 0;
+static filter_policy_t c_influx_filter;
+
+/* The ring of batches, the tail batch is the one being filled */
+static batch_t     *batches              = NULL;
+static int          batch_size           = 0;
+static unsigned int batch_head           = 0;
+static unsigned int batch_tail           = 0;
+
+/* The HTTP connection */
+static int          http_fd              = -1;
+static net_addr_t   http_addr;
+static int          http_state           = HTTP_IDLE;
+static long long    http_started         = 0;
+static long long    http_retry_at        = 0;
+static int          http_backoff         = 1000;
+static char         http_header[1024];
+static int          http_header_len      = 0;
+static char        *http_body            = NULL;
+static int          http_body_len        = 0;
+static int          http_sent            = 0;
+static char         http_resp[4096];
+static int          http_resp_len        = 0;
+static z_stream     zstream;
+static char        *zbuf                 = NULL;
+static int          zbuf_size            = 0;
+
+static unsigned long stat_points         = 0;
+static unsigned long stat_posts          = 0;
+static unsigned long stat_retries        = 0;
+static unsigned long stat_dropped        = 0;
+
+
+void influx_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "influx:host","InfluxDB compatible server to write to",OPT_STR,&c_influx_host);
+    iniparse_add(ctx, 0, "influx:port","Port of the server",OPT_INT,&c_influx_port);
+    iniparse_add(ctx, 0, "influx:path","Write endpoint including query string",OPT_STR,&c_influx_path);
+    iniparse_add(ctx, 0, "influx:measurement","Measurement name for readings",OPT_STR,&c_influx_measurement);
+    iniparse_add(ctx, 0, "influx:tags","Extra tags for every point (eg site=home)",OPT_STR,&c_influx_tags);
+    iniparse_add(ctx, 0, "influx:authorization","Value for the Authorization header",OPT_STR,&c_influx_auth);
+    iniparse_add(ctx, 0, "influx:interval","Milliseconds between writes",OPT_INT,&c_influx_interval);
+    iniparse_add(ctx, 0, "influx:points","Write as soon as this many points are waiting",OPT_INT,&c_influx_points);
+    iniparse_add(ctx, 0, "influx:backlog","Batches to hold whilst the server is away",OPT_INT,&c_influx_backlog);
+    iniparse_add(ctx, 0, "influx:gzip","Compress the writes",OPT_BOOL,&c_influx_gzip);
+    filter_options(ctx, "influx", &c_influx_filter);
+}
+
+/** \brief Create the exporter sink if a server has been configured
+ *
+ *  \return The sink
+ *  \retval NULL - Not configured
+ */
+sink_t *influx_init()
+{
+    sink_t   *sink;
+
+    if ( c_influx_host == NULL ) {
+        return NULL;
+    }
+    if ( c_influx_points < 1 ) {
+        c_influx_points = 1;
+    }
+    if ( c_influx_backlog < 2 ) {
+        c_influx_backlog = 2;
+    }
+    if ( c_influx_interval < 10 ) {
+        c_influx_interval = 10;
+    }
+
+    sink = sink_create("influx", &c_influx_filter, influx_write, NULL);
+    sink->open = influx_open;
+    sink->event = influx_event;
+    return sink;
+}
+
+void influx_stats(unsigned long *points, unsigned long *posts, unsigned long *retries, unsigned long *dropped)
+{
+    *points = stat_points;
+    *posts = stat_posts;
+    *retries = stat_retries;
+    *dropped = stat_dropped;
+}
+
+
+static int influx_open(sink_t *sink)
+{
+    int       i;
+
+    batch_size = c_influx_points * INFLUX_LINE_MAX;
+    if ( ( batches = calloc(c_influx_backlog, sizeof(batch_t)) ) == NULL ) {
+        syslog(LOG_ERR,"Unable to allocate %d batches for InfluxDB",c_influx_backlog);
+        return -1;
+    }
+    for ( i = 0; i < c_influx_backlog; i++ ) {
+        if ( ( batches[i].data = malloc(batch_size) ) == NULL ) {
+            syslog(LOG_ERR,"Unable to allocate %d batches of %d bytes for InfluxDB",c_influx_backlog,batch_size);
+            influx_free();
+            return -1;
+        }
+    }
+    if ( c_influx_gzip ) {
+        memset(&zstream, 0, sizeof(zstream));
+        /* windowBits + 16 asks for a gzip wrapper */
+        if ( deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK ) {
+            c_influx_gzip = 0;
+        } else {
+            zbuf_size = deflateBound(&zstream, batch_size);
+            if ( ( zbuf = malloc(zbuf_size) ) == NULL ) {
+                syslog(LOG_ERR,"Unable to allocate %d bytes to compress into",zbuf_size);
+                deflateEnd(&zstream);
+                influx_free();
+                return -1;
+            }
+        }
+    }
+
+    if ( heap_static() && net_resolve(c_influx_host, c_influx_port, &http_addr) != 0 ) {
+        syslog(LOG_ERR,"Unable to resolve InfluxDB server %s, it won't be tried again",c_influx_host);
+    }
+
+    ev_every(c_influx_interval, influx_timer, NULL);
+    return 0;
+}
+
+/* What influx_open() managed to allocate, the sink still gets called */
+static void influx_free()
+{
+    int       i;
+
+    for ( i = 0; i < c_influx_backlog; i++ ) {
+        free(batches[i].data);
+    }
+    free(batches);
+    batches = NULL;
+}
+
+static int influx_write(sink_t *sink, reading_t *reading)
+{
+    char   *line;
+    int     len;
+
+    if ( batches == NULL ) {
+        return -1;
+    }
+    line = influx_reserve();
+
+    len = snprintf(line, INFLUX_LINE_MAX, "%s,sensor=%d%s%s watts=%di,temp=%.1f,kwh=%.6f,joules=%.0f %lld\n",
+                   c_influx_measurement, reading->sensor, c_influx_tags ? "," : "", c_influx_tags ? c_influx_tags : "",
+                   reading->watts, reading->temp, reading->kwh, reading->joules,
+                   (long long)( reading->ts * 1000.0 ));
+    if ( len >= INFLUX_LINE_MAX ) {
+        return -1;
+    }
+    influx_commit(len);
+    return 0;
+}
+
+static int influx_event(sink_t *sink, event_t *event)
+{
+    char   *line;
+    int     len;
+
+    if ( batches == NULL ) {
+        return -1;
+    }
+    line = influx_reserve();
+
+    len = snprintf(line, INFLUX_LINE_MAX, "alert,name=%s,sensor=%d%s%s raised=%di,value=%.2f,threshold=%.2f %lld\n",
+                   event->name, event->sensor, c_influx_tags ? "," : "", c_influx_tags ? c_influx_tags : "",
+                   event->raised, event->value, event->threshold, (long long)event->now * 1000);
+    if ( len >= INFLUX_LINE_MAX ) {
+        return -1;
+    }
+    influx_commit(len);
+    return 0;
+}
+
+/* Room for a line at the end of the batch being filled, lines are
+   formatted straight into the batch */
+static char *influx_reserve()
+{
+    batch_t   *batch = &batches[batch_tail % c_influx_backlog];
+
+    if ( batch->len + INFLUX_LINE_MAX > batch_size ) {
+        influx_seal();
+        batch = &batches[batch_tail % c_influx_backlog];
+    }
+    return batch->data + batch->len;
+}
+
+static void influx_commit(int len)
+{
+    batch_t   *batch = &batches[batch_tail % c_influx_backlog];
+
+    batch->len += len;
+    batch->points++;
+    stat_points++;
+    if ( batch->points >= c_influx_points ) {
+        influx_seal();
+    }
+}
+
+/* Close off the batch being filled and queue it for sending */
+static void influx_seal()
+{
+    batch_t   *batch = &batches[batch_tail % c_influx_backlog];
+
+    if ( batch->len == 0 ) {
+        return;
+    }
+    batch_tail++;
+    if ( batch_tail - batch_head == c_influx_backlog ) {
+        /* Out of room, drop the oldest batch that isn't on the wire. If
+           the head is being sent it swaps places with the one dropped */
+        if ( http_state == HTTP_SENDING || http_state == HTTP_READING ) {
+            batch_t tmp = batches[( batch_head + 1 ) % c_influx_backlog];
+
+            batches[( batch_head + 1 ) % c_influx_backlog] = batches[batch_head % c_influx_backlog];
+            batches[batch_head % c_influx_backlog] = tmp;
+        }
+        batch = &batches[batch_head % c_influx_backlog];
+        stat_dropped += batch->points;
+        batch_head++;
+        syslog(LOG_WARNING,"Influx backlog full, dropped %d points",batch->points);
+    }
+    batch = &batches[batch_tail % c_influx_backlog];
+    batch->len = batch->points = 0;
+    influx_kick();
+}
+
+static void influx_timer(void *data)
+{
+    long long   now = ev_now();
+
+    influx_seal();
+    if ( ( http_state == HTTP_CONNECTING || http_state == HTTP_SENDING || http_state == HTTP_READING ) &&
+         now - http_started > INFLUX_TIMEOUT ) {
+        influx_fail("timed out");
+    }
+    influx_kick();
+}
+
+/* Start sending the oldest batch if we're able to */
+static void influx_kick()
+{
+    if ( batch_head == batch_tail || ev_now() < http_retry_at ) {
+        return;
+    }
+    if ( http_state == HTTP_IDLE ) {
+        influx_connect();
+    } else if ( http_state == HTTP_READY ) {
+        if ( influx_prepare() == 0 ) {
+            http_state = HTTP_SENDING;
+            http_started = ev_now();
+            ev_mod(http_fd, POLLIN|POLLOUT);
+        }
+    }
+}
+
+static void influx_connect()
+{
+    char     *why;
+    int       fd;
+
+    if ( ( fd = net_connect(c_influx_host, c_influx_port, &http_addr, 0, &why) ) == -1 ) {
+        influx_fail(why);
+        return;
+    }
+    http_fd = fd;
+    http_state = HTTP_CONNECTING;
+    http_started = ev_now();
+    ev_add(http_fd, POLLOUT, influx_io, NULL);
+}
+
+static void influx_close()
+{
+    if ( http_fd != -1 ) {
+        ev_del(http_fd);
+        close(http_fd);
+    }
+    http_fd = -1;
+    http_state = HTTP_IDLE;
+}
+
+/* Something went wrong - the head batch stays put for a retry */
+static void influx_fail(char *why)
+{
+    syslog(LOG_WARNING,"Influx write to %s failed (%s), retrying in %ds",c_influx_host,why,http_backoff / 1000);
+    influx_close();
+    stat_retries++;
+    http_retry_at = ev_now() + http_backoff;
+    http_backoff *= 2;
+    if ( http_backoff > INFLUX_MAX_BACKOFF ) {
+        http_backoff = INFLUX_MAX_BACKOFF;
+    }
+}
+
+/* Build the request for the head batch */
+static int influx_prepare()
+{
+    batch_t   *batch = &batches[batch_head % c_influx_backlog];
+
+    http_body = batch->data;
+    http_body_len = batch->len;
+    if ( c_influx_gzip ) {
+        deflateReset(&zstream);
+        zstream.next_in = (unsigned char *)batch->data;
+        zstream.avail_in = batch->len;
+        zstream.next_out = (unsigned char *)zbuf;
+        zstream.avail_out = zbuf_size;
+        if ( deflate(&zstream, Z_FINISH) == Z_STREAM_END ) {
+            http_body = zbuf;
+            http_body_len = zbuf_size - zstream.avail_out;
+        }
+    }
+    http_header_len = snprintf(http_header, sizeof(http_header),
+                               "POST %s HTTP/1.1\r\n"
+                               "Host: %s:%d\r\n"
+                               "User-Agent: currentcostd\r\n"
+                               "Content-Type: text/plain; charset=utf-8\r\n"
+                               "Content-Length: %d\r\n"
+                               "%s%s%s"
+                               "%s"
+                               "\r\n",
+                               c_influx_path, c_influx_host, c_influx_port, http_body_len,
+                               c_influx_auth ? "Authorization: " : "", c_influx_auth ? c_influx_auth : "", c_influx_auth ? "\r\n" : "",
+                               http_body != batch->data ? "Content-Encoding: gzip\r\n" : "");
+    if ( http_header_len >= sizeof(http_header) ) {
+        return -1;
+    }
+    http_sent = 0;
+    http_resp_len = 0;
+    return 0;
+}
+
+static void influx_io(int fd, int revents, void *data)
+{
+    int         err = 0;
+    socklen_t   len = sizeof(err);
+    int         ret;
+
+    switch ( http_state ) {
+    case HTTP_CONNECTING:
+        if ( getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0 ) {
+            influx_fail(strerror(err));
+            return;
+        }
+        http_state = HTTP_READY;
+        ev_mod(fd, POLLIN);
+        influx_kick();
+        break;
+    case HTTP_SENDING:
+        if ( revents & POLLOUT ) {
+            influx_send();
+        }
+        break;
+    case HTTP_READING:
+        if ( revents & ( POLLIN | POLLHUP | POLLERR ) ) {
+            ret = read(fd, http_resp + http_resp_len, sizeof(http_resp) - http_resp_len - 1);
+            if ( ret == 0 || ( ret < 0 && errno != EAGAIN && errno != EINTR ) ) {
+                influx_fail(ret == 0 ? "connection closed" : strerror(errno));
+                return;
+            }
+            if ( ret > 0 ) {
+                http_resp_len += ret;
+                http_resp[http_resp_len] = 0;
+                influx_response();
+            }
+        }
+        break;
+    case HTTP_READY:
+        /* Server closed a kept alive connection */
+        if ( revents & ( POLLIN | POLLHUP | POLLERR ) ) {
+            influx_close();
+            influx_kick();
+        }
+        break;
+    }
+}
+
+static void influx_send()
+{
+    struct iovec   iov[2];
+    int            iovcnt = 0;
+    int            ret;
+
+    if ( http_sent < http_header_len ) {
+        iov[iovcnt].iov_base = http_header + http_sent;
+        iov[iovcnt].iov_len = http_header_len - http_sent;
+        iovcnt++;
+        iov[iovcnt].iov_base = http_body;
+        iov[iovcnt].iov_len = http_body_len;
+        iovcnt++;
+    } else {
+        iov[iovcnt].iov_base = http_body + ( http_sent - http_header_len );
+        iov[iovcnt].iov_len = http_body_len - ( http_sent - http_header_len );
+        iovcnt++;
+    }
+    ret = writev(http_fd, iov, iovcnt);
+    if ( ret < 0 ) {
+        if ( errno != EAGAIN && errno != EINTR ) {
+            influx_fail(strerror(errno));
+        }
+        return;
+    }
+    http_sent += ret;
+    if ( http_sent == http_header_len + http_body_len ) {
+        http_state = HTTP_READING;
+        ev_mod(http_fd, POLLIN);
+    }
+}
+
+/* See if we've got the whole response yet, and act on it if so */
+static void influx_response()
+{
+    batch_t   *batch;
+    char      *body, *ptr;
+    int        status;
+    int        clen = -1;
+    int        keepalive = 1;
+
+    if ( ( body = strstr(http_resp, "\r\n\r\n") ) == NULL ) {
+        if ( http_resp_len == sizeof(http_resp) - 1 ) {
+            influx_fail("response too long");
+        }
+        return;
+    }
+    body += 4;
+    if ( sscanf(http_resp, "HTTP/%*d.%*d %d", &status) != 1 ) {
+        influx_fail("bad response");
+        return;
+    }
+    for ( ptr = strstr(http_resp, "\r\n"); ptr && ptr < body; ptr = strstr(ptr + 2, "\r\n") ) {
+        if ( strncasecmp(ptr + 2, "Content-Length:", 15) == 0 ) {
+            clen = atoi(ptr + 17);
+        } else if ( strncasecmp(ptr + 2, "Connection: close", 17) == 0 ) {
+            keepalive = 0;
+        } else if ( strncasecmp(ptr + 2, "Transfer-Encoding:", 18) == 0 ) {
+            keepalive = 0;
+        }
+    }
+    if ( clen > 0 && ( http_resp + http_resp_len ) - body < clen ) {
+        if ( http_resp_len == sizeof(http_resp) - 1 ) {
+            keepalive = 0;      /* We don't care about the rest of it */
+        } else {
+            return;
+        }
+    }
+    if ( clen == -1 && status != 204 && status != 304 ) {
+        keepalive = 0;
+    }
+
+    if ( status >= 500 || status == 429 || status == 408 ) {
+        influx_fail("server busy");
+        return;
+    }
+
+    /* Sent (or rejected as bad data, which retrying won't fix) */
+    batch = &batches[batch_head % c_influx_backlog];
+    if ( status >= 300 ) {
+        syslog(LOG_ERR,"Influx rejected %d points with status %d",batch->points,status);
+        stat_dropped += batch->points;
+    } else {
+        stat_posts++;
+    }
+    batch->len = batch->points = 0;
+    batch_head++;
+    http_backoff = 1000;
+
+    if ( keepalive ) {
+        http_state = HTTP_READY;
+    } else {
+        influx_close();
+    }
+    influx_kick();
+}
@@ -0,0 +1,35 @@
+/*
+ *   Current Cost Daemon - InfluxDB line protocol exporter
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef INFLUX_H
+#define INFLUX_H
+
+#include "libini.h"
+#include "sink.h"
+
+/* Register the [influx] options */
+extern void         influx_options(configctx_t *ctx);
+
+/* Set up the batches and return the sink, NULL if no server is configured */
+extern sink_t      *influx_init();
+
+extern void         influx_stats(unsigned long *points, unsigned long *posts, unsigned long *retries, unsigned long *dropped);
+
+#endif /* INFLUX_H */
@@ -0,0 +1,121 @@
+/*
+ *   Current Cost Daemon - latest reading for each sensor
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Each slot is published under a sequence count: it's odd whilst the
+ *   slot is being written, so a reader which sees it change (or odd)
+ *   simply tries again. Readers never write to the table, which lets it
+ *   be mapped read only into other processes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "latest.h"
+
+
+/* Configuration */
+static char        *c_latest_shm         = NULL;
+
+static latest_table_t *table             = NULL;
+static latest_table_t  local;
+
+typedef char latest_sensors_check[LATEST_SENSORS == MAX_SENSORS ? 1 : -1];
+typedef char latest_slot_check[sizeof(latest_slot_t) == 64 ? 1 : -1];
+
+
+void latest_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "latest:shm","Shared memory object to export the latest readings in (eg /currentcost)",OPT_STR,&c_latest_shm);
+}
+
+void latest_init()
+{
+    latest_slot_t  *slot;
+    uint32_t        seq;
+    int             fd, i;
+    void           *map;
+
+    table = &local;
+    if ( c_latest_shm != NULL ) {
+        if ( ( fd = shm_open(c_latest_shm, O_RDWR|O_CREAT, 0644) ) == -1 ||
+             ftruncate(fd, sizeof(latest_table_t)) != 0 ||
+             ( map = mmap(NULL, sizeof(latest_table_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) ) == MAP_FAILED ) {
+            syslog(LOG_ERR,"Unable to export latest readings as %s",c_latest_shm);
+        } else {
+            table = map;
+        }
+        if ( fd != -1 ) {
+            close(fd);
+        }
+    }
+    /* A restart starts from scratch, mappers see the sequence move on.
+       It's written like a reading, and made even again if we died part
+       way through one */
+    for ( i = 0; i < LATEST_SENSORS; i++ ) {
+        slot = &table->slots[i];
+        seq = slot->seq | 1;
+        __atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->watts = 0;
+        slot->ts = slot->temp = slot->kwh = 0;
+        slot->readings = 0;
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+    }
+    table->sensors = LATEST_SENSORS;
+    table->slot_size = sizeof(latest_slot_t);
+    table->version = LATEST_VERSION;
+    table->pid = getpid();
+    __atomic_store_n(&table->magic, LATEST_MAGIC, __ATOMIC_RELEASE);
+}
+
+void latest_close()
+{
+    if ( table != NULL ) {
+        table->pid = 0;
+    }
+}
+
+void latest_publish(reading_t *reading)
+{
+    latest_slot_t  *slot;
+    uint32_t        seq;
+
+    if ( table == NULL || reading->sensor < 0 || reading->sensor >= LATEST_SENSORS ) {
+        return;
+    }
+    slot = &table->slots[reading->sensor];
+    seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->watts = reading->watts;
+    slot->ts = reading->ts;
+    slot->temp = reading->temp;
+    slot->kwh = reading->kwh;
+    slot->readings++;
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+const latest_table_t *latest_table()
+{
+    return table;
+}
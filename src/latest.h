@@ -0,0 +1,110 @@
+/*
+ *   Current Cost Daemon - latest reading for each sensor
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   The table is exported read only as the POSIX shared memory object
+ *   named by latest:shm, other processes can map it and call
+ *   latest_read() on it without making any system calls:
+ *
+ *     int fd = shm_open("/currentcost", O_RDONLY, 0);
+ *     latest_table_t *table = mmap(NULL, sizeof(*table), PROT_READ, MAP_SHARED, fd, 0);
+ *
+ *   Check magic and version before trusting the rest.
+ */
+
+#ifndef LATEST_H
+#define LATEST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LATEST_MAGIC        0x544c4343     /* "CCLT" */
+#define LATEST_VERSION      1
+#define LATEST_SENSORS      10
+
+/* One sensor, a cache line each so readers don't bounce each other */
+typedef struct {
+    uint32_t        seq;           /* Odd whilst being written, carries on over a restart */
+    int32_t         watts;
+    double          ts;            /* Corrected time of the reading */
+    double          temp;
+    double          kwh;           /* Cumulative energy */
+    uint64_t        readings;      /* Readings seen, 0 = never heard */
+    char            pad[24];
+} latest_slot_t;
+
+typedef struct {
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        sensors;       /* Number of slots */
+    uint32_t        slot_size;
+    int64_t         pid;           /* Daemon writing it, 0 once it's stopped */
+    char            pad[40];
+    latest_slot_t   slots[LATEST_SENSORS];
+} latest_table_t;
+
+
+/** \brief Take a consistent copy of a sensor's slot
+ *
+ *  \return 0 - Copied
+ *  \retval -1 - Bad sensor or never heard
+ */
+static inline int latest_read(const latest_table_t *table, int sensor, latest_slot_t *out)
+{
+    const latest_slot_t  *slot;
+    uint32_t              seq;
+
+    if ( sensor < 0 || sensor >= (int)table->sensors ) {
+        return -1;
+    }
+    slot = &table->slots[sensor];
+    do {
+        while ( ( seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) ) & 1 )
+            ;
+        out->watts = __atomic_load_n(&slot->watts, __ATOMIC_RELAXED);
+        out->ts = slot->ts;
+        out->temp = slot->temp;
+        out->kwh = slot->kwh;
+        out->readings = __atomic_load_n(&slot->readings, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ( __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq );
+    out->seq = seq;
+    return out->readings ? 0 : -1;
+}
+
+
+#ifndef LATEST_READER_ONLY
+#include "currentcost.h"
+#include "libini.h"
+
+/* Register the [latest] options */
+extern void         latest_options(configctx_t *ctx);
+
+/* Set up the table, in shared memory if latest:shm is set */
+extern void         latest_init();
+
+/* Mark the table as no longer being updated */
+extern void         latest_close();
+
+/* Publish a reading, only ever called from the main thread */
+extern void         latest_publish(reading_t *reading);
+
+/* The table, for readers within the daemon */
+extern const latest_table_t *latest_table();
+#endif
+
+#endif /* LATEST_H */
@@ -285,6 +285,9 @@ void iniparse_help(configctx_t *ctx, FILE *fp)
         case OPT_INT:
             fprintf(fp,"%s --%-23s (integer)   %s\n", opttext, opt->lopt, opt->desc);
             break;
+        case OPT_FLOAT:
+            fprintf(fp,"%s --%-23s (float)     %s\n", opttext, opt->lopt, opt->desc);
+            break;
         case OPT_STR|OPT_ARRAY:
         case OPT_FILENAME|OPT_ARRAY:
             fprintf(fp,"%s --%-23s (str array) %s\n", opttext, opt->lopt, opt->desc);
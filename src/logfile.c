@@ -0,0 +1,160 @@
+/*
+ *   Current Cost Daemon - appending readings to a file
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Each reading is appended to logfile:path as a line of
+ *
+ *     timestamp sensor watts temperature kwh
+ *
+ *   and events as
+ *
+ *     timestamp sensor alert name raised|cleared value threshold
+ *
+ *   Lines are formatted straight into the buffers of an aio file (see
+ *   aio.c), so writing a reading never waits on the disc. What's been
+ *   written is synced at most every logfile:sync milliseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "logfile.h"
+#include "aio.h"
+
+
+#define LOGFILE_LINE_MAX    256
+
+
+static int          logfile_open(sink_t *sink);
+static int          logfile_write(sink_t *sink, reading_t *reading);
+static int          logfile_event(sink_t *sink, event_t *event);
+
+/* Configuration */
+static char        *c_logfile_path       = NULL;
+static char        *c_logfile_method     = "auto";
+static int          c_logfile_interval   = 1000;
+static int          c_logfile_sync       = 5000;
+static int          c_logfile_buffers    = 8;
+static int          c_logfile_buffer_size = 65536;
+static filter_policy_t c_logfile_filter;
+
+static aio_file_t  *logfile              = NULL;
+
+
+void logfile_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "logfile:path","File to append readings to",OPT_STR,&c_logfile_path);
+    iniparse_add(ctx, 0, "logfile:method","How to write: auto, uring, thread or blocking",OPT_STR,&c_logfile_method);
+    iniparse_add(ctx, 0, "logfile:interval","Milliseconds between writes",OPT_INT,&c_logfile_interval);
+    iniparse_add(ctx, 0, "logfile:sync","Milliseconds between fsyncs (0 = after every write, -1 = never)",OPT_INT,&c_logfile_sync);
+    iniparse_add(ctx, 0, "logfile:buffers","Buffers which can be filled or written at once",OPT_INT,&c_logfile_buffers);
+    iniparse_add(ctx, 0, "logfile:buffer-size","Bytes in each buffer",OPT_INT,&c_logfile_buffer_size);
+    filter_options(ctx, "logfile", &c_logfile_filter);
+}
+
+/** \brief Create the file sink if a path has been configured
+ *
+ *  \return The sink
+ *  \retval NULL - Not configured
+ */
+sink_t *logfile_init()
+{
+    sink_t   *sink;
+
+    if ( c_logfile_path == NULL ) {
+        return NULL;
+    }
+    if ( aio_method(c_logfile_method) == -1 ) {
+        syslog(LOG_WARNING,"Unknown logfile:method <%s>, using auto",c_logfile_method);
+        c_logfile_method = "auto";
+    }
+    if ( c_logfile_buffer_size < LOGFILE_LINE_MAX ) {
+        c_logfile_buffer_size = LOGFILE_LINE_MAX;
+    }
+
+    sink = sink_create("logfile", &c_logfile_filter, logfile_write, NULL);
+    sink->open = logfile_open;
+    sink->event = logfile_event;
+    return sink;
+}
+
+void logfile_close()
+{
+    if ( logfile != NULL ) {
+        aio_close(logfile);
+    }
+}
+
+void logfile_stats(unsigned long *bytes, unsigned long *syncs, unsigned long *dropped, unsigned long *errors)
+{
+    aio_stats_t   stats;
+
+    memset(&stats, 0, sizeof(stats));
+    if ( logfile != NULL ) {
+        aio_stats(logfile, &stats);
+    }
+    *bytes = stats.bytes;
+    *syncs = stats.syncs;
+    *dropped = stats.dropped;
+    *errors = stats.errors;
+}
+
+
+static int logfile_open(sink_t *sink)
+{
+    logfile = aio_open(c_logfile_path, aio_method(c_logfile_method), c_logfile_buffers,
+                       c_logfile_buffer_size, c_logfile_interval, c_logfile_sync);
+    if ( logfile == NULL ) {
+        return -1;
+    }
+    syslog(LOG_INFO,"Appending readings to %s using %s",c_logfile_path,aio_method_name(aio_file_method(logfile)));
+    return 0;
+}
+
+static int logfile_write(sink_t *sink, reading_t *reading)
+{
+    char   *line;
+    int     len;
+
+    if ( logfile == NULL || ( line = aio_reserve(logfile, LOGFILE_LINE_MAX) ) == NULL ) {
+        return -1;
+    }
+    len = snprintf(line, LOGFILE_LINE_MAX, "%.3f %d %d %.1f %.6f\n",
+                   reading->ts, reading->sensor, reading->watts, reading->temp, reading->kwh);
+    aio_commit(logfile, len);
+    return 0;
+}
+
+static int logfile_event(sink_t *sink, event_t *event)
+{
+    char   *line;
+    int     len;
+
+    if ( logfile == NULL || ( line = aio_reserve(logfile, LOGFILE_LINE_MAX) ) == NULL ) {
+        return -1;
+    }
+    len = snprintf(line, LOGFILE_LINE_MAX, "%ld %d alert %s %s %.2f %.2f\n", (long)event->now,
+                   event->sensor, event->name, event->raised ? "raised" : "cleared", event->value, event->threshold);
+    if ( len >= LOGFILE_LINE_MAX ) {
+        len = LOGFILE_LINE_MAX - 1;
+        line[len - 1] = '\n';
+    }
+    aio_commit(logfile, len);
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ *   Current Cost Daemon - appending readings to a file
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef LOGFILE_H
+#define LOGFILE_H
+
+#include "libini.h"
+#include "sink.h"
+
+/* Register the [logfile] options */
+extern void         logfile_options(configctx_t *ctx);
+
+/* Return the sink, NULL if no file is configured */
+extern sink_t      *logfile_init();
+
+/* Write out and sync what's buffered, on the way out */
+extern void         logfile_close();
+
+extern void         logfile_stats(unsigned long *bytes, unsigned long *syncs, unsigned long *dropped, unsigned long *errors);
+
+#endif /* LOGFILE_H */
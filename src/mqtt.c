@@ -0,0 +1,595 @@
+/*
+ *   Current Cost Daemon - MQTT publisher
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   A minimal MQTT 3.1.1 client which runs from the event loop. Readings
+ *   are encoded as PUBLISH packets into a bounded ring as they arrive
+ *   and whatever has accumulated is written out in one go when the
+ *   socket is writable. QoS 1 packets stay in the ring until the broker
+ *   acknowledges them and are resent (with DUP set) after a reconnect.
+ *   When the ring is full the oldest packet is dropped. Packet ids come
+ *   from a counter rather than the slot, so a late PUBACK for a dropped
+ *   packet can't be taken for the one which replaced it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "mqtt.h"
+#include "evloop.h"
+#include "net.h"
+#include "heap.h"
+
+
+#define MQTT_MAX_PACKET     256
+#define MQTT_MAX_CONNECT    512
+#define MQTT_OUTBUF         16384
+#define MQTT_INBUF          1024
+#define MQTT_MAX_BACKOFF    60000
+#define MQTT_CONNECT_TIMEOUT 10000
+
+enum { MQTT_IDLE, MQTT_CONNECTING, MQTT_WAIT_CONNACK, MQTT_CONNECTED };
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_INFLIGHT };
+
+typedef struct {
+    unsigned char   state;
+    unsigned char   qos;
+    unsigned short  len;
+    unsigned short  id;            /* Packet id for QoS 1 */
+    unsigned char   packet[MQTT_MAX_PACKET];
+} slot_t;
+
+
+static void         mqtt_connect();
+static void         mqtt_disconnect(char *why);
+static void         mqtt_io(int fd, int revents, void *data);
+static void         mqtt_timer(void *data);
+static void         mqtt_fill();
+static void         mqtt_flush();
+static void         mqtt_input();
+static void         mqtt_reap();
+static int          mqtt_enqueue(char *topic, char *payload, int qos);
+static int          mqtt_open(sink_t *sink);
+static int          mqtt_write(sink_t *sink, reading_t *reading);
+static int          mqtt_event(sink_t *sink, event_t *event);
+static int          encode_length(unsigned char *buf, int len);
+static int          encode_string(unsigned char *buf, char *str);
+
+/* Configuration */
+static char        *c_mqtt_host          = NULL;
+static int          c_mqtt_port          = 1883;
+static char        *c_mqtt_client_id     = NULL;
+static char        *c_mqtt_topic         = "currentcost";
+static char        *c_mqtt_username      = NULL;
+static char        *c_mqtt_password      = NULL;
+static int          c_mqtt_qos           = 0;
+static int          c_mqtt_keepalive     = 60;
+static int          c_mqtt_queue         = 1024;
+static char         c_mqtt_clean         = 0;
+static filter_policy_t c_mqtt_filter;
+
+/* Connection state */
+static int          mqtt_fd              = -1;
+static net_addr_t   mqtt_addr;
+static int          mqtt_state           = MQTT_IDLE;
+static long long    mqtt_next_connect    = 0;
+static long long    mqtt_connect_start   = 0;
+static int          mqtt_backoff         = 1000;
+static long long    mqtt_last_tx         = 0;
+static long long    mqtt_last_rx         = 0;
+
+/* The ring of packets - head/send/tail are sequence numbers */
+static slot_t      *queue                = NULL;
+static unsigned int queue_head           = 0;
+static unsigned int queue_send           = 0;
+static unsigned int queue_tail           = 0;
+static unsigned short next_id            = 0;
+
+static unsigned char outbuf[MQTT_OUTBUF];
+static int          outlen               = 0;
+static int          outoff               = 0;
+static unsigned char inbuf[MQTT_INBUF];
+static int          inlen                = 0;
+
+static unsigned long stat_published      = 0;
+static unsigned long stat_acked          = 0;
+static unsigned long stat_dropped        = 0;
+
+
+void mqtt_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "mqtt:host","MQTT broker to publish readings to",OPT_STR,&c_mqtt_host);
+    iniparse_add(ctx, 0, "mqtt:port","MQTT broker port",OPT_INT,&c_mqtt_port);
+    iniparse_add(ctx, 0, "mqtt:client-id","MQTT client id (keep it fixed for a persistent session)",OPT_STR,&c_mqtt_client_id);
+    iniparse_add(ctx, 0, "mqtt:topic","Topic prefix to publish under",OPT_STR,&c_mqtt_topic);
+    iniparse_add(ctx, 0, "mqtt:username","MQTT username",OPT_STR,&c_mqtt_username);
+    iniparse_add(ctx, 0, "mqtt:password","MQTT password",OPT_STR,&c_mqtt_password);
+    iniparse_add(ctx, 0, "mqtt:qos","QoS to publish at (0 or 1)",OPT_INT,&c_mqtt_qos);
+    iniparse_add(ctx, 0, "mqtt:keepalive","Keepalive interval in seconds (0 = off)",OPT_INT,&c_mqtt_keepalive);
+    iniparse_add(ctx, 0, "mqtt:queue","Messages to buffer whilst the broker is away (a power of two)",OPT_INT,&c_mqtt_queue);
+    iniparse_add(ctx, 0, "mqtt:clean-session","Start a clean session on each connect",OPT_BOOL,&c_mqtt_clean);
+    filter_options(ctx, "mqtt", &c_mqtt_filter);
+}
+
+/** \brief Create the MQTT sink if a broker has been configured
+ *
+ *  \return The sink
+ *  \retval NULL - MQTT isn't configured
+ */
+sink_t *mqtt_init()
+{
+    static char   client_id[64];
+    sink_t       *sink;
+    int           size;
+
+    if ( c_mqtt_host == NULL ) {
+        return NULL;
+    }
+    if ( c_mqtt_queue < 16 ) {
+        c_mqtt_queue = 16;
+    } else if ( c_mqtt_queue > 16384 ) {
+        /* Under half the ids, so a dropped packet's id isn't reused until
+           well after the broker has acknowledged it */
+        c_mqtt_queue = 16384;
+    }
+    /* A power of two, so the slots follow on when the counters wrap */
+    for ( size = 16; size * 2 <= c_mqtt_queue; size *= 2 ) {
+        ;
+    }
+    c_mqtt_queue = size;
+    if ( c_mqtt_keepalive < 0 ) {
+        c_mqtt_keepalive = 0;
+    } else if ( c_mqtt_keepalive > 65535 ) {
+        c_mqtt_keepalive = 65535;
+    }
+    if ( c_mqtt_qos < 0 || c_mqtt_qos > 1 ) {
+        c_mqtt_qos = 1;
+    }
+    if ( c_mqtt_client_id == NULL ) {
+        char host[40];
+
+        gethostname(host, sizeof(host));
+        host[sizeof(host) - 1] = 0;
+        snprintf(client_id, sizeof(client_id), "currentcostd-%s", host);
+        c_mqtt_client_id = client_id;
+    }
+    /* The CONNECT has to fit: protocol, flags and keepalive then the strings */
+    size = 10 + 2 + strlen(c_mqtt_client_id);
+    if ( c_mqtt_username ) {
+        size += 2 + strlen(c_mqtt_username);
+    }
+    if ( c_mqtt_password ) {
+        size += 2 + strlen(c_mqtt_password);
+    }
+    if ( size > MQTT_MAX_CONNECT ) {
+        syslog(LOG_ERR,"MQTT client id, username and password are too long (%d bytes, at most %d)",size,MQTT_MAX_CONNECT);
+        return NULL;
+    }
+
+    sink = sink_create("mqtt", &c_mqtt_filter, mqtt_write, NULL);
+    sink->open = mqtt_open;
+    sink->event = mqtt_event;
+    return sink;
+}
+
+void mqtt_stats(unsigned long *published, unsigned long *acked, unsigned long *dropped)
+{
+    *published = stat_published;
+    *acked = stat_acked;
+    *dropped = stat_dropped;
+}
+
+
+/* Resolving the broker can block, so it waits until after startup */
+static int mqtt_open(sink_t *sink)
+{
+    if ( ( queue = calloc(c_mqtt_queue, sizeof(slot_t)) ) == NULL ) {
+        return -1;
+    }
+    if ( heap_static() && net_resolve(c_mqtt_host, c_mqtt_port, &mqtt_addr) != 0 ) {
+        syslog(LOG_ERR,"Unable to resolve MQTT broker %s, it won't be tried again",c_mqtt_host);
+    }
+    ev_every(1000, mqtt_timer, NULL);
+    mqtt_connect();
+    return 0;
+}
+
+static int mqtt_write(sink_t *sink, reading_t *reading)
+{
+    char    topic[128];
+    char    payload[160];
+
+    snprintf(topic, sizeof(topic), "%s/sensor/%d", c_mqtt_topic, reading->sensor);
+    snprintf(payload, sizeof(payload), "{\"time\":%ld,\"watts\":%d,\"temp\":%.1f,\"kwh\":%.6f,\"joules\":%.0f}",
+             (long)reading->now, reading->watts, reading->temp, reading->kwh, reading->joules);
+    return mqtt_enqueue(topic, payload, c_mqtt_qos);
+}
+
+static int mqtt_event(sink_t *sink, event_t *event)
+{
+    char    topic[128];
+    char    payload[160];
+
+    snprintf(topic, sizeof(topic), "%s/alert/%s", c_mqtt_topic, event->name);
+    snprintf(payload, sizeof(payload), "{\"time\":%ld,\"state\":\"%s\",\"sensor\":%d,\"value\":%.2f,\"threshold\":%.2f}",
+             (long)event->now, event->raised ? "raised" : "cleared", event->sensor, event->value, event->threshold);
+    /* Alerts matter, so always at least once */
+    return mqtt_enqueue(topic, payload, 1);
+}
+
+/** \brief Encode a PUBLISH into the ring
+ *
+ *  \return 0 - Queued
+ *  \retval -1 - Message too big or there's no ring
+ */
+static int mqtt_enqueue(char *topic, char *payload, int qos)
+{
+    unsigned char  *ptr;
+    slot_t         *slot;
+    int             tlen = strlen(topic);
+    int             plen = strlen(payload);
+    int             rlen = 2 + tlen + ( qos ? 2 : 0 ) + plen;
+
+    /* mqtt_open() failed, the sink is still called */
+    if ( queue == NULL ) {
+        return -1;
+    }
+    if ( rlen + 5 > MQTT_MAX_PACKET ) {
+        return -1;
+    }
+
+    /* Full up, lose the oldest */
+    if ( queue_tail - queue_head == c_mqtt_queue ) {
+        queue[queue_head % c_mqtt_queue].state = SLOT_FREE;
+        queue_head++;
+        if ( (int)( queue_send - queue_head ) < 0 ) {
+            queue_send = queue_head;
+        }
+        stat_dropped++;
+    }
+
+    slot = &queue[queue_tail % c_mqtt_queue];
+    ptr = slot->packet;
+    *ptr++ = 0x30 | ( qos << 1 );
+    ptr += encode_length(ptr, rlen);
+    ptr += encode_string(ptr, topic);
+    slot->id = 0;
+    if ( qos ) {
+        next_id = ( next_id % 65535 ) + 1;
+        slot->id = next_id;
+        *ptr++ = slot->id >> 8;
+        *ptr++ = slot->id & 0xff;
+    }
+    memcpy(ptr, payload, plen);
+    ptr += plen;
+    slot->len = ptr - slot->packet;
+    slot->qos = qos;
+    slot->state = SLOT_QUEUED;
+    queue_tail++;
+    stat_published++;
+
+    if ( mqtt_state == MQTT_CONNECTED ) {
+        ev_mod(mqtt_fd, POLLIN|POLLOUT);
+    }
+    return 0;
+}
+
+static void mqtt_connect()
+{
+    char     *why;
+    int       fd;
+
+    mqtt_next_connect = ev_now() + mqtt_backoff;
+    mqtt_backoff *= 2;
+    if ( mqtt_backoff > MQTT_MAX_BACKOFF ) {
+        mqtt_backoff = MQTT_MAX_BACKOFF;
+    }
+
+    if ( ( fd = net_connect(c_mqtt_host, c_mqtt_port, &mqtt_addr, 0, &why) ) == -1 ) {
+        syslog(LOG_WARNING,"MQTT broker %s: %s",c_mqtt_host,why);
+        return;
+    }
+    mqtt_fd = fd;
+    mqtt_state = MQTT_CONNECTING;
+    mqtt_connect_start = ev_now();
+    outlen = outoff = inlen = 0;
+    ev_add(mqtt_fd, POLLOUT, mqtt_io, NULL);
+}
+
+static void mqtt_disconnect(char *why)
+{
+    unsigned int   seq;
+    slot_t        *slot;
+
+    if ( mqtt_state == MQTT_CONNECTED ) {
+        syslog(LOG_WARNING,"Lost MQTT broker %s: %s",c_mqtt_host,why);
+    }
+    if ( mqtt_fd != -1 ) {
+        ev_del(mqtt_fd);
+        close(mqtt_fd);
+    }
+    mqtt_fd = -1;
+    mqtt_state = MQTT_IDLE;
+    outlen = outoff = inlen = 0;
+
+    /* Anything unacknowledged goes again once we're back */
+    for ( seq = queue_head; seq != queue_send; seq++ ) {
+        slot = &queue[seq % c_mqtt_queue];
+        if ( slot->state == SLOT_INFLIGHT ) {
+            slot->state = SLOT_QUEUED;
+            slot->packet[0] |= 0x08;
+        }
+    }
+    queue_send = queue_head;
+}
+
+static void mqtt_send_connect()
+{
+    unsigned char  *ptr = outbuf;
+    unsigned char   body[MQTT_MAX_CONNECT];
+    unsigned char  *b = body;
+    unsigned char   flags = 0;
+
+    b += encode_string(b, "MQTT");
+    *b++ = 4;                                  /* 3.1.1 */
+    if ( c_mqtt_clean )
+        flags |= 0x02;
+    if ( c_mqtt_username )
+        flags |= 0x80;
+    if ( c_mqtt_password )
+        flags |= 0x40;
+    *b++ = flags;
+    *b++ = c_mqtt_keepalive >> 8;
+    *b++ = c_mqtt_keepalive & 0xff;
+    b += encode_string(b, c_mqtt_client_id);
+    if ( c_mqtt_username )
+        b += encode_string(b, c_mqtt_username);
+    if ( c_mqtt_password )
+        b += encode_string(b, c_mqtt_password);
+
+    *ptr++ = 0x10;
+    ptr += encode_length(ptr, b - body);
+    memcpy(ptr, body, b - body);
+    ptr += b - body;
+    outlen = ptr - outbuf;
+    outoff = 0;
+}
+
+static void mqtt_io(int fd, int revents, void *data)
+{
+    int     err = 0;
+    int     ret;
+    socklen_t len = sizeof(err);
+
+    if ( mqtt_state == MQTT_CONNECTING ) {
+        if ( getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0 ) {
+            mqtt_disconnect(strerror(err));
+            return;
+        }
+        mqtt_state = MQTT_WAIT_CONNACK;
+        mqtt_send_connect();
+        mqtt_flush();
+        ev_mod(fd, POLLIN | ( outoff < outlen ? POLLOUT : 0 ));
+        return;
+    }
+
+    if ( revents & ( POLLIN | POLLHUP | POLLERR ) ) {
+        ret = read(fd, inbuf + inlen, sizeof(inbuf) - inlen);
+        if ( ret == 0 || ( ret < 0 && errno != EAGAIN && errno != EINTR ) ) {
+            mqtt_disconnect(ret == 0 ? "closed" : strerror(errno));
+            return;
+        }
+        if ( ret > 0 ) {
+            inlen += ret;
+            mqtt_last_rx = ev_now();
+            mqtt_input();
+            if ( mqtt_fd == -1 ) {
+                return;
+            }
+        }
+    }
+    if ( revents & POLLOUT ) {
+        mqtt_flush();
+    }
+}
+
+/** \brief Copy queued packets into the output buffer
+ */
+static void mqtt_fill()
+{
+    slot_t   *slot;
+
+    if ( outoff == outlen ) {
+        outoff = outlen = 0;
+    }
+    while ( queue_send != queue_tail ) {
+        slot = &queue[queue_send % c_mqtt_queue];
+        if ( slot->state == SLOT_QUEUED ) {
+            if ( outlen + slot->len > sizeof(outbuf) ) {
+                break;
+            }
+            memcpy(outbuf + outlen, slot->packet, slot->len);
+            outlen += slot->len;
+            slot->state = slot->qos ? SLOT_INFLIGHT : SLOT_FREE;
+        }
+        queue_send++;
+    }
+    mqtt_reap();
+}
+
+static void mqtt_flush()
+{
+    int     ret;
+
+    if ( mqtt_state == MQTT_CONNECTED ) {
+        mqtt_fill();
+    }
+    while ( outoff < outlen ) {
+        ret = write(mqtt_fd, outbuf + outoff, outlen - outoff);
+        if ( ret < 0 ) {
+            if ( errno == EAGAIN || errno == EINTR ) {
+                break;
+            }
+            mqtt_disconnect(strerror(errno));
+            return;
+        }
+        outoff += ret;
+        mqtt_last_tx = ev_now();
+        if ( outoff == outlen && mqtt_state == MQTT_CONNECTED ) {
+            mqtt_fill();
+        }
+    }
+    if ( mqtt_state == MQTT_CONNECTED && outoff == outlen && queue_send == queue_tail ) {
+        ev_mod(mqtt_fd, POLLIN);
+    }
+}
+
+/* Move the head past anything which is finished with */
+static void mqtt_reap()
+{
+    while ( queue_head != queue_send && queue[queue_head % c_mqtt_queue].state == SLOT_FREE ) {
+        queue_head++;
+    }
+}
+
+static void mqtt_input()
+{
+    unsigned char  *ptr;
+    unsigned int    seq;
+    slot_t         *slot;
+    int             rlen, mult, used, id;
+
+    while ( inlen >= 2 ) {
+        /* Decode the remaining length */
+        rlen = 0;
+        mult = 1;
+        used = 1;
+        do {
+            if ( used >= inlen ) {
+                return;
+            }
+            rlen += ( inbuf[used] & 0x7f ) * mult;
+            mult *= 128;
+        } while ( ( inbuf[used++] & 0x80 ) && used < 5 );
+
+        if ( used + rlen > sizeof(inbuf) ) {
+            mqtt_disconnect("oversized packet");
+            return;
+        }
+        if ( used + rlen > inlen ) {
+            return;
+        }
+        ptr = inbuf + used;
+        switch ( inbuf[0] & 0xf0 ) {
+        case 0x20:     /* CONNACK */
+            if ( rlen < 2 || ptr[1] != 0 ) {
+                syslog(LOG_ERR,"MQTT broker refused connection (%d)",rlen < 2 ? -1 : ptr[1]);
+                mqtt_disconnect("refused");
+                return;
+            }
+            syslog(LOG_INFO,"Connected to MQTT broker %s (session %s)",c_mqtt_host,( ptr[0] & 1 ) ? "resumed" : "new");
+            mqtt_state = MQTT_CONNECTED;
+            mqtt_backoff = 1000;
+            ev_mod(mqtt_fd, POLLIN|POLLOUT);
+            break;
+        case 0x40:     /* PUBACK */
+            if ( rlen >= 2 ) {
+                /* Acks come in order, so it's usually the oldest */
+                id = ( ptr[0] << 8 ) | ptr[1];
+                for ( seq = queue_head; seq != queue_send; seq++ ) {
+                    slot = &queue[seq % c_mqtt_queue];
+                    if ( slot->state == SLOT_INFLIGHT && slot->id == id ) {
+                        slot->state = SLOT_FREE;
+                        stat_acked++;
+                        mqtt_reap();
+                        break;
+                    }
+                }
+            }
+            break;
+        case 0xd0:     /* PINGRESP */
+            break;
+        }
+        memmove(inbuf, inbuf + used + rlen, inlen - used - rlen);
+        inlen -= used + rlen;
+    }
+}
+
+static void mqtt_timer(void *data)
+{
+    long long   now = ev_now();
+
+    switch ( mqtt_state ) {
+    case MQTT_IDLE:
+        if ( now >= mqtt_next_connect ) {
+            mqtt_connect();
+        }
+        break;
+    case MQTT_CONNECTING:
+    case MQTT_WAIT_CONNACK:
+        if ( now - mqtt_connect_start > MQTT_CONNECT_TIMEOUT ) {
+            mqtt_disconnect("timed out connecting");
+        }
+        break;
+    case MQTT_CONNECTED:
+        /* A keepalive of 0 turns it off */
+        if ( c_mqtt_keepalive <= 0 ) {
+            break;
+        }
+        if ( now - mqtt_last_rx > c_mqtt_keepalive * 1500 ) {
+            mqtt_disconnect("keepalive timeout");
+        } else if ( now - mqtt_last_tx >= c_mqtt_keepalive * 500 && outlen + 2 <= sizeof(outbuf) ) {
+            outbuf[outlen++] = 0xc0;       /* PINGREQ */
+            outbuf[outlen++] = 0x00;
+            mqtt_last_tx = now;
+            ev_mod(mqtt_fd, POLLIN|POLLOUT);
+        }
+        break;
+    }
+}
+
+static int encode_length(unsigned char *buf, int len)
+{
+    int     i = 0;
+
+    do {
+        buf[i] = len % 128;
+        len /= 128;
+        if ( len > 0 ) {
+            buf[i] |= 0x80;
+        }
+        i++;
+    } while ( len > 0 );
+    return i;
+}
+
+static int encode_string(unsigned char *buf, char *str)
+{
+    int     len = strlen(str);
+
+    buf[0] = len >> 8;
+    buf[1] = len & 0xff;
+    memcpy(buf + 2, str, len);
+    return len + 2;
+}
@@ -0,0 +1,35 @@
+/*
+ *   Current Cost Daemon - MQTT publisher
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MQTT_H
+#define MQTT_H
+
+#include "libini.h"
+#include "sink.h"
+
+/* Register the [mqtt] options */
+extern void         mqtt_options(configctx_t *ctx);
+
+/* Start connecting and return the sink, NULL if no broker is configured */
+extern sink_t      *mqtt_init();
+
+extern void         mqtt_stats(unsigned long *published, unsigned long *acked, unsigned long *dropped);
+
+#endif /* MQTT_H */
@@ -0,0 +1,118 @@
+/*
+ *   Current Cost Daemon - outgoing connections
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   getaddrinfo() allocates, so with heap:static the clients look their
+ *   host up once whilst starting and keep connecting to that address.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "net.h"
+#include "heap.h"
+
+
+static int          net_socket(int family, int keepalive);
+
+
+int net_resolve(char *host, int port, net_addr_t *addr)
+{
+    struct addrinfo   hints, *res;
+    char              service[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if ( getaddrinfo(host, service, &hints, &res) != 0 ) {
+        return -1;
+    }
+    memcpy(&addr->addr, res->ai_addr, res->ai_addrlen);
+    addr->len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+int net_connect(char *host, int port, net_addr_t *addr, int keepalive, char **why)
+{
+    struct addrinfo   hints, *res, *ai;
+    char              service[16];
+    int               fd = -1;
+
+    if ( heap_static() ) {
+        if ( addr->len == 0 ) {
+            *why = "unable to resolve host at startup";
+            return -1;
+        }
+        if ( ( fd = net_socket(addr->addr.ss_family, keepalive) ) != -1 &&
+             connect(fd, (struct sockaddr *)&addr->addr, addr->len) != 0 && errno != EINPROGRESS ) {
+            close(fd);
+            fd = -1;
+        }
+        *why = "unable to connect";
+        return fd;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if ( getaddrinfo(host, service, &hints, &res) != 0 ) {
+        *why = "unable to resolve host";
+        return -1;
+    }
+    for ( ai = res; ai != NULL; ai = ai->ai_next ) {
+        if ( ( fd = net_socket(ai->ai_family, keepalive) ) == -1 ) {
+            continue;
+        }
+        if ( connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS ) {
+            memcpy(&addr->addr, ai->ai_addr, ai->ai_addrlen);
+            addr->len = ai->ai_addrlen;
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    *why = "unable to connect";
+    return fd;
+}
+
+
+static int net_socket(int family, int keepalive)
+{
+    int     fd, one = 1;
+
+    if ( ( fd = socket(family, SOCK_STREAM, 0) ) == -1 ) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if ( keepalive ) {
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    }
+    return fd;
+}
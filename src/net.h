@@ -0,0 +1,41 @@
+/*
+ *   Current Cost Daemon - outgoing connections
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include <sys/socket.h>
+
+/* Where a client last connected to */
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t       len;           /* 0 = not looked up yet */
+} net_addr_t;
+
+/* Look the host up now rather than on the first connect, returns -1 if
+   it can't be */
+extern int          net_resolve(char *host, int port, net_addr_t *addr);
+
+/* Start a non-blocking TCP connection with Nagle off, returns the
+   descriptor or -1 with why set. The host is looked up each time unless
+   heap:static is set, when the address from net_resolve() is kept */
+extern int          net_connect(char *host, int port, net_addr_t *addr, int keepalive, char **why);
+
+#endif /* NET_H */
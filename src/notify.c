@@ -0,0 +1,161 @@
+/*
+ *   Current Cost Daemon - service manager notifications
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   The sd_notify() protocol without libsystemd: datagrams of
+ *   "NAME=value" lines sent to the socket named by NOTIFY_SOCKET, a
+ *   leading '@' meaning the abstract namespace. Anything listening on a
+ *   datagram socket will do for testing:
+ *
+ *     socat UNIX-RECV:/tmp/notify.sock - &
+ *     NOTIFY_SOCKET=/tmp/notify.sock WATCHDOG_USEC=2000000 currentcostd ...
+ *
+ *   The watchdog is pinged from the event loop, and only whilst readings
+ *   are arriving: after notify:stall seconds without one the pings stop
+ *   and the service manager can restart us.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "notify.h"
+#include "evloop.h"
+
+
+static void         notify_watchdog(void *data);
+
+/* Configuration */
+static int          c_notify_stall       = 60;
+
+static int          notify_fd            = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t    notify_len           = 0;
+static long long    started              = 0;
+static long long    last_reading         = 0;
+static unsigned long readings            = 0;
+static int          stalled              = 0;
+
+
+void notify_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "notify:stall","Seconds without a reading before the watchdog stops being pinged (0 = never)",OPT_INT,&c_notify_stall);
+}
+
+void notify_init()
+{
+    char       *socket_name = getenv("NOTIFY_SOCKET");
+    char       *usec = getenv("WATCHDOG_USEC");
+    char       *pid = getenv("WATCHDOG_PID");
+    long long   interval = 0;
+    size_t      len;
+
+    started = ev_now();
+    if ( usec && ( pid == NULL || atoi(pid) == getpid() ) ) {
+        interval = atoll(usec) / 1000;
+    }
+    /* The commands we run aren't ours to report on */
+    unsetenv("WATCHDOG_USEC");
+    unsetenv("WATCHDOG_PID");
+
+    if ( socket_name == NULL || ( len = strlen(socket_name) ) < 2 || len >= sizeof(notify_addr.sun_path) ||
+         ( socket_name[0] != '/' && socket_name[0] != '@' ) ) {
+        unsetenv("NOTIFY_SOCKET");
+        return;
+    }
+    memset(&notify_addr, 0, sizeof(notify_addr));
+    notify_addr.sun_family = AF_UNIX;
+    memcpy(notify_addr.sun_path, socket_name, len);
+    if ( socket_name[0] == '@' ) {
+        notify_addr.sun_path[0] = 0;
+    }
+    notify_len = offsetof(struct sockaddr_un, sun_path) + len;
+    unsetenv("NOTIFY_SOCKET");
+
+    if ( ( notify_fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0) ) == -1 ) {
+        syslog(LOG_ERR,"Unable to create notify socket");
+        return;
+    }
+    /* Ping at half the timeout, as sd_watchdog_enabled() suggests */
+    if ( interval > 0 ) {
+        ev_every(interval / 2 > 10 ? interval / 2 : 10, notify_watchdog, NULL);
+        syslog(LOG_INFO,"Watchdog enabled, pinging every %lldms",interval / 2);
+    }
+}
+
+int notify_send(char *fmt, ...)
+{
+    char      buf[512];
+    va_list   ap;
+    int       len;
+
+    if ( notify_fd == -1 ) {
+        return 0;
+    }
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if ( len >= sizeof(buf) ) {
+        len = sizeof(buf) - 1;
+    }
+    return sendto(notify_fd, buf, len, MSG_NOSIGNAL, (struct sockaddr *)&notify_addr, notify_len) == len ? 0 : -1;
+}
+
+void notify_ready()
+{
+    syslog(LOG_INFO,"Ready after %lldms",ev_now() - started);
+    notify_send("READY=1\nMAINPID=%d\nSTATUS=Waiting for the first reading", (int)getpid());
+}
+
+void notify_stopping()
+{
+    notify_send("STOPPING=1");
+}
+
+void notify_reading()
+{
+    last_reading = ev_now();
+    readings++;
+}
+
+
+static void notify_watchdog(void *data)
+{
+    long long   now = ev_now();
+    long long   since = now - ( last_reading ? last_reading : started );
+
+    if ( c_notify_stall > 0 && since > c_notify_stall * 1000LL ) {
+        if ( stalled == 0 ) {
+            syslog(LOG_WARNING,"No readings for %llds, letting the watchdog expire",since / 1000);
+            notify_send("STATUS=No readings for %llds", since / 1000);
+            stalled = 1;
+        }
+        return;
+    }
+    stalled = 0;
+    if ( last_reading ) {
+        notify_send("WATCHDOG=1\nSTATUS=%lu readings, last %llds ago", readings, since / 1000);
+    } else {
+        notify_send("WATCHDOG=1");
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ *   Current Cost Daemon - service manager notifications
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include "libini.h"
+
+extern void         notify_options(configctx_t *ctx);
+
+/* Pick up NOTIFY_SOCKET and WATCHDOG_USEC, does nothing without them */
+extern void         notify_init();
+
+/* Send a message such as "STATUS=..." to the service manager */
+extern int          notify_send(char *fmt, ...);
+
+extern void         notify_ready();
+extern void         notify_stopping();
+
+/* A reading made it through the pipeline */
+extern void         notify_reading();
+
+#endif /* NOTIFY_H */
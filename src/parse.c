@@ -0,0 +1,118 @@
+/*
+ *   Current Cost Daemon - CC128 line parsing
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "parse.h"
+
+
+/* Picks out the same fields as the regex this used to be,
+
+     <time>(.*):(.*):(.*)</time>.*<tmpr>(.*)</tmpr>.*<ch1><watts>(.*)</watts>
+
+   but in place, regcomp() and regexec() allocate and so did copying the
+   matches out */
+int parse_reading(char *line, time_t now, long long rx, reading_t *reading)
+{
+    char            *time, *time_end, *tmpr, *watts, *min, *sec;
+    char            *ptr;
+    struct tm         tm;
+
+    if ( ( time = strstr(line, "<time>") ) == NULL ||
+         ( time_end = strstr(time, "</time>") ) == NULL ||
+         ( tmpr = strstr(time_end, "<tmpr>") ) == NULL || strstr(tmpr, "</tmpr>") == NULL ||
+         ( watts = strstr(tmpr, "<ch1><watts>") ) == NULL || strstr(watts, "</watts>") == NULL ) {
+        return -1;
+    }
+    time += 6;
+    if ( ( min = memchr(time, ':', time_end - time) ) == NULL ||
+         ( sec = memchr(min + 1, ':', time_end - min - 1) ) == NULL ) {
+        return -1;
+    }
+
+    memset(reading, 0, sizeof(*reading));
+    if ( ( ptr = strstr(line,"<sensor>") ) != NULL ) {
+        reading->sensor = atoi(ptr + 8);
+    }
+    reading->now = now;
+    reading->rx = rx;
+    reading->hour = atoi(time);
+    reading->min = atoi(min + 1);
+    reading->sec = atoi(sec + 1);
+    reading->temp = atof(tmpr + 6);
+    reading->watts = atoi(watts + 12);
+
+    localtime_r(&reading->now,&tm);
+    reading->offset = (reading->hour * 3600) + (reading->min*60) + reading->sec;
+    reading->offset -= ( ( tm.tm_hour * 3600 ) + ( tm.tm_min * 60 ) + tm.tm_sec);
+    return 0;
+}
+
+/* History comes as
+
+     <time>HH:MM:SS</time><hist>...<units>kwhr</units>
+       <data><sensor>N</sensor><h002>001.2</h002><h004>...</data>...</hist>
+
+   with a data block for each sensor. Only the hNNN (two hourly) totals
+   are taken, the daily and monthly ones are too coarse to be of use */
+int parse_history(char *line, time_t now, history_t *hist)
+{
+    char            *time, *data, *end, *ptr;
+    int              sensor;
+
+    if ( ( time = strstr(line, "<time>") ) == NULL || strstr(time, "</time>") == NULL ||
+         strstr(time, "<hist>") == NULL || strstr(time, "<units>kwhr</units>") == NULL ) {
+        return -1;
+    }
+    time += 6;
+    if ( time[2] != ':' || time[5] != ':' ) {
+        return -1;
+    }
+    hist->now = now;
+    hist->hour = atoi(time);
+    hist->min = atoi(time + 3);
+    hist->sec = atoi(time + 6);
+    hist->num = 0;
+
+    for ( data = strstr(time, "<data>"); data != NULL; data = strstr(end, "<data>") ) {
+        if ( ( end = strstr(data, "</data>") ) == NULL ) {
+            break;
+        }
+        if ( ( ptr = strstr(data, "<sensor>") ) == NULL || ptr > end ) {
+            continue;
+        }
+        sensor = atoi(ptr + 8);
+        for ( ptr = data; ( ptr = strstr(ptr, "<h") ) != NULL && ptr < end; ptr += 2 ) {
+            if ( ptr[5] != '>' || hist->num >= MAX_HISTORY ||
+                 !isdigit(ptr[2]) || !isdigit(ptr[3]) || !isdigit(ptr[4]) ) {
+                continue;
+            }
+            hist->totals[hist->num].sensor = sensor;
+            hist->totals[hist->num].ago = atoi(ptr + 2);
+            hist->totals[hist->num].kwh = atof(ptr + 6);
+            hist->num++;
+        }
+    }
+    return hist->num;
+}
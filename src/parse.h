@@ -0,0 +1,47 @@
+/*
+ *   Current Cost Daemon - CC128 line parsing
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef PARSE_H
+#define PARSE_H
+
+#include "currentcost.h"
+
+/** \brief Fill in a reading from a line sent by the meter
+ *
+ *  \param line - Line without its newline
+ *  \param now - Wall clock time it arrived
+ *  \param rx - CLOCK_MONOTONIC ns it started arriving
+ *
+ *  \return 0 - Reading filled in
+ *  \retval -1 - Not a reading (eg a history block)
+ */
+extern int          parse_reading(char *line, time_t now, long long rx, reading_t *reading);
+
+/** \brief Pick the hourly kWh totals out of a history message
+ *
+ *  \param line - Line without its newline
+ *  \param now - Wall clock time it arrived
+ *
+ *  \return Number of totals filled in
+ *  \retval -1 - Not a history message with hourly kWh totals
+ */
+extern int          parse_history(char *line, time_t now, history_t *hist);
+
+#endif /* PARSE_H */
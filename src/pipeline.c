@@ -0,0 +1,208 @@
+/*
+ *   Current Cost Daemon - reading pipeline
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   The standard set of stages is composed at build time into a single
+ *   function. Stages which aren't configured return straight away, so
+ *   that covers the usual setups. If something inserts a stage of its
+ *   own we fall back to a chain of function pointers. Nothing in the
+ *   daemon inserts one yet, so the chain is only run when built with
+ *   -DPIPELINE_DYNAMIC, which is there to benchmark it against the
+ *   static pipeline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "pipeline.h"
+#include "energy.h"
+#include "gap.h"
+#include "dedup.h"
+#include "ring.h"
+#include "latest.h"
+#include "feed.h"
+#include "tariff.h"
+#include "alert.h"
+#include "disagg.h"
+#include "sink.h"
+
+
+static int stage_stamp(reading_t *reading)
+{
+    energy_stamp(reading);
+    return 1;
+}
+
+static int stage_dedup(reading_t *reading)
+{
+    return dedup_sample(reading);
+}
+
+static int stage_energy(reading_t *reading)
+{
+    energy_sample(reading);
+    return 1;
+}
+
+static int stage_gap(reading_t *reading)
+{
+    gap_sample(reading);
+    return 1;
+}
+
+static int stage_ring(reading_t *reading)
+{
+    ring_push(reading);
+    return 1;
+}
+
+static int stage_latest(reading_t *reading)
+{
+    latest_publish(reading);
+    return 1;
+}
+
+static int stage_feed(reading_t *reading)
+{
+    feed_publish(reading);
+    return 1;
+}
+
+static int stage_tariff(reading_t *reading)
+{
+    tariff_sample(reading);
+    return 1;
+}
+
+static int stage_alert(reading_t *reading)
+{
+    alert_sample(reading);
+    return 1;
+}
+
+static int stage_disagg(reading_t *reading)
+{
+    disagg_sample(reading);
+    return 1;
+}
+
+static int stage_sinks(reading_t *reading)
+{
+    sink_dispatch(reading);
+    return 1;
+}
+
+#define STANDARD_STAGES(X) \
+    X(stage_stamp)  \
+    X(stage_dedup)  \
+    X(stage_energy) \
+    X(stage_gap)    \
+    X(stage_ring)   \
+    X(stage_latest) \
+    X(stage_feed)   \
+    X(stage_tariff) \
+    X(stage_alert)  \
+    X(stage_disagg) \
+    X(stage_sinks)
+
+PIPELINE_STATIC(pipeline_static, STANDARD_STAGES)
+
+static stage_fn     standard[STAGE_END] = { stage_stamp, stage_dedup, stage_energy, stage_gap, stage_ring, stage_latest, stage_feed, stage_tariff, stage_alert, stage_disagg, stage_sinks };
+static pipeline_t   extra[STAGE_END + 1];
+static int          num_extra = 0;
+static pipeline_t   chain;
+static int          chain_at[STAGE_END + 1];   /* Where each standard stage's extras start */
+static int          use_chain = 0;
+
+
+/** \brief Add a stage before one of the standard ones
+ *
+ *  \return 0 - Added
+ *  \retval -1 - No such stage or the chain would be too long
+ */
+int pipeline_insert(int before, stage_fn fn)
+{
+    if ( before < 0 || before > STAGE_END ) {
+        return -1;
+    }
+    /* The standard stages have to fit in the chain after the extras */
+    if ( STAGE_END + num_extra >= MAX_STAGES ) {
+        syslog(LOG_ERR,"No room for another pipeline stage, at most %d can be added",MAX_STAGES - STAGE_END);
+        return -1;
+    }
+    if ( pipeline_chain_add(&extra[before], fn) != 0 ) {
+        return -1;
+    }
+    num_extra++;
+    return 0;
+}
+
+/** \brief Build the chain from the standard stages and any inserted
+ *
+ *  \return 0 - Ready
+ *  \retval -1 - The stages didn't fit
+ */
+int pipeline_init()
+{
+    int     i, j;
+
+    chain.num = 0;
+    for ( i = 0; i <= STAGE_END; i++ ) {
+        chain_at[i] = chain.num;
+        for ( j = 0; j < extra[i].num; j++ ) {
+            if ( pipeline_chain_add(&chain, extra[i].stages[j]) != 0 ) {
+                syslog(LOG_ERR,"Too many pipeline stages, at most %d",MAX_STAGES);
+                return -1;
+            }
+        }
+        if ( i < STAGE_END && pipeline_chain_add(&chain, standard[i]) != 0 ) {
+            syslog(LOG_ERR,"Too many pipeline stages, at most %d",MAX_STAGES);
+            return -1;
+        }
+    }
+#ifdef PIPELINE_DYNAMIC
+    use_chain = 1;
+#else
+    use_chain = num_extra > 0;
+#endif
+    syslog(LOG_INFO,"Using %s pipeline of %d stages",use_chain ? "dynamic" : "static",chain.num);
+    return 0;
+}
+
+int pipeline_run(reading_t *reading)
+{
+    if ( use_chain ) {
+        return pipeline_chain_run(&chain, reading);
+    }
+    return pipeline_static(reading);
+}
+
+int pipeline_resume(int stage, reading_t *reading)
+{
+    int     i;
+
+    if ( stage < 0 || stage > STAGE_END ) {
+        return 0;
+    }
+    for ( i = chain_at[stage]; i < chain.num; i++ ) {
+        if ( chain.stages[i](reading) == 0 ) {
+            return 0;
+        }
+    }
+    return 1;
+}
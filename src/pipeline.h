@@ -0,0 +1,89 @@
+/*
+ *   Current Cost Daemon - reading pipeline
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "currentcost.h"
+
+#define MAX_STAGES      16
+
+/* A stage works on the reading in place, returning 0 to drop it */
+typedef int (*stage_fn)(reading_t *reading);
+
+/* Dynamic chain of stages */
+typedef struct {
+    int             num;
+    stage_fn        stages[MAX_STAGES];
+} pipeline_t;
+
+
+/* Compose a list of stages into a single function at build time:
+ *
+ *   #define MY_STAGES(X) X(stage_a) X(stage_b)
+ *   PIPELINE_STATIC(my_pipeline, MY_STAGES)
+ *
+ * gives a my_pipeline(reading) which calls the stages directly, so the
+ * compiler can inline them into one another.
+ */
+#define PIPELINE_CALL(fn)   if ( fn(reading) == 0 ) return 0;
+#define PIPELINE_STATIC(name, STAGES) \
+    static inline int name(reading_t *reading) { STAGES(PIPELINE_CALL) return 1; }
+
+static inline int pipeline_chain_run(pipeline_t *pipeline, reading_t *reading)
+{
+    int     i;
+
+    for ( i = 0; i < pipeline->num; i++ ) {
+        if ( pipeline->stages[i](reading) == 0 ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline int pipeline_chain_add(pipeline_t *pipeline, stage_fn fn)
+{
+    if ( pipeline->num >= MAX_STAGES ) {
+        return -1;
+    }
+    pipeline->stages[pipeline->num++] = fn;
+    return 0;
+}
+
+
+/* The daemon's pipeline */
+enum { STAGE_STAMP, STAGE_DEDUP, STAGE_ENERGY, STAGE_GAP, STAGE_RING, STAGE_LATEST, STAGE_FEED, STAGE_TARIFF, STAGE_ALERT, STAGE_DISAGG, STAGE_SINKS, STAGE_END };
+
+/* Add an extra stage before one of the standard ones, this forces the
+   dynamic chain so call it before pipeline_init(). Only MAX_STAGES -
+   STAGE_END can be added */
+extern int          pipeline_insert(int before, stage_fn fn);
+
+extern int          pipeline_init();
+
+/* Run a freshly parsed reading through to the sinks */
+extern int          pipeline_run(reading_t *reading);
+
+/* Carry on with a reading held back by a stage, from the standard stage
+   given (and any inserted before it) */
+extern int          pipeline_resume(int stage, reading_t *reading);
+
+#endif /* PIPELINE_H */
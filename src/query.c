@@ -0,0 +1,783 @@
+/*
+ *   Current Cost Daemon - query socket
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   A client sends one request line on the UNIX socket at query:socket:
+ *
+ *     latest [SENSOR]
+ *     range SENSOR FROM TO
+ *     agg SENSOR FROM TO STEP
+ *     appliances SENSOR FROM TO
+ *     lttb SENSOR FROM TO POINTS
+ *     gaps SENSOR FROM TO
+ *     metrics
+ *
+ *   Times are epoch seconds and ranges are FROM <= ts < TO. The answer
+ *   is "OK", a line per result and "END count", or a single "ERR why".
+ *   Result lines are:
+ *
+ *     latest:  sensor ts watts temp kwh
+ *     range:   ts watts temp joules
+ *     agg:     start count min max mean kwh
+ *     appliances: id watts switches kwh
+ *     lttb:    ts watts
+ *     gaps:    start seconds kwh estimated|partial|filled
+ *     metrics: name value
+ *
+ *   Each client gets a thread of its own which reads the store directly,
+ *   so a long query never holds up the serial port. Readings still in
+ *   the in memory ring are taken from there rather than the disc.
+ *   Aggregates are built from the coarsest rollups that line up with
+ *   the step, finishing off with raw readings for the part that hasn't
+ *   been rolled up yet.
+ *
+ *   lttb thins a range down to at most POINTS for charting with Largest
+ *   Triangle Three Buckets: the range is cut into POINTS - 2 buckets of
+ *   time and from each the reading making the largest triangle with the
+ *   one chosen before and the mean of the bucket after is kept, along
+ *   with the first and last readings. It's done as the readings stream
+ *   past, holding only two buckets, from the rollups when a bucket
+ *   covers at least QUERY_LTTB_SAMPLES of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "query.h"
+#include "store.h"
+#include "ring.h"
+#include "latest.h"
+#include "mqtt.h"
+#include "influx.h"
+#include "federate.h"
+#include "collector.h"
+#include "logfile.h"
+#include "capture.h"
+#include "trace.h"
+#include "disagg.h"
+#include "dedup.h"
+#include "gap.h"
+#include "heap.h"
+
+
+/* Results are written out in chunks of this size */
+#define QUERY_CHUNK         32768
+#define QUERY_LINE_MAX      128
+
+/* Most points a downsample can ask for, and the rollups a bucket needs
+   to span before they're used instead of the readings */
+#define QUERY_LTTB_MAX      100000
+#define QUERY_LTTB_SAMPLES  4
+
+typedef struct {
+    double          ts;
+    double          watts;
+} lttb_point_t;
+
+typedef struct {
+    lttb_point_t   *points;
+    int             num;
+    int             size;
+    double          ts;            /* Sums for the mean */
+    double          watts;
+} lttb_bucket_t;
+
+typedef struct {
+    int             fd;
+    int             len;
+    long            count;
+    int             failed;
+
+    /* Aggregate being built */
+    time_t          from;
+    int             step;
+    int             span;          /* Seconds covered by each rollup */
+    time_t          start;
+    long            num;
+    int32_t         min;
+    int32_t         max;
+    double          watts;
+    double          joules;
+    time_t          covered;       /* Rollups have been seen up to here */
+
+    /* Appliance totals */
+    struct {
+        double      watts;
+        long        switches;
+        double      joules;
+    } usage[DISAGG_APPLIANCES];
+
+    /* Downsample being built */
+    double          width;         /* Seconds per bucket */
+    long            buckets;
+    long            bucket;        /* Bucket that next is filling */
+    int             started;       /* The first reading has gone out */
+    lttb_point_t    chosen;        /* Last point sent */
+    lttb_bucket_t   waiting;       /* Bucket to choose from once next is done */
+    lttb_bucket_t   next;
+
+    char            buf[QUERY_CHUNK];
+} client_t;
+
+
+static void        *query_accept(void *arg);
+static void        *query_client(void *arg);
+static void         query_request(client_t *client, char *line);
+static void         query_printf(client_t *client, char *fmt, ...);
+static void         query_send(client_t *client);
+static void         query_raw(client_t *client, int sensor, time_t from, time_t to, store_scan_fn fn);
+static void         query_metrics(client_t *client);
+static void         query_metric(client_t *client, char *name, long long value);
+static int          query_range(void *record, void *arg);
+static int          query_agg_rollup(void *record, void *arg);
+static int          query_agg_raw(void *record, void *arg);
+static int          query_appliance(void *record, void *arg);
+static int          query_lttb_rollup(void *record, void *arg);
+static int          query_lttb_raw(void *record, void *arg);
+static int          query_gap(gap_t *gap, void *arg);
+static void         agg_add(client_t *client, time_t ts, long count, int32_t min, int32_t max, double watts, double joules);
+static void         agg_emit(client_t *client);
+static void         lttb_add(client_t *client, double ts, double watts);
+static void         lttb_choose(client_t *client, lttb_bucket_t *bucket, double ts, double watts);
+static void         lttb_finish(client_t *client);
+static void         lttb_emit(client_t *client, lttb_point_t *point);
+
+/* Configuration */
+static char        *c_query_socket       = NULL;
+static int          c_query_clients      = 4;
+
+static int          query_fd             = -1;
+static int          query_active         = 0;
+
+
+void query_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "query:socket","UNIX socket to answer queries on",OPT_STR,&c_query_socket);
+    iniparse_add(ctx, 0, "query:max-clients","Queries to answer at once",OPT_INT,&c_query_clients);
+}
+
+int query_init()
+{
+    struct sockaddr_un  addr;
+    pthread_t           tid;
+    sigset_t            all, old;
+
+    if ( c_query_socket == NULL ) {
+        return -1;
+    }
+    if ( strlen(c_query_socket) >= sizeof(addr.sun_path) ) {
+        syslog(LOG_ERR,"Query socket path %s is too long",c_query_socket);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, c_query_socket);
+    unlink(c_query_socket);
+
+    if ( ( query_fd = socket(AF_UNIX, SOCK_STREAM, 0) ) == -1 ||
+         bind(query_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+         listen(query_fd, 16) != 0 ) {
+        syslog(LOG_ERR,"Unable to listen on %s: %s",c_query_socket,strerror(errno));
+        if ( query_fd != -1 ) {
+            close(query_fd);
+            query_fd = -1;
+        }
+        return -1;
+    }
+
+    /* Leave the signals to the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if ( pthread_create(&tid, NULL, query_accept, NULL) != 0 ) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        close(query_fd);
+        query_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    syslog(LOG_INFO,"Answering queries on %s",c_query_socket);
+    return 0;
+}
+
+void query_close()
+{
+    if ( query_fd != -1 ) {
+        unlink(c_query_socket);
+    }
+}
+
+
+static void *query_accept(void *arg)
+{
+    pthread_attr_t   attr;
+    pthread_t        tid;
+    client_t        *client;
+    int              fd;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while ( 1 ) {
+        if ( ( fd = accept(query_fd, NULL, NULL) ) == -1 ) {
+            if ( errno != EINTR && errno != ECONNABORTED ) {
+                sleep(1);
+            }
+            continue;
+        }
+        if ( __sync_fetch_and_add(&query_active, 1) >= c_query_clients ) {
+            __sync_fetch_and_sub(&query_active, 1);
+            if ( write(fd, "ERR busy\n", 9) < 0 ) {
+                /* Nothing we can do */
+            }
+            close(fd);
+            continue;
+        }
+        client = calloc(1, sizeof(*client));
+        client->fd = fd;
+        if ( pthread_create(&tid, &attr, query_client, client) != 0 ) {
+            __sync_fetch_and_sub(&query_active, 1);
+            close(fd);
+            free(client);
+        }
+    }
+    return NULL;
+}
+
+static void *query_client(void *arg)
+{
+    client_t        *client = arg;
+    struct timeval   tv = { 10, 0 };
+    char             line[256];
+    char            *end;
+    int              len = 0, ret;
+
+    setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(client->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while ( len < sizeof(line) - 1 ) {
+        if ( ( ret = read(client->fd, line + len, sizeof(line) - len - 1) ) <= 0 ) {
+            break;
+        }
+        len += ret;
+        line[len] = 0;
+        if ( ( end = strchr(line, '\n') ) != NULL ) {
+            *end = 0;
+            if ( end > line && end[-1] == '\r' ) {
+                end[-1] = 0;
+            }
+            query_request(client, line);
+            break;
+        }
+    }
+    close(client->fd);
+    free(client);
+    __sync_fetch_and_sub(&query_active, 1);
+    return NULL;
+}
+
+static void query_request(client_t *client, char *line)
+{
+    latest_slot_t slot;
+    char        *argv[6];
+    char        *save;
+    int          argc = 0;
+    int          sensor, level, i;
+    time_t       from, to;
+
+    while ( argc < 6 && ( argv[argc] = strtok_r(argc ? NULL : line, " \t", &save) ) != NULL ) {
+        argc++;
+    }
+    if ( argc == 0 ) {
+        query_printf(client, "ERR empty request\n");
+    } else if ( strcmp(argv[0], "latest") == 0 && argc <= 2 ) {
+        query_printf(client, "OK\n");
+        for ( sensor = 0; sensor < MAX_SENSORS; sensor++ ) {
+            if ( ( argc == 1 || sensor == atoi(argv[1]) ) && latest_read(latest_table(), sensor, &slot) == 0 ) {
+                query_printf(client, "%d %.3f %d %.1f %.6f\n", sensor, slot.ts, slot.watts, slot.temp, slot.kwh);
+                client->count++;
+            }
+        }
+        query_printf(client, "END %ld\n", client->count);
+    } else if ( strcmp(argv[0], "range") == 0 && argc == 4 ) {
+        sensor = atoi(argv[1]);
+        from = strtol(argv[2], NULL, 10);
+        to = strtol(argv[3], NULL, 10);
+        if ( from >= to || sensor < 0 || sensor >= MAX_SENSORS ) {
+            query_printf(client, "ERR bad range\n");
+        } else {
+            query_printf(client, "OK\n");
+            query_raw(client, sensor, from, to, query_range);
+            query_printf(client, "END %ld\n", client->count);
+        }
+    } else if ( strcmp(argv[0], "agg") == 0 && argc == 5 ) {
+        sensor = atoi(argv[1]);
+        from = strtol(argv[2], NULL, 10);
+        to = strtol(argv[3], NULL, 10);
+        client->step = atoi(argv[4]);
+        if ( client->step < 1 || from >= to || sensor < 0 || sensor >= MAX_SENSORS ) {
+            query_printf(client, "ERR bad aggregate\n");
+        } else {
+            client->from = client->start = client->covered = from;
+            query_printf(client, "OK\n");
+
+            /* Coarsest rollup that fits the buckets, then raw for the rest */
+            for ( level = STORE_HOUR; level > STORE_RAW; level-- ) {
+                if ( client->step % store_span(level) == 0 && from % store_span(level) == 0 ) {
+                    client->span = store_span(level);
+                    store_scan(sensor, level, from, to, query_agg_rollup, client);
+                    break;
+                }
+            }
+            if ( client->covered < to ) {
+                query_raw(client, sensor, client->covered, to, query_agg_raw);
+            }
+            agg_emit(client);
+            query_printf(client, "END %ld\n", client->count);
+        }
+    } else if ( strcmp(argv[0], "appliances") == 0 && argc == 4 ) {
+        sensor = atoi(argv[1]);
+        from = strtol(argv[2], NULL, 10);
+        to = strtol(argv[3], NULL, 10);
+        if ( from >= to || sensor < 0 || sensor >= MAX_SENSORS ) {
+            query_printf(client, "ERR bad range\n");
+        } else {
+            query_printf(client, "OK\n");
+            memset(client->usage, 0, sizeof(client->usage));
+            store_scan(sensor, STORE_EVENT, from, to, query_appliance, client);
+            for ( i = 0; i < DISAGG_APPLIANCES; i++ ) {
+                if ( client->usage[i].switches ) {
+                    query_printf(client, "%d %.0f %ld %.6f\n", i, client->usage[i].watts / client->usage[i].switches,
+                                 client->usage[i].switches, client->usage[i].joules / 3600000.0);
+                    client->count++;
+                }
+            }
+            query_printf(client, "END %ld\n", client->count);
+        }
+    } else if ( strcmp(argv[0], "lttb") == 0 && argc == 5 ) {
+        sensor = atoi(argv[1]);
+        from = strtol(argv[2], NULL, 10);
+        to = strtol(argv[3], NULL, 10);
+        i = atoi(argv[4]);
+        if ( i < 3 || i > QUERY_LTTB_MAX || from >= to || sensor < 0 || sensor >= MAX_SENSORS ) {
+            query_printf(client, "ERR bad downsample\n");
+        } else {
+            client->from = client->covered = from;
+            client->buckets = i - 2;
+            client->width = (double)( to - from ) / client->buckets;
+            query_printf(client, "OK\n");
+
+            for ( level = STORE_HOUR; level > STORE_RAW; level-- ) {
+                if ( store_span(level) * QUERY_LTTB_SAMPLES <= client->width ) {
+                    client->span = store_span(level);
+                    store_scan(sensor, level, from, to, query_lttb_rollup, client);
+                    break;
+                }
+            }
+            if ( client->covered < to ) {
+                query_raw(client, sensor, client->covered, to, query_lttb_raw);
+            }
+            lttb_finish(client);
+            free(client->waiting.points);
+            free(client->next.points);
+            query_printf(client, "END %ld\n", client->count);
+        }
+    } else if ( strcmp(argv[0], "gaps") == 0 && argc == 4 ) {
+        sensor = atoi(argv[1]);
+        from = strtol(argv[2], NULL, 10);
+        to = strtol(argv[3], NULL, 10);
+        if ( from >= to || sensor < 0 || sensor >= MAX_SENSORS ) {
+            query_printf(client, "ERR bad range\n");
+        } else {
+            query_printf(client, "OK\n");
+            gap_scan(sensor, from, to, query_gap, client);
+            query_printf(client, "END %ld\n", client->count);
+        }
+    } else if ( strcmp(argv[0], "metrics") == 0 && argc == 1 ) {
+        query_printf(client, "OK\n");
+        query_metrics(client);
+        query_printf(client, "END %ld\n", client->count);
+    } else {
+        query_printf(client, "ERR unknown request\n");
+    }
+    query_send(client);
+}
+
+/** \brief Feed raw readings to fn, the recent ones from the ring and
+ *         anything older from the store
+ */
+static void query_raw(client_t *client, int sensor, time_t from, time_t to, store_scan_fn fn)
+{
+    ring_snap_t   snap;
+    store_raw_t   raw;
+    time_t        split = (time_t)ring_oldest(sensor);
+    int           i;
+
+    if ( split == 0 ) {
+        split = to;
+    }
+    if ( from < split ) {
+        store_scan(sensor, STORE_RAW, from, split < to ? split : to, fn, client);
+        from = split;
+    }
+    if ( from >= to || client->failed ) {
+        return;
+    }
+    /* Better no END than an answer with the recent readings missing */
+    if ( ( i = ring_snapshot(sensor, from, to, &snap) ) <= 0 ) {
+        client->failed = i < 0;
+        return;
+    }
+    for ( i = 0; i < snap.num && client->failed == 0; i++ ) {
+        raw.ts = (uint32_t)snap.ts[i];
+        raw.ms = (uint16_t)( ( snap.ts[i] - raw.ts ) * 1000 );
+        raw.temp = snap.temp[i];
+        raw.watts = snap.watts[i];
+        raw.joules = snap.joules[i];
+        fn(&raw, client);
+    }
+    ring_snap_free(&snap);
+}
+
+static void query_metrics(client_t *client)
+{
+    unsigned long   a, b, c, d, e;
+    long long       p50, p99, max;
+    char           *name, *ptr, metric[64];
+    int             i, len;
+
+    ring_stats(&a, &b);
+    query_metric(client, "ring_bytes", a);
+    query_metric(client, "ring_readings", b);
+    mqtt_stats(&a, &b, &c);
+    query_metric(client, "mqtt_published", a);
+    query_metric(client, "mqtt_acked", b);
+    query_metric(client, "mqtt_dropped", c);
+    influx_stats(&a, &b, &c, &d);
+    query_metric(client, "influx_points", a);
+    query_metric(client, "influx_posts", b);
+    query_metric(client, "influx_retries", c);
+    query_metric(client, "influx_dropped", d);
+    federate_stats(&a, &b, &c, &d);
+    query_metric(client, "federate_spooled", a);
+    query_metric(client, "federate_acked", b);
+    query_metric(client, "federate_retries", c);
+    query_metric(client, "federate_dropped", d);
+    collector_stats(&a, &b, &c, &d, &e);
+    query_metric(client, "collector_nodes", a);
+    query_metric(client, "collector_sites", b);
+    query_metric(client, "collector_readings", c);
+    query_metric(client, "collector_duplicates", d);
+    query_metric(client, "collector_lost", e);
+    logfile_stats(&a, &b, &c, &d);
+    query_metric(client, "logfile_bytes", a);
+    query_metric(client, "logfile_syncs", b);
+    query_metric(client, "logfile_dropped", c);
+    query_metric(client, "logfile_errors", d);
+    dedup_stats(&a, &b, &c);
+    query_metric(client, "dedup_duplicates", a);
+    query_metric(client, "dedup_held", b);
+    query_metric(client, "dedup_replaced", c);
+    capture_stats(&a, &b);
+    query_metric(client, "capture_bytes", a);
+    query_metric(client, "capture_dropped", b);
+    heap_stats(&a, &b);
+    query_metric(client, "heap_bytes", a);
+    query_metric(client, "heap_budget", b);
+    gap_stats(&a, &b, &c);
+    query_metric(client, "gap_count", a);
+    query_metric(client, "gap_seconds", b);
+    query_metric(client, "gap_filled", c);
+
+    for ( i = 0; trace_stats(i, &name, &a, &p50, &p99, &max) == 0; i++ ) {
+        if ( a == 0 ) {
+            continue;
+        }
+        len = snprintf(metric, sizeof(metric), "trace_%s", name);
+        for ( ptr = metric; *ptr; ptr++ ) {
+            if ( *ptr == ':' || *ptr == '-' ) {
+                *ptr = '_';
+            }
+        }
+        if ( len >= sizeof(metric) - 8 ) {
+            len = sizeof(metric) - 8;
+        }
+        strcpy(metric + len, "_count");
+        query_metric(client, metric, a);
+        strcpy(metric + len, "_p50_ns");
+        query_metric(client, metric, p50);
+        strcpy(metric + len, "_p99_ns");
+        query_metric(client, metric, p99);
+        strcpy(metric + len, "_max_ns");
+        query_metric(client, metric, max);
+    }
+}
+
+/* One "name value" line of the metrics */
+static void query_metric(client_t *client, char *name, long long value)
+{
+    query_printf(client, "%s %lld\n", name, value);
+    client->count++;
+}
+
+static void query_printf(client_t *client, char *fmt, ...)
+{
+    va_list  ap;
+    int      len;
+
+    if ( client->len > sizeof(client->buf) - QUERY_LINE_MAX ) {
+        query_send(client);
+    }
+    va_start(ap, fmt);
+    len = vsnprintf(client->buf + client->len, QUERY_LINE_MAX, fmt, ap);
+    va_end(ap);
+
+    /* Only what fitted went in */
+    if ( len >= QUERY_LINE_MAX ) {
+        len = QUERY_LINE_MAX - 1;
+    }
+    if ( len > 0 ) {
+        client->len += len;
+    }
+}
+
+static void query_send(client_t *client)
+{
+    int   sent = 0, ret;
+
+    while ( client->failed == 0 && sent < client->len ) {
+        if ( ( ret = write(client->fd, client->buf + sent, client->len - sent) ) <= 0 ) {
+            if ( ret < 0 && errno == EINTR ) {
+                continue;
+            }
+            client->failed = 1;
+        } else {
+            sent += ret;
+        }
+    }
+    client->len = 0;
+}
+
+static int query_range(void *record, void *arg)
+{
+    client_t     *client = arg;
+    store_raw_t  *raw = record;
+
+    query_printf(client, "%u.%03u %d %.1f %.1f\n", raw->ts, raw->ms, raw->watts, raw->temp / 10.0, raw->joules);
+    client->count++;
+    return client->failed;
+}
+
+static int query_agg_rollup(void *record, void *arg)
+{
+    client_t        *client = arg;
+    store_rollup_t  *rollup = record;
+
+    agg_add(client, rollup->ts, rollup->count, rollup->min, rollup->max, rollup->mean * rollup->count, rollup->joules);
+    client->covered = rollup->ts + client->span;
+    return client->failed;
+}
+
+static int query_agg_raw(void *record, void *arg)
+{
+    client_t     *client = arg;
+    store_raw_t  *raw = record;
+
+    agg_add(client, raw->ts, 1, raw->watts, raw->watts, raw->watts, raw->joules);
+    return client->failed;
+}
+
+static int query_appliance(void *record, void *arg)
+{
+    client_t       *client = arg;
+    store_event_t  *event = record;
+
+    if ( event->appliance < DISAGG_APPLIANCES ) {
+        client->usage[event->appliance].watts += event->watts;
+        client->usage[event->appliance].switches++;
+        client->usage[event->appliance].joules += event->joules;
+    }
+    return 0;
+}
+
+static int query_gap(gap_t *gap, void *arg)
+{
+    client_t     *client = arg;
+    uint32_t      span = gap->end - gap->start;
+
+    query_printf(client, "%u %u %.6f %s\n", gap->start, span, gap->joules / 3600000.0,
+                 gap->filled == 0 ? "estimated" : gap->filled < span ? "partial" : "filled");
+    client->count++;
+    return client->failed;
+}
+
+static int query_lttb_rollup(void *record, void *arg)
+{
+    client_t        *client = arg;
+    store_rollup_t  *rollup = record;
+
+    lttb_add(client, rollup->ts + client->span / 2.0, rollup->mean);
+    client->covered = rollup->ts + client->span;
+    return client->failed;
+}
+
+static int query_lttb_raw(void *record, void *arg)
+{
+    client_t     *client = arg;
+    store_raw_t  *raw = record;
+
+    lttb_add(client, raw->ts + raw->ms / 1000.0, raw->watts);
+    return client->failed;
+}
+
+static void agg_add(client_t *client, time_t ts, long count, int32_t min, int32_t max, double watts, double joules)
+{
+    time_t   start = client->from + ( ( ts - client->from ) / client->step ) * client->step;
+
+    if ( start != client->start ) {
+        agg_emit(client);
+        client->start = start;
+    }
+    if ( client->num == 0 || min < client->min )
+        client->min = min;
+    if ( client->num == 0 || max > client->max )
+        client->max = max;
+    client->num += count;
+    client->watts += watts;
+    client->joules += joules;
+}
+
+static void agg_emit(client_t *client)
+{
+    if ( client->num == 0 ) {
+        return;
+    }
+    query_printf(client, "%ld %ld %d %d %.1f %.6f\n", (long)client->start, client->num, client->min, client->max,
+                 client->watts / client->num, client->joules / 3600000.0);
+    client->count++;
+    client->num = 0;
+    client->watts = 0;
+    client->joules = 0;
+}
+
+/* Take the next point in time order. Once a bucket is done its mean is
+   known, so the one before can be chosen from */
+static void lttb_add(client_t *client, double ts, double watts)
+{
+    lttb_bucket_t   swap;
+    lttb_point_t   *points;
+    long            bucket = (long)( ( ts - client->from ) / client->width );
+
+    if ( bucket >= client->buckets ) {
+        bucket = client->buckets - 1;
+    }
+    if ( client->started == 0 ) {
+        client->chosen.ts = ts;
+        client->chosen.watts = watts;
+        lttb_emit(client, &client->chosen);
+        client->started = 1;
+        return;
+    }
+    if ( client->next.num && bucket != client->bucket ) {
+        if ( client->waiting.num ) {
+            lttb_choose(client, &client->waiting, client->next.ts / client->next.num, client->next.watts / client->next.num);
+        }
+        swap = client->waiting;
+        client->waiting = client->next;
+        client->next = swap;
+        client->next.num = 0;
+        client->next.ts = client->next.watts = 0;
+    }
+    client->bucket = bucket;
+
+    if ( client->next.num == client->next.size ) {
+        if ( ( points = realloc(client->next.points, ( client->next.size + 256 ) * 2 * sizeof(lttb_point_t)) ) == NULL ) {
+            client->failed = 1;
+            return;
+        }
+        client->next.points = points;
+        client->next.size = ( client->next.size + 256 ) * 2;
+    }
+    client->next.points[client->next.num].ts = ts;
+    client->next.points[client->next.num].watts = watts;
+    client->next.num++;
+    client->next.ts += ts;
+    client->next.watts += watts;
+}
+
+/* Send the point of bucket making the largest triangle with the last
+   one sent and ts,watts */
+static void lttb_choose(client_t *client, lttb_bucket_t *bucket, double ts, double watts)
+{
+    lttb_point_t  *a = &client->chosen;
+    lttb_point_t  *p;
+    double         area, best_area = -1;
+    int            i, best = 0;
+
+    for ( i = 0; i < bucket->num; i++ ) {
+        p = &bucket->points[i];
+        area = fabs(( a->ts - ts ) * ( p->watts - a->watts ) - ( a->ts - p->ts ) * ( watts - a->watts ));
+        if ( area > best_area ) {
+            best_area = area;
+            best = i;
+        }
+    }
+    client->chosen = bucket->points[best];
+    lttb_emit(client, &client->chosen);
+}
+
+/* The last point stands in for the bucket after the last one */
+static void lttb_finish(client_t *client)
+{
+    lttb_bucket_t  *tail = client->next.num ? &client->next : &client->waiting;
+    lttb_point_t    last;
+
+    if ( tail->num == 0 ) {
+        return;
+    }
+    last = tail->points[--tail->num];
+    tail->ts -= last.ts;
+    tail->watts -= last.watts;
+    if ( client->waiting.num ) {
+        if ( client->next.num ) {
+            lttb_choose(client, &client->waiting, client->next.ts / client->next.num, client->next.watts / client->next.num);
+        } else {
+            lttb_choose(client, &client->waiting, last.ts, last.watts);
+        }
+    }
+    if ( client->next.num ) {
+        lttb_choose(client, &client->next, last.ts, last.watts);
+    }
+    lttb_emit(client, &last);
+}
+
+static void lttb_emit(client_t *client, lttb_point_t *point)
+{
+    query_printf(client, "%.3f %.1f\n", point->ts, point->watts);
+    client->count++;
+}
@@ -0,0 +1,35 @@
+/*
+ *   Current Cost Daemon - query socket
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "libini.h"
+
+/* Register the [query] options */
+extern void         query_options(configctx_t *ctx);
+
+/* Start answering queries, -1 if no socket is configured or it failed */
+extern int          query_init();
+
+/* Remove the socket */
+extern void         query_close();
+
+#endif /* QUERY_H */
@@ -0,0 +1,278 @@
+/*
+ *   Current Cost Daemon - ring of recent readings
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Each sensor seen gets a ring big enough for ring:hours of readings
+ *   at ring:interval seconds apart, kept as separate arrays of each
+ *   field so a scan over timestamps or watts stays within the cache.
+ *
+ *   There's only one writer. Before it overwrites a slot it bumps
+ *   "claimed", and once the slot is written it bumps "head". Readers
+ *   copy what they want without any lock, then look at "claimed" to
+ *   see whether the writer lapped them, throwing away any slots it got
+ *   to - the same trick as a seqlock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <syslog.h>
+
+#include "ring.h"
+#include "heap.h"
+
+
+typedef struct {
+    unsigned long   claimed;       /* Slots claimed by the writer */
+    unsigned long   head;          /* Slots written */
+    double         *ts;
+    int32_t        *watts;
+    int16_t        *temp;
+    float          *joules;
+    double          last_ts;
+} ring_t;
+
+/* Bytes per slot across the arrays */
+#define RING_SLOT   ( sizeof(double) + sizeof(int32_t) + sizeof(int16_t) + sizeof(float) )
+
+
+static int          ring_alloc(ring_t *ring);
+static unsigned long ring_search(ring_t *ring, unsigned long lo, unsigned long hi, double ts);
+
+/* Configuration */
+static int          c_ring_hours         = 24;
+static int          c_ring_interval      = 6;
+
+static ring_t       rings[MAX_SENSORS];
+static unsigned long ring_capacity       = 0;
+static unsigned long ring_mask           = 0;
+static unsigned long ring_bytes          = 0;
+
+
+void ring_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "ring:hours","Hours of readings to keep in memory (0 to disable)",OPT_INT,&c_ring_hours);
+    iniparse_add(ctx, 0, "ring:interval","Expected seconds between readings from a sensor",OPT_INT,&c_ring_interval);
+}
+
+void ring_init()
+{
+    unsigned long   want;
+    int             i;
+
+    memset(rings, 0, sizeof(rings));
+    if ( c_ring_hours <= 0 ) {
+        ring_capacity = 0;
+        return;
+    }
+    if ( c_ring_interval < 1 ) {
+        c_ring_interval = 1;
+    }
+    want = (unsigned long)c_ring_hours * 3600 / c_ring_interval;
+    for ( ring_capacity = 64; ring_capacity < want; ring_capacity <<= 1 )
+        ;
+    ring_mask = ring_capacity - 1;
+    syslog(LOG_INFO,"Keeping %lu readings per sensor in memory",ring_capacity);
+
+    /* Otherwise a sensor's ring is allocated when it's first heard */
+    if ( heap_static() ) {
+        for ( i = 0; i < MAX_SENSORS && ring_capacity; i++ ) {
+            ring_alloc(&rings[i]);
+        }
+    }
+}
+
+void ring_push(reading_t *reading)
+{
+    ring_t         *ring;
+    unsigned long   h, i;
+    double          ts = reading->ts;
+
+    if ( ring_capacity == 0 || reading->sensor < 0 || reading->sensor >= MAX_SENSORS ) {
+        return;
+    }
+    ring = &rings[reading->sensor];
+    if ( ring->ts == NULL && ring_alloc(ring) < 0 ) {
+        return;
+    }
+    /* Keep the timestamps in order for the binary search */
+    if ( ts < ring->last_ts ) {
+        ts = ring->last_ts;
+    }
+    ring->last_ts = ts;
+
+    h = ring->head;
+    i = h & ring_mask;
+    __atomic_store_n(&ring->claimed, h + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ring->ts[i] = ts;
+    ring->watts[i] = reading->watts;
+    ring->temp[i] = (int16_t)lrint(reading->temp * 10);
+    ring->joules[i] = reading->joules;
+    __atomic_store_n(&ring->head, h + 1, __ATOMIC_RELEASE);
+}
+
+int ring_snapshot(int sensor, double from, double to, ring_snap_t *snap)
+{
+    ring_t         *ring;
+    unsigned long   h, c, lo, hi, n, i, j, skip;
+    char           *block;
+
+    memset(snap, 0, sizeof(*snap));
+    if ( sensor < 0 || sensor >= MAX_SENSORS ) {
+        return 0;
+    }
+    ring = &rings[sensor];
+    if ( __atomic_load_n(&ring->ts, __ATOMIC_ACQUIRE) == NULL ) {
+        return 0;
+    }
+
+    /* The slot after head may be in the middle of being overwritten */
+    h = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    lo = h + 1 > ring_capacity ? h + 1 - ring_capacity : 0;
+    lo = ring_search(ring, lo, h, from);
+    hi = ring_search(ring, lo, h, to);
+    if ( ( n = hi - lo ) == 0 ) {
+        return 0;
+    }
+
+    if ( ( block = malloc(n * RING_SLOT) ) == NULL ) {
+        return -1;
+    }
+    snap->ts = (double *)block;
+    snap->watts = (int32_t *)( snap->ts + n );
+    snap->joules = (float *)( snap->watts + n );
+    snap->temp = (int16_t *)( snap->joules + n );
+
+    /* Copy in up to two runs either side of the wrap */
+    for ( i = lo; i < hi; i += j ) {
+        unsigned long  at = i & ring_mask;
+
+        j = ring_capacity - at < hi - i ? ring_capacity - at : hi - i;
+        memcpy(snap->ts + ( i - lo ), ring->ts + at, j * sizeof(double));
+        memcpy(snap->watts + ( i - lo ), ring->watts + at, j * sizeof(int32_t));
+        memcpy(snap->joules + ( i - lo ), ring->joules + at, j * sizeof(float));
+        memcpy(snap->temp + ( i - lo ), ring->temp + at, j * sizeof(int16_t));
+    }
+
+    /* Drop whatever the writer got to whilst we were copying, and
+       anything the search was misled into by it */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    c = __atomic_load_n(&ring->claimed, __ATOMIC_RELAXED);
+    skip = c > ring_capacity && c - ring_capacity > lo ? c - ring_capacity - lo : 0;
+    if ( skip > n ) {
+        skip = n;
+    }
+    while ( skip < n && snap->ts[skip] < from ) {
+        skip++;
+    }
+    while ( n > skip && snap->ts[n - 1] >= to ) {
+        n--;
+    }
+    if ( n == skip ) {
+        ring_snap_free(snap);
+        return 0;
+    }
+    if ( skip ) {
+        memmove(snap->ts, snap->ts + skip, ( n - skip ) * sizeof(double));
+        memmove(snap->watts, snap->watts + skip, ( n - skip ) * sizeof(int32_t));
+        memmove(snap->joules, snap->joules + skip, ( n - skip ) * sizeof(float));
+        memmove(snap->temp, snap->temp + skip, ( n - skip ) * sizeof(int16_t));
+    }
+    snap->num = n - skip;
+    return snap->num;
+}
+
+void ring_snap_free(ring_snap_t *snap)
+{
+    /* The arrays are all one block */
+    free(snap->ts);
+    memset(snap, 0, sizeof(*snap));
+}
+
+double ring_oldest(int sensor)
+{
+    ring_t       *ring;
+    unsigned long h, c, lo;
+    double        ts;
+
+    if ( sensor < 0 || sensor >= MAX_SENSORS ) {
+        return 0;
+    }
+    ring = &rings[sensor];
+    if ( __atomic_load_n(&ring->ts, __ATOMIC_ACQUIRE) == NULL ) {
+        return 0;
+    }
+    do {
+        if ( ( h = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ) == 0 ) {
+            return 0;
+        }
+        lo = h + 1 > ring_capacity ? h + 1 - ring_capacity : 0;
+        ts = ring->ts[lo & ring_mask];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        c = __atomic_load_n(&ring->claimed, __ATOMIC_RELAXED);
+    } while ( c > ring_capacity && c - ring_capacity > lo );
+    return ts;
+}
+
+void ring_stats(unsigned long *bytes, unsigned long *readings)
+{
+    unsigned long   h;
+    int             i;
+
+    *bytes = __atomic_load_n(&ring_bytes, __ATOMIC_RELAXED);
+    *readings = 0;
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        h = __atomic_load_n(&rings[i].head, __ATOMIC_RELAXED);
+        *readings += h < ring_capacity ? h : ring_capacity;
+    }
+}
+
+
+static int ring_alloc(ring_t *ring)
+{
+    char   *block;
+
+    if ( ( block = malloc(ring_capacity * RING_SLOT) ) == NULL ) {
+        syslog(LOG_ERR,"Unable to allocate %lu bytes for the reading ring",ring_capacity * RING_SLOT);
+        ring_capacity = 0;
+        return -1;
+    }
+    ring->watts = (int32_t *)( block + ring_capacity * sizeof(double) );
+    ring->joules = (float *)( ring->watts + ring_capacity );
+    ring->temp = (int16_t *)( ring->joules + ring_capacity );
+    __atomic_store_n(&ring->ts, (double *)block, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ring_bytes, ring_capacity * RING_SLOT, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* First slot in lo..hi with a timestamp of at least ts */
+static unsigned long ring_search(ring_t *ring, unsigned long lo, unsigned long hi, double ts)
+{
+    unsigned long   mid;
+
+    while ( lo < hi ) {
+        mid = lo + ( hi - lo ) / 2;
+        if ( ring->ts[mid & ring_mask] < ts ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
@@ -0,0 +1,59 @@
+/*
+ *   Current Cost Daemon - ring of recent readings
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include "currentcost.h"
+#include "libini.h"
+
+
+/* A copy of part of a sensor's ring, one array per field */
+typedef struct {
+    int             num;
+    double         *ts;
+    int32_t        *watts;
+    int16_t        *temp;          /* Tenths of a degree */
+    float          *joules;
+} ring_snap_t;
+
+
+/* Register the [ring] options */
+extern void         ring_options(configctx_t *ctx);
+
+extern void         ring_init();
+
+/* Add a reading, only ever called from the main thread */
+extern void         ring_push(reading_t *reading);
+
+/* Copy out the readings with from <= ts < to, safe from any thread.
+   Returns the number copied or -1 if there's no memory for the copy,
+   free the copy with ring_snap_free() */
+extern int          ring_snapshot(int sensor, double from, double to, ring_snap_t *snap);
+extern void         ring_snap_free(ring_snap_t *snap);
+
+/* Timestamp of the oldest reading held, 0 if there aren't any */
+extern double       ring_oldest(int sensor);
+
+/* Bytes allocated to the rings and readings held in them */
+extern void         ring_stats(unsigned long *bytes, unsigned long *readings);
+
+#endif /* RING_H */
@@ -0,0 +1,148 @@
+/*
+ *   Current Cost Daemon - reading sinks
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "sink.h"
+#include "trace.h"
+
+
+static sink_t      *sinks = NULL;
+static int          all_open = 0;
+
+
+/* Connecting and allocating is left until the sink is wanted, so the
+   daemon is reading the serial port as soon as it starts */
+static inline void sink_open(sink_t *sink)
+{
+    if ( __builtin_expect(sink->opened == 0, 0) ) {
+        sink->opened = 1;
+        if ( sink->open && sink->open(sink) != 0 ) {
+            syslog(LOG_ERR,"Unable to open sink <%s>",sink->name);
+        }
+    }
+}
+
+
+sink_t *sink_create(char *name, filter_policy_t *policy, int (*write)(sink_t *sink, reading_t *reading), void *data)
+{
+    sink_t   *sink = calloc(1, sizeof(*sink));
+
+    sink->name = strdup(name);
+    filter_init(&sink->filter, policy);
+    sink->write = write;
+    sink->data = data;
+    sink->next = NULL;
+    return sink;
+}
+
+void sink_register(sink_t *sink)
+{
+    sink_t  *arg;
+    char     name[64];
+
+    snprintf(name, sizeof(name), "filter:%s", sink->name);
+    sink->trace_filter = trace_point(name);
+    snprintf(name, sizeof(name), "sink:%s", sink->name);
+    sink->trace_write = trace_point(name);
+
+    if ( sinks == NULL ) {
+        sinks = sink;
+    } else {
+        arg = sinks;
+        while ( arg->next != NULL )
+            arg = arg->next;
+        arg->next = sink;
+    }
+    all_open = 0;
+    syslog(LOG_INFO,"Registered sink <%s>",sink->name);
+}
+
+void sink_open_all()
+{
+    sink_t  *sink;
+
+    if ( all_open ) {
+        return;
+    }
+    for ( sink = sinks; sink != NULL; sink = sink->next ) {
+        sink_open(sink);
+    }
+    all_open = 1;
+}
+
+sink_t *sink_find(char *name)
+{
+    sink_t  *sink = sinks;
+
+    while ( sink != NULL ) {
+        if ( strcmp(sink->name, name) == 0 ) {
+            return sink;
+        }
+        sink = sink->next;
+    }
+    return NULL;
+}
+
+void sink_dispatch(reading_t *reading)
+{
+    sink_t     *sink = sinks;
+    reading_t   scratch;
+    reading_t  *out;
+
+    while ( sink != NULL ) {
+        TRACE_START(t);
+        sink_open(sink);
+        out = filter_apply(&sink->filter, reading, &scratch);
+        TRACE_STOP(sink->trace_filter, t);
+        if ( out != NULL ) {
+            TRACE_START(w);
+            sink->write(sink, out);
+            TRACE_STOP(sink->trace_write, w);
+        }
+        sink = sink->next;
+    }
+}
+
+int sink_write(sink_t *sink, reading_t *reading)
+{
+    sink_open(sink);
+    return sink->write(sink, reading);
+}
+
+void sink_event(sink_t *sink, event_t *event)
+{
+    if ( sink != NULL ) {
+        sink_open(sink);
+        if ( sink->event ) {
+            sink->event(sink, event);
+        }
+        return;
+    }
+    for ( sink = sinks; sink != NULL; sink = sink->next ) {
+        sink_open(sink);
+        if ( sink->event ) {
+            sink->event(sink, event);
+        }
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ *   Current Cost Daemon - reading sinks
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include "currentcost.h"
+#include "filter.h"
+
+
+typedef struct _sink sink_t;
+
+/* Something noteworthy happened - eg an alert rule fired */
+typedef struct {
+    char           *name;
+    int             raised;        /* 1 = raised, 0 = cleared */
+    int             sensor;
+    double          value;         /* Value which tripped the rule */
+    double          threshold;
+    time_t          now;
+} event_t;
+
+struct _sink {
+    char           *name;
+    filter_t        filter;
+    int           (*write)(sink_t *sink, reading_t *reading);
+    int           (*event)(sink_t *sink, event_t *event);    /* Optional */
+    int           (*open)(sink_t *sink);     /* Optional, deferred until the sink is first needed */
+    int             opened;
+    void           *data;
+    int             trace_filter;  /* Tracepoints, set by sink_register() */
+    int             trace_write;
+    sink_t         *next;
+};
+
+
+/* Allocate a sink, the filter starts off as a copy of policy */
+extern sink_t      *sink_create(char *name, filter_policy_t *policy, int (*write)(sink_t *sink, reading_t *reading), void *data);
+extern void         sink_register(sink_t *sink);
+
+/* Open any sinks which haven't been needed yet */
+extern void         sink_open_all();
+
+/* Pass a reading through each sink's filter and on to the sink */
+extern void         sink_dispatch(reading_t *reading);
+
+/* Write a reading straight to a sink, bypassing the filter */
+extern int          sink_write(sink_t *sink, reading_t *reading);
+
+extern sink_t      *sink_find(char *name);
+
+/* Send an event to a sink, or every sink which takes events if NULL */
+extern void         sink_event(sink_t *sink, event_t *event);
+
+
+/* Sinks */
+extern sink_t      *sink_exec_create(char *command, char *alert_command, filter_policy_t *policy);
+
+#endif /* SINK_H */
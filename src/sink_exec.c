@@ -0,0 +1,79 @@
+/*
+ *   Current Cost Daemon - run a command for each reading
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sink.h"
+
+
+typedef struct {
+    char           *command;
+    char           *alert_command;
+} exec_t;
+
+
+static int exec_write(sink_t *sink, reading_t *reading)
+{
+    exec_t *exec = sink->data;
+    char    buf[4096];
+
+    if ( exec->command == NULL ) {
+        return 0;
+    }
+    snprintf(buf,sizeof(buf),"%s %ld %d %.1f %02d:%02d:%02d %.2f %.0f %d %.6f %d",exec->command,
+             (long)reading->now, reading->watts, reading->temp, reading->hour, reading->min, reading->sec,
+             reading->delta, reading->joules, reading->offset, reading->kwh, reading->sensor);
+    return system(buf);
+}
+
+/* Arguments are: name raised|cleared sensor value threshold timestamp */
+static int exec_event(sink_t *sink, event_t *event)
+{
+    exec_t *exec = sink->data;
+    char    buf[4096];
+
+    if ( exec->alert_command == NULL ) {
+        return 0;
+    }
+    snprintf(buf,sizeof(buf),"%s %s %s %d %.2f %.2f %ld",exec->alert_command, event->name,
+             event->raised ? "raised" : "cleared", event->sensor, event->value, event->threshold,
+             (long)event->now);
+    return system(buf);
+}
+
+/** \brief Create a sink which runs a command with the reading as arguments
+ *
+ *  \param command - Command to run (see scripts/update.sh for the arguments)
+ *  \param alert_command - Command to run for events (may be NULL)
+ *  \param policy - Filter policy for the sink
+ */
+sink_t *sink_exec_create(char *command, char *alert_command, filter_policy_t *policy)
+{
+    exec_t   *exec = calloc(1, sizeof(*exec));
+    sink_t   *sink;
+
+    exec->command = command;
+    exec->alert_command = alert_command;
+    sink = sink_create("exec", policy, exec_write, exec);
+    sink->event = exec_event;
+    return sink;
+}
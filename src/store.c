@@ -0,0 +1,1120 @@
+/*
+ *   Current Cost Daemon - native reading store
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Each sensor has a directory of segment files under store:dir, each
+ *   an array of fixed size records in time order:
+ *
+ *     <dir>/<sensor>/YYYY-MM-DD.raw     readings
+ *     <dir>/<sensor>/YYYY-MM-DD.min     minute rollups
+ *     <dir>/<sensor>/YYYY.hour          hour rollups
+ *     <dir>/<sensor>/YYYY-MM-DD.evt     appliance events
+ *
+ *   Dates are UTC. Records are buffered and appended every
+ *   store:flush-interval seconds. Readers in other threads take a copy
+ *   of what's pending along with the file offset it will be written at,
+ *   so they see a consistent view without holding the lock whilst they
+ *   read the disc.
+ *
+ *   The collector keeps a store like this for each site it hears from,
+ *   opened with store_open() and written with store_append().
+ *
+ *   With store:raw-days or store:minute-days set a low priority thread
+ *   drops the days past them, once the next level up has all of it.
+ *   Hours are kept for ever.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <math.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "store.h"
+#include "evloop.h"
+#include "heap.h"
+
+
+/* Records buffered per series before they're written */
+#define STORE_PENDING       256
+
+/* Records read from disc at a time by a scan */
+#define STORE_READ          256
+
+/* Idle I/O class for the compactor, see ioprio_set(2) */
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_IDLE         ( 3 << 13 )
+
+typedef struct {
+    int             fd;
+    time_t          seg;           /* Start of the open segment, 0 = none yet */
+    off_t           off;           /* Where the pending records will go */
+    int             num;           /* Records pending */
+    uint32_t        last_ts;
+    char           *pending;
+} series_t;
+
+typedef struct {
+    uint32_t        start;
+    uint32_t        count;
+    int32_t         min;
+    int32_t         max;
+    double          watts;
+    double          temp;
+    double          joules;
+} bucket_t;
+
+/* A store directory, the daemon's own and one for each collected site */
+struct store {
+    char           *dir;
+    series_t        series[MAX_SENSORS][STORE_LEVELS];
+    bucket_t        buckets[MAX_SENSORS][STORE_LEVELS];
+    struct store   *next;
+};
+
+
+static int          store_write(sink_t *sink, reading_t *reading);
+static int          store_setup(store_t *st, char *dir);
+static void         store_timer(void *data);
+static void         series_append(store_t *st, int sensor, int level, void *record);
+static int          series_open(store_t *st, int sensor, int level, time_t seg);
+static void         series_flush(series_t *s, int level);
+static void         bucket_add(store_t *st, int sensor, int level, store_raw_t *raw);
+static void         bucket_emit(store_t *st, int sensor, int level);
+static void         bucket_fold(bucket_t *b, uint32_t start, uint32_t count, int32_t min, int32_t max, double watts, double temp, double joules);
+static void         bucket_rollup(bucket_t *b, store_rollup_t *rollup);
+static int          rebuild_minute(void *record, void *arg);
+static long         rollup_minutes(store_raw_t *raw, long num, store_rollup_t *rollups);
+static void        *compact_thread(void *arg);
+static int          compact_raw(int sensor, time_t seg);
+static int          compact_minute(int sensor, time_t seg);
+static int          compact_live(int sensor, int level, time_t seg);
+static int          compact_count(void *record, void *arg);
+static void         compact_throttle(size_t bytes);
+static time_t       segment_start(int level, time_t ts);
+static char        *segment_path(char *dir, int sensor, int level, time_t seg, char *buf, size_t buflen);
+static int          segment_list(char *base, int sensor, int level, time_t from, time_t to, time_t **list);
+static int          segment_scan(char *path, int level, off_t limit, time_t from, time_t to, store_scan_fn fn, void *arg);
+static long         segment_load(char *path, int level, void **records);
+static int          segment_replace(char *path, void *records, size_t len);
+
+/* Configuration */
+static char        *c_store_dir          = NULL;
+static int          c_store_flush        = 5;
+static filter_policy_t c_store_filter;
+static int          c_store_raw_days     = 0;
+static int          c_store_minute_days  = 0;
+static int          c_store_compact_interval = 3600;
+static int          c_store_compact_rate = 1024;
+
+static const int    level_size[STORE_LEVELS]   = { sizeof(store_raw_t), sizeof(store_rollup_t), sizeof(store_rollup_t), sizeof(store_event_t) };
+static const int    level_span[STORE_LEVELS]   = { 0, 60, 3600, 0 };
+static const char  *level_suffix[STORE_LEVELS] = { "raw", "min", "hour", "evt" };
+
+static store_t      local;
+static store_t     *stores               = NULL;
+static int          flushing             = 0;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t    compactor;
+static int          compacting           = 0;
+static int          compact_stop         = 0;
+static pthread_mutex_t compact_lock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t compact_running   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_wake       = PTHREAD_COND_INITIALIZER;
+
+
+void store_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "store:dir","Directory to keep readings and rollups in",OPT_STR,&c_store_dir);
+    iniparse_add(ctx, 0, "store:flush-interval","Seconds between writes to the store",OPT_INT,&c_store_flush);
+    iniparse_add(ctx, 0, "store:raw-days","Days to keep readings for once rolled up (0 = forever)",OPT_INT,&c_store_raw_days);
+    iniparse_add(ctx, 0, "store:minute-days","Days to keep minute rollups for once rolled up into hours (0 = forever)",OPT_INT,&c_store_minute_days);
+    iniparse_add(ctx, 0, "store:compact-interval","Seconds between looking for segments past their time",OPT_INT,&c_store_compact_interval);
+    iniparse_add(ctx, 0, "store:compact-rate","KB/s compaction may read and write (0 = unlimited)",OPT_INT,&c_store_compact_rate);
+    filter_options(ctx, "store", &c_store_filter);
+}
+
+sink_t *store_init()
+{
+    if ( c_store_dir == NULL || store_setup(&local, c_store_dir) != 0 ) {
+        return NULL;
+    }
+
+    if ( c_store_raw_days > 0 || c_store_minute_days > 0 ) {
+        /* Minutes dropped before their readings would just come back */
+        if ( c_store_minute_days > 0 && c_store_minute_days < c_store_raw_days ) {
+            c_store_minute_days = c_store_raw_days;
+        }
+        if ( c_store_compact_interval < 60 ) {
+            c_store_compact_interval = 60;
+        }
+        if ( pthread_create(&compactor, NULL, compact_thread, NULL) == 0 ) {
+            compacting = 1;
+        } else {
+            syslog(LOG_ERR,"Unable to start the store compactor");
+        }
+    }
+
+    return sink_create("store", &c_store_filter, store_write, NULL);
+}
+
+/** \brief Open another store directory, for the collector's sites
+ *
+ *  \return The store
+ *  \retval NULL - Unable to create the directory
+ */
+store_t *store_open(char *dir)
+{
+    store_t  *st;
+
+    if ( ( st = calloc(1, sizeof(store_t)) ) == NULL ) {
+        return NULL;
+    }
+    if ( store_setup(st, strdup(dir)) != 0 ) {
+        free(st);
+        return NULL;
+    }
+    return st;
+}
+
+/** \brief Store a reading, rolling it up as it goes
+ *
+ *  \return 0 - Stored
+ *  \retval -1 - Bad sensor or timestamp
+ */
+int store_append(store_t *st, int sensor, store_raw_t *raw)
+{
+    series_t     *s;
+
+    if ( sensor < 0 || sensor >= MAX_SENSORS || raw->ts == 0 ) {
+        return -1;
+    }
+    s = &st->series[sensor][STORE_RAW];
+
+    /* Keep the segments in order for the binary search, a stepped back
+       meter clock is held at the last time we stored */
+    if ( raw->ts < s->last_ts ) {
+        raw->ts = s->last_ts;
+        raw->ms = 0;
+    }
+
+    pthread_mutex_lock(&store_lock);
+    series_append(st, sensor, STORE_RAW, raw);
+    bucket_add(st, sensor, STORE_MINUTE, raw);
+    bucket_add(st, sensor, STORE_HOUR, raw);
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+void store_event(int sensor, store_event_t *event)
+{
+    series_t     *s;
+
+    if ( c_store_dir == NULL || sensor < 0 || sensor >= MAX_SENSORS ) {
+        return;
+    }
+    s = &local.series[sensor][STORE_EVENT];
+    pthread_mutex_lock(&store_lock);
+    if ( event->ts < s->last_ts ) {
+        event->ts = s->last_ts;
+    }
+    series_append(&local, sensor, STORE_EVENT, event);
+    pthread_mutex_unlock(&store_lock);
+}
+
+int store_span(int level)
+{
+    return level_span[level];
+}
+
+/** \brief Write out the pending records
+ *
+ *  \param closing - Also write the rollups still being built and sync,
+ *                   stopping the compactor first
+ */
+void store_flush(int closing)
+{
+    store_t  *st;
+    int       i, j;
+
+    if ( stores == NULL ) {
+        return;
+    }
+    if ( closing && compacting ) {
+        pthread_mutex_lock(&compact_lock);
+        compact_stop = 1;
+        pthread_cond_signal(&compact_wake);
+        pthread_mutex_unlock(&compact_lock);
+        pthread_join(compactor, NULL);
+        compacting = 0;
+    }
+    pthread_mutex_lock(&store_lock);
+    for ( st = stores; st != NULL; st = st->next ) {
+        for ( i = 0; i < MAX_SENSORS; i++ ) {
+            for ( j = 0; j < STORE_LEVELS; j++ ) {
+                if ( closing && j != STORE_RAW && st->buckets[i][j].count ) {
+                    bucket_emit(st, i, j);
+                }
+                series_flush(&st->series[i][j], j);
+                if ( closing && st->series[i][j].fd != -1 ) {
+                    fsync(st->series[i][j].fd);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+/** \brief Scan the records of a level for a sensor
+ *
+ *  \param sensor - Sensor to scan
+ *  \param level - STORE_RAW, STORE_MINUTE, STORE_HOUR or STORE_EVENT
+ *  \param from - First second wanted
+ *  \param to - Stop at records from this second
+ *  \param fn - Called for each record in time order
+ *  \param arg - Passed to fn
+ *
+ *  \return 0 - Scanned (or stopped by fn)
+ *  \retval -1 - No store or bad arguments
+ */
+int store_scan(int sensor, int level, time_t from, time_t to, store_scan_fn fn, void *arg)
+{
+    series_t   snap;
+    char       path[FILENAME_MAX];
+    char      *pending = NULL;
+    time_t    *segs = NULL;
+    int        size, num, i;
+    int        stop = 0;
+
+    if ( c_store_dir == NULL || sensor < 0 || sensor >= MAX_SENSORS ||
+         level < 0 || level >= STORE_LEVELS || from >= to ) {
+        return -1;
+    }
+    size = level_size[level];
+
+    /* Anything written after this point is newer than we're going to
+       look at, so stop the open segment where the pending records start */
+    pthread_mutex_lock(&store_lock);
+    snap = local.series[sensor][level];
+    if ( snap.num ) {
+        pending = malloc(snap.num * size);
+        memcpy(pending, snap.pending, snap.num * size);
+    }
+    pthread_mutex_unlock(&store_lock);
+
+    num = segment_list(c_store_dir, sensor, level, from, to, &segs);
+    for ( i = 0; i < num && stop == 0; i++ ) {
+        if ( snap.seg && segs[i] > snap.seg ) {
+            break;
+        }
+        segment_path(c_store_dir, sensor, level, segs[i], path, sizeof(path));
+        stop = segment_scan(path, level, segs[i] == snap.seg ? snap.off : -1, from, to, fn, arg);
+    }
+    for ( i = 0; i < snap.num && stop == 0; i++ ) {
+        uint32_t  ts = *(uint32_t *)( pending + i * size );
+
+        if ( ts >= to ) {
+            break;
+        }
+        if ( ts >= from ) {
+            stop = fn(pending + i * size, arg);
+        }
+    }
+    free(segs);
+    free(pending);
+    return 0;
+}
+
+/** \brief Write a day of readings straight to its segment along with
+ *         the minute rollups, for bulk imports
+ *
+ *  \param sensor - Sensor the readings are for
+ *  \param raw - Readings in time order, all from the same UTC day
+ *  \param num - Number of readings
+ *
+ *  \return Number of readings in the segment now
+ *  \retval -1 - Couldn't write it
+ *
+ *  \note Readings already in the segment are kept, imported ones are
+ *        only added before or after them, so importing a day twice
+ *        changes nothing. The files are replaced whole and nothing
+ *        shared is touched, so different days can be imported from
+ *        different threads. The daemon shouldn't be writing to the
+ *        same sensor at the same time.
+ */
+int store_import(int sensor, store_raw_t *raw, int num)
+{
+    char            path[FILENAME_MAX];
+    store_raw_t    *old = NULL, *merged;
+    store_rollup_t *rollups;
+    time_t          seg;
+    long            have, total = 0, i, j, nrollups = 0;
+    int             ret = -1;
+
+    if ( c_store_dir == NULL || sensor < 0 || sensor >= MAX_SENSORS || num < 1 ) {
+        return -1;
+    }
+    seg = segment_start(STORE_RAW, raw[0].ts);
+    snprintf(path,sizeof(path),"%s/%d",c_store_dir,sensor);
+    mkdir(path, 0755);
+    segment_path(c_store_dir, sensor, STORE_RAW, seg, path, sizeof(path));
+    if ( ( have = segment_load(path, STORE_RAW, (void **)&old) ) < 0 ) {
+        return -1;
+    }
+    merged = malloc(( num + have ) * sizeof(store_raw_t));
+    rollups = malloc(( 86400 / level_span[STORE_MINUTE] ) * sizeof(store_rollup_t));
+    if ( merged == NULL || rollups == NULL ) {
+        goto done;
+    }
+    for ( i = 0; i < num && ( have == 0 || raw[i].ts < old[0].ts ); i++ ) {
+        merged[total++] = raw[i];
+    }
+    for ( j = 0; j < have; j++ ) {
+        merged[total++] = old[j];
+    }
+    for ( ; i < num; i++ ) {
+        if ( have == 0 || raw[i].ts > old[have - 1].ts ) {
+            merged[total++] = raw[i];
+        }
+    }
+
+    nrollups = rollup_minutes(merged, total, rollups);
+
+    if ( total > have && segment_replace(path, merged, total * sizeof(store_raw_t)) != 0 ) {
+        goto done;
+    }
+    segment_path(c_store_dir, sensor, STORE_MINUTE, seg, path, sizeof(path));
+    if ( segment_replace(path, rollups, nrollups * sizeof(store_rollup_t)) == 0 ) {
+        ret = total;
+    }
+done:
+    free(old);
+    free(merged);
+    free(rollups);
+    return ret;
+}
+
+/** \brief Rebuild a year of hour rollups from the minute ones
+ *
+ *  \param sensor - Sensor to rebuild
+ *  \param when - Any time in the year
+ *
+ *  \return Number of hours written
+ *  \retval -1 - Couldn't write them
+ *
+ *  \note Like store_import() years can be rebuilt in parallel
+ */
+int store_rebuild(int sensor, time_t when)
+{
+    char            path[FILENAME_MAX];
+    store_rollup_t *rollups;
+    bucket_t       *hours;
+    time_t          seg, end, *segs = NULL;
+    struct tm       tm;
+    long            num, i, n = 0;
+    int             ret = -1;
+
+    if ( c_store_dir == NULL || sensor < 0 || sensor >= MAX_SENSORS ) {
+        return -1;
+    }
+    seg = segment_start(STORE_HOUR, when);
+    gmtime_r(&seg, &tm);
+    tm.tm_year++;
+    end = timegm(&tm);
+    num = ( end - seg ) / level_span[STORE_HOUR];
+    hours = calloc(num, sizeof(bucket_t));
+    rollups = malloc(num * sizeof(store_rollup_t));
+    if ( hours == NULL || rollups == NULL ) {
+        goto done;
+    }
+
+    /* Minute rollups are folded into the hour bucket they fall in,
+       counted from the start of the first */
+    hours[0].start = seg;
+    n = segment_list(c_store_dir, sensor, STORE_MINUTE, seg, end, &segs);
+    for ( i = 0; i < n; i++ ) {
+        segment_path(c_store_dir, sensor, STORE_MINUTE, segs[i], path, sizeof(path));
+        segment_scan(path, STORE_MINUTE, -1, seg, end, rebuild_minute, hours);
+    }
+    for ( i = 0, n = 0; i < num; i++ ) {
+        if ( hours[i].count ) {
+            bucket_rollup(&hours[i], &rollups[n++]);
+        }
+    }
+    segment_path(c_store_dir, sensor, STORE_HOUR, seg, path, sizeof(path));
+    if ( n && segment_replace(path, rollups, n * sizeof(store_rollup_t)) == 0 ) {
+        ret = n;
+    } else if ( n == 0 ) {
+        ret = 0;
+    }
+done:
+    free(segs);
+    free(hours);
+    free(rollups);
+    return ret;
+}
+
+/** \brief Apply the retention policy, dropping readings older than
+ *         store:raw-days and minute rollups older than store:minute-days
+ *
+ *  \param now - Time to count the days back from
+ *
+ *  \return Number of segments dropped
+ *
+ *  \note A segment only goes once the next level covers every reading
+ *        in it, any missing rollups are built first. Rollups are
+ *        replaced by renaming and segments dropped by unlinking, so a
+ *        scan sees either the old segment or the rollups of it. Reads
+ *        and writes are held to store:compact-rate and the lock is never
+ *        held across them, so readings keep flowing meanwhile.
+ */
+int store_compact(time_t now)
+{
+    time_t      *segs, cutoff;
+    int          sensor, num, i, dropped = 0;
+
+    if ( c_store_dir == NULL ) {
+        return 0;
+    }
+    /* Two at once would both splice the same year of hours */
+    pthread_mutex_lock(&compact_running);
+    for ( sensor = 0; sensor < MAX_SENSORS && compact_stop == 0; sensor++ ) {
+        if ( c_store_raw_days > 0 ) {
+            cutoff = segment_start(STORE_RAW, now) - (time_t)c_store_raw_days * 86400;
+            num = segment_list(c_store_dir, sensor, STORE_RAW, 0, cutoff, &segs);
+            for ( i = 0; i < num && compact_stop == 0; i++ ) {
+                dropped += compact_raw(sensor, segs[i]);
+            }
+            free(segs);
+        }
+        if ( c_store_minute_days > 0 ) {
+            cutoff = segment_start(STORE_MINUTE, now) - (time_t)c_store_minute_days * 86400;
+            num = segment_list(c_store_dir, sensor, STORE_MINUTE, 0, cutoff, &segs);
+            for ( i = 0; i < num && compact_stop == 0; i++ ) {
+                dropped += compact_minute(sensor, segs[i]);
+            }
+            free(segs);
+        }
+    }
+    pthread_mutex_unlock(&compact_running);
+    return dropped;
+}
+
+
+static int store_write(sink_t *sink, reading_t *reading)
+{
+    store_raw_t   raw;
+
+    if ( reading->ts <= 0 ) {
+        return -1;
+    }
+    raw.ts = (uint32_t)reading->ts;
+    raw.ms = (uint16_t)( ( reading->ts - raw.ts ) * 1000 );
+    raw.temp = (int16_t)lrint(reading->temp * 10);
+    raw.watts = reading->watts;
+    raw.joules = reading->joules;
+    return store_append(&local, reading->sensor, &raw);
+}
+
+static int store_setup(store_t *st, char *dir)
+{
+    int       i, j;
+
+    if ( mkdir(dir, 0755) != 0 && errno != EEXIST ) {
+        syslog(LOG_ERR,"Unable to create store directory %s",dir);
+        return -1;
+    }
+    st->dir = dir;
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        for ( j = 0; j < STORE_LEVELS; j++ ) {
+            st->series[i][j].fd = -1;
+            /* Otherwise they're allocated as each series is first written */
+            if ( heap_static() && ( st->series[i][j].pending = malloc(STORE_PENDING * level_size[j]) ) == NULL ) {
+                syslog(LOG_ERR,"Unable to allocate the store buffers");
+                return -1;
+            }
+        }
+    }
+    pthread_mutex_lock(&store_lock);
+    st->next = stores;
+    stores = st;
+    pthread_mutex_unlock(&store_lock);
+
+    if ( flushing == 0 ) {
+        if ( c_store_flush < 1 ) {
+            c_store_flush = 1;
+        }
+        ev_every(c_store_flush * 1000, store_timer, NULL);
+        flushing = 1;
+    }
+    return 0;
+}
+
+static void store_timer(void *data)
+{
+    store_flush(0);
+}
+
+/* Called with the lock held */
+static void series_append(store_t *st, int sensor, int level, void *record)
+{
+    series_t  *s = &st->series[sensor][level];
+    uint32_t   ts = *(uint32_t *)record;
+    time_t     seg = segment_start(level, ts);
+
+    if ( s->pending == NULL && ( s->pending = malloc(STORE_PENDING * level_size[level]) ) == NULL ) {
+        return;
+    }
+    if ( seg != s->seg ) {
+        series_flush(s, level);
+        if ( series_open(st, sensor, level, seg) < 0 ) {
+            return;
+        }
+    }
+    memcpy(s->pending + s->num * level_size[level], record, level_size[level]);
+    s->last_ts = ts;
+    if ( ++s->num == STORE_PENDING ) {
+        series_flush(s, level);
+    }
+}
+
+static int series_open(store_t *st, int sensor, int level, time_t seg)
+{
+    series_t  *s = &st->series[sensor][level];
+    char       path[FILENAME_MAX];
+    int        size = level_size[level];
+    uint32_t   ts;
+
+    if ( s->fd != -1 ) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    s->seg = seg;
+    snprintf(path,sizeof(path),"%s/%d",st->dir,sensor);
+    mkdir(path, 0755);
+    segment_path(st->dir, sensor, level, seg, path, sizeof(path));
+    if ( ( s->fd = open(path, O_WRONLY|O_CREAT, 0644) ) == -1 ) {
+        syslog(LOG_ERR,"Unable to open store segment %s",path);
+        return -1;
+    }
+    /* A crash can leave part of a record on the end */
+    s->off = lseek(s->fd, 0, SEEK_END);
+    if ( s->off % size ) {
+        s->off -= s->off % size;
+        if ( ftruncate(s->fd, s->off) != 0 ) {
+            syslog(LOG_WARNING,"Unable to trim store segment %s",path);
+        }
+    }
+    if ( s->off > 0 && pread(s->fd, &ts, sizeof(ts), s->off - size) == sizeof(ts) && ts > s->last_ts ) {
+        s->last_ts = ts;
+    }
+    return 0;
+}
+
+/* Called with the lock held */
+static void series_flush(series_t *s, int level)
+{
+    size_t    len = s->num * level_size[level];
+    ssize_t   ret;
+
+    if ( s->num == 0 || s->fd == -1 ) {
+        s->num = 0;
+        return;
+    }
+    ret = pwrite(s->fd, s->pending, len, s->off);
+    if ( ret != len ) {
+        syslog(LOG_ERR,"Failed to write %d records to the store: %s",s->num,ret < 0 ? strerror(errno) : "short write");
+        if ( ret > 0 && ftruncate(s->fd, s->off) != 0 ) {
+            syslog(LOG_ERR,"Unable to back out partial store write");
+        }
+    } else {
+        s->off += len;
+    }
+    s->num = 0;
+}
+
+static void bucket_add(store_t *st, int sensor, int level, store_raw_t *raw)
+{
+    bucket_t  *b = &st->buckets[sensor][level];
+    uint32_t   start = raw->ts - ( raw->ts % level_span[level] );
+
+    if ( b->count && b->start != start ) {
+        bucket_emit(st, sensor, level);
+    }
+    bucket_fold(b, start, 1, raw->watts, raw->watts, raw->watts, raw->temp / 10.0, raw->joules);
+}
+
+static void bucket_emit(store_t *st, int sensor, int level)
+{
+    bucket_t        *b = &st->buckets[sensor][level];
+    store_rollup_t   rollup;
+
+    bucket_rollup(b, &rollup);
+    series_append(st, sensor, level, &rollup);
+}
+
+/* Add readings, or a rollup of them, to a bucket */
+static void bucket_fold(bucket_t *b, uint32_t start, uint32_t count, int32_t min, int32_t max, double watts, double temp, double joules)
+{
+    if ( b->count == 0 ) {
+        b->start = start;
+        b->min = min;
+        b->max = max;
+        b->watts = b->temp = b->joules = 0;
+    }
+    b->count += count;
+    if ( min < b->min )
+        b->min = min;
+    if ( max > b->max )
+        b->max = max;
+    b->watts += watts;
+    b->temp += temp;
+    b->joules += joules;
+}
+
+/* Turn a bucket into a rollup and empty it */
+static void bucket_rollup(bucket_t *b, store_rollup_t *rollup)
+{
+    rollup->ts = b->start;
+    rollup->count = b->count;
+    rollup->min = b->min;
+    rollup->max = b->max;
+    rollup->mean = b->watts / b->count;
+    rollup->temp = b->temp / b->count;
+    rollup->joules = b->joules;
+    b->count = 0;
+}
+
+static int rebuild_minute(void *record, void *arg)
+{
+    store_rollup_t  *rollup = record;
+    bucket_t        *hours = arg;
+    uint32_t         start = rollup->ts - ( rollup->ts % level_span[STORE_HOUR] );
+
+    bucket_fold(&hours[( start - hours[0].start ) / level_span[STORE_HOUR]], start, rollup->count, rollup->min, rollup->max,
+                (double)rollup->mean * rollup->count, (double)rollup->temp * rollup->count, rollup->joules);
+    return 0;
+}
+
+/* Minute rollups of a day of readings, returns how many */
+static long rollup_minutes(store_raw_t *raw, long num, store_rollup_t *rollups)
+{
+    bucket_t    b;
+    long        i, n = 0;
+
+    memset(&b, 0, sizeof(b));
+    for ( i = 0; i < num; i++ ) {
+        uint32_t start = raw[i].ts - ( raw[i].ts % level_span[STORE_MINUTE] );
+
+        if ( b.count && b.start != start ) {
+            bucket_rollup(&b, &rollups[n++]);
+        }
+        bucket_fold(&b, start, 1, raw[i].watts, raw[i].watts, raw[i].watts, raw[i].temp / 10.0, raw[i].joules);
+    }
+    if ( b.count ) {
+        bucket_rollup(&b, &rollups[n++]);
+    }
+    return n;
+}
+
+static void *compact_thread(void *arg)
+{
+    struct timespec  until;
+    int              dropped;
+
+    /* Stay out of the way of the serial port and the queries */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_IDLE);
+#endif
+    pthread_mutex_lock(&compact_lock);
+    while ( compact_stop == 0 ) {
+        pthread_mutex_unlock(&compact_lock);
+        if ( ( dropped = store_compact(time(NULL)) ) > 0 ) {
+            syslog(LOG_INFO,"Compacted %d store segments",dropped);
+        }
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += c_store_compact_interval;
+        pthread_mutex_lock(&compact_lock);
+        while ( compact_stop == 0 && pthread_cond_timedwait(&compact_wake, &compact_lock, &until) == 0 ) {
+        }
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return NULL;
+}
+
+/** \brief Drop a day of readings, making sure its minutes are there
+ *
+ *  \return 1 - Dropped
+ *  \retval 0 - Kept
+ */
+static int compact_raw(int sensor, time_t seg)
+{
+    char            path[FILENAME_MAX], minpath[FILENAME_MAX];
+    store_raw_t    *raw = NULL;
+    store_rollup_t *rollups = NULL;
+    long            num, count = 0, n;
+    int             ret = 0;
+
+    if ( compact_live(sensor, STORE_RAW, seg) || compact_live(sensor, STORE_MINUTE, seg) ) {
+        return 0;
+    }
+    segment_path(c_store_dir, sensor, STORE_RAW, seg, path, sizeof(path));
+    segment_path(c_store_dir, sensor, STORE_MINUTE, seg, minpath, sizeof(minpath));
+    if ( ( num = segment_load(path, STORE_RAW, (void **)&raw) ) < 0 ) {
+        return 0;
+    }
+    compact_throttle(num * sizeof(store_raw_t));
+    segment_scan(minpath, STORE_MINUTE, -1, seg, seg + 86400, compact_count, &count);
+    if ( count != num ) {
+        rollups = malloc(( 86400 / level_span[STORE_MINUTE] ) * sizeof(store_rollup_t));
+        n = rollup_minutes(raw, num, rollups);
+        if ( segment_replace(minpath, rollups, n * sizeof(store_rollup_t)) != 0 ) {
+            goto done;
+        }
+        compact_throttle(n * sizeof(store_rollup_t));
+    }
+    ret = unlink(path) == 0;
+done:
+    free(raw);
+    free(rollups);
+    return ret;
+}
+
+/** \brief Drop a day of minute rollups, making sure its hours are there
+ *
+ *  \return 1 - Dropped
+ *  \retval 0 - Kept
+ */
+static int compact_minute(int sensor, time_t seg)
+{
+    char            path[FILENAME_MAX], hourpath[FILENAME_MAX];
+    store_rollup_t *minutes = NULL, *hours = NULL, *merged = NULL;
+    bucket_t        day[24];
+    time_t          year = segment_start(STORE_HOUR, seg);
+    long            num, nhours, count = 0, have = 0, i, j, n = 0;
+    int             ret = 0;
+
+    if ( compact_live(sensor, STORE_MINUTE, seg) ) {
+        return 0;
+    }
+    segment_path(c_store_dir, sensor, STORE_MINUTE, seg, path, sizeof(path));
+    segment_path(c_store_dir, sensor, STORE_HOUR, year, hourpath, sizeof(hourpath));
+    if ( ( num = segment_load(path, STORE_MINUTE, (void **)&minutes) ) < 0 ) {
+        return 0;
+    }
+    compact_throttle(num * sizeof(store_rollup_t));
+    for ( i = 0; i < num; i++ ) {
+        count += minutes[i].count;
+    }
+    segment_scan(hourpath, STORE_HOUR, -1, seg, seg + 86400, compact_count, &have);
+    if ( have != count ) {
+        /* The hours being written to can't be replaced under the daemon,
+           leave the minutes until they can */
+        if ( compact_live(sensor, STORE_HOUR, year) ) {
+            syslog(LOG_WARNING,"Keeping %s, the hours are missing some of it",path);
+            goto done;
+        }
+        memset(day, 0, sizeof(day));
+        for ( i = 0; i < num; i++ ) {
+            uint32_t start = minutes[i].ts - ( minutes[i].ts % level_span[STORE_HOUR] );
+
+            bucket_fold(&day[( start - seg ) / level_span[STORE_HOUR]], start, minutes[i].count, minutes[i].min, minutes[i].max,
+                        (double)minutes[i].mean * minutes[i].count, (double)minutes[i].temp * minutes[i].count, minutes[i].joules);
+        }
+
+        /* Splice the day into the year */
+        if ( ( nhours = segment_load(hourpath, STORE_HOUR, (void **)&hours) ) < 0 ||
+             ( merged = malloc(( nhours + 24 ) * sizeof(store_rollup_t)) ) == NULL ) {
+            goto done;
+        }
+        for ( i = 0; i < nhours && hours[i].ts < seg; i++ ) {
+            merged[n++] = hours[i];
+        }
+        for ( j = 0; j < 24; j++ ) {
+            if ( day[j].count ) {
+                bucket_rollup(&day[j], &merged[n++]);
+            }
+        }
+        for ( ; i < nhours; i++ ) {
+            if ( hours[i].ts >= seg + 86400 ) {
+                merged[n++] = hours[i];
+            }
+        }
+        if ( segment_replace(hourpath, merged, n * sizeof(store_rollup_t)) != 0 ) {
+            goto done;
+        }
+        compact_throttle(( nhours + n ) * sizeof(store_rollup_t));
+    }
+    ret = unlink(path) == 0;
+done:
+    free(minutes);
+    free(hours);
+    free(merged);
+    return ret;
+}
+
+/* Whether the daemon has a segment open for writing */
+static int compact_live(int sensor, int level, time_t seg)
+{
+    int     live;
+
+    pthread_mutex_lock(&store_lock);
+    live = local.series[sensor][level].seg == seg;
+    pthread_mutex_unlock(&store_lock);
+    return live;
+}
+
+static int compact_count(void *record, void *arg)
+{
+    *(long *)arg += ((store_rollup_t *)record)->count;
+    return 0;
+}
+
+/* Sleep long enough for bytes to fit in store:compact-rate */
+static void compact_throttle(size_t bytes)
+{
+    struct timespec  until;
+    double           secs;
+
+    if ( c_store_compact_rate <= 0 ) {
+        return;
+    }
+    secs = bytes / ( c_store_compact_rate * 1024.0 );
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += (time_t)secs;
+    until.tv_nsec += ( secs - (time_t)secs ) * 1e9;
+    if ( until.tv_nsec >= 1000000000 ) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&compact_lock);
+    if ( compact_stop == 0 ) {
+        pthread_cond_timedwait(&compact_wake, &compact_lock, &until);
+    }
+    pthread_mutex_unlock(&compact_lock);
+}
+
+static time_t segment_start(int level, time_t ts)
+{
+    struct tm   tm;
+
+    if ( level == STORE_HOUR ) {
+        gmtime_r(&ts, &tm);
+        tm.tm_mon = 0;
+        tm.tm_mday = 1;
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        return timegm(&tm);
+    }
+    return ts - ( ts % 86400 );
+}
+
+static char *segment_path(char *dir, int sensor, int level, time_t seg, char *buf, size_t buflen)
+{
+    struct tm   tm;
+
+    gmtime_r(&seg, &tm);
+    if ( level == STORE_HOUR ) {
+        snprintf(buf,buflen,"%s/%d/%04d.%s",dir,sensor,tm.tm_year + 1900,level_suffix[level]);
+    } else {
+        snprintf(buf,buflen,"%s/%d/%04d-%02d-%02d.%s",dir,sensor,tm.tm_year + 1900,tm.tm_mon + 1,tm.tm_mday,level_suffix[level]);
+    }
+    return buf;
+}
+
+static int segment_compare(const void *a, const void *b)
+{
+    time_t   x = *(const time_t *)a, y = *(const time_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/** \brief List the segments of a level which might hold from..to
+ *
+ *  \return Number of segments, *list is sorted and to be freed
+ */
+static int segment_list(char *base, int sensor, int level, time_t from, time_t to, time_t **list)
+{
+    char            path[FILENAME_MAX];
+    char            suffix[8];
+    DIR            *dir;
+    struct dirent  *ent;
+    struct tm       tm;
+    time_t          seg, first = segment_start(level, from);
+    int             num = 0, size = 0;
+
+    *list = NULL;
+    snprintf(path,sizeof(path),"%s/%d",base,sensor);
+    if ( ( dir = opendir(path) ) == NULL ) {
+        return 0;
+    }
+    while ( ( ent = readdir(dir) ) != NULL ) {
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_mday = 1;
+        if ( level == STORE_HOUR ) {
+            if ( sscanf(ent->d_name,"%4d.%7s",&tm.tm_year,suffix) != 2 )
+                continue;
+        } else if ( sscanf(ent->d_name,"%4d-%2d-%2d.%7s",&tm.tm_year,&tm.tm_mon,&tm.tm_mday,suffix) != 4 ) {
+            continue;
+        } else {
+            tm.tm_mon--;
+        }
+        if ( strcmp(suffix, level_suffix[level]) != 0 ) {
+            continue;
+        }
+        tm.tm_year -= 1900;
+        seg = timegm(&tm);
+        if ( seg < first || seg >= to ) {
+            continue;
+        }
+        if ( num == size ) {
+            size = size ? size * 2 : 64;
+            *list = realloc(*list, size * sizeof(time_t));
+        }
+        (*list)[num++] = seg;
+    }
+    closedir(dir);
+    qsort(*list, num, sizeof(time_t), segment_compare);
+    return num;
+}
+
+/** \brief Feed the records of one segment file to a scan
+ *
+ *  \param limit - Ignore anything from this offset on, -1 for no limit
+ *
+ *  \return 0 - Carry on with the next segment
+ *  \retval 1 - Scan finished
+ */
+static int segment_scan(char *path, int level, off_t limit, time_t from, time_t to, store_scan_fn fn, void *arg)
+{
+    char         buf[STORE_READ * sizeof(store_rollup_t)];
+    struct stat  st;
+    int          size = level_size[level];
+    long         lo, hi, mid, num, i, n;
+    uint32_t     ts;
+    int          fd;
+    int          stop = 0;
+
+    if ( ( fd = open(path, O_RDONLY) ) == -1 ) {
+        return 0;
+    }
+    if ( fstat(fd, &st) != 0 ) {
+        close(fd);
+        return 0;
+    }
+    if ( limit >= 0 && limit < st.st_size ) {
+        st.st_size = limit;
+    }
+    num = st.st_size / size;
+
+    /* First record at or after from */
+    lo = 0;
+    hi = num;
+    while ( lo < hi ) {
+        mid = ( lo + hi ) / 2;
+        if ( pread(fd, &ts, sizeof(ts), mid * size) != sizeof(ts) ) {
+            break;
+        }
+        if ( ts < from ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for ( ; lo < num && stop == 0; lo += n ) {
+        n = num - lo > STORE_READ ? STORE_READ : num - lo;
+        if ( pread(fd, buf, n * size, lo * size) != n * size ) {
+            break;
+        }
+        for ( i = 0; i < n && stop == 0; i++ ) {
+            if ( *(uint32_t *)( buf + i * size ) >= to ) {
+                stop = 1;
+            } else {
+                stop = fn(buf + i * size, arg);
+            }
+        }
+    }
+    close(fd);
+    return stop != 0;
+}
+
+/** \brief Read a whole segment file
+ *
+ *  \return Number of records, *records is to be freed
+ *  \retval -1 - Couldn't read it (a missing file is just empty)
+ */
+static long segment_load(char *path, int level, void **records)
+{
+    struct stat  st;
+    long         num;
+    int          fd;
+
+    *records = NULL;
+    if ( ( fd = open(path, O_RDONLY) ) == -1 ) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if ( fstat(fd, &st) != 0 ) {
+        close(fd);
+        return -1;
+    }
+    num = st.st_size / level_size[level];
+    if ( num && ( ( *records = malloc(num * level_size[level]) ) == NULL ||
+                  pread(fd, *records, num * level_size[level], 0) != num * level_size[level] ) ) {
+        syslog(LOG_ERR,"Unable to read store segment %s",path);
+        free(*records);
+        *records = NULL;
+        num = -1;
+    }
+    close(fd);
+    return num;
+}
+
+/* Write a segment alongside and rename it into place */
+static int segment_replace(char *path, void *records, size_t len)
+{
+    char       tmpname[FILENAME_MAX];
+    int        fd;
+
+    snprintf(tmpname,sizeof(tmpname),"%s.tmp",path);
+    if ( ( fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644) ) == -1 ) {
+        syslog(LOG_ERR,"Unable to write store segment %s",tmpname);
+        return -1;
+    }
+    if ( write(fd, records, len) != len || fsync(fd) != 0 ) {
+        syslog(LOG_ERR,"Failed to write store segment %s: %s",tmpname,strerror(errno));
+        close(fd);
+        unlink(tmpname);
+        return -1;
+    }
+    close(fd);
+    if ( rename(tmpname, path) != 0 ) {
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ *   Current Cost Daemon - native reading store
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include "libini.h"
+#include "sink.h"
+
+
+/* Levels of the store, raw readings, the rollups of them and appliance
+   events */
+enum { STORE_RAW, STORE_MINUTE, STORE_HOUR, STORE_EVENT, STORE_LEVELS };
+
+/* A reading as stored on disc */
+typedef struct {
+    uint32_t        ts;
+    uint16_t        ms;
+    int16_t         temp;          /* Tenths of a degree */
+    int32_t         watts;
+    float           joules;        /* Energy since the previous reading */
+} store_raw_t;
+
+/* A minute or hour of readings, ts is the start of the bucket */
+typedef struct {
+    uint32_t        ts;
+    uint32_t        count;
+    int32_t         min;
+    int32_t         max;
+    float           mean;          /* Mean watts */
+    float           temp;          /* Mean temperature */
+    double          joules;
+} store_rollup_t;
+
+/* An appliance switching on or off, see disagg.c */
+typedef struct {
+    uint32_t        ts;
+    uint16_t        appliance;
+    uint8_t         on;
+    uint8_t         pad;
+    int32_t         watts;         /* Size of the step */
+    float           joules;        /* Used since it went on, set when it goes off */
+} store_event_t;
+
+/* A store directory, see store_open() */
+typedef struct store store_t;
+
+/* Called for each record of a scan, return non zero to stop */
+typedef int (*store_scan_fn)(void *record, void *arg);
+
+
+/* Register the [store] options */
+extern void         store_options(configctx_t *ctx);
+
+/* Return the store sink, NULL if no directory is configured */
+extern sink_t      *store_init();
+
+/* Write out everything pending, and the partial rollups if closing */
+extern void         store_flush(int closing);
+
+/* Call fn for each record of a level with from <= ts < to in time
+   order. Safe to call from any thread. */
+extern int          store_scan(int sensor, int level, time_t from, time_t to, store_scan_fn fn, void *arg);
+
+/* Another store in dir, written through store_append() and flushed
+   along with the daemon's own */
+extern store_t     *store_open(char *dir);
+extern int          store_append(store_t *store, int sensor, store_raw_t *raw);
+
+/* Bulk import a day of readings in time order, building the minute
+   rollups. Days can be imported in parallel */
+extern int          store_import(int sensor, store_raw_t *raw, int num);
+
+/* Rebuild the hour rollups of the year containing when from the minute
+   ones, after importing */
+extern int          store_rebuild(int sensor, time_t when);
+
+/* Drop the segments past store:raw-days and store:minute-days once the
+   next level covers them, the compactor thread calls this */
+extern int          store_compact(time_t now);
+
+/* Record an appliance event, does nothing without a store */
+extern void         store_event(int sensor, store_event_t *event);
+
+/* Seconds covered by a record of each level */
+extern int          store_span(int level);
+
+#endif /* STORE_H */
@@ -0,0 +1,715 @@
+/*
+ *   Current Cost Daemon - tariffs and cost ledger
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Tariffs are configured as:
+ *
+ *   [tariff]
+ *   standing-charge = 0.25              ; per day
+ *   band = 00:00-07:00 0.09             ; per kWh
+ *   band = mon-fri 07:00-24:00 0.28
+ *   band = sat,sun 07:00-24:00 0.20
+ *
+ *   [tariff.3]                          ; Sensor 3 is billed differently
+ *   band = 00:00-24:00 0.15
+ *
+ *   Later bands override earlier ones. Each sensor has a ledger file of
+ *   fixed size daily records carrying running totals, so the cost of
+ *   any range of days is two reads however much history there is.
+ *
+ *   Energy over a gap in the readings is costed a minute at a time
+ *   across the gap rather than all at the price when it ended. That and
+ *   corrections from the meter's history can land on days already
+ *   closed off, which are amended along with the totals after them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "libini.h"
+#include "tariff.h"
+#include "gap.h"
+
+
+#define MAX_BANDS       32
+#define WEEK_MINUTES    ( 7 * 1440 )
+
+typedef struct {
+    int             configured;
+    double          standing;
+    int             num_prices;
+    double          prices[MAX_BANDS + 1];
+    unsigned char   week[WEEK_MINUTES];    /* Price index for each minute */
+} tariff_t;
+
+typedef struct {
+    int             fd;
+    char           *filename;
+    int32_t         first_day;
+    ledger_t        today;
+    int             valid;
+    int             month;                 /* year * 12 + month */
+    double          month_kwh;
+    double          month_cost;
+} ledger_state_t;
+
+
+static int          tariff_load(configctx_t *cache, char *section, tariff_t *tariff);
+static int          band_parse(tariff_t *tariff, char *band);
+static int          ledger_open(ledger_state_t *ledger, char *filename, int flags);
+static void         ledger_add(ledger_state_t *ledger, tariff_t *tariff, time_t when, double joules);
+static void         ledger_post(ledger_state_t *ledger, tariff_t *tariff, int32_t day, double kwh, double cost);
+static int          ledger_amend(ledger_state_t *ledger, int32_t day, double kwh, double cost);
+static void         ledger_advance(ledger_state_t *ledger, tariff_t *tariff, int32_t day);
+static int          ledger_write(ledger_state_t *ledger, ledger_t *rec);
+static int          ledger_read(int fd, int32_t first_day, int32_t day, ledger_t *rec);
+static void         civil_from_days(int32_t days, int *y, int *m, int *d);
+static int32_t      days_from_civil(int y, int m, int d);
+static time_t       local_midnight(int32_t day);
+static char        *ledger_filename(int sensor, char *buf, size_t buflen);
+
+static tariff_t     tariffs[MAX_SENSORS];
+static ledger_state_t ledgers[MAX_SENSORS];
+static char        *ledger_dir = NULL;
+static int          enabled = 0;
+static time_t       checkpoint_last = 0;
+
+
+/** \brief Load the tariff definitions
+ *
+ *  \param config_file - Configuration file to read the tariff sections from
+ *  \param dir - Directory to keep the ledgers in (may be NULL)
+ *
+ *  \return Number of sensors with a tariff
+ */
+int tariff_init(char *config_file, char *dir)
+{
+    configctx_t  *cache;
+    tariff_t      deflt;
+    char          section[32];
+    char          filename[FILENAME_MAX];
+    int           i;
+
+    memset(tariffs, 0, sizeof(tariffs));
+    memset(ledgers, 0, sizeof(ledgers));
+    ledger_dir = dir;
+    enabled = 0;
+
+    if ( config_file == NULL ) {
+        return 0;
+    }
+
+    cache = iniparse_cache_init();
+    if ( iniparse_file(cache, config_file) < 0 ) {
+        iniparse_cleanup(cache);
+        return 0;
+    }
+    memset(&deflt, 0, sizeof(deflt));
+    tariff_load(cache, "tariff", &deflt);
+
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        snprintf(section,sizeof(section),"tariff.%d",i);
+        if ( tariff_load(cache, section, &tariffs[i]) == 0 ) {
+            tariffs[i] = deflt;
+        }
+        ledgers[i].fd = -1;
+        if ( tariffs[i].configured ) {
+            enabled++;
+            if ( ledger_dir ) {
+                ledger_open(&ledgers[i], strdup(ledger_filename(i, filename, sizeof(filename))), 0);
+            }
+        }
+    }
+    iniparse_cleanup(cache);
+
+    if ( enabled ) {
+        syslog(LOG_INFO,"Tariffs configured for %d sensors",enabled);
+    }
+    return enabled;
+}
+
+double tariff_price(int sensor, time_t when)
+{
+    struct tm  tm;
+    tariff_t  *tariff;
+
+    if ( sensor < 0 || sensor >= MAX_SENSORS ) {
+        return 0;
+    }
+    tariff = &tariffs[sensor];
+    localtime_r(&when, &tm);
+    return tariff->prices[tariff->week[( tm.tm_wday * 1440 ) + ( tm.tm_hour * 60 ) + tm.tm_min]];
+}
+
+void tariff_sample(reading_t *reading)
+{
+    if ( enabled == 0 || reading->sensor < 0 || reading->sensor >= MAX_SENSORS ||
+         tariffs[reading->sensor].configured == 0 ) {
+        return;
+    }
+    if ( reading->gap ) {
+        tariff_spread(reading->sensor, reading->ts - reading->delta, reading->ts, reading->joules);
+    } else {
+        ledger_add(&ledgers[reading->sensor], &tariffs[reading->sensor], (time_t)reading->ts, reading->joules);
+    }
+
+    /* Keep the partial day on disc so reports are up to date */
+    if ( reading->now - checkpoint_last >= 60 ) {
+        tariff_checkpoint();
+        checkpoint_last = reading->now;
+    }
+}
+
+/** \brief Cost energy used evenly over a span of time, each minute at
+ *         its own price
+ *
+ *  \param sensor - Sensor it was used by
+ *  \param from - Start of the span
+ *  \param to - End of the span
+ *  \param joules - Energy, negative to take some back
+ */
+void tariff_spread(int sensor, double from, double to, double joules)
+{
+    ledger_state_t *ledger;
+    tariff_t       *tariff;
+    struct tm       tm;
+    time_t          when;
+    double          t, next, kwh = 0, cost = 0, piece;
+    int32_t         day = 0, d;
+
+    if ( enabled == 0 || sensor < 0 || sensor >= MAX_SENSORS || tariffs[sensor].configured == 0 ) {
+        return;
+    }
+    ledger = &ledgers[sensor];
+    tariff = &tariffs[sensor];
+    if ( to - from < 1 ) {
+        ledger_add(ledger, tariff, (time_t)to, joules);
+        return;
+    }
+    for ( t = from; t < to; t = next ) {
+        when = (time_t)t;
+        localtime_r(&when, &tm);
+        next = ( when - tm.tm_sec ) + 60;
+        if ( next > to ) {
+            next = to;
+        }
+        d = days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+        if ( d != day && t > from ) {
+            ledger_post(ledger, tariff, day, kwh, cost);
+            kwh = cost = 0;
+        }
+        day = d;
+        piece = joules * ( next - t ) / ( to - from ) / 3600000.0;
+        kwh += piece;
+        cost += piece * tariff->prices[tariff->week[( tm.tm_wday * 1440 ) + ( tm.tm_hour * 60 ) + tm.tm_min]];
+    }
+    ledger_post(ledger, tariff, day, kwh, cost);
+}
+
+void tariff_checkpoint()
+{
+    int     i;
+
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        if ( ledgers[i].valid ) {
+            ledger_write(&ledgers[i], &ledgers[i].today);
+        }
+    }
+}
+
+/** \brief Rebuild every ledger from historic readings with the current
+ *         tariffs
+ *
+ *  \param fp - Stream of "epoch joules [sensor]" lines in time order
+ *
+ *  \return Number of readings costed
+ *  \retval -1 - Failure
+ */
+int tariff_recompute(FILE *fp)
+{
+    ledger_state_t  rebuild[MAX_SENSORS];
+    char            filename[FILENAME_MAX];
+    char            tmpname[FILENAME_MAX + 4];
+    char            line[256];
+    long            when;
+    double          joules;
+    int             sensor;
+    int             count = 0;
+    int             i;
+
+    if ( ledger_dir == NULL ) {
+        fprintf(stderr,"No tariff:ledger-dir configured\n");
+        return -1;
+    }
+
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        memset(&rebuild[i], 0, sizeof(rebuild[i]));
+        rebuild[i].fd = -1;
+    }
+
+    while ( fgets(line, sizeof(line), fp) != NULL ) {
+        sensor = 0;
+        if ( sscanf(line,"%ld %lf %d",&when,&joules,&sensor) < 2 ) {
+            continue;
+        }
+        if ( sensor < 0 || sensor >= MAX_SENSORS || tariffs[sensor].configured == 0 ) {
+            continue;
+        }
+        if ( rebuild[sensor].fd == -1 ) {
+            snprintf(tmpname,sizeof(tmpname),"%s.tmp",ledger_filename(sensor, filename, sizeof(filename)));
+            if ( ledger_open(&rebuild[sensor], tmpname, O_CREAT|O_TRUNC) < 0 ) {
+                fprintf(stderr,"Unable to create %s: %s\n",tmpname,strerror(errno));
+                return -1;
+            }
+        }
+        ledger_add(&rebuild[sensor], &tariffs[sensor], (time_t)when, joules);
+        count++;
+    }
+
+    /* Swap the rebuilt ledgers into place */
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        if ( rebuild[i].fd == -1 ) {
+            continue;
+        }
+        ledger_write(&rebuild[i], &rebuild[i].today);
+        fsync(rebuild[i].fd);
+        close(rebuild[i].fd);
+        ledger_filename(i, filename, sizeof(filename));
+        snprintf(tmpname,sizeof(tmpname),"%s.tmp",filename);
+        if ( rename(tmpname, filename) != 0 ) {
+            fprintf(stderr,"Unable to replace %s: %s\n",filename,strerror(errno));
+            return -1;
+        }
+    }
+    return count;
+}
+
+/** \brief Report usage and cost per sensor for a range of days, with
+ *         how much of the usage is estimated
+ *
+ *  \param range - "YYYY-MM-DD" or "YYYY-MM-DD,YYYY-MM-DD"
+ *  \param fp - Where to write the report
+ *
+ *  \return 0 - Success
+ *  \retval -1 - Bad range
+ */
+int tariff_report(char *range, FILE *fp)
+{
+    char       filename[FILENAME_MAX];
+    ledger_t   first, start, end;
+    int32_t    from, to;
+    int        y, m, d;
+    int        fd;
+    int        i;
+    char      *ptr;
+
+    if ( ledger_dir == NULL ) {
+        fprintf(stderr,"No tariff:ledger-dir configured\n");
+        return -1;
+    }
+    if ( sscanf(range,"%d-%d-%d",&y,&m,&d) != 3 ) {
+        return -1;
+    }
+    from = to = days_from_civil(y, m, d);
+    if ( ( ptr = strchr(range,',') ) != NULL ) {
+        if ( sscanf(ptr + 1,"%d-%d-%d",&y,&m,&d) != 3 ) {
+            return -1;
+        }
+        to = days_from_civil(y, m, d);
+    }
+
+    fprintf(fp,"%-6s %12s %12s %12s %12s %12s\n","sensor","kWh","estimated","energy","standing","total");
+    for ( i = 0; i < MAX_SENSORS; i++ ) {
+        if ( ( fd = open(ledger_filename(i, filename, sizeof(filename)), O_RDONLY) ) == -1 ) {
+            continue;
+        }
+        if ( pread(fd, &first, sizeof(first), 0) != sizeof(first) ) {
+            close(fd);
+            continue;
+        }
+        memset(&start, 0, sizeof(start));
+        memset(&end, 0, sizeof(end));
+        /* Past the end of the ledger, use the last day we have */
+        if ( ledger_read(fd, first.day, from - 1, &start) < 0 ) {
+            ledger_read(fd, first.day, -1, &start);
+        }
+        if ( ledger_read(fd, first.day, to, &end) < 0 ) {
+            ledger_read(fd, first.day, -1, &end);
+        }
+        close(fd);
+        fprintf(fp,"%-6d %12.3f %12.3f %12.2f %12.2f %12.2f\n", i,
+                end.cum_kwh - start.cum_kwh,
+                gap_estimated(i, local_midnight(from), local_midnight(to + 1)),
+                end.cum_cost - start.cum_cost,
+                end.cum_standing - start.cum_standing,
+                ( end.cum_cost + end.cum_standing ) - ( start.cum_cost + start.cum_standing ));
+    }
+    return 0;
+}
+
+
+static char *ledger_filename(int sensor, char *buf, size_t buflen)
+{
+    snprintf(buf, buflen, "%s/cost-%d.dat", ledger_dir, sensor);
+    return buf;
+}
+
+/** \brief Read a tariff section out of the config cache
+ *
+ *  \return 1 - Section present
+ *  \retval 0 - Section not present
+ */
+static int tariff_load(configctx_t *cache, char *section, tariff_t *tariff)
+{
+    char        key[64];
+    char      **bands = NULL;
+    int         num_bands = 0;
+    int         found = 0;
+    int         i;
+
+    memset(tariff, 0, sizeof(*tariff));
+    tariff->num_prices = 1;   /* Price 0 is free for uncovered time */
+
+    snprintf(key,sizeof(key),"%s:standing-charge",section);
+    if ( iniparse_cache_extract(cache, key, OPT_FLOAT, &tariff->standing) > 0 ) {
+        found = 1;
+    }
+    snprintf(key,sizeof(key),"%s:band",section);
+    if ( iniparse_cache_extract_array(cache, key, OPT_STR, &bands, &num_bands) > 0 ) {
+        found = 1;
+    }
+    for ( i = 0; i < num_bands; i++ ) {
+        if ( band_parse(tariff, bands[i]) < 0 ) {
+            syslog(LOG_ERR,"Invalid tariff band in [%s]: %s",section,bands[i]);
+        }
+        free(bands[i]);
+    }
+    free(bands);
+    tariff->configured = found;
+    return found;
+}
+
+/** \brief Parse "[days] HH:MM-HH:MM price" and mark it in the week table
+ */
+static int band_parse(tariff_t *tariff, char *band)
+{
+    static const char *daynames[] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+    char        days[7] = { 1, 1, 1, 1, 1, 1, 1 };
+    char        dayspec[64];
+    int         h1, m1, h2, m2;
+    double      price;
+    char       *ptr = band;
+    char       *tok;
+    int         i, d, d1, d2, start, end;
+
+    while ( isspace(*ptr) )
+        ptr++;
+    if ( isalpha(*ptr) ) {
+        /* Day specification - eg mon-fri or sat,sun */
+        memset(days, 0, sizeof(days));
+        i = 0;
+        while ( *ptr && !isspace(*ptr) && i < sizeof(dayspec) - 1 ) {
+            dayspec[i++] = tolower(*ptr++);
+        }
+        dayspec[i] = 0;
+        for ( tok = strtok(dayspec,","); tok != NULL; tok = strtok(NULL,",") ) {
+            d1 = d2 = -1;
+            for ( d = 0; d < 7; d++ ) {
+                if ( strncmp(tok, daynames[d], 3) == 0 )
+                    d1 = d;
+                if ( strlen(tok) > 4 && strncmp(tok + 4, daynames[d], 3) == 0 )
+                    d2 = d;
+            }
+            if ( d1 == -1 ) {
+                return -1;
+            }
+            if ( d2 == -1 ) {
+                d2 = d1;
+            }
+            for ( d = d1; ; d = ( d + 1 ) % 7 ) {
+                days[d] = 1;
+                if ( d == d2 )
+                    break;
+            }
+        }
+    }
+    if ( sscanf(ptr," %d:%d-%d:%d %lf",&h1,&m1,&h2,&m2,&price) != 5 ) {
+        return -1;
+    }
+    if ( tariff->num_prices > MAX_BANDS ) {
+        return -1;
+    }
+    start = ( h1 * 60 ) + m1;
+    end = ( h2 * 60 ) + m2;
+    if ( start < 0 || end > 1440 || start >= end ) {
+        return -1;
+    }
+    tariff->prices[tariff->num_prices] = price;
+    for ( d = 0; d < 7; d++ ) {
+        if ( days[d] ) {
+            for ( i = start; i < end; i++ ) {
+                tariff->week[( d * 1440 ) + i] = tariff->num_prices;
+            }
+        }
+    }
+    tariff->num_prices++;
+    return 0;
+}
+
+/** \brief Open a ledger and pick up where we left off
+ *
+ *  \param ledger - Ledger state to set up
+ *  \param filename - Ledger file
+ *  \param flags - Extra open() flags
+ *
+ *  \note Without O_CREAT a missing ledger is created on the first write
+ */
+static int ledger_open(ledger_state_t *ledger, char *filename, int flags)
+{
+    ledger_t    rec, prev;
+    off_t       size;
+    int         y, m, d;
+
+    memset(ledger, 0, sizeof(*ledger));
+    ledger->filename = filename;
+    if ( ( ledger->fd = open(filename, O_RDWR|flags, 0644) ) == -1 ) {
+        if ( errno == ENOENT && ( flags & O_CREAT ) == 0 ) {
+            return 0;
+        }
+        syslog(LOG_ERR,"Unable to open ledger %s",filename);
+        return -1;
+    }
+    size = lseek(ledger->fd, 0, SEEK_END);
+    if ( size < (off_t)sizeof(rec) || pread(ledger->fd, &rec, sizeof(rec), 0) != sizeof(rec) ) {
+        return 0;
+    }
+    ledger->first_day = rec.day;
+    if ( ledger_read(ledger->fd, ledger->first_day, -1, &rec) < 0 ) {
+        return 0;
+    }
+    ledger->today = rec;
+    ledger->valid = 1;
+
+    /* Month to date is the difference from the end of last month */
+    civil_from_days(rec.day, &y, &m, &d);
+    ledger->month = ( y * 12 ) + m - 1;
+    memset(&prev, 0, sizeof(prev));
+    ledger_read(ledger->fd, ledger->first_day, days_from_civil(y, m, 1) - 1, &prev);
+    ledger->month_kwh = rec.cum_kwh - prev.cum_kwh;
+    ledger->month_cost = ( rec.cum_cost + rec.cum_standing ) - ( prev.cum_cost + prev.cum_standing );
+    return 0;
+}
+
+static void ledger_add(ledger_state_t *ledger, tariff_t *tariff, time_t when, double joules)
+{
+    struct tm   tm;
+    double      kwh;
+
+    localtime_r(&when, &tm);
+    kwh = joules / 3600000.0;
+    ledger_post(ledger, tariff, days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday), kwh,
+                kwh * tariff->prices[tariff->week[( tm.tm_wday * 1440 ) + ( tm.tm_hour * 60 ) + tm.tm_min]]);
+}
+
+/** \brief Put usage and its cost against a day, going back to amend
+ *         the ledger if the day is over
+ */
+static void ledger_post(ledger_state_t *ledger, tariff_t *tariff, int32_t day, double kwh, double cost)
+{
+    int         y, m, d;
+
+    if ( ledger->valid && day < ledger->today.day && ledger_amend(ledger, day, kwh, cost) == 0 ) {
+        civil_from_days(day, &y, &m, &d);
+        if ( ( y * 12 ) + m - 1 == ledger->month ) {
+            ledger->month_kwh += kwh;
+            ledger->month_cost += cost;
+        }
+        return;
+    }
+    /* Anything we can't go back for goes on today */
+    ledger_advance(ledger, tariff, day);
+
+    ledger->month_kwh += kwh;
+    ledger->month_cost += cost;
+    ledger->today.kwh += kwh;
+    ledger->today.cost += cost;
+    ledger->today.cum_kwh += kwh;
+    ledger->today.cum_cost += cost;
+}
+
+/** \brief Close off days until the ledger is on the given day, days
+ *         without readings still pick up the standing charge
+ */
+static void ledger_advance(ledger_state_t *ledger, tariff_t *tariff, int32_t day)
+{
+    ledger_t    next;
+    int         y, m, d;
+
+    if ( ledger->valid && ledger->today.day >= day ) {
+        return;
+    }
+    if ( ledger->valid == 0 ) {
+        memset(&ledger->today, 0, sizeof(ledger->today));
+        ledger->first_day = day;
+        ledger->today.day = day - 1;
+        ledger->valid = 1;
+    } else {
+        ledger_write(ledger, &ledger->today);
+        civil_from_days(ledger->today.day, &y, &m, &d);
+        syslog(LOG_INFO,"Cost for %04d-%02d-%02d: %.3f kWh %.2f, month to date %.3f kWh %.2f",
+               y, m, d, ledger->today.kwh, ledger->today.cost + ledger->today.standing,
+               ledger->month_kwh, ledger->month_cost);
+    }
+    while ( ledger->today.day < day ) {
+        memset(&next, 0, sizeof(next));
+        next.day = ledger->today.day + 1;
+        next.standing = tariff->standing;
+        next.cum_kwh = ledger->today.cum_kwh;
+        next.cum_cost = ledger->today.cum_cost;
+        next.cum_standing = ledger->today.cum_standing + tariff->standing;
+        civil_from_days(next.day, &y, &m, &d);
+        if ( ( y * 12 ) + m - 1 != ledger->month ) {
+            ledger->month = ( y * 12 ) + m - 1;
+            ledger->month_kwh = 0;
+            ledger->month_cost = 0;
+        }
+        ledger->month_cost += tariff->standing;
+        if ( next.day < day ) {
+            ledger_write(ledger, &next);
+        }
+        ledger->today = next;
+    }
+}
+
+/** \brief Add to a day already written out, and to the running totals
+ *         of every day since
+ *
+ *  \return 0 - Amended
+ *  \retval -1 - The day isn't in the ledger file
+ */
+static int ledger_amend(ledger_state_t *ledger, int32_t day, double kwh, double cost)
+{
+    ledger_t    rec;
+    int32_t     d;
+
+    /* Make sure every day up to today is there before changing any */
+    if ( ledger->fd == -1 || day < ledger->first_day ||
+         ledger_read(ledger->fd, ledger->first_day, ledger->today.day - 1, &rec) < 0 ) {
+        return -1;
+    }
+    for ( d = day; d < ledger->today.day; d++ ) {
+        if ( ledger_read(ledger->fd, ledger->first_day, d, &rec) < 0 ) {
+            return -1;
+        }
+        if ( d == day ) {
+            rec.kwh += kwh;
+            rec.cost += cost;
+        }
+        rec.cum_kwh += kwh;
+        rec.cum_cost += cost;
+        ledger_write(ledger, &rec);
+    }
+    ledger->today.cum_kwh += kwh;
+    ledger->today.cum_cost += cost;
+    return 0;
+}
+
+static int ledger_write(ledger_state_t *ledger, ledger_t *rec)
+{
+    if ( ledger->fd == -1 ) {
+        if ( ledger->filename == NULL ||
+             ( ledger->fd = open(ledger->filename, O_RDWR|O_CREAT, 0644) ) == -1 ) {
+            return -1;
+        }
+    }
+    if ( pwrite(ledger->fd, rec, sizeof(*rec), (off_t)( rec->day - ledger->first_day ) * sizeof(*rec)) != sizeof(*rec) ) {
+        syslog(LOG_ERR,"Unable to write ledger: %s",strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/** \brief Read the record for a day (or the last record if day is -1)
+ */
+static int ledger_read(int fd, int32_t first_day, int32_t day, ledger_t *rec)
+{
+    off_t    offs;
+
+    if ( day == -1 ) {
+        offs = lseek(fd, 0, SEEK_END);
+        offs -= ( offs % sizeof(*rec) ) + sizeof(*rec);
+    } else {
+        if ( day < first_day ) {
+            memset(rec, 0, sizeof(*rec));
+            return 0;
+        }
+        offs = (off_t)( day - first_day ) * sizeof(*rec);
+    }
+    if ( offs < 0 || pread(fd, rec, sizeof(*rec), offs) != sizeof(*rec) ) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Days since 1970-01-01 for a proleptic Gregorian date */
+static int32_t days_from_civil(int y, int m, int d)
+{
+    int      era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = ( y >= 0 ? y : y - 399 ) / 400;
+    yoe = y - era * 400;
+    doy = ( 153 * ( m + ( m > 2 ? -3 : 9 ) ) + 2 ) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/* Start of a local day */
+static time_t local_midnight(int32_t day)
+{
+    struct tm   tm;
+    int         y, m, d;
+
+    civil_from_days(day, &y, &m, &d);
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = y - 1900;
+    tm.tm_mon = m - 1;
+    tm.tm_mday = d;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static void civil_from_days(int32_t days, int *y, int *m, int *d)
+{
+    int      era, doe, yoe, doy, mp;
+
+    days += 719468;
+    era = ( days >= 0 ? days : days - 146096 ) / 146097;
+    doe = days - era * 146097;
+    yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365;
+    doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 );
+    mp = ( 5 * doy + 2 ) / 153;
+    *d = doy - ( 153 * mp + 2 ) / 5 + 1;
+    *m = mp + ( mp < 10 ? 3 : -9 );
+    *y = yoe + era * 400 + ( *m <= 2 );
+}
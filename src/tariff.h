@@ -0,0 +1,63 @@
+/*
+ *   Current Cost Daemon - tariffs and cost ledger
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef TARIFF_H
+#define TARIFF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "currentcost.h"
+
+
+/* One day of the ledger as stored on disc, the cumulative fields make
+   the cost of any range of days a difference of two records */
+typedef struct {
+    int32_t         day;           /* Local days since 1970-01-01 */
+    int32_t         pad;
+    double          kwh;
+    double          cost;          /* Energy cost for the day */
+    double          standing;      /* Standing charge for the day */
+    double          cum_kwh;       /* Totals up to and including this day */
+    double          cum_cost;
+    double          cum_standing;
+} ledger_t;
+
+
+/* Read the [tariff] and [tariff.N] sections from the config file */
+extern int          tariff_init(char *config_file, char *ledger_dir);
+
+/* Cost up a reading into the day/month buckets */
+extern void         tariff_sample(reading_t *reading);
+
+/* Cost energy used evenly between two times, eg across a gap */
+extern void         tariff_spread(int sensor, double from, double to, double joules);
+
+/* Write the partial day out to the ledger */
+extern void         tariff_checkpoint();
+
+/* Rebuild the ledgers from "epoch joules [sensor]" lines */
+extern int          tariff_recompute(FILE *fp);
+
+/* Print the usage and cost between two YYYY-MM-DD dates (inclusive) */
+extern int          tariff_report(char *range, FILE *fp);
+
+extern double       tariff_price(int sensor, time_t when);
+
+#endif /* TARIFF_H */
@@ -0,0 +1,334 @@
+/*
+ *   Current Cost Daemon - hot path tracing
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   Each thread which records gets its own histograms and event ring, so
+ *   recording never takes a lock. The histograms are log linear like
+ *   HdrHistogram: 16 buckets per power of two, which keeps each within
+ *   about 6% of the true time from nanoseconds up to days.
+ *
+ *   The event ring holds enough for trace:readings readings, trace_dump()
+ *   has a thread started with tracing write out those tagged with the
+ *   most recent ones in the Chrome trace format, which chrome://tracing
+ *   and Perfetto both load. The main thread's histograms and ring are
+ *   allocated then too, so with heap:static it stays off the heap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+
+#define TRACE_SUB           16             /* Buckets per power of two */
+#define TRACE_BUCKETS       ( ( 47 - 3 ) * TRACE_SUB )
+#define TRACE_PER_READING   16             /* Events we allow for each reading */
+
+typedef struct {
+    unsigned long   reading;
+    long long       start;
+    long long       duration;
+    int             point;
+} trace_event_t;
+
+typedef struct trace_thread {
+    int                  tid;
+    uint64_t             hist[TRACE_POINTS][TRACE_BUCKETS];
+    trace_event_t       *events;
+    unsigned long        head;             /* Events ever recorded */
+    struct trace_thread *next;
+} trace_thread_t;
+
+
+static int          bucket_of(long long ns);
+static long long    bucket_value(int bucket);
+static trace_thread_t *trace_self();
+static void        *trace_dumper(void *arg);
+static int          trace_write();
+
+/* Configuration */
+static char         c_trace_enabled      = 0;
+static int          c_trace_readings     = 100;
+static char        *c_trace_file         = "/tmp/currentcost-trace.json";
+
+int                 trace_enabled        = 0;
+
+static char        *names[TRACE_POINTS]  = { "read", "frame", "parse", "pipeline" };
+static int          num_points           = TRACE_FIXED;
+static unsigned long readings            = 0;
+static unsigned long num_events          = 0;
+static trace_thread_t *threads           = NULL;
+static pthread_mutex_t threads_lock      = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_thread_t *self     = NULL;
+
+static int          dump_wanted          = 0;
+static pthread_t    dump_tid;
+static pthread_mutex_t dump_lock         = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  dump_cond         = PTHREAD_COND_INITIALIZER;
+
+
+void trace_options(configctx_t *ctx)
+{
+    iniparse_add(ctx, 0, "trace:enabled","Time the read, frame, parse, filter and sink stages",OPT_BOOL,&c_trace_enabled);
+    iniparse_add(ctx, 0, "trace:readings","Readings to keep events for, written out on SIGUSR2",OPT_INT,&c_trace_readings);
+    iniparse_add(ctx, 0, "trace:file","File to write the Chrome trace to",OPT_STR,&c_trace_file);
+}
+
+/* Called from the main thread, which does the recording */
+void trace_init()
+{
+    sigset_t   all, old;
+    int        ret;
+
+    if ( c_trace_enabled == 0 ) {
+        return;
+    }
+    num_events = ( c_trace_readings > 0 ? c_trace_readings : 1 ) * TRACE_PER_READING;
+    if ( trace_self() == NULL ) {
+        syslog(LOG_ERR,"Unable to allocate %lu trace events",num_events);
+        return;
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&dump_tid, NULL, trace_dumper, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if ( ret != 0 ) {
+        syslog(LOG_ERR,"Unable to start the trace writer");
+        return;
+    }
+    trace_enabled = 1;
+    syslog(LOG_INFO,"Tracing %d points, SIGUSR2 writes %s",num_points,c_trace_file);
+}
+
+int trace_point(char *name)
+{
+    if ( num_points == TRACE_POINTS ) {
+        return -1;
+    }
+    names[num_points] = strdup(name);
+    return num_points++;
+}
+
+void trace_reading()
+{
+    if ( __builtin_expect(trace_enabled, 0) ) {
+        readings++;
+    }
+}
+
+long long trace_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_record(int point, long long start)
+{
+    trace_thread_t  *t = self ? self : trace_self();
+    trace_event_t   *event;
+    long long        now = trace_now();
+
+    if ( t == NULL || point < 0 || point >= TRACE_POINTS ) {
+        return;
+    }
+    t->hist[point][bucket_of(now - start)]++;
+
+    event = &t->events[t->head % num_events];
+    event->reading = readings;
+    event->start = start;
+    event->duration = now - start;
+    event->point = point;
+    t->head++;
+}
+
+/** \brief Have the events of the last trace:readings readings written out
+ *
+ *  \note Returns straight away, the file is written by another thread
+ */
+void trace_dump()
+{
+    if ( trace_enabled == 0 ) {
+        return;
+    }
+    pthread_mutex_lock(&dump_lock);
+    dump_wanted = 1;
+    pthread_cond_signal(&dump_cond);
+    pthread_mutex_unlock(&dump_lock);
+}
+
+int trace_stats(int point, char **name, unsigned long *count, long long *p50, long long *p99, long long *max)
+{
+    uint64_t         merged[TRACE_BUCKETS];
+    trace_thread_t  *t;
+    uint64_t         total = 0, seen = 0;
+    int              i;
+
+    if ( point < 0 || point >= num_points ) {
+        return -1;
+    }
+    memset(merged, 0, sizeof(merged));
+    pthread_mutex_lock(&threads_lock);
+    for ( t = threads; t != NULL; t = t->next ) {
+        for ( i = 0; i < TRACE_BUCKETS; i++ ) {
+            merged[i] += t->hist[point][i];
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    for ( i = 0; i < TRACE_BUCKETS; i++ ) {
+        total += merged[i];
+    }
+    *name = names[point];
+    *count = total;
+    *p50 = *p99 = *max = 0;
+    for ( i = 0; i < TRACE_BUCKETS && total; i++ ) {
+        if ( merged[i] == 0 ) {
+            continue;
+        }
+        if ( seen < ( total + 1 ) / 2 && seen + merged[i] >= ( total + 1 ) / 2 ) {
+            *p50 = bucket_value(i);
+        }
+        if ( seen < ( total * 99 + 99 ) / 100 && seen + merged[i] >= ( total * 99 + 99 ) / 100 ) {
+            *p99 = bucket_value(i);
+        }
+        seen += merged[i];
+        *max = bucket_value(i);
+    }
+    return 0;
+}
+
+
+static int bucket_of(long long ns)
+{
+    int     e;
+
+    if ( ns < TRACE_SUB ) {
+        return ns < 0 ? 0 : ns;
+    }
+    e = 63 - __builtin_clzll(ns);
+    if ( e > 46 ) {
+        return TRACE_BUCKETS - 1;
+    }
+    return ( e - 3 ) * TRACE_SUB + ( ( ns >> ( e - 4 ) ) & ( TRACE_SUB - 1 ) );
+}
+
+/* Middle of the range a bucket covers */
+static long long bucket_value(int bucket)
+{
+    int     e;
+
+    if ( bucket < TRACE_SUB ) {
+        return bucket;
+    }
+    e = bucket / TRACE_SUB + 3;
+    return ( (long long)( TRACE_SUB + bucket % TRACE_SUB ) << ( e - 4 ) ) + ( ( 1LL << ( e - 4 ) ) >> 1 );
+}
+
+/* First recording from this thread */
+static trace_thread_t *trace_self()
+{
+    trace_thread_t  *t;
+
+    if ( ( t = calloc(1, sizeof(*t)) ) == NULL ||
+         ( t->events = calloc(num_events, sizeof(trace_event_t)) ) == NULL ) {
+        free(t);
+        return NULL;
+    }
+    t->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&threads_lock);
+    t->next = threads;
+    threads = t;
+    pthread_mutex_unlock(&threads_lock);
+    self = t;
+    return t;
+}
+
+static void *trace_dumper(void *arg)
+{
+    pthread_mutex_lock(&dump_lock);
+    for ( ;; ) {
+        while ( dump_wanted == 0 ) {
+            pthread_cond_wait(&dump_cond, &dump_lock);
+        }
+        dump_wanted = 0;
+        pthread_mutex_unlock(&dump_lock);
+        trace_write();
+        pthread_mutex_lock(&dump_lock);
+    }
+    return NULL;
+}
+
+/** \brief Write out the events of the last trace:readings readings
+ *
+ *  \return Number of events written
+ *  \retval -1 - Couldn't write the file
+ */
+static int trace_write()
+{
+    trace_thread_t  *t;
+    trace_event_t   *event;
+    unsigned long    i, oldest;
+    unsigned long    count;
+    long long        p50, p99, max;
+    char            *name;
+    FILE            *fp;
+    int              num = 0, p;
+
+    if ( ( fp = fopen(c_trace_file, "w") ) == NULL ) {
+        syslog(LOG_ERR,"Unable to write trace to %s",c_trace_file);
+        return -1;
+    }
+    oldest = readings > c_trace_readings ? readings - c_trace_readings + 1 : 0;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    pthread_mutex_lock(&threads_lock);
+    for ( t = threads; t != NULL; t = t->next ) {
+        i = t->head > num_events ? t->head - num_events : 0;
+        for ( ; i < t->head; i++ ) {
+            event = &t->events[i % num_events];
+            if ( event->reading < oldest ) {
+                continue;
+            }
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"reading\":%lu}}",
+                    num ? ",\n" : "", names[event->point], event->start / 1000.0, event->duration / 1000.0,
+                    (int)getpid(), t->tid, event->reading);
+            num++;
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    /* The histograms go along too for anyone reading the file by hand */
+    fprintf(fp, "\n],\"otherData\":{");
+    for ( p = 0; trace_stats(p, &name, &count, &p50, &p99, &max) == 0; p++ ) {
+        fprintf(fp, "%s\"%s\":\"count %lu p50 %lldns p99 %lldns max %lldns\"", p ? "," : "", name, count, p50, p99, max);
+    }
+    fprintf(fp, "}}\n");
+    fclose(fp);
+    syslog(LOG_INFO,"Wrote %d trace events to %s",num,c_trace_file);
+    return num;
+}
+
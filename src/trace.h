@@ -0,0 +1,65 @@
+/*
+ *   Current Cost Daemon - hot path tracing
+ *
+ *   Copyright (C) 2010, Dominic Morris
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; version 2 of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *   A tracepoint is a pair of macros around the code being timed:
+ *
+ *     TRACE_START(t);
+ *     parse_reading(...);
+ *     TRACE_STOP(TRACE_PARSE, t);
+ *
+ *   With trace:enabled off each is a test of one global which is never
+ *   set, so the branch is always predicted.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "libini.h"
+
+/* Fixed points, trace_point() adds more after these. A frame is one
+   line from the serial buffer all the way through to the sinks */
+enum { TRACE_READ, TRACE_FRAME, TRACE_PARSE, TRACE_PIPELINE, TRACE_FIXED };
+
+#define TRACE_POINTS        32
+
+extern int          trace_enabled;
+
+#define TRACE_START(var)        long long var = __builtin_expect(trace_enabled, 0) ? trace_now() : 0
+#define TRACE_STOP(point, var)  do { if ( __builtin_expect(trace_enabled, 0) ) trace_record(point, var); } while ( 0 )
+
+
+extern void         trace_options(configctx_t *ctx);
+extern void         trace_init();
+
+/* Add a named point, returns its id or -1 if there's no room */
+extern int          trace_point(char *name);
+
+/* Start of the next reading, events are tagged with it */
+extern void         trace_reading();
+
+extern long long    trace_now();
+extern void         trace_record(int point, long long start);
+
+/* Have the events of the last trace:readings readings written to
+   trace:file as Chrome trace JSON, by the trace thread */
+extern void         trace_dump();
+
+/* Histogram of a point across all threads, returns -1 past the last one */
+extern int          trace_stats(int point, char **name, unsigned long *count, long long *p50, long long *p99, long long *max);
+
+#endif /* TRACE_H */